@@ -26,6 +26,7 @@
 #define __LIBVHD2_H__
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include <uuid/uuid.h>
 
 //--------------------------------------------------------------------
@@ -99,6 +100,13 @@ const uint32_t	VHDF_OPEN_IGNORE_PARENT  = 0x00000008;
 */
 const uint32_t	VHDF_OPEN_ENABLE_TRIM = 0x00000010;
 
+/**
+    Use Linux io_uring interface for VHD files I/O. Batches of requests (e.g. reading sector extents from a block with
+    sector bitmap containing a mixture of '0's and '1's, filling media) are submitted to the kernel with a single system call.
+    If io_uring isn't supported by the kernel or the library is built without it, the flag is ignored and the default synchronous I/O is used.
+*/
+const uint32_t	VHDF_OPEN_IO_URING = 0x00000020;
+
 
 //--------------------------------------------------------------------
 
@@ -128,6 +136,46 @@ const uint32_t	VHDF_OPEN_ENABLE_TRIM = 0x00000010;
 */
 const uint32_t	VHDF_OPMODE_PURE_BLOCKS = 0x00010000;
 
+/*
+    Durability modes. They define what survives a crash (power loss, host OS crash) of the VHD opened in write mode.
+    At most one of them can be specified; without any the default mode is used:
+        - newly allocated blocks' metadata is written and the file is fsync()ed at the end of every write call that appends blocks,
+          but the data may reach the media after the metadata. Other writes become durable only after VHD_Flush().
+
+    In all modes all written data and metadata are durable after successful VHD_Flush() or VHD_Close().
+    The mode can be changed by VHD_SetMode() except VHDF_OPMODE_WRITETHROUGH that can be set only on opening.
+*/
+
+/**
+    "Writeback" mode, the fastest one. Metadata is written only by VHD_Flush(), VHD_Close() or when a block is allocated
+    and at least 5 seconds (KWriteback_CommitIntervalMs) passed since the previous commit. Metadata is always written after the data it refers to is synced.
+    Crash guarantee: the VHD stays consistent, i.e. the BAT never refers to a block with data that didn't reach the media,
+    but all writes since the last commit can be lost, including those to the blocks allocated meanwhile. Suits scratch disks.
+*/
+const uint32_t	VHDF_OPMODE_WRITEBACK = 0x00020000;
+
+/**
+    "Ordered" mode. Metadata of the allocated blocks is committed in order: file data is synced with fdatasync(), then the BAT and
+    sector bitmaps are written, then another fdatasync() makes them durable.
+    Block allocations made by asynchronous write requests (see VHD_SubmitIo()) are group-committed: the worker thread keeps executing
+    the queued requests and commits the whole batch at once; allocating write requests are completed only after the commit covering them.
+    Synchronous writes commit the metadata at the end of each call.
+    Crash guarantee: the VHD stays consistent; a completed write that allocated a block is durable.
+    Writes to the already allocated blocks become durable after VHD_Flush().
+*/
+const uint32_t	VHDF_OPMODE_ORDERED = 0x00040000;
+
+/**
+    "Write-through" mode, the safest and the slowest one. The file is opened with O_DSYNC, so each data write reaches the media
+    before the call returns; dirty metadata (BAT, sector bitmaps) is written at the end of every write call.
+    Crash guarantee: the VHD stays consistent and every completed write is durable. Suits persistent disks.
+    Can be specified only in VHD_Open().
+*/
+const uint32_t	VHDF_OPMODE_WRITETHROUGH = 0x00080000;
+
+/** all durability mode flags */
+const uint32_t	VHDF_OPMODE_DURABILITY_MASK = VHDF_OPMODE_WRITEBACK | VHDF_OPMODE_ORDERED | VHDF_OPMODE_WRITETHROUGH;
+
 
 /**
     When creating fixed VHD do not zero-fill its contents.
@@ -136,6 +184,13 @@ const uint32_t	VHDF_OPMODE_PURE_BLOCKS = 0x00010000;
 const uint32_t	VHDF_CREATE_FIXED_NO_ZERO_FILL = 0x00100000;
 
 
+/**
+    VHD_Compact() flag: also reclaim the Dynamic VHD blocks containing only zeroes. Requires reading all data of the VHD.
+    Differencing VHD blocks containing zeroes are never reclaimed, because they hide the parent's data.
+*/
+const uint32_t	VHDF_COMPACT_ZERO_BLOCKS = 0x00000001;
+
+
 //--------------------------------------------------------------------
 /** VHD types, see specs. Only usable and supported types are listed */
 typedef enum
@@ -207,6 +262,70 @@ typedef struct
 } TVHD_ParamsStruct;
 
 
+//--------------------------------------------------------------------
+/** Operation codes for the asynchronous I/O requests. @see VHD_SubmitIo() */
+typedef enum
+{
+    EVhdIo_None    = 0,    ///< 0, invalid value
+    EVhdIo_Read    = 1,    ///< 1, read sectors,     @see VHD_ReadSectors()
+    EVhdIo_Write   = 2,    ///< 2, write sectors,    @see VHD_WriteSectors()
+    EVhdIo_Discard = 3,    ///< 3, discard sectors,  @see VHD_DiscardSectors()
+    EVhdIo_Flush   = 4     ///< 4, flush data and metadata, @see VHD_Flush()
+} TVhdIoOpcode;
+
+//--------------------------------------------------------------------
+/**
+    Describes an asynchronous I/O request. @see VHD_SubmitIo(), VHD_PollCompletions()
+    The structure is owned by the API user and must not be modified or deallocated from the moment it is submitted
+    until it is returned by VHD_PollCompletions().
+*/
+typedef struct
+{
+    TVhdIoOpcode ioOpcode;      ///< requested operation
+    uint32_t    ioStartSector;  ///< starting sector. Ignored for EVhdIo_Flush
+    int         ioSectors;      ///< number of sectors to process. Ignored for EVhdIo_Flush
+    void*       ioBuffer;       ///< data buffer for EVhdIo_Read and EVhdIo_Write, ignored otherwise
+    uint32_t    ioBufSize;      ///< data buffer size in bytes
+    void*       ioUserData;     ///< arbitrary user's data, not used by the library
+
+    /** out: request result; the same value as the corresponding synchronous API would return. */
+    int         ioResult;
+
+} TVhdIoRequest;
+
+//--------------------------------------------------------------------
+/** Kinds of the logical sector extents. @see VHD_MapExtents() */
+typedef enum
+{
+    EVhdExt_None   = 0,    ///< 0, invalid value
+    EVhdExt_Data   = 1,    ///< 1, sectors data are located in the file described by the extent
+    EVhdExt_Zero   = 2,    ///< 2, sectors are not allocated and read as zeros
+    EVhdExt_Parent = 3     ///< 3, sectors belong to the parent VHD that can't be opened, e.g. because of VHDF_OPEN_IGNORE_PARENT flag
+} TVhdExtentKind;
+
+//--------------------------------------------------------------------
+/**
+    Describes an extent of logical sectors and their location in the VHD chain. @see VHD_MapExtents()
+*/
+typedef struct
+{
+    TVhdExtentKind extKind;     ///< extent kind
+    uint32_t    extStartSector; ///< starting logical sector of the extent
+    uint32_t    extSectors;     ///< number of sectors in the extent
+    uint32_t    extLayer;       ///< VHD chain layer index: 0 refers to the VHD itself, 1 - to its parent etc. @see VHD_ParentInfo()
+    int         extFd;          ///< EVhdExt_Data only: file descriptor of the layer VHD file, -1 otherwise. Owned by the library
+    uint64_t    extFileOffset;  ///< EVhdExt_Data only: byte offset of the extent data in the layer file, 0 otherwise
+
+} TVhdExtent;
+
+//--------------------------------------------------------------------
+/** Sector allocation bitmaps cache replacement policies. @see VHD_SetBitmapCachePolicy() */
+typedef enum
+{
+    EVhdCache_LRU = 0,  ///< 0, the least recently used bitmaps are evicted. Default policy
+    EVhdCache_2Q  = 1   ///< 1, 2Q policy: bitmaps touched only by a single pass over the VHD (backup, coalescing) don't evict the frequently used ones
+} TVhdCachePolicy;
+
 
 
 
@@ -263,12 +382,49 @@ int VHD_ReadSectors(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors,
 int VHD_WriteSectors(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors, const void* apBuffer, uint32_t aBufSize);
 
 
+//--------------------------------------------------------------------
+/**
+	Read a number of sectors from VHD to a scatter-gather list of buffers.
+    The same as VHD_ReadSectors(), but the data are read directly to the buffers described by iovecs, without an intermediate copy.
+    Buffers sizes don't need to be multiples of the sector size.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aStartSector	starting sector.
+	@param	aSectors		number of sectors to read 0..LONG_MAX
+	@param	apIov		    array of iovecs describing the buffers for the read data
+    @param  aIovCnt         number of elements in the array
+
+	@return	positive number of read sectors on success, negative error code otherwise.
+*/
+int VHD_ReadSectorsV(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors, const struct iovec* apIov, int aIovCnt);
+
+
+//--------------------------------------------------------------------
+/**
+	Write a number of sectors to VHD from a scatter-gather list of buffers.
+    The same as VHD_WriteSectors(), but the data are written directly from the buffers described by iovecs, without an intermediate copy.
+    Buffers sizes don't need to be multiples of the sector size.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aStartSector	starting sector.
+	@param	aSectors		number of sectors to write 0..LONG_MAX
+	@param	apIov		    array of iovecs describing the buffers with data to write
+    @param  aIovCnt         number of elements in the array
+
+	@return	positive number of written sectors on success, negative error code otherwise.
+*/
+int VHD_WriteSectorsV(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors, const struct iovec* apIov, int aIovCnt);
+
+
 
 //--------------------------------------------------------------------
 /**
 	TRIM or "Discard sectors" API.
     Calling this API marks an extent of sectors as "discarded" or not containing useful information (opposite to VHD_WriteSectors() API).
     This feature can be used for efficient VHD compacting, because VHD blocks that contain all "discarded" sectors can be taken out by compacting tool.
+    The space of the discarded sectors is given back to the host file system by punching holes in the VHD file, if the file system supports this;
+    only the host file system blocks that are entirely within the discarded sectors are deallocated. Dynamic and Differencing VHD blocks that
+    don't have any sectors left in use are taken out of the BAT.
 	In order to use this API VHD file must be opened with VHDF_OPEN_ENABLE_TRIM flag.
 
 	@param 	vhdHandle 	    VHD hadle obtained from VHD_Open()
@@ -291,6 +447,20 @@ int VHD_DiscardSectors(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSector
 */
 int VHD_Flush(TVhdHandle aVhdHandle);
 
+//--------------------------------------------------------------------
+/**
+	Change operational mode flags of the opened VHD, see VHDF_OPMODE_* flags.
+	Currently only the durability mode can be changed; metadata pending in the old mode is committed before switching.
+
+	@param 	aVhdHandle  VHD hadle obtained from VHD_Open()
+	@param  aModeFlags  new set of VHDF_OPMODE_* flags. At most one durability mode flag; VHDF_OPMODE_WRITETHROUGH and
+                        VHDF_OPMODE_PURE_BLOCKS must be the same as specified in VHD_Open().
+
+	@return KErrNone on success, KErrArgument on invalid flags, KErrNotSupported if the flags can't be changed at runtime,
+            negative error code otherwise.
+*/
+int VHD_SetMode(TVhdHandle aVhdHandle, uint32_t aModeFlags);
+
 
 //--------------------------------------------------------------------
 /**
@@ -416,6 +586,233 @@ TVhdHandle	VHD_Create(const TVHD_ParamsStruct* apParams);
 int VHD_CoalesceChain(TVhdHandle aVhdHandle, uint32_t aChainIdxStart, uint32_t aChainIdxResult);
 
 
+//--------------------------------------------------------------------
+/**
+    Compact a Dynamic or Differencing VHD file while it stays opened. The blocks that don't have any sectors in use (e.g. discarded by
+    VHD_DiscardSectors()) are taken out of the BAT, the blocks from the end of the file are moved to the free space in front of them,
+    the footer is moved after the last block and the file is truncated. The VHD file remains valid on the media if the operation
+    is interrupted at any point.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open() with VHDF_OPEN_RDWR flag
+	@param	aFlags          a set of VHDF_COMPACT_* flags, 0 by default
+
+	@return	KErrNone on success, KErrNotSupported for Fixed VHDs, negative error code otherwise.
+*/
+int VHD_Compact(TVhdHandle aVhdHandle, uint32_t aFlags);
+
+
+//--------------------------------------------------------------------
+/**
+    Defragment a Dynamic or Differencing VHD file while it stays opened: move the blocks so that their order in the file matches
+    their logical order, thus sequential reads of the VHD become sequential reads of the file. A block is copied to its new place and
+    synced before the BAT refers to it, so the VHD file remains valid on the media if the operation is interrupted at any point;
+    calling the API again continues the defragmentation, even after reopening the VHD. The blocks in the way are moved to the free space
+    after the others, the file may grow by a few blocks meanwhile; it is truncated after the last block when all blocks are in place.
+    The VHD is locked only for a step of a few blocks at a time, so it can be used by other threads while the defragmentation goes on.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open() with VHDF_OPEN_RDWR flag
+	@param	aMaxBlocks      max. number of blocks to put into their places by this call, 0 means no limit
+	@param	aMaxMBps        max. data copying rate, MB per second; 0 means no limit
+
+	@return	number of the blocks that aren't in their places yet, 0 if the VHD is defragmented.
+            KErrNotSupported for Fixed VHDs, negative error code otherwise.
+*/
+int VHD_Defragment(TVhdHandle aVhdHandle, uint32_t aMaxBlocks, uint32_t aMaxMBps);
+
+
+//--------------------------------------------------------------------
+/**
+    Submit a number of asynchronous I/O requests. The call doesn't block waiting for requests completion.
+    Requests submitted to the same VHD handle are executed one after another in the order of submission by the library worker thread,
+    so the client can keep many requests in flight without using a thread per request.
+    Completed requests are collected by VHD_PollCompletions().
+
+    Synchronous API calls (VHD_ReadSectors(), VHD_Flush() etc.) on the same handle wait until all submitted requests are executed.
+    VHD_Close() executes all submitted requests before closing the VHD; the requests that haven't been collected are forgotten.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param  apReqs          array of pointers to the requests to submit. @see TVhdIoRequest
+	@param  aNumReqs        number of requests in the array
+
+	@return	number of requests submitted, it can be less than aNumReqs if the maximal number of requests in flight is reached.
+            -EAGAIN if no requests can be submitted at present, other negative error code otherwise.
+*/
+int VHD_SubmitIo(TVhdHandle aVhdHandle, TVhdIoRequest* apReqs[], int aNumReqs);
+
+
+//--------------------------------------------------------------------
+/**
+	Collect completed asynchronous I/O requests. @see VHD_SubmitIo()
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param  apReqs          out: array of pointers to the completed requests. Each request has TVhdIoRequest::ioResult field set.
+	@param  aMaxReqs        max. number of requests to collect, size of the apReqs array
+	@param  aMinReqs        min. number of requests to collect; the call will block until this number of requests complete.
+                            0 means "don't block at all". The value is limited by the number of requests in flight.
+
+	@return	number of collected requests on success, negative error code otherwise.
+*/
+int VHD_PollCompletions(TVhdHandle aVhdHandle, TVhdIoRequest* apReqs[], int aMaxReqs, int aMinReqs);
+
+
+//--------------------------------------------------------------------
+/**
+	Get a file descriptor that can be used to wait for asynchronous I/O requests completion with poll(), select() etc.
+	The descriptor is an eventfd; it becomes readable when there are completed requests to be collected by VHD_PollCompletions()
+	and stays readable until all of them are collected. There is no need to read() it.
+	The descriptor is owned by the library and valid until VHD_Close().
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@return	file descriptor on success, negative error code otherwise.
+*/
+int VHD_GetIoEventFd(TVhdHandle aVhdHandle);
+
+
+//--------------------------------------------------------------------
+/**
+    Translate an extent of logical sectors into a list of extents describing where the sectors data are located in the VHD chain files.
+    This allows the client to perform data I/O directly on the files, bypassing the library.
+
+    If aAllocateOnWrite is non-zero, the blocks that aren't present in the VHD are allocated and the whole range is returned as
+    EVhdExt_Data extents in the layer 0. The client must write all the sectors mapped this way and then call VHD_CommitExtents() to mark them
+    as allocated. The VHD must be opened for writing in this case.
+
+	@param 	aVhdHandle          VHD hadle obtained from VHD_Open()
+	@param	aStartSector	    starting sector.
+	@param	aSectors		    number of sectors to map 1..LONG_MAX
+	@param	aAllocateOnWrite	if non-zero, allocate VHD blocks for writing. See above.
+	@param  apExtents           out: array of the extents; adjacent sectors with the same location kind are merged to a single extent
+	@param  aMaxExtents         max. number of the extents in the array
+
+	@return	number of the extents filled in on success, negative error code otherwise.
+            If the array is too small, the extents describe only a beginning of the sectors range; call the API again for the rest.
+
+    Note: file descriptors and offsets are valid until VHD_Close(); any VHD_DiscardSectors(), VHD_CoalesceChain(), VHD_Compact() or VHD_Defragment() call makes them stale.
+*/
+int VHD_MapExtents(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors, int aAllocateOnWrite, TVhdExtent* apExtents, int aMaxExtents);
+
+
+//--------------------------------------------------------------------
+/**
+    Mark an extent of sectors as containing valid data after the client has written them directly to the file.
+    All the sectors must have been mapped by VHD_MapExtents() with aAllocateOnWrite flag set.
+    The metadata are updated in the same way as for VHD_WriteSectors() and become persistent on VHD_Flush() or VHD_Close().
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aStartSector	starting sector.
+	@param	aSectors		number of sectors 1..LONG_MAX
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_CommitExtents(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors);
+
+
+//--------------------------------------------------------------------
+/**
+    Set the max. number of sector allocation bitmaps cached per VHD file. Applies to every Dynamic and Differencing VHD in the chain,
+    including parents that will be opened later. The default is 64. A bitmap takes about 512 bytes of RAM for the 2MB blocks.
+    Random I/O over a large area of a VHD chain may benefit from a larger cache.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aMaxBitmaps     max. number of cached bitmaps per VHD file, 1..65536
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetBitmapCacheSize(TVhdHandle aVhdHandle, uint32_t aMaxBitmaps);
+
+
+//--------------------------------------------------------------------
+/**
+    Set the sector allocation bitmaps cache replacement policy for every Dynamic and Differencing VHD in the chain,
+    including parents that will be opened later. The default is EVhdCache_LRU.
+
+    EVhdCache_2Q makes the cache scan-resistant: a bitmap read for the first time is cached in a small "probation" FIFO queue and
+    is evicted from it soon unless it's accessed again after having been evicted recently. Thus, a sequential pass over whole VHD
+    doesn't wipe out the bitmaps of the blocks that are accessed frequently.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aPolicy         replacement policy, see TVhdCachePolicy
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetBitmapCachePolicy(TVhdHandle aVhdHandle, TVhdCachePolicy aPolicy);
+
+
+//--------------------------------------------------------------------
+/**
+    Set the Block Allocation Table cache parameters for every Dynamic and Differencing VHD in the chain, including parents that will be
+    opened later. BAT is read from the file on demand by pages of 2^aPageSizeLog2 sectors, each sector describes 128 blocks; the least
+    recently used pages are evicted when there are aMaxPages pages cached. The default is 8-sector (4K) pages, 16 pages per VHD file.
+    Random I/O over a huge VHD may benefit from more pages; smaller pages save memory when the I/O is scattered over few areas.
+    Changing the page size writes the modified BAT sectors to the media and drops the cached pages.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aPageSizeLog2   Log2(sectors per cache page), 0..5
+	@param	aMaxPages       max. number of cached BAT pages per VHD file, 1..65536
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetBatCacheSize(TVhdHandle aVhdHandle, uint32_t aPageSizeLog2, uint32_t aMaxPages);
+
+
+//--------------------------------------------------------------------
+/**
+    Set the size of the host file region preallocated ahead of the blocks appended to a Dynamic or Differencing VHD.
+    When a new block is appended beyond the preallocated region, the file system space for it and for the next aWindowMB megabytes
+    is allocated in one go without changing the file size, so the VHD footer stays at the end of the file and the file gets large
+    contiguous extents instead of growing one block at a time. The space that hasn't been used is released when the VHD is closed.
+    Has no effect on Fixed VHDs, on VHDs opened read-only and on file systems that don't support preallocation. The default is 64MB.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aWindowMB       preallocation window size in MB, 0..4096. 0 disables preallocation and releases the preallocated space.
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetPreallocation(TVhdHandle aVhdHandle, uint32_t aWindowMB);
+
+
+//--------------------------------------------------------------------
+/**
+    Set the process-wide memory budget for the metadata caches (BAT and sector allocation bitmaps) of all opened VHD files.
+    When a cache needs a new page and the budget is exhausted, it reuses one of its own pages, and the least recently active cache of
+    another VHD file is asked to release some memory. Caches release memory when they are accessed next time, so the actual usage can
+    exceed a lowered budget for a while. One page per cache is always allowed and isn't limited by the budget.
+
+    The per-file limits still apply, @see VHD_SetBitmapCacheSize(), VHD_SetBatCacheSize().
+
+	@param	aBytes          the budget in bytes; 0 means "unlimited", this is the default.
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetCacheBudget(uint64_t aBytes);
+
+
+//--------------------------------------------------------------------
+/**
+    @return number of bytes used by the metadata caches of all opened VHD files. @see VHD_SetCacheBudget()
+*/
+uint64_t VHD_GetCacheUsage();
+
+
+//--------------------------------------------------------------------
+/**
+    Enable or disable the process-wide background metadata flusher. When enabled, a thread writes dirty BAT and sector bitmaps
+    of all VHD files opened for writing in background: the metadata of a file is committed when it has been dirty for aMaxAgeMs or
+    aMaxDirtyWrites write calls have left it dirty, whichever comes first. The commit syncs the file data before writing the metadata,
+    as in VHDF_OPMODE_ORDERED mode. A file being accessed by its client is skipped till the next flusher pass.
+
+    The flusher reduces the amount of metadata I/O done by write calls and cache evictions, and in VHDF_OPMODE_WRITEBACK mode
+    it limits the amount of metadata that can be lost on crash.
+
+	@param	aMaxAgeMs       max. time the metadata can stay dirty, in milliseconds. 0 disables this trigger.
+	@param	aMaxDirtyWrites max. number of write calls that left the metadata dirty. 0 disables this trigger.
+                            If both values are 0, the flusher is disabled; this is the default.
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetBackgroundFlush(uint32_t aMaxAgeMs, uint32_t aMaxDirtyWrites);
+
+
 
 
 
@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file implementation of the asynchronous I/O requests queue
+*/
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include "async_io.h"
+
+
+//####################################################################
+//#  CAsyncIoQueue class implementation
+//####################################################################
+
+//--------------------------------------------------------------------
+/**
+    Constructor.
+    @param  aVhd    VHD object that requests will be executed on. Must outlive this object.
+*/
+CAsyncIoQueue::CAsyncIoQueue(CVhdFileBase& aVhd)
+              :iVhd(aVhd), iState(EInvalid), iEventFd(-1), iNumExecuting(0)
+{
+    DBG_LOG("CAsyncIoQueue::CAsyncIoQueue[0x%p]", this);
+
+    pthread_mutex_init(&iLock, NULL);
+    pthread_cond_init(&iCondSubmitted, NULL);
+    pthread_cond_init(&iCondCompleted, NULL);
+}
+
+CAsyncIoQueue::~CAsyncIoQueue()
+{
+    DBG_LOG("CAsyncIoQueue::~CAsyncIoQueue[0x%p], state:%d", this, iState);
+
+    if(iState != EInvalid)
+    {//-- the Close() method must be called before deleting this object; the worker thread must be stopped.
+        Fault(EInvalidState);
+    }
+
+    pthread_cond_destroy(&iCondCompleted);
+    pthread_cond_destroy(&iCondSubmitted);
+    pthread_mutex_destroy(&iLock);
+}
+
+//--------------------------------------------------------------------
+/**
+    Create the completion eventfd and start the worker thread.
+    @return KErrNone on success, negative error code otherwise
+*/
+int CAsyncIoQueue::Open()
+{
+    DBG_LOG("CAsyncIoQueue::Open[0x%p]", this);
+    ASSERT(iState == EInvalid);
+
+    iEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(iEventFd < 0)
+    {
+        const int nRes = -errno;
+        DBG_LOG("Error creating eventfd! code:%d", nRes);
+        return nRes;
+    }
+
+    iState = ERunning;
+
+    const int nRes = pthread_create(&iThread, NULL, ThreadFunction, this);
+    if(nRes != 0)
+    {
+        DBG_LOG("Error creating worker thread! code:%d", nRes);
+        iState = EInvalid;
+        close(iEventFd);
+        iEventFd = -1;
+        return -nRes;
+    }
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Stop the worker thread and release resources.
+    All requests submitted before this call are executed; completed requests that weren't collected by the client are discarded.
+*/
+void CAsyncIoQueue::Close()
+{
+    DBG_LOG("CAsyncIoQueue::Close[0x%p], state:%d", this, iState);
+
+    if(iState == EInvalid)
+        return;
+
+    pthread_mutex_lock(&iLock);
+    iState = EStopping;
+    pthread_cond_signal(&iCondSubmitted);
+    pthread_mutex_unlock(&iLock);
+
+    pthread_join(iThread, NULL);
+
+    ASSERT(iPending.empty() && !iNumExecuting && iAwaitingCommit.empty());
+    iCompleted.clear();
+
+    close(iEventFd);
+    iEventFd = -1;
+
+    iState = EInvalid;
+}
+
+//--------------------------------------------------------------------
+/**
+    Queue requests for execution by the worker thread.
+
+    @param  apReqs      array of pointers to the requests
+    @param  aNumReqs    number of requests in the array
+
+    @return number of queued requests, can be less than aNumReqs if KMaxAsyncIo_Requests limit is reached.
+            -EAGAIN if no requests can be queued at present, KErrArgument if some request is invalid, other negative error code otherwise.
+*/
+int CAsyncIoQueue::Submit(TVhdIoRequest* apReqs[], int aNumReqs)
+{
+    if(!apReqs || aNumReqs < 0)
+        return KErrArgument;
+
+    //-- check all requests first, so that invalid ones are rejected before anything is submitted
+    for(int i=0; i<aNumReqs; ++i)
+    {
+        if(!DoCheckRequest(apReqs[i]))
+        {
+            DBG_LOG("invalid request #%d", i);
+            return KErrArgument;
+        }
+    }
+
+    pthread_mutex_lock(&iLock);
+
+    if(iState != ERunning)
+    {
+        pthread_mutex_unlock(&iLock);
+        return KErrGeneral;
+    }
+
+    int numSubmitted = 0;
+    while(numSubmitted < aNumReqs && NumInFlight() < KMaxAsyncIo_Requests)
+    {
+        TVhdIoRequest* pReq = apReqs[numSubmitted];
+        pReq->ioResult = KErrGeneral;
+        iPending.push_back(pReq);
+        ++numSubmitted;
+    }
+
+    if(numSubmitted)
+        pthread_cond_signal(&iCondSubmitted);
+
+    pthread_mutex_unlock(&iLock);
+
+    if(!numSubmitted && aNumReqs)
+        return -EAGAIN;
+
+    return numSubmitted;
+}
+
+//--------------------------------------------------------------------
+/**
+    Collect completed requests.
+
+    @param  apReqs      out: array of pointers to the completed requests
+    @param  aMaxReqs    max. number of requests to collect
+    @param  aMinReqs    number of completed requests to wait for; limited by the number of requests in flight and aMaxReqs.
+                        The limit is checked again on every wakeup: if another thread polling the same queue has collected
+                        some of the requests, this one doesn't wait for more requests than can still complete.
+
+    @return number of collected requests, negative error code on error.
+*/
+int CAsyncIoQueue::PollCompletions(TVhdIoRequest* apReqs[], int aMaxReqs, int aMinReqs)
+{
+    if(!apReqs || aMaxReqs < 0 || aMinReqs < 0)
+        return KErrArgument;
+
+    pthread_mutex_lock(&iLock);
+
+    const uint32_t KWantReqs = (uint32_t)Min(aMinReqs, aMaxReqs);
+
+    while(iCompleted.size() < Min(KWantReqs, NumInFlight()))
+        pthread_cond_wait(&iCondCompleted, &iLock);
+
+    int numCollected = 0;
+    while(numCollected < aMaxReqs && !iCompleted.empty())
+    {
+        apReqs[numCollected++] = iCompleted.front();
+        iCompleted.pop_front();
+    }
+
+    if(iCompleted.empty())
+        DoResetCompletionSignal();
+
+    //-- fewer requests can complete now, let the other polling threads re-check what they wait for
+    if(numCollected)
+        pthread_cond_broadcast(&iCondCompleted);
+
+    pthread_mutex_unlock(&iLock);
+
+    return numCollected;
+}
+
+//--------------------------------------------------------------------
+/**
+    Wait until all submitted requests are executed and the worker thread doesn't access the VHD object.
+    Must be called before any synchronous access to the VHD object.
+*/
+void CAsyncIoQueue::WaitIdle()
+{
+    pthread_mutex_lock(&iLock);
+
+    while(!iPending.empty() || iNumExecuting || !iAwaitingCommit.empty())
+        pthread_cond_wait(&iCondCompleted, &iLock);
+
+    pthread_mutex_unlock(&iLock);
+}
+
+//--------------------------------------------------------------------
+/**
+    Check request parameters that can be validated without accessing the VHD object.
+    @return true if the request looks valid
+*/
+bool CAsyncIoQueue::DoCheckRequest(const TVhdIoRequest* apReq) const
+{
+    if(!apReq)
+        return false;
+
+    switch(apReq->ioOpcode)
+    {
+        case EVhdIo_Read:
+        case EVhdIo_Write:
+        return apReq->ioBuffer != NULL;
+
+        case EVhdIo_Discard:
+        case EVhdIo_Flush:
+        return true;
+
+        default:
+        return false;
+    };
+}
+
+//--------------------------------------------------------------------
+/** make the completion eventfd readable */
+void CAsyncIoQueue::DoSignalCompletion()
+{
+    const uint64_t val = 1;
+    if(write(iEventFd, &val, sizeof(val)) != sizeof(val))
+    {
+        DBG_LOG("Error writing eventfd! code:%d", -errno);
+    }
+}
+
+//--------------------------------------------------------------------
+/** reset the completion eventfd counter */
+void CAsyncIoQueue::DoResetCompletionSignal()
+{
+    uint64_t val;
+    (void)read(iEventFd, &val, sizeof(val)); //-- the descriptor is non-blocking, EAGAIN is OK
+}
+
+//--------------------------------------------------------------------
+/** worker thread entry point */
+void* CAsyncIoQueue::ThreadFunction(void* apThis)
+{
+    CAsyncIoQueue* pThis = reinterpret_cast<CAsyncIoQueue*>(apThis);
+    pThis->DoProcessRequests();
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------
+/**
+    Worker thread loop. Executes submitted requests one by one until the queue is stopped and there are no more pending requests.
+    Allocating write requests are group-committed when the queue runs dry or the group is large enough, see VHDF_OPMODE_ORDERED.
+*/
+void CAsyncIoQueue::DoProcessRequests()
+{
+    DBG_LOG("CAsyncIoQueue[0x%p] worker thread started", this);
+
+    pthread_mutex_lock(&iLock);
+
+    for(;;)
+    {
+        while(iPending.empty() && iAwaitingCommit.empty() && iState == ERunning)
+            pthread_cond_wait(&iCondSubmitted, &iLock);
+
+        if(!iAwaitingCommit.empty() && (iPending.empty() || iAwaitingCommit.size() >= KMaxGroupCommit_Requests))
+        {//-- nothing else to join the group, or the group is big enough. Commit it.
+            DoGroupCommit();
+            continue;
+        }
+
+        if(iPending.empty())
+        {
+            ASSERT(iState == EStopping);
+            break;
+        }
+
+        TVhdIoRequest* pReq = iPending.front();
+        iPending.pop_front();
+        ++iNumExecuting;
+
+        //-- execute the request without holding the lock, so that the client can submit/collect other requests meanwhile
+        pthread_mutex_unlock(&iLock);
+        DoExecuteRequest(pReq);
+        const bool bCommitPending = iVhd.CommitPending();
+        pthread_mutex_lock(&iLock);
+
+        --iNumExecuting;
+
+        if(pReq->ioOpcode == EVhdIo_Write && pReq->ioResult >= 0 && bCommitPending)
+        {//-- the request has allocated blocks (or follows those that did); it will be completed after the commit
+            iAwaitingCommit.push_back(pReq);
+            continue;
+        }
+
+        if(!bCommitPending)
+        {//-- metadata has been committed by the request itself (e.g. flush), the whole group is durable
+            while(!iAwaitingCommit.empty())
+            {
+                DoCompleteRequest(iAwaitingCommit.front());
+                iAwaitingCommit.pop_front();
+            }
+        }
+
+        DoCompleteRequest(pReq);
+    }
+
+    pthread_mutex_unlock(&iLock);
+
+    DBG_LOG("CAsyncIoQueue[0x%p] worker thread finished", this);
+}
+
+//--------------------------------------------------------------------
+/**
+    Commit metadata for all requests in the "awaiting commit" list and complete them.
+    A commit failure is reported in every request of the group.
+    @pre the lock is held
+*/
+void CAsyncIoQueue::DoGroupCommit()
+{
+    ASSERT(!iAwaitingCommit.empty());
+
+    ++iNumExecuting; //-- the VHD object is being accessed by this thread
+
+    pthread_mutex_unlock(&iLock);
+
+    int nRes = KErrGeneral;
+    iVhd.LockAccess();
+    try
+    {
+        nRes = iVhd.CommitMetadata();
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+    iVhd.UnlockAccess();
+
+    pthread_mutex_lock(&iLock);
+
+    --iNumExecuting;
+
+    DBG_LOG("CAsyncIoQueue[0x%p] group commit of %d requests, code:%d", this, (int)iAwaitingCommit.size(), nRes);
+
+    while(!iAwaitingCommit.empty())
+    {
+        TVhdIoRequest* pReq = iAwaitingCommit.front();
+        iAwaitingCommit.pop_front();
+
+        if(nRes < 0)
+            pReq->ioResult = nRes;
+
+        DoCompleteRequest(pReq);
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Put the executed request to the "completed" list and notify the client.
+    @pre the lock is held
+*/
+void CAsyncIoQueue::DoCompleteRequest(TVhdIoRequest* apReq)
+{
+    iCompleted.push_back(apReq);
+
+    DoSignalCompletion();
+    pthread_cond_broadcast(&iCondCompleted);
+}
+
+//--------------------------------------------------------------------
+/**
+    Execute a single request on the VHD object and store the result in the request.
+    The results are the same as the corresponding synchronous API would return.
+*/
+void CAsyncIoQueue::DoExecuteRequest(TVhdIoRequest* apReq)
+{
+    int nRes = KErrGeneral;
+
+    iVhd.LockAccess(); //-- keep the background metadata flusher away
+    try
+    {
+        switch(apReq->ioOpcode)
+        {
+            case EVhdIo_Read:
+            nRes = iVhd.ReadSectors(apReq->ioStartSector, apReq->ioSectors, apReq->ioBuffer, apReq->ioBufSize);
+            break;
+
+            case EVhdIo_Write:
+            iVhd.SetCommitDeferred(iVhd.GroupCommit()); //-- allocations will be committed by DoGroupCommit()
+            nRes = iVhd.WriteSectors(apReq->ioStartSector, apReq->ioSectors, apReq->ioBuffer, apReq->ioBufSize);
+            break;
+
+            case EVhdIo_Discard:
+            if(iVhd.TrimEnabled())
+                nRes = iVhd.DiscardSectors(apReq->ioStartSector, apReq->ioSectors);
+            else
+                nRes = KErrNotSupported;
+            break;
+
+            case EVhdIo_Flush:
+            nRes = iVhd.Flush();
+            break;
+
+            default:
+            Fault(EMustNotBeCalled); //-- requests are checked on submission
+            break;
+        };
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    iVhd.SetCommitDeferred(false);
+    iVhd.UnlockAccess();
+
+    apReq->ioResult = nRes;
+}
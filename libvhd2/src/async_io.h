@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file asynchronous I/O requests queue, see VHD_SubmitIo() API
+*/
+
+
+#ifndef __ASYNC_IO_H__
+#define __ASYNC_IO_H__
+
+#include <pthread.h>
+
+#include <deque>
+using std::deque;
+
+#include "vhd.h"
+
+//--------------------------------------------------------------------
+/**
+    A queue of asynchronous I/O requests associated with a VHD file object.
+
+    Submitted requests are executed by a single worker thread one after another, in the order of submission, by calling
+    corresponding synchronous methods of the VHD object. CVhdFileBase and its helpers are not thread-safe, thus there must be
+    no other access to the VHD object while the worker thread is executing requests. @see WaitIdle().
+
+    Completed requests are put to the "completed" list and the eventfd counter is incremented, so that the client can
+    wait for completions with poll() or select().
+
+    If the VHD is opened with VHDF_OPMODE_ORDERED, write requests that allocate blocks are not completed straight away;
+    they wait in the "awaiting commit" list until there are no more pending requests (or KMaxGroupCommit_Requests is reached),
+    then the metadata of all of them is committed at once and they are completed together.
+
+    Not intended for derivation.
+*/
+class CAsyncIoQueue
+{
+ public:
+    CAsyncIoQueue(CVhdFileBase& aVhd);
+   ~CAsyncIoQueue();
+
+    int  Open();
+    void Close();
+
+    int  Submit(TVhdIoRequest* apReqs[], int aNumReqs);
+    int  PollCompletions(TVhdIoRequest* apReqs[], int aMaxReqs, int aMinReqs);
+    void WaitIdle();
+
+    int  EventFd() const {return iEventFd;} ///< @return eventfd descriptor signalled on requests completion
+
+ private:
+    CAsyncIoQueue(const CAsyncIoQueue&);
+    CAsyncIoQueue& operator=(const CAsyncIoQueue&);
+
+    /** this object states */
+    enum TState
+    {
+        EInvalid = 0,   ///< invalid initial state, the worker thread isn't running
+        ERunning,       ///< the worker thread is running and accepting requests
+        EStopping       ///< the worker thread is executing the rest of the requests and is about to finish
+    };
+
+    /** @return number of requests in flight, i.e. submitted and not collected yet */
+    uint32_t NumInFlight() const {return iPending.size() + iNumExecuting + iAwaitingCommit.size() + iCompleted.size();}
+
+    static void* ThreadFunction(void* apThis);
+    void DoProcessRequests();
+    void DoExecuteRequest(TVhdIoRequest* apReq);
+    void DoGroupCommit();
+    void DoCompleteRequest(TVhdIoRequest* apReq);
+    bool DoCheckRequest(const TVhdIoRequest* apReq) const;
+
+    void DoSignalCompletion();
+    void DoResetCompletionSignal();
+
+ private:
+    CVhdFileBase&   iVhd;           ///< VHD object the requests are executed on
+    TState          iState;         ///< this object state
+
+    pthread_t       iThread;        ///< worker thread
+    pthread_mutex_t iLock;          ///< protects all members below
+    pthread_cond_t  iCondSubmitted; ///< signalled when new requests are submitted or the queue is being stopped
+    pthread_cond_t  iCondCompleted; ///< signalled when the worker thread completes a request
+
+    int             iEventFd;       ///< eventfd descriptor, readable when there are completed requests in iCompleted
+
+    deque<TVhdIoRequest*> iPending;   ///< requests submitted and waiting for execution
+    deque<TVhdIoRequest*> iAwaitingCommit; ///< executed write requests waiting for the metadata group commit
+    deque<TVhdIoRequest*> iCompleted; ///< completed requests waiting to be collected by the client
+    uint32_t        iNumExecuting;  ///< number of requests being executed by the worker thread (0 or 1)
+};
+
+
+#endif //__ASYNC_IO_H__
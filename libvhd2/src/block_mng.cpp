@@ -29,6 +29,9 @@
 #include "block_mng.h"
 
 ASSERT_COMPILE(KMaxCached_SectorBitmaps > 0 && KMaxCached_SectorBitmaps < 1024);
+ASSERT_COMPILE(sizeof(TBatEntry) == (1 << KBatEntrySizeLog2));
+ASSERT_COMPILE(KBatCache_PageSizeLog2_Limit <= 5); //-- page dirty sectors mask is 32 bits
+ASSERT_COMPILE(KBatCache_PageSizeLog2 <= KBatCache_PageSizeLog2_Limit && KBatCache_MaxPages > 0 && KBatCache_MaxPages <= KBatCache_MaxPages_Limit);
 
 //####################################################################
 //#  CBat class implementation
@@ -51,8 +54,11 @@ CBat::CBat(CVhdDynDiffBase& aVhd)
     ASSERT(iMaxEntries);
 
     iBatSector = (uint32_t)(BatOffset >> SectorSzLog2());
-    iBatBuffer = NULL;
+    iBatSectors = 1 + ((iMaxEntries - 1) >> EntriesPerSectorLog2()); //-- BAT on the media is padded to the sector boundary
     iState = EInvalid;
+    iPageSizeLog2 = KBatCache_PageSizeLog2;
+    iMaxPages = KBatCache_MaxPages;
+    iChanges = 0;
 }
 
 
@@ -68,7 +74,7 @@ CBat::~CBat()
     if(State() != EInvalid)
         Fault(EInvalidState);
 
-    ASSERT(!iBatBuffer);
+    ASSERT(iLru.empty());
 }
 
 //--------------------------------------------------------------------
@@ -84,15 +90,14 @@ void CBat::Close(bool aForceClose /*=false*/)
     InvalidateCache(aForceClose); //-- does some checks as well
 
     //-- destroy BAT cache
-    delete [] iBatBuffer;
-    iBatBuffer = NULL;
+    iPageTable.clear();
 }
 
 //--------------------------------------------------------------------
 /**
     Invalidates cache data. If the client will try to access data with cache invalid, it will result in
     re-reading data from the media to the cache.
-    Does not deallocate cache RAM, just marks data as invalid.
+    Cached pages are released.
 
     @param  aIgnoreDirty    if true, ignores dirty data. not for a normal use
     @pre the cache must not be dirty; @see Flush()
@@ -105,80 +110,313 @@ void CBat::InvalidateCache(bool aIgnoreDirty /*=false*/)
         Fault(EBat_DestroyingDirty);
     }
 
+    DestroyPages();
     SetState(EInvalid);
+    iChanges++;
 }
 
 
 //--------------------------------------------------------------------
 /**
-    Creates BAT cache if it doesn't exist.
+    Creates BAT cache if it doesn't exist. Doesn't read anything from the media, pages are read on demand.
 */
 void CBat::CreateBatCache()
 {
     DBG_LOG("CBat::CreateBatCache() maxEntries:%d", iMaxEntries);
     ASSERT(State() == EInvalid);
+    ASSERT(iLru.empty());
+
+    const uint32_t KPages = 1 + ((iBatSectors - 1) >> iPageSizeLog2);
+    iPageTable.assign(KPages, (TBatPage*)NULL);
+
+    SetState(EClean);
+}
+
+//--------------------------------------------------------------------
+/** Release all cached pages */
+void CBat::DestroyPages()
+{
+    for(TPageList::iterator it = iLru.begin(); it != iLru.end(); ++it)
+    {
+        TBatPage* pPage = *it;
 
-    if(iBatBuffer)
-    {//-- strange, the cache seems to already exist
-        Fault(EAlreadyExists);
+        ASSERT(iPageTable[pPage->iPageNo] == pPage);
+        iPageTable[pPage->iPageNo] = NULL;
+
+        delete [] pPage->ipData;
+        delete pPage;
+        CacheRelease(PageBytes());
     }
 
-    //-- allocate buffer for the cache.
-    iBatBuffer = new uint32_t [iMaxEntries];
-    FillZ(iBatBuffer, sizeof(TBatEntry)*iMaxEntries);
+    iLru.clear();
 }
 
 //--------------------------------------------------------------------
 /**
-    Read raw BAT data from the media into the cache.
+    @param  aPageNo BAT page number
+    @return number of sectors in the page; the last page can be smaller than others.
+*/
+uint32_t CBat::PageSectors(uint32_t aPageNo) const
+{
+    const uint32_t KStartSector = aPageNo << iPageSizeLog2;
+    ASSERT(KStartSector < iBatSectors);
+
+    return Min(iBatSectors - KStartSector, 1u << iPageSizeLog2);
+}
+
+//--------------------------------------------------------------------
+/**
+    Get a page from the cache. If the page isn't cached, it is read from the media; the least recently used page may be evicted
+    to make room for it. If all cached pages are dirty, whole cache is flushed first.
+
+    @param  aPageNo     BAT page number
+    @param  aErrCode    out: error code if the page can't be obtained
+
+    @return pointer to the page, NULL on error
+*/
+CBat::TBatPage* CBat::GetPage(uint32_t aPageNo, int& aErrCode)
+{
+    ASSERT(StateValid());
+    ASSERT(aPageNo < iPageTable.size());
+
+    //-- give some memory back if the cache manager asks for it
+    if(CacheReclaimPending())
+    {
+        aErrCode = DoReclaimPages();
+        if(aErrCode != KErrNone)
+            return NULL;
+    }
+
+    TBatPage* pPage = iPageTable[aPageNo];
+    if(pPage)
+    {//-- the page is cached, make it the most recently used
+        iLru.splice(iLru.begin(), iLru, pPage->iLruPos);
+        return pPage;
+    }
+
+    if(iLru.size() >= iMaxPages || !CacheReserve(PageBytes(), iLru.empty()))
+    {//-- need to evict a page
+        pPage = DoEvictPage(aErrCode);
+        if(!pPage)
+            return NULL;
+    }
+    else
+    {
+        pPage = new TBatPage;
+        pPage->ipData = new uint32_t [1 << EntriesPerPageLog2()];
+    }
+
+    pPage->iPageNo = aPageNo;
+    pPage->iDirtySectors = 0;
+
+    aErrCode = ReadPage(pPage);
+    if(aErrCode != KErrNone)
+    {
+        delete [] pPage->ipData;
+        delete pPage;
+        CacheRelease(PageBytes());
+        return NULL;
+    }
+
+    iLru.push_front(pPage);
+    pPage->iLruPos = iLru.begin();
+    iPageTable[aPageNo] = pPage;
+
+    return pPage;
+}
+
+//--------------------------------------------------------------------
+/**
+    Remove the least recently used clean page from the cache. If all cached pages are dirty, whole cache is flushed first.
+    @param  aErrCode    out: error code if the page can't be evicted
+    @return pointer to the page that isn't in the cache any more, NULL on error
+*/
+CBat::TBatPage* CBat::DoEvictPage(int& aErrCode)
+{
+    ASSERT(!iLru.empty());
+
+    //-- find the least recently used clean page
+    TPageList::iterator it = iLru.end();
+    do
+    {
+        --it;
+        if(!(*it)->iDirtySectors)
+            break;
+    } while(it != iLru.begin());
+
+    if((*it)->iDirtySectors)
+    {//-- all pages are dirty, write them all and evict the least recently used one
+        aErrCode = iVhd.DoRaw_DataBarrier();
+        if(aErrCode != KErrNone)
+            return NULL;
+
+        aErrCode = WriteBAT();
+        if(aErrCode != KErrNone)
+            return NULL;
+
+        it = --iLru.end();
+    }
+
+    TBatPage* pPage = *it;
+    iLru.erase(it);
+
+    DBG_LOG("CBat::DoEvictPage() page:%d", pPage->iPageNo);
+    iPageTable[pPage->iPageNo] = NULL;
+
+    return pPage;
+}
+
+//--------------------------------------------------------------------
+/**
+    Release cached pages if the cache manager asks for memory. At least one page is kept.
     @return KErrNone on success, negative error code otherwise
 */
-int CBat::ReadBAT()
+int CBat::DoReclaimPages()
 {
-    DBG_LOG("CBat::ReadBAT()");
+    while(iLru.size() > 1 && CacheReclaimDebt())
+    {
+        int nRes;
+        TBatPage* pPage = DoEvictPage(nRes);
+        if(!pPage)
+            return nRes;
 
-    //-- 1. create a cache if it doesn't exist
-    if(!iBatBuffer)
-        CreateBatCache();
+        delete [] pPage->ipData;
+        delete pPage;
+        CacheRelease(PageBytes());
+    }
 
-    if(State() == EDirty)
-    {//-- an attempt to discard cache with dirty data
-        Fault(EBat_DestroyingDirty);
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Change the cache page size and capacity. If the page size changes, dirty pages are written to the media and all pages are
+    released, they are read again on demand. If there are more pages cached than the new capacity, the least recently used ones
+    are written if necessary and evicted.
+
+    @param  aPageSizeLog2   Log2(sectors per cache page), 0..KBatCache_PageSizeLog2_Limit
+    @param  aMaxPages       max. number of cached pages, 1..KBatCache_MaxPages_Limit
+    @return KErrNone on success, negative error code otherwise
+*/
+int CBat::SetCacheSize(uint32_t aPageSizeLog2, uint32_t aMaxPages)
+{
+    DBG_LOG("CBat::SetCacheSize(%d, %d) pages:%d", aPageSizeLog2, aMaxPages, iLru.size());
+
+    if(aPageSizeLog2 > KBatCache_PageSizeLog2_Limit || !aMaxPages || aMaxPages > KBatCache_MaxPages_Limit)
+        return KErrArgument;
+
+    int nRes;
+
+    if(aPageSizeLog2 != iPageSizeLog2)
+    {//-- the pages are laid out differently now, start from scratch
+        if(State() == EDirty)
+        {//-- the data of the allocated blocks goes to the media before the BAT that refers to them
+            nRes = iVhd.DoRaw_DataBarrier();
+            if(nRes == KErrNone)
+                nRes = WriteBAT();
+
+            if(nRes != KErrNone)
+                return nRes;
+        }
+
+        DestroyPages();
+        iPageSizeLog2 = aPageSizeLog2;
+
+        if(StateValid())
+            iPageTable.assign(1 + ((iBatSectors - 1) >> iPageSizeLog2), (TBatPage*)NULL);
+    }
+
+    iMaxPages = aMaxPages;
+
+    while(iLru.size() > iMaxPages)
+    {
+        TBatPage* pPage = DoEvictPage(nRes);
+        if(!pPage)
+            return nRes;
+
+        delete [] pPage->ipData;
+        delete pPage;
+        CacheRelease(PageBytes());
     }
 
-    //-- 2. read whole BAT to the cache buffer
-    const int  bytesToRead = sizeof(TBatEntry)*iMaxEntries;
-    const int  bytesRead = iVhd.DoRaw_ReadData(iBatSector, bytesToRead, iBatBuffer);
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Read a BAT page from the media.
+    @param  apPage  page to read, its number must be set
+    @return KErrNone on success, negative error code otherwise
+*/
+int CBat::ReadPage(TBatPage* apPage)
+{
+    DBG_LOG("CBat::ReadPage(%d)", apPage->iPageNo);
+
+    const int  bytesToRead = PageSectors(apPage->iPageNo) << SectorSzLog2();
+    const int  bytesRead = iVhd.DoRaw_ReadData(iBatSector + (apPage->iPageNo << iPageSizeLog2), bytesToRead, apPage->ipData);
     if(bytesRead != bytesToRead)
-        return bytesRead; //-- error code in this case
+        return (bytesRead < 0) ? bytesRead : KErrCorrupt;
 
-    //-- 3. set correct state
-    SetState(EClean);
     return KErrNone;
 }
 
 //--------------------------------------------------------------------
 /**
     Write raw BAT data to the media from the cache.
+    Only dirty BAT sectors are written; all of them are written by a single batch of requests, so adjacent dirty sectors
+    can be written by a single system call.
     @return KErrNone on success, negative error code otherwise
 */
 int CBat::WriteBAT()
 {
     DBG_LOG("CBat::WriteBAT()");
 
-    if(!iBatBuffer || State() != EDirty)
+    if(State() != EDirty)
     {
         ASSERT(0);
         return KErrNone;
     }
 
-    //-- write whole BAT buffer to the media
-    const int  bytesToWrite = sizeof(TBatEntry)*iMaxEntries;
-    const int  bytesWritten = iVhd.DoRaw_WriteData(iBatSector, bytesToWrite, iBatBuffer);
-    if(bytesWritten != bytesToWrite)
-        return bytesWritten; //-- error code in this case
+    //-- queue writing extents of dirty sectors in the order of pages
+    for(size_t i=0; i<iPageTable.size(); ++i)
+    {
+        const TBatPage* pPage = iPageTable[i];
+        if(!pPage || !pPage->iDirtySectors)
+            continue;
+
+        const uint8_t*  pData = reinterpret_cast<const uint8_t*>(pPage->ipData);
+        const uint32_t  KPageStartSec = iBatSector + (pPage->iPageNo << iPageSizeLog2);
+        const uint32_t  KPageSectors = PageSectors(pPage->iPageNo);
+
+        for(uint32_t sec = 0; sec < KPageSectors; )
+        {
+            if(!(pPage->iDirtySectors & (1u << sec)))
+            {
+                ++sec;
+                continue;
+            }
+
+            uint32_t numSec = 1;
+            while(sec + numSec < KPageSectors && (pPage->iDirtySectors & (1u << (sec + numSec))))
+                ++numSec;
+
+            DBG_LOG("CBat::WriteBAT() page:%d, sectors:%d-%d", pPage->iPageNo, sec, sec + numSec - 1);
+
+            const uint32_t KBytes = numSec << SectorSzLog2();
+            iVhd.DoRaw_QueueWrite(KPageStartSec + sec, KBytes, TIoVecBuf((void*)(pData + (sec << SectorSzLog2())), KBytes));
+
+            sec += numSec;
+        }
+    }
+
+    const int nRes = iVhd.DoRaw_SubmitBatch();
+    if(nRes != KErrNone)
+        return nRes;
 
     //-- set correct state
+    for(TPageList::iterator it = iLru.begin(); it != iLru.end(); ++it)
+        (*it)->iDirtySectors = 0;
+
     SetState(EClean);
     return KErrNone;
 }
@@ -203,17 +441,20 @@ TBatEntry CBat::ReadEntry(uint32_t aIndex)
 
     if(!StateValid())
     {//-- Invalid state; cache isn't created yet or invalidated explicitly
-        int nRes = ReadBAT(); //-- read BAT from the media
-        if(nRes != KErrNone)
-        {
-            return nRes;
-        }
+        CreateBatCache();
     }
 
     ASSERT(StateValid());
 
+    int nRes;
+    const TBatPage* pPage = GetPage(aIndex >> EntriesPerPageLog2(), nRes);
+    if(!pPage)
+    {
+        return nRes;
+    }
+
     //-- get entry directly from the cache and change endianness if necessary
-    TBatEntry entry = iBatBuffer[aIndex];
+    TBatEntry entry = pPage->ipData[aIndex & ((1 << EntriesPerPageLog2()) - 1)];
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     entry = __bswap_32(entry);
 #endif
@@ -230,7 +471,7 @@ TBatEntry CBat::ReadEntry(uint32_t aIndex)
     @param  aIndex   a valid index in BAT
     @return KErrNone on success, negative error code otherwise
 
-    @post   marks whole BAT cache as dirty
+    @post   marks the BAT sector containing the entry as dirty
 */
 int CBat::WriteEntry(uint32_t aIndex, TBatEntry aEntry)
 {
@@ -243,22 +484,32 @@ int CBat::WriteEntry(uint32_t aIndex, TBatEntry aEntry)
     //-- the cache might be invalidated
     if(!StateValid())
     {//-- Invalid state; cache isn't created yet or invalidated explicitly
-        int nRes = ReadBAT(); //-- read BAT from the media
-        if(nRes != KErrNone)
-        {
-            return nRes;
-        }
+        CreateBatCache();
     }
 
     ASSERT(StateValid());
 
+    int nRes;
+    TBatPage* pPage = GetPage(aIndex >> EntriesPerPageLog2(), nRes);
+    if(!pPage)
+    {
+        return nRes;
+    }
+
     //-- change endianness if necessary
 #if __BYTE_ORDER == __LITTLE_ENDIAN
     aEntry = __bswap_32(aEntry);
 #endif
 
-    iBatBuffer[aIndex] = aEntry;
+    const uint32_t KIndexInPage = aIndex & ((1 << EntriesPerPageLog2()) - 1);
+
+    if(pPage->ipData[KIndexInPage] == aEntry)
+        return KErrNone; //-- nothing changes
+
+    pPage->ipData[KIndexInPage] = aEntry;
+    pPage->iDirtySectors |= 1u << (KIndexInPage >> EntriesPerSectorLog2());
     SetState(EDirty);
+    iChanges++;
 
     return KErrNone;
 }
@@ -278,7 +529,7 @@ int CBat::Flush()
         return KErrNone;
 
     const int nRes = WriteBAT();
-    ASSERT(State() == EClean);
+    ASSERT(nRes != KErrNone || State() == EClean);
 
     return nRes;
 }
@@ -305,10 +556,13 @@ bool CBat::BatIndexValid(uint32_t aIndex) const
     @param  CVhdDynDiffBase reference to the class representing common functionality for dynamic & differencing VHDs
 */
 CSectorMapper::CSectorMapper(CVhdDynDiffBase& aVhd)
-              :iVhd(aVhd)
+              :iVhd(aVhd), iMaxPages(0), iNumPages(0), iPolicy(EVhdCache_LRU), iChanges(0), iHashBitsLog2(0)
 {
     DBG_LOG("CSectorMapper::CSectorMapper()");
     iState = EInvalid;
+
+    DoResizeHashTable(KMaxCached_SectorBitmaps);
+    iMaxPages = KMaxCached_SectorBitmaps;
 }
 
 //--------------------------------------------------------------------
@@ -323,7 +577,7 @@ CSectorMapper::~CSectorMapper()
     if(State() != EInvalid)
         Fault(EInvalidState);
 
-    ASSERT(!iPages.size());
+    ASSERT(!iNumPages && !DoFirstPage());
 }
 
 //--------------------------------------------------------------------
@@ -340,18 +594,83 @@ void CSectorMapper::Close(bool aForceClose /*=false*/)
     SetState(EInvalid);
 
     //-- destroy cache page objects and the cache itself
-    for(TPListConstItr itr = iPages.begin(); itr != iPages.end(); ++itr)
+    while(CSectorBmpPage* pPage = DoFirstPage())
     {
-        CSectorBmpPage* pPage = *itr;
-        ASSERT((*itr)->State() == ESB_Invalid);
+        ASSERT(pPage->State() == ESB_Invalid);
+        DoDestroyPage(pPage, aForceClose);
+    }
 
-        pPage->Close(aForceClose);
-        delete pPage;
+    ASSERT(!iNumPages);
+
+    iGhostFifo.clear();
+    iGhosts.clear();
+}
+
+//--------------------------------------------------------------------
+/**
+    Change the max. number of pages in the cache. If the cache contains more pages than the new capacity,
+    the least recently used ones are flushed and evicted.
+
+    @param  aMaxPages   new cache capacity, 1..KMaxCached_SectorBitmaps_Limit
+    @return KErrNone on success, negative error code otherwise
+*/
+int CSectorMapper::SetCapacity(uint32_t aMaxPages)
+{
+    DBG_LOG("CSectorMapper::SetCapacity(%d) pages:%d", aMaxPages, iNumPages);
+
+    if(!aMaxPages || aMaxPages > KMaxCached_SectorBitmaps_Limit)
+        return KErrArgument;
+
+    DoResizeHashTable(aMaxPages);
+    iMaxPages = aMaxPages;
+
+    while(iNumPages > iMaxPages)
+    {
+        CSectorBmpPage* pPage = DoSelectVictim();
+
+        const int nRes = DoQueueVictim(pPage);
+        if(nRes != KErrNone)
+            return nRes;
+
+        pPage->InvalidateCache();
+        DoDestroyPage(pPage);
     }
-    iPages.clear();
+
+    return KErrNone;
 }
 
+//--------------------------------------------------------------------
+/**
+    Change the cache replacement policy. Cached pages are kept; when switching to EVhdCache_LRU, the pages from the probation queue
+    become the least recently used ones.
+
+    @param  aPolicy new replacement policy
+    @return KErrNone on success, negative error code otherwise
+*/
+int CSectorMapper::SetPolicy(TVhdCachePolicy aPolicy)
+{
+    DBG_LOG("CSectorMapper::SetPolicy(%d)", aPolicy);
+
+    if(aPolicy != EVhdCache_LRU && aPolicy != EVhdCache_2Q)
+        return KErrArgument;
+
+    if(aPolicy == EVhdCache_LRU)
+    {
+        while(iProbationQ.ipHead)
+        {
+            CSectorBmpPage* pPage = iProbationQ.ipHead;
+            DoQueueUnlink(pPage);
+            DoQueueInsert(pPage, false, false);
+        }
+
+        iGhostFifo.clear();
+        iGhosts.clear();
+    }
 
+    iPolicy = aPolicy;
+
+    return KErrNone;
+}
 
 //--------------------------------------------------------------------
 /**
@@ -372,10 +691,13 @@ void CSectorMapper::InvalidateCache(bool aIgnoreDirty /*=false*/)
         Fault(ESecMap_DestroyingDirty);
     }
 
-    for(TPListConstItr itr = iPages.begin(); itr != iPages.end(); ++itr)
+    for(CSectorBmpPage* pPage = DoFirstPage(); pPage; pPage = DoNextPage(pPage))
     {
-        (*itr)->InvalidateCache(aIgnoreDirty);
+        pPage->InvalidateCache(aIgnoreDirty);
     }
+
+    iVictims.clear();
+    iChanges++;
 }
 
 //--------------------------------------------------------------------
@@ -390,12 +712,13 @@ int CSectorMapper::Flush()
     if(State() != EDirty)
         return KErrNone;
 
-    int nFlushRes = KErrNone;
+    //-- write the queued evicted bitmaps first, cached pages can have newer data for the same blocks
+    int nFlushRes = DoWriteVictims(false);
 
     //-- make best effort to flush all pages
-    for(TPListConstItr itr = iPages.begin(); itr != iPages.end(); ++itr)
+    for(CSectorBmpPage* pPage = DoFirstPage(); pPage; pPage = DoNextPage(pPage))
     {
-        const int nRes = DoFlushPage(*itr);
+        const int nRes = DoFlushPage(pPage);
         if(nRes != KErrNone)
             nFlushRes = nRes;
     }
@@ -426,6 +749,26 @@ const CSectorBmpPage* CSectorMapper::GetSectorAllocBitmap(TBatEntry aBlockSector
     return pPage;
 }
 
+//--------------------------------------------------------------------
+/**
+    Forget the bitmap of a block that has been taken out of the BAT: drop its page from the cache and from the write-back queue
+    without writing it, the block's space doesn't belong to the VHD any more.
+
+    @param  aBlockSector    starting sector of the block that has been unlinked
+*/
+void CSectorMapper::DiscardBlock(TBatEntry aBlockSector)
+{
+    DBG_LOG("CSectorMapper::DiscardBlock(aBlockSector:%d) ", aBlockSector);
+
+    CSectorBmpPage* pPage = DoFindCachedPage(aBlockSector);
+    if(pPage)
+        DoDestroyPage(pPage, true);
+
+    DoForgetVictim(aBlockSector);
+    DoForgetEvicted(aBlockSector);
+    iChanges++;
+}
+
 //--------------------------------------------------------------------
 /**
     Read a single bit of the block's sector allocation bitmap.
@@ -466,6 +809,7 @@ TSectorBitmapState CSectorMapper::SetSectorAllocBits(TBatEntry aBlockSector, uin
     const TSectorBitmapState bmpState = pPage->SetAllocBmpBits(aSectorNumber, aNumBits);
 
     ASSERT(bmpState != ESB_Invalid);
+    iChanges++;
 
     if(bmpState == ESB_Dirty)
         SetState(EDirty); //-- mark whole cache as dirty
@@ -495,6 +839,7 @@ TSectorBitmapState CSectorMapper::ResetSectorAllocBits(TBatEntry aBlockSector, u
     const TSectorBitmapState bmpState = pPage->ResetAllocBmpBits(aSectorNumber, aNumBits);
 
     ASSERT(bmpState != ESB_Invalid);
+    iChanges++;
 
     if(bmpState == ESB_Dirty)
         SetState(EDirty); //-- mark whole cache as dirty
@@ -506,7 +851,7 @@ TSectorBitmapState CSectorMapper::ResetSectorAllocBits(TBatEntry aBlockSector, u
 //--------------------------------------------------------------------
 /**
     Search cache for a page with a given block number (key)
-    Can make found page MRU if required.
+    Can make found page MRU if required. Pages in the probation queue are not moved, it is a FIFO.
 
     @param  aBlockSector    sector of the block this bitmap belongs to. The caller is responsible for ensuring it is correct.
     @param  aMakeMRU        if true and if the page is found, makes it MRU by placint to the top of the list
@@ -516,17 +861,14 @@ CSectorBmpPage* CSectorMapper::DoFindCachedPage(TBatEntry aBlockSector, bool aMa
 {
     ASSERT(iVhd.BatEntryValid(aBlockSector));
 
-    for(TPListItr itr = iPages.begin(); itr != iPages.end(); ++itr)
+    for(CSectorBmpPage* pPage = iHashTable[DoHashIndex(aBlockSector)]; pPage; pPage = pPage->ipHashNext)
     {
-        CSectorBmpPage* pPage = (*itr);
-        ASSERT(pPage);
-
         if(pPage->BlockSector() ==  aBlockSector)
         {
-            if(aMakeMRU && itr != iPages.begin())
+            if(aMakeMRU && !pPage->iProbation && pPage != iMainQ.ipHead)
             {
-                iPages.erase(itr);
-                iPages.push_front(pPage);
+                DoQueueUnlink(pPage);
+                DoQueueInsert(pPage, false);
             }
 
             return pPage;
@@ -539,14 +881,19 @@ CSectorBmpPage* CSectorMapper::DoFindCachedPage(TBatEntry aBlockSector, bool aMa
 //--------------------------------------------------------------------
 /**
     Brings the populated page object from the cache if it is cached.
-    Otherwise it either creates a new page or evicts the LRU page from the cache. Then populates the page with data from the media.
-    Also makes the page MRU by putting it to the top of the list.
+    Otherwise it either creates a new page or evicts a page from the cache according to the replacement policy.
+    Then populates the page with data from the media.
+    Also makes the page MRU by putting it to the top of the main queue, or to the top of the probation queue if the page is new to
+    the cache with EVhdCache_2Q policy.
 
     @param  aBlockSector    sector of the block this bitmap belongs to. The caller is responsible for ensuring it is correct.
     @return pointer to page object. Guaranteed to be valid
 */
 CSectorBmpPage* CSectorMapper::DoGetPopulatedPage(TBatEntry aBlockSector)
 {
+    //-- give some memory back if the cache manager asks for it
+    if(CacheReclaimPending() && DoReclaimPages() != KErrNone)
+        return NULL;
 
     //-- search the cache first for the given block number (key)
     CSectorBmpPage* pPage = DoFindCachedPage(aBlockSector, true);
@@ -557,51 +904,64 @@ CSectorBmpPage* CSectorMapper::DoGetPopulatedPage(TBatEntry aBlockSector)
 
     if(!pPage)
     {//-- need to allocate a new cache page or evict one from the cache for us
-        if(iPages.size() < KMaxCached_SectorBitmaps)
+        if(iNumPages < iMaxPages && CacheReserve(PageBytes(), !iNumPages))
         {//-- allocate a brand new cache page
             pPage = new CSectorBmpPage(*this, aBlockSector);
+            ++iNumPages;
         }
         else
         {
-            pPage = iPages.back();              //-- get last page from the list
+            pPage = DoSelectVictim();           //-- get the page to evict
 
-            //-- flush it, may contain dirty data
-            //-- if flushing page failed, it means that something VERY serious happened.
+            //-- put its dirty data to the write-back queue, this doesn't write anything unless the queue is full
+            //-- if writing the queue failed, it means that something VERY serious happened.
             //-- don't try being too smart now, @todo make better error handling
-            if(DoFlushPage(pPage) != KErrNone)
+            if(DoQueueVictim(pPage) != KErrNone)
                 return NULL;
 
-            iPages.pop_back();                  //-- evict last page from the list
+            if(pPage->iProbation)
+                DoRememberEvicted(pPage->BlockSector());
+
+            DoQueueUnlink(pPage);               //-- evict the page from the cache
+            DoHashRemove(pPage);
             pPage->InvalidateCache();           //-- invalidate cached data
             pPage->SetBlockSector(aBlockSector);//-- assign a new block sector (key)
         }
 
-        //-- add the page to the top of the list, making it MRU
-        iPages.push_front(pPage);
+        //-- add the page to the top of the queue, making it MRU
+        //-- with 2Q policy, only the pages that have been evicted from the probation queue recently go to the main queue
+        const bool bProbation = (iPolicy == EVhdCache_2Q) && !DoForgetEvicted(aBlockSector);
+
+        DoQueueInsert(pPage, bProbation);
+        DoHashInsert(pPage);
     }
 
     ASSERT(pPage && pPage->State() == ESB_Invalid); //-- page cache state must be invalid
-    ASSERT(pPage == iPages.front());                //-- the page must be made MRU already
+    ASSERT(pPage->iProbation || pPage == iMainQ.ipHead); //-- the page must be made MRU already
     ASSERT(pPage->BlockSector() == aBlockSector);   //-- key must be set correctly
 
     {//-- read the page data from the media and place it to the corresponding object.
-     //-- try not to leak memory if some error happens
-        CAutoClosePtr<CSectorBmpPage> pTmp(pPage);
-        pPage = NULL;
-
         CDynBuffer buf(BmpSizeInBytes());
 
-        const int nRes = iVhd.DoRaw_ReadData(aBlockSector, BmpSizeInBytes(), buf.Ptr());
-        if(nRes != (int)BmpSizeInBytes())
+        TSectorBitmapState state = ESB_Invalid;
+
+        const TDirtyVictim* pVictim = DoFindVictim(aBlockSector);
+        if(pVictim)
+        {//-- the bitmap was evicted recently and hasn't been written yet, the queue has the latest data. ImportData() modifies the buffer
+            memcpy(buf.Ptr(), &pVictim->iData[0], BmpSizeInBytes());
+            state = pPage->ImportData(buf.Ptr());
+        }
+        else
         {
-            ASSERT(0);
-            return NULL;
+            const int nRes = iVhd.DoRaw_ReadData(aBlockSector, BmpSizeInBytes(), buf.Ptr());
+            if(nRes == (int)BmpSizeInBytes())
+                state = pPage->ImportData(buf.Ptr());
         }
 
-        const TSectorBitmapState state = pTmp->ImportData(buf.Ptr());
         if(state == ESB_Invalid)
-        {//-- something really bad happened
+        {//-- something really bad happened; don't leave the half-baked page in the cache
             ASSERT(0);
+            DoDestroyPage(pPage);
             return NULL;
         }
 
@@ -609,16 +969,257 @@ CSectorBmpPage* CSectorMapper::DoGetPopulatedPage(TBatEntry aBlockSector)
 
         if(State() == EInvalid)
             SetState(EClean);
-
-        pPage = pTmp.release();
     }
 
     return pPage;
 }
 
+//--------------------------------------------------------------------
+/** @return hash table bucket index for the given block sector */
+uint32_t CSectorMapper::DoHashIndex(TBatEntry aBlockSector) const
+{
+    //-- multiplicative hashing; block sectors are spaced by the block size, so the low bits alone are a poor hash
+    return (uint32_t)(aBlockSector * 0x9E3779B1u) >> (32 - iHashBitsLog2);
+}
+
+//--------------------------------------------------------------------
+/**
+    Resize the hash table so that it has at least twice as many buckets as aMaxPages and rehash cached pages.
+    @param  aMaxPages   cache capacity the table is sized for
+*/
+void CSectorMapper::DoResizeHashTable(uint32_t aMaxPages)
+{
+    uint32_t bitsLog2 = 1;
+    while((1u << bitsLog2) < 2*aMaxPages)
+        ++bitsLog2;
+
+    if(bitsLog2 == iHashBitsLog2)
+        return;
+
+    DBG_LOG("CSectorMapper::DoResizeHashTable() buckets:%d", 1 << bitsLog2);
+
+    iHashBitsLog2 = bitsLog2;
+    iHashTable.assign(1u << bitsLog2, (CSectorBmpPage*)NULL);
+
+    for(CSectorBmpPage* pPage = DoFirstPage(); pPage; pPage = DoNextPage(pPage))
+        DoHashInsert(pPage);
+}
+
+//--------------------------------------------------------------------
+/** Put the page to its hash table bucket */
+void CSectorMapper::DoHashInsert(CSectorBmpPage* apPage)
+{
+    CSectorBmpPage*& pBucket = iHashTable[DoHashIndex(apPage->BlockSector())];
+    apPage->ipHashNext = pBucket;
+    pBucket = apPage;
+}
+
+//--------------------------------------------------------------------
+/** Remove the page from its hash table bucket */
+void CSectorMapper::DoHashRemove(CSectorBmpPage* apPage)
+{
+    CSectorBmpPage** ppLink = &iHashTable[DoHashIndex(apPage->BlockSector())];
+    while(*ppLink != apPage)
+    {
+        ASSERT(*ppLink);
+        ppLink = &(*ppLink)->ipHashNext;
+    }
+
+    *ppLink = apPage->ipHashNext;
+    apPage->ipHashNext = NULL;
+}
+
+//--------------------------------------------------------------------
+/** @return reference to the queue the page is linked into */
+CSectorMapper::TPageQueue& CSectorMapper::DoQueueOf(const CSectorBmpPage* apPage)
+{
+    return apPage->iProbation ? iProbationQ : iMainQ;
+}
+
 //--------------------------------------------------------------------
 /**
-    Flushes page's dirty data  onto the media.
+    Insert the page into one of the queues
+    @param  apPage      page to insert, must not be linked into any queue
+    @param  aProbation  if true, insert the page into the probation queue, otherwise into the main one
+    @param  aFront      if true, insert the page to the top of the queue, making it MRU; otherwise make it LRU
+*/
+void CSectorMapper::DoQueueInsert(CSectorBmpPage* apPage, bool aProbation, bool aFront /*=true*/)
+{
+    ASSERT(!apPage->ipLruPrev && !apPage->ipLruNext);
+
+    apPage->iProbation = aProbation;
+    TPageQueue& queue = DoQueueOf(apPage);
+
+    if(aFront)
+    {
+        apPage->ipLruNext = queue.ipHead;
+        if(queue.ipHead)
+            queue.ipHead->ipLruPrev = apPage;
+        else
+            queue.ipTail = apPage;
+
+        queue.ipHead = apPage;
+    }
+    else
+    {
+        apPage->ipLruPrev = queue.ipTail;
+        if(queue.ipTail)
+            queue.ipTail->ipLruNext = apPage;
+        else
+            queue.ipHead = apPage;
+
+        queue.ipTail = apPage;
+    }
+
+    ++queue.iCount;
+}
+
+//--------------------------------------------------------------------
+/** Remove the page from the queue it is linked into */
+void CSectorMapper::DoQueueUnlink(CSectorBmpPage* apPage)
+{
+    TPageQueue& queue = DoQueueOf(apPage);
+    ASSERT(queue.iCount);
+
+    if(apPage->ipLruPrev)
+        apPage->ipLruPrev->ipLruNext = apPage->ipLruNext;
+    else
+        queue.ipHead = apPage->ipLruNext;
+
+    if(apPage->ipLruNext)
+        apPage->ipLruNext->ipLruPrev = apPage->ipLruPrev;
+    else
+        queue.ipTail = apPage->ipLruPrev;
+
+    apPage->ipLruPrev = apPage->ipLruNext = NULL;
+    --queue.iCount;
+}
+
+//--------------------------------------------------------------------
+/** @return the first cached page for iterating all of them, NULL if the cache is empty. @see DoNextPage() */
+CSectorBmpPage* CSectorMapper::DoFirstPage() const
+{
+    return iMainQ.ipHead ? iMainQ.ipHead : iProbationQ.ipHead;
+}
+
+//--------------------------------------------------------------------
+/** @return the cached page following apPage, the main queue pages go first; NULL if there are no more pages */
+CSectorBmpPage* CSectorMapper::DoNextPage(const CSectorBmpPage* apPage) const
+{
+    if(apPage->ipLruNext)
+        return apPage->ipLruNext;
+
+    return apPage->iProbation ? NULL : iProbationQ.ipHead;
+}
+
+//--------------------------------------------------------------------
+/**
+    Choose a page to evict from the full cache according to the replacement policy.
+    With EVhdCache_2Q policy it's the oldest page of the probation queue if the queue exceeds its share of the cache,
+    otherwise the least recently used page of the main queue.
+
+    @return pointer to the page, the cache must not be empty
+*/
+CSectorBmpPage* CSectorMapper::DoSelectVictim() const
+{
+    ASSERT(iNumPages);
+
+    const uint32_t KMaxProbationPages = Max(iMaxPages >> 2, 1u);
+
+    if(iProbationQ.iCount && (iProbationQ.iCount >= KMaxProbationPages || !iMainQ.iCount))
+        return iProbationQ.ipTail;
+
+    ASSERT(iMainQ.ipTail);
+    return iMainQ.ipTail;
+}
+
+//--------------------------------------------------------------------
+/**
+    Remember the block sector of the page evicted from the probation queue in the ghost FIFO.
+    The FIFO keeps about a half of the cache capacity entries.
+*/
+void CSectorMapper::DoRememberEvicted(TBatEntry aBlockSector)
+{
+    ASSERT(iPolicy == EVhdCache_2Q);
+
+    if(iGhosts.insert(aBlockSector).second)
+        iGhostFifo.push_back(aBlockSector);
+
+    const uint32_t KMaxGhosts = Max(iMaxPages >> 1, 1u);
+
+    while(iGhostFifo.size() > KMaxGhosts)
+    {
+        iGhosts.erase(iGhostFifo.front());
+        iGhostFifo.pop_front();
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Check if the page for the given block has been evicted from the probation queue recently and forget about it.
+    @return true if the block sector was remembered in the ghost FIFO
+*/
+bool CSectorMapper::DoForgetEvicted(TBatEntry aBlockSector)
+{
+    //-- the entry in iGhostFifo becomes stale, it will go away in due course
+    return iGhosts.erase(aBlockSector) != 0;
+}
+
+//--------------------------------------------------------------------
+/**
+    Remove the page from the cache and delete it.
+    @param  apPage          the page to destroy, must be linked into the cache
+    @param  aForceClose     if true, ignores dirty data. not for a normal use
+*/
+void CSectorMapper::DoDestroyPage(CSectorBmpPage* apPage, bool aForceClose /*=false*/)
+{
+    ASSERT(iNumPages);
+
+    DoQueueUnlink(apPage);
+    DoHashRemove(apPage);
+    --iNumPages;
+
+    apPage->Close(aForceClose);
+    delete apPage;
+
+    CacheRelease(PageBytes());
+}
+
+//--------------------------------------------------------------------
+/** @return memory taken by a cache page, for the cache budget accounting */
+uint32_t CSectorMapper::PageBytes() const
+{
+    return sizeof(CSectorBmpPage) + BmpSizeInBytes();
+}
+
+//--------------------------------------------------------------------
+/**
+    Flush and release cached pages chosen by the replacement policy if the cache manager asks for memory. At least one page is kept.
+    @return KErrNone on success, negative error code otherwise
+*/
+int CSectorMapper::DoReclaimPages()
+{
+    while(iNumPages > 1 && CacheReclaimDebt())
+    {
+        CSectorBmpPage* pPage = DoSelectVictim();
+
+        const int nRes = DoQueueVictim(pPage);
+        if(nRes != KErrNone)
+            return nRes;
+
+        if(pPage->iProbation)
+            DoRememberEvicted(pPage->BlockSector());
+
+        pPage->InvalidateCache();
+        DoDestroyPage(pPage);
+    }
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Flushes page's dirty data  onto the media. Only the range of the bitmap sectors modified since the page became dirty is written.
 
     @param  apPage pointer to the page object to flush.
     @return KErrNone on success, negative error code otherwise
@@ -639,31 +1240,177 @@ int CSectorMapper::DoFlushPage(CSectorBmpPage* apPage)
     //-- 1. get page data in correct endianness
     const TSectorBitmapState bufState = apPage->ExportData(buf.Ptr());
 
+    //-- the page can have been reloaded from the write-back queue, then the queued sectors haven't been written yet either.
+    //-- the page data is newer, so the queue entry is replaced by the page.
+    uint32_t secFrom = apPage->DirtySecFrom();
+    uint32_t secTo   = apPage->DirtySecTo();
+
+    const TDirtyVictim* pVictim = DoFindVictim(apPage->BlockSector());
+    if(pVictim)
+    {
+        secFrom = Min(secFrom, pVictim->iDirtySecFrom);
+        secTo   = Max(secTo, pVictim->iDirtySecTo);
+    }
+
+    ASSERT(secFrom < secTo && secTo <= BmpSizeInSectors());
+
+    //-- 2. write dirty sectors to the media
+    const uint32_t bytesToWrite = (secTo - secFrom) << SectorSzLog2();
+    const uint8_t* pData = (const uint8_t*)buf.Ptr() + (secFrom << SectorSzLog2());
 
-    //-- 2. write data to the media
-    const int nRes = iVhd.DoRaw_WriteData(apPage->BlockSector(), BmpSizeInBytes(), buf.Ptr());
-    if(nRes != (int)BmpSizeInBytes())
+    const int nRes = iVhd.DoRaw_WriteData(apPage->BlockSector() + secFrom, bytesToWrite, pData);
+    if(nRes != (int)bytesToWrite)
     {
         DBG_LOG("Flushing page error! code:%d", nRes);
         return nRes;
     }
 
+    if(pVictim)
+        DoForgetVictim(apPage->BlockSector());
+
     //-- 3. mark page as "clean", "fully mapped" or "fully unmapped"
+    DoMarkPageClean(apPage, bufState);
+
+    return KErrNone;
+}
 
+//--------------------------------------------------------------------
+/**
+    Change the state of the page which data has been exported for writing to the media.
+    @param  apPage      page object
+    @param  aBufState   exported data state, @see CSectorBmpPage::ExportData()
+*/
+void CSectorMapper::DoMarkPageClean(CSectorBmpPage* apPage, TSectorBitmapState aBufState)
+{
     if(iVhd.TrimEnabled())
     {//-- TRIM or "discarding sectors" can reset bits in the alloc. bitmap
-        ASSERT(bufState == ESB_Clean || bufState == ESB_FullyMapped || bufState == ESB_FullyUnmapped);
+        ASSERT(aBufState == ESB_Clean || aBufState == ESB_FullyMapped || aBufState == ESB_FullyUnmapped);
     }
     else
     {//-- Normally we can only set bits, other states are impossible
-        ASSERT(bufState == ESB_Clean || bufState == ESB_FullyMapped);
+        ASSERT(aBufState == ESB_Clean || aBufState == ESB_FullyMapped);
+    }
+
+    apPage->SetState(aBufState);
+}
+
+//--------------------------------------------------------------------
+/**
+    Put the data of the dirty page being evicted to the write-back queue, so that the page can be reused straight away.
+    If the queue becomes full, all queued bitmaps are written.
+
+    @param  apPage  the page being evicted
+    @return KErrNone on success, negative error code otherwise
+
+    @post  changes page state ESB_Dirty->ESB_Clean, other states are not changed
+*/
+int CSectorMapper::DoQueueVictim(CSectorBmpPage* apPage)
+{
+    if(apPage->State() != ESB_Dirty)
+        return KErrNone;
+
+    ASSERT(iVhd.BatEntryValid(apPage->BlockSector()));
+    ASSERT(State() == EDirty);
+
+    TDirtyVictim* pVictim = DoFindVictim(apPage->BlockSector());
+    if(!pVictim)
+    {
+        iVictims.push_back(TDirtyVictim());
+        pVictim = &iVictims.back();
+        pVictim->iBlockSector  = apPage->BlockSector();
+        pVictim->iDirtySecFrom = apPage->DirtySecFrom();
+        pVictim->iDirtySecTo   = apPage->DirtySecTo();
+        pVictim->iData.resize(BmpSizeInBytes());
+    }
+    else
+    {//-- the page was reloaded from the queue, the queued dirty sectors haven't been written yet
+        pVictim->iDirtySecFrom = Min(pVictim->iDirtySecFrom, apPage->DirtySecFrom());
+        pVictim->iDirtySecTo   = Max(pVictim->iDirtySecTo, apPage->DirtySecTo());
+    }
+
+    ASSERT(pVictim->iDirtySecFrom < pVictim->iDirtySecTo && pVictim->iDirtySecTo <= BmpSizeInSectors());
+
+    const TSectorBitmapState bufState = apPage->ExportData(&pVictim->iData[0]);
+    DoMarkPageClean(apPage, bufState);
+
+    DBG_LOG("CSectorMapper::DoQueueVictim() blkSector:%d, queued:%d", apPage->BlockSector(), (int)iVictims.size());
+
+    if(iVictims.size() < KMaxDirtyBmpVictims)
+        return KErrNone;
+
+    return DoWriteVictims(true);
+}
+
+//--------------------------------------------------------------------
+/**
+    Write the dirty sectors of all bitmaps from the write-back queue to the media by a single batch of requests.
+    @param  aBarrier    if true, apply the data barrier first (@see CVhdFileBase::DoRaw_DataBarrier()); not needed if the caller
+                        has synced the data already.
+    @return KErrNone on success, negative error code otherwise. On error the queue is kept.
+*/
+int CSectorMapper::DoWriteVictims(bool aBarrier)
+{
+    if(iVictims.empty())
+        return KErrNone;
+
+    if(aBarrier)
+    {
+        const int nRes = iVhd.DoRaw_DataBarrier();
+        if(nRes != KErrNone)
+            return nRes;
     }
 
-    apPage->SetState(bufState);
+    for(size_t i=0; i<iVictims.size(); ++i)
+    {
+        TDirtyVictim& victim = iVictims[i];
+        const uint32_t bytesToWrite = (victim.iDirtySecTo - victim.iDirtySecFrom) << SectorSzLog2();
+        uint8_t* pData = &victim.iData[victim.iDirtySecFrom << SectorSzLog2()];
+
+        iVhd.DoRaw_QueueWrite(victim.iBlockSector + victim.iDirtySecFrom, bytesToWrite, TIoVecBuf(pData, bytesToWrite));
+    }
+
+    const int nRes = iVhd.DoRaw_SubmitBatch();
+    if(nRes != KErrNone)
+    {
+        DBG_LOG("Writing evicted bitmaps error! code:%d", nRes);
+        return nRes;
+    }
 
+    iVictims.clear();
     return KErrNone;
 }
 
+//--------------------------------------------------------------------
+/**
+    Find the bitmap of the given block in the write-back queue.
+    @param  aBlockSector    sector of the block the bitmap belongs to
+    @return pointer to the queue entry, NULL if not found
+*/
+CSectorMapper::TDirtyVictim* CSectorMapper::DoFindVictim(TBatEntry aBlockSector)
+{
+    for(size_t i=0; i<iVictims.size(); ++i)
+    {
+        if(iVictims[i].iBlockSector == aBlockSector)
+            return &iVictims[i];
+    }
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------
+/** Remove the bitmap of the given block from the write-back queue, if it is there */
+void CSectorMapper::DoForgetVictim(TBatEntry aBlockSector)
+{
+    for(vector<TDirtyVictim>::iterator it = iVictims.begin(); it != iVictims.end(); ++it)
+    {
+        if(it->iBlockSector == aBlockSector)
+        {
+            iVictims.erase(it);
+            return;
+        }
+    }
+}
+
 
 //####################################################################
 //#  CSectorBmpPage class implementation
@@ -678,7 +1425,8 @@ int CSectorMapper::DoFlushPage(CSectorBmpPage* apPage)
     @param  aBlockSector    sector of the block this bitmap belongs to
 */
 CSectorBmpPage::CSectorBmpPage(CSectorMapper& aParent, TBatEntry aBlockSector/*=0*/)
-               :iParent(aParent), iBlockSector(aBlockSector)
+               :iParent(aParent), iBlockSector(aBlockSector), iDirtySecFrom(0), iDirtySecTo(0),
+                ipLruPrev(NULL), ipLruNext(NULL), ipHashNext(NULL), iProbation(false)
 {
     DBG_LOG("CSectorBmpPage::CSectorBmpPage[0x%p] Sect:%d", this, aBlockSector);
     iState = ESB_Invalid;
@@ -836,11 +1584,12 @@ TSectorBitmapState CSectorBmpPage::SetAllocBmpBits(uint32_t aBitNumber, uint32_t
             break; //-- nothing to do
 
         iAllocBitmap.Fill(aBitNumber, aBitNumber+aNumBits-1, 1);
-        SetState(ESB_Dirty);
+        DoMarkDirty(aBitNumber, aNumBits);
     break;
 
     case ESB_Dirty:
         iAllocBitmap.Fill(aBitNumber, aBitNumber+aNumBits-1, 1);
+        DoMarkDirty(aBitNumber, aNumBits);
     break;
 
     case ESB_FullyMapped:
@@ -857,7 +1606,7 @@ TSectorBitmapState CSectorBmpPage::SetAllocBmpBits(uint32_t aBitNumber, uint32_t
         }
 
         iAllocBitmap.Fill(aBitNumber, aBitNumber+aNumBits-1, 1);
-        SetState(ESB_Dirty);
+        DoMarkDirty(aBitNumber, aNumBits);
     }
     break;
 
@@ -897,11 +1646,12 @@ TSectorBitmapState CSectorBmpPage::ResetAllocBmpBits(uint32_t aBitNumber, uint32
             break; //-- nothing to do
 
         iAllocBitmap.Fill(aBitNumber, aBitNumber+aNumBits-1, 0);
-        SetState(ESB_Dirty);
+        DoMarkDirty(aBitNumber, aNumBits);
     break;
 
     case ESB_Dirty:
         iAllocBitmap.Fill(aBitNumber, aBitNumber+aNumBits-1, 0);
+        DoMarkDirty(aBitNumber, aNumBits);
     break;
 
     case ESB_FullyMapped:
@@ -915,7 +1665,7 @@ TSectorBitmapState CSectorBmpPage::ResetAllocBmpBits(uint32_t aBitNumber, uint32
         }
 
         iAllocBitmap.Fill(aBitNumber, aBitNumber+aNumBits-1, 0);
-        SetState(ESB_Dirty);
+        DoMarkDirty(aBitNumber, aNumBits);
         }
     break;
 
@@ -934,6 +1684,34 @@ TSectorBitmapState CSectorBmpPage::ResetAllocBmpBits(uint32_t aBitNumber, uint32
 
 
 
+//--------------------------------------------------------------------
+/**
+    Mark the page as dirty and extend the range of dirty bitmap sectors to include the given bits,
+    so that only the modified part of the bitmap is written to the media.
+
+    @param  aBitNumber  starting bit number
+    @param  aNumBits    number of modified bits
+*/
+void CSectorBmpPage::DoMarkDirty(uint32_t aBitNumber, uint32_t aNumBits)
+{
+    const uint32_t KBitsInSectorLog2 = SectorSzLog2() + KBitsInByteLog2;
+
+    const uint32_t secFrom = aBitNumber >> KBitsInSectorLog2;
+    const uint32_t secTo   = ((aBitNumber + aNumBits - 1) >> KBitsInSectorLog2) + 1;
+
+    if(State() != ESB_Dirty)
+    {
+        SetState(ESB_Dirty);
+        iDirtySecFrom = secFrom;
+        iDirtySecTo   = secTo;
+    }
+    else
+    {
+        iDirtySecFrom = Min(iDirtySecFrom, secFrom);
+        iDirtySecTo   = Max(iDirtySecTo, secTo);
+    }
+}
+
 //--------------------------------------------------------------------
 /**
     Imports data from the external buffer into the internal bitmap representation.
@@ -25,19 +25,29 @@
 #define __BLOCK_MANAGEMENT_H__
 
 #include "vhd.h"
+#include "cache_mng.h"
 
 #include <list>
 using std::list;
 
+#include <deque>
+using std::deque;
+
+#include <set>
+using std::set;
+
 //--------------------------------------------------------------------
 /**
     This class represents a VHD Block Allocation Table (BAT), implements BAT caching etc.
-    Not intended for derivation.
+    Implements WB-caching; BAT is split into pages of 2^PageSizeLog2() sectors that are read from the media on demand,
+    so that opening a VHD doesn't require reading whole BAT and the memory used is limited by MaxPages() pages, @see SetCacheSize().
+    Least recently used pages are evicted from the cache; dirty pages are written to the media when necessary.
+    Dirty state is tracked per BAT sector, only dirty sectors are written.
+    Cache pages are accounted by the process-wide cache budget, @see CCacheClient.
 
-    @todo !!!! Currently implements very simple WB-caching, it caches WHOLE BAT in one block. ?? make a paged cache to reduce media hits?
-    or mmap BAT and use system paging ?
+    Not intended for derivation.
 */
-class CBat
+class CBat : public CCacheClient
 {
  public:
     CBat(CVhdDynDiffBase& aVhd);
@@ -59,6 +69,11 @@ class CBat
     };
 
     TState State() const            {return iState;}
+    uint32_t Changes() const        {return iChanges;}  ///< @return counter of the BAT changes, see iChanges
+
+    int SetCacheSize(uint32_t aPageSizeLog2, uint32_t aMaxPages);
+    uint32_t PageSizeLog2() const   {return iPageSizeLog2;} ///< @return Log2(sectors per cache page)
+    uint32_t MaxPages() const       {return iMaxPages;}     ///< @return max. number of pages in the cache
 
  private:
     CBat(const CBat&);
@@ -76,8 +91,34 @@ class CBat
     uint32_t SectorSzLog2() const {return KDefSecSizeLog2;}
     uint32_t SectorSize()   const {return KDefSecSize;}
 
+    /** @return Log2(number of BAT entries in a sector) */
+    uint32_t EntriesPerSectorLog2() const {return SectorSzLog2() - KBatEntrySizeLog2;}
+
+    /** @return Log2(number of BAT entries in a cache page) */
+    uint32_t EntriesPerPageLog2() const {return EntriesPerSectorLog2() + iPageSizeLog2;}
+
+    /** a page of the BAT cache */
+    struct TBatPage
+    {
+        uint32_t    iPageNo;        ///< page number in the BAT
+        uint32_t*   ipData;         ///< BAT entries, in the media byte order
+        uint32_t    iDirtySectors;  ///< bit mask of the page sectors that need writing to the media
+        list<TBatPage*>::iterator iLruPos; ///< position in the LRU list
+    };
+
+    typedef list<TBatPage*> TPageList;
+
+    uint32_t PageSectors(uint32_t aPageNo) const;
+
+    /** @return memory taken by a cache page, for the cache budget accounting */
+    uint32_t PageBytes() const {return sizeof(TBatPage) + (sizeof(TBatEntry) << EntriesPerPageLog2());}
+
     void CreateBatCache();
-    int  ReadBAT();
+    void DestroyPages();
+    TBatPage* GetPage(uint32_t aPageNo, int& aErrCode);
+    TBatPage* DoEvictPage(int& aErrCode);
+    int  DoReclaimPages();
+    int  ReadPage(TBatPage* apPage);
     int  WriteBAT();
 
  private:
@@ -85,10 +126,15 @@ class CBat
     CVhdDynDiffBase&    iVhd;       ///< ref. to the object representing a Dynamic or Differencing VHD file
     uint32_t            iBatSector; ///< BAT position in the file (sector number)
     uint32_t            iMaxEntries;///< Max. entries in BAT
+    uint32_t            iBatSectors;///< BAT size in sectors, the last sector may be partially used
 
     TState              iState;     ///< object state
-    uint32_t*           iBatBuffer; ///< BAT buffer that caches whole BAT ??? make paged cache ??
+    uint32_t            iPageSizeLog2;///< Log2(sectors per cache page)
+    uint32_t            iMaxPages;  ///< max. number of pages in the cache
+    uint32_t            iChanges;   ///< incremented when an entry changes or the cache is invalidated; tells if the BAT changed since some moment
 
+    vector<TBatPage*>   iPageTable; ///< BAT page number -> cached page, NULL if the page isn't cached
+    TPageList           iLru;       ///< cached pages, the most recently used first
 };
 
 
@@ -109,10 +155,21 @@ class CSectorBmpPage;
 //--------------------------------------------------------------------
 /**
     Provides interface to the Sector Allocation Bitmaps in the VHD file.
-    Maintains the bitmaps LRU cache.
+    Maintains the bitmaps cache. Cached pages are linked into intrusive queues and indexed by a hash table keyed by
+    the block sector, so that looking up a page doesn't depend on the cache size. The cache capacity can be changed at runtime,
+    @see SetCapacity()
+
+    Replacement policy is selectable, @see SetPolicy():
+    EVhdCache_LRU   all pages are in the "main" LRU queue.
+    EVhdCache_2Q    a page read for the first time goes to the "probation" FIFO queue (A1in) of about 1/4 of the cache size.
+                    Sector numbers of pages evicted from it are remembered in the "ghost" FIFO (A1out); a page that is read again
+                    while it's remembered there goes to the "main" LRU queue (Am). Thus pages touched by a single pass over the VHD
+                    don't evict the pages that are used repeatedly.
+
+    Cache pages are accounted by the process-wide cache budget, @see CCacheClient.
     Not intended for derivation.
 */
-class CSectorMapper
+class CSectorMapper : public CCacheClient
 {
 
  public:
@@ -123,12 +180,22 @@ class CSectorMapper
     void InvalidateCache(bool aIgnoreDirty = false);
     void Close(bool aForceClose = false);
 
+    int SetCapacity(uint32_t aMaxPages);
+    uint32_t Capacity() const {return iMaxPages;} ///< @return max. number of pages in the cache
+
+    int SetPolicy(TVhdCachePolicy aPolicy);
+    TVhdCachePolicy Policy() const {return iPolicy;} ///< @return cache replacement policy
+
+    uint32_t Changes() const {return iChanges;} ///< @return counter of the sector bitmap changes, see iChanges
+
     //----- sector allocation bitmap-related interface
     TSectorBitmapState SetSectorAllocBits(TBatEntry aBlockSector, uint32_t aSectorNumber, uint32_t aNumBits);
     TSectorBitmapState ResetSectorAllocBits(TBatEntry aBlockSector, uint32_t aSectorNumber, uint32_t aNumBits);
 
     uint32_t GetSectorAllocBit(TBatEntry aBlockSector, uint32_t aSectorNumber);
     const CSectorBmpPage* GetSectorAllocBitmap(TBatEntry aBlockSector);
+
+    void DiscardBlock(TBatEntry aBlockSector);
     //------------------------------------------------
 
 
@@ -163,16 +230,73 @@ class CSectorMapper
     CSectorBmpPage* DoFindCachedPage(TBatEntry aBlockSector, bool aMakeMRU = false);
     CSectorBmpPage* DoGetPopulatedPage(TBatEntry aBlockSector);
     int DoFlushPage(CSectorBmpPage* apPage);
+    void DoMarkPageClean(CSectorBmpPage* apPage, TSectorBitmapState aBufState);
 
+    /** an evicted dirty bitmap waiting in the write-back queue */
+    struct TDirtyVictim
+    {
+        TBatEntry       iBlockSector;   ///< sector of the block the bitmap belongs to
+        uint32_t        iDirtySecFrom;  ///< first bitmap sector to write
+        uint32_t        iDirtySecTo;    ///< bitmap sector past the last one to write
+        vector<uint8_t> iData;          ///< whole bitmap data in the media format
+    };
 
-    typedef list<CSectorBmpPage*>       TPageList;
-    typedef TPageList::iterator         TPListItr;
-    typedef TPageList::const_iterator   TPListConstItr;
+    int  DoQueueVictim(CSectorBmpPage* apPage);
+    int  DoWriteVictims(bool aBarrier);
+    TDirtyVictim* DoFindVictim(TBatEntry aBlockSector);
+    void DoForgetVictim(TBatEntry aBlockSector);
+
+    /** an intrusive doubly-linked queue of the cache pages, the head is the most recently used or inserted page */
+    struct TPageQueue
+    {
+        TPageQueue() :ipHead(NULL), ipTail(NULL), iCount(0) {}
+
+        CSectorBmpPage* ipHead;     ///< the first page, NULL if the queue is empty
+        CSectorBmpPage* ipTail;     ///< the last page, NULL if the queue is empty
+        uint32_t        iCount;     ///< number of pages in the queue
+    };
+
+    //-- intrusive queues and hash index of the cache pages
+    inline uint32_t DoHashIndex(TBatEntry aBlockSector) const;
+    void DoResizeHashTable(uint32_t aMaxPages);
+    void DoHashInsert(CSectorBmpPage* apPage);
+    void DoHashRemove(CSectorBmpPage* apPage);
+
+    TPageQueue& DoQueueOf(const CSectorBmpPage* apPage);
+    void DoQueueInsert(CSectorBmpPage* apPage, bool aProbation, bool aFront = true);
+    void DoQueueUnlink(CSectorBmpPage* apPage);
+    CSectorBmpPage* DoFirstPage() const;
+    CSectorBmpPage* DoNextPage(const CSectorBmpPage* apPage) const;
+
+    //-- replacement policy
+    CSectorBmpPage* DoSelectVictim() const;
+    void DoRememberEvicted(TBatEntry aBlockSector);
+    bool DoForgetEvicted(TBatEntry aBlockSector);
+
+    void DoDestroyPage(CSectorBmpPage* apPage, bool aForceClose = false);
+    int  DoReclaimPages();
+
+    uint32_t PageBytes() const;
 
  private:
     CVhdDynDiffBase&    iVhd;       ///< ref. to the object representing a Dynamic or Differencing VHD file
     TState              iState;     ///< object state
-    TPageList           iPages;     ///< list of the cache pages
+
+    uint32_t            iMaxPages;  ///< max. number of pages in the cache
+    uint32_t            iNumPages;  ///< current number of pages in the cache
+    TVhdCachePolicy     iPolicy;    ///< replacement policy
+    uint32_t            iChanges;   ///< incremented when the bitmap bits are changed, a block is discarded or the cache is invalidated
+
+    TPageQueue          iMainQ;     ///< "main" LRU queue (Am); the only queue used with EVhdCache_LRU policy
+    TPageQueue          iProbationQ;///< "probation" FIFO queue (A1in), EVhdCache_2Q only
+
+    deque<TBatEntry>    iGhostFifo; ///< block sectors of the pages recently evicted from the probation queue (A1out), EVhdCache_2Q only. May contain stale entries
+    set<TBatEntry>      iGhosts;    ///< index of iGhostFifo entries
+
+    uint32_t            iHashBitsLog2; ///< Log2(number of hash table buckets)
+    vector<CSectorBmpPage*> iHashTable; ///< hash table buckets, each one is a singly-linked list of pages chained by ipHashNext
+
+    vector<TDirtyVictim> iVictims;  ///< write-back queue of the evicted dirty bitmaps, up to KMaxDirtyBmpVictims entries
 };
 
 
@@ -192,7 +316,7 @@ class CSectorBmpPage
     void Close(bool aForceClose = false);
 
     TSectorBitmapState State() const            {return iState;}
-    void SetState(TSectorBitmapState aState)    {iState = aState;}
+    inline void SetState(TSectorBitmapState aState);
 
     TBatEntry BlockSector() const               {return iBlockSector;}
     void SetBlockSector(TBatEntry aNewBlockSector);
@@ -213,6 +337,8 @@ class CSectorBmpPage
     TSectorBitmapState ImportData(void* apBuf);
     TSectorBitmapState ExportData(void* apBuf);
 
+    uint32_t DirtySecFrom() const {return iDirtySecFrom;} ///< @return first dirty sector of the bitmap, valid in ESB_Dirty state only
+    uint32_t DirtySecTo()   const {return iDirtySecTo;}   ///< @return dirty sector of the bitmap past the last one, valid in ESB_Dirty state only
 
 
  private:
@@ -224,6 +350,7 @@ class CSectorBmpPage
 
     TSectorBitmapState DoProcessDataBuffer(void* apData, uint32_t aNumBits) const;
     int DoCreateAllocBitmap();
+    void DoMarkDirty(uint32_t aBitNumber, uint32_t aNumBits);
 
 
  private:
@@ -231,9 +358,27 @@ class CSectorBmpPage
     TSectorBitmapState  iState;         ///< object state
     TBatEntry           iBlockSector;   ///< sector of the block this bitmaps belongs to
     CBitVector          iAllocBitmap;   ///< sector allocation bitmap
+    uint32_t            iDirtySecFrom;  ///< first bitmap sector containing modified bits
+    uint32_t            iDirtySecTo;    ///< bitmap sector past the last one containing modified bits
+
+    //-- links maintained by the parent cache
+    friend class CSectorMapper;
+    CSectorBmpPage*     ipLruPrev;      ///< previous (more recently used) page in the parent's queue
+    CSectorBmpPage*     ipLruNext;      ///< next (less recently used) page in the parent's queue
+    CSectorBmpPage*     ipHashNext;     ///< next page in the parent's hash table bucket
+    bool                iProbation;     ///< true if the page is in the parent's probation queue, false if in the main one
 };
 
 //--------------------------------------------------------------------
+/** Set the page state, leaving the ESB_Dirty state forgets the dirty sectors range */
+void CSectorBmpPage::SetState(TSectorBitmapState aState)
+{
+    iState = aState;
+
+    if(aState != ESB_Dirty)
+        iDirtySecFrom = iDirtySecTo = 0;
+}
+
 /**
     a "Raw" version of GetBit(), without object state checks. faster, but
     the caller must be sure that the iAllocBitmap is in proper state
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file implementation of the process-wide metadata cache memory budget
+*/
+
+#include <algorithm>
+
+#include "cache_mng.h"
+
+
+//####################################################################
+//#  CCacheClient class implementation
+//####################################################################
+
+//--------------------------------------------------------------------
+/** Constructor. Registers the object with the cache manager */
+CCacheClient::CCacheClient()
+             :iCachedBytes(0), iMinBytes(0), iReclaimBytes(0), iLastActive(0)
+{
+    CCacheManager::Instance().Register(this);
+}
+
+//--------------------------------------------------------------------
+/**
+    Destructor. Unregisters the object from the cache manager.
+    @pre all reserved memory must be released by the derived class
+*/
+CCacheClient::~CCacheClient()
+{
+    ASSERT(!iCachedBytes);
+    CCacheManager::Instance().Unregister(this);
+}
+
+//--------------------------------------------------------------------
+/**
+    Ask the manager for the memory for a new cache page.
+
+    @param  aBytes  number of bytes to reserve
+    @param  aForce  if true, reserve the memory even if the budget is exceeded. Used for the first page of the cache.
+    @return true if the memory is reserved and the page can be allocated; false if the cache must reuse one of its pages instead
+*/
+bool CCacheClient::CacheReserve(uint32_t aBytes, bool aForce /*=false*/)
+{
+    return CCacheManager::Instance().Reserve(this, aBytes, aForce);
+}
+
+//--------------------------------------------------------------------
+/** Report deallocation of a cache page, the memory was reserved by CacheReserve() */
+void CCacheClient::CacheRelease(uint32_t aBytes)
+{
+    CCacheManager::Instance().Release(this, aBytes);
+}
+
+//--------------------------------------------------------------------
+/** @return number of bytes the manager asks this cache to release */
+uint64_t CCacheClient::CacheReclaimDebt() const
+{
+    return CCacheManager::Instance().ReclaimDebt(this);
+}
+
+
+//####################################################################
+//#  CCacheManager class implementation
+//####################################################################
+
+//--------------------------------------------------------------------
+/** @return reference to the single instance of the cache manager */
+CCacheManager& CCacheManager::Instance()
+{
+    static CCacheManager manager;
+    return manager;
+}
+
+CCacheManager::CCacheManager()
+              :iBudget(0), iUsedBytes(0), iTick(0)
+{
+    pthread_mutex_init(&iLock, NULL);
+}
+
+CCacheManager::~CCacheManager()
+{
+    pthread_mutex_destroy(&iLock);
+}
+
+//--------------------------------------------------------------------
+/**
+    Set the cache budget. If the caches use more memory than the new budget, every cache is asked to release its share of the
+    excess; it happens when the cache is accessed next time. Memory requests made under the previous budget are cancelled.
+
+    @param  aBytes  cache budget in bytes, 0 means "unlimited"
+*/
+void CCacheManager::SetBudget(uint64_t aBytes)
+{
+    DBG_LOG("CCacheManager::SetBudget(%llu) used:%llu", (unsigned long long)aBytes, (unsigned long long)iUsedBytes);
+
+    pthread_mutex_lock(&iLock);
+
+    iBudget = aBytes;
+
+    //-- previous requests are cancelled
+    const uint64_t KExcess = (iBudget && iUsedBytes > iBudget) ? iUsedBytes - iBudget : 0;
+
+    for(size_t i=0; i<iClients.size(); ++i)
+    {
+        CCacheClient* pClient = iClients[i];
+        pClient->iReclaimBytes = KExcess ? Min(pClient->ReclaimableBytes(), (pClient->iCachedBytes * KExcess + iUsedBytes - 1) / iUsedBytes) : 0;
+    }
+
+    pthread_mutex_unlock(&iLock);
+}
+
+//--------------------------------------------------------------------
+/** @return total number of bytes used by all caches */
+uint64_t CCacheManager::UsedBytes() const
+{
+    pthread_mutex_lock(&iLock);
+    const uint64_t usedBytes = iUsedBytes;
+    pthread_mutex_unlock(&iLock);
+
+    return usedBytes;
+}
+
+//--------------------------------------------------------------------
+void CCacheManager::Register(CCacheClient* apClient)
+{
+    pthread_mutex_lock(&iLock);
+    iClients.push_back(apClient);
+    pthread_mutex_unlock(&iLock);
+}
+
+//--------------------------------------------------------------------
+void CCacheManager::Unregister(CCacheClient* apClient)
+{
+    pthread_mutex_lock(&iLock);
+
+    vector<CCacheClient*>::iterator it = std::find(iClients.begin(), iClients.end(), apClient);
+    ASSERT(it != iClients.end());
+    iClients.erase(it);
+
+    pthread_mutex_unlock(&iLock);
+}
+
+//--------------------------------------------------------------------
+/** @see CCacheClient::CacheReserve() */
+bool CCacheManager::Reserve(CCacheClient* apClient, uint32_t aBytes, bool aForce)
+{
+    pthread_mutex_lock(&iLock);
+
+    apClient->iLastActive = ++iTick;
+
+    const bool bReserve = aForce || !iBudget || (iUsedBytes + aBytes <= iBudget);
+    if(bReserve)
+    {
+        if(aForce && !apClient->iCachedBytes)
+            apClient->iMinBytes = aBytes; //-- the first page of the cache is always allowed
+
+        iUsedBytes += aBytes;
+        apClient->iCachedBytes += aBytes;
+    }
+    else
+    {//-- the client will reuse its own page this time; make room for it for the future
+        DoRequestReclaim(apClient, aBytes);
+    }
+
+    pthread_mutex_unlock(&iLock);
+
+    return bReserve;
+}
+
+//--------------------------------------------------------------------
+/** @see CCacheClient::CacheRelease() */
+void CCacheManager::Release(CCacheClient* apClient, uint32_t aBytes)
+{
+    pthread_mutex_lock(&iLock);
+
+    ASSERT(apClient->iCachedBytes >= aBytes && iUsedBytes >= aBytes);
+
+    apClient->iCachedBytes -= aBytes;
+    iUsedBytes -= aBytes;
+
+    if(apClient->iCachedBytes < apClient->iMinBytes)
+        apClient->iMinBytes = 0; //-- the cache has released all its pages
+
+    //-- the debt is paid off when the cache is down to the page it is always allowed
+    const uint64_t debt = apClient->iReclaimBytes - Min(apClient->iReclaimBytes, (uint64_t)aBytes);
+    apClient->iReclaimBytes = Min(debt, apClient->ReclaimableBytes());
+
+    pthread_mutex_unlock(&iLock);
+}
+
+//--------------------------------------------------------------------
+/** @see CCacheClient::CacheReclaimDebt() */
+uint64_t CCacheManager::ReclaimDebt(const CCacheClient* apClient) const
+{
+    pthread_mutex_lock(&iLock);
+    const uint64_t debt = apClient->iReclaimBytes;
+    pthread_mutex_unlock(&iLock);
+
+    return debt;
+}
+
+//--------------------------------------------------------------------
+/**
+    Ask the least recently active cache other than the requester, that has some memory not requested back yet, to release aBytes.
+    @pre the lock must be held
+*/
+void CCacheManager::DoRequestReclaim(const CCacheClient* apRequester, uint64_t aBytes)
+{
+    CCacheClient* pVictim = NULL;
+
+    for(size_t i=0; i<iClients.size(); ++i)
+    {
+        CCacheClient* pClient = iClients[i];
+        if(pClient == apRequester || pClient->iReclaimBytes >= pClient->ReclaimableBytes())
+            continue;
+
+        if(!pVictim || pClient->iLastActive < pVictim->iLastActive)
+            pVictim = pClient;
+    }
+
+    if(pVictim)
+        pVictim->iReclaimBytes = Min(pVictim->ReclaimableBytes(), pVictim->iReclaimBytes + aBytes);
+}
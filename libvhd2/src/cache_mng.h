@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file process-wide memory budget for the metadata caches of all opened VHD files, see VHD_SetCacheBudget()
+*/
+
+
+#ifndef __CACHE_MANAGEMENT_H__
+#define __CACHE_MANAGEMENT_H__
+
+#include <pthread.h>
+
+#include "vhd.h"
+
+class CCacheManager;
+
+//--------------------------------------------------------------------
+/**
+    A base class for the metadata caches (BAT, sector bitmaps) that are accounted by the process-wide cache budget.
+
+    Before allocating a new cache page the derived class calls CacheReserve(); if the budget doesn't allow it, the cache must reuse one of
+    its own pages instead. Every page deallocation is reported by CacheRelease().
+
+    The manager never touches the cache contents itself, because caches of different VHD handles can be used by different threads.
+    When a cache needs memory that is held by other caches, the manager asks the least recently active one to give some back;
+    the owner checks CacheReclaimPending() on every access and releases pages while CacheReclaimDebt() is not 0.
+    The page reserved with aForce when the cache is empty is never asked back, so the owner can always pay the debt off keeping one page.
+*/
+class CCacheClient
+{
+ public:
+    uint64_t CachedBytes() const {return iCachedBytes;} ///< @return number of bytes accounted to this cache
+
+ protected:
+    CCacheClient();
+    virtual ~CCacheClient();
+
+    bool CacheReserve(uint32_t aBytes, bool aForce = false);
+    void CacheRelease(uint32_t aBytes);
+    uint64_t CacheReclaimDebt() const;
+    bool CacheReclaimPending() const {return iReclaimBytes != 0;} ///< @return true if the manager asks for memory. A lock-free hint, @see CacheReclaimDebt()
+
+ private:
+    CCacheClient(const CCacheClient&);
+    CCacheClient& operator=(const CCacheClient&);
+
+    friend class CCacheManager;
+
+    uint64_t ReclaimableBytes() const {return iCachedBytes - iMinBytes;} ///< @return number of bytes the manager can ask back
+
+    uint64_t    iCachedBytes;   ///< number of bytes accounted to this cache, protected by the manager's lock
+    uint64_t    iMinBytes;      ///< size of the page always allowed to the cache, not reclaimable; protected by the manager's lock
+    volatile uint64_t iReclaimBytes; ///< number of bytes the manager asks this cache to release, <= ReclaimableBytes(); protected by the manager's lock
+    uint64_t    iLastActive;    ///< manager's tick of the last CacheReserve() call, protected by the manager's lock
+};
+
+//--------------------------------------------------------------------
+/**
+    Process-wide metadata cache memory manager. Accounts the memory used by all CCacheClient objects and keeps it within the budget.
+    The budget doesn't cover one page per cache that is always allowed, so that every cache can work.
+    Thread-safe, there is only one instance of this class, @see Instance()
+*/
+class CCacheManager
+{
+ public:
+    static CCacheManager& Instance();
+
+    void SetBudget(uint64_t aBytes);
+    uint64_t Budget() const {return iBudget;}   ///< @return cache budget in bytes, 0 means "unlimited"
+    uint64_t UsedBytes() const;
+
+ private:
+    CCacheManager();
+   ~CCacheManager();
+    CCacheManager(const CCacheManager&);
+    CCacheManager& operator=(const CCacheManager&);
+
+    friend class CCacheClient;
+
+    void Register(CCacheClient* apClient);
+    void Unregister(CCacheClient* apClient);
+
+    bool Reserve(CCacheClient* apClient, uint32_t aBytes, bool aForce);
+    void Release(CCacheClient* apClient, uint32_t aBytes);
+    uint64_t ReclaimDebt(const CCacheClient* apClient) const;
+
+    void DoRequestReclaim(const CCacheClient* apRequester, uint64_t aBytes);
+
+ private:
+    mutable pthread_mutex_t iLock;  ///< protects all members below and the accounting data of the clients
+    uint64_t                iBudget;    ///< cache budget in bytes, 0 means "unlimited"
+    uint64_t                iUsedBytes; ///< total number of bytes accounted to all clients
+    uint64_t                iTick;      ///< activity counter, @see CCacheClient::iLastActive
+    vector<CCacheClient*>   iClients;   ///< registered clients
+};
+
+
+#endif //__CACHE_MANAGEMENT_H__
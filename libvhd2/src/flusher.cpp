@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file implementation of the process-wide background metadata flusher
+*/
+
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+
+#include "flusher.h"
+
+
+//####################################################################
+//#  CMetadataFlusher class implementation
+//####################################################################
+
+//--------------------------------------------------------------------
+/** @return reference to the single instance of the flusher */
+CMetadataFlusher& CMetadataFlusher::Instance()
+{
+    static CMetadataFlusher flusher;
+    return flusher;
+}
+
+CMetadataFlusher::CMetadataFlusher()
+                 :iWakeupPending(false), iStopPending(false), iThreadRunning(false), iMaxAgeMs(0), iMaxDirtyWrites(0)
+{
+    pthread_mutex_init(&iLock, NULL);
+    pthread_mutex_init(&iWakeLock, NULL);
+    pthread_cond_init(&iWakeCond, NULL);
+}
+
+CMetadataFlusher::~CMetadataFlusher()
+{
+    DoStopThread();
+
+    pthread_cond_destroy(&iWakeCond);
+    pthread_mutex_destroy(&iWakeLock);
+    pthread_mutex_destroy(&iLock);
+}
+
+//--------------------------------------------------------------------
+/**
+    Set the flush triggers and start or stop the flusher thread accordingly.
+    Not thread-safe itself, must be called by one thread at a time.
+
+    @param  aMaxAgeMs       max. time the metadata can stay dirty, ms. 0 disables this trigger
+    @param  aMaxDirtyWrites max. number of write calls that left the metadata dirty. 0 disables this trigger
+    @return KErrNone on success, negative error code otherwise
+*/
+int CMetadataFlusher::Configure(uint32_t aMaxAgeMs, uint32_t aMaxDirtyWrites)
+{
+    DBG_LOG("CMetadataFlusher::Configure(%d, %d)", aMaxAgeMs, aMaxDirtyWrites);
+
+    iMaxAgeMs = aMaxAgeMs;
+    iMaxDirtyWrites = aMaxDirtyWrites;
+
+    if(!aMaxAgeMs && !aMaxDirtyWrites)
+    {//-- the flusher is disabled
+        DoStopThread();
+        return KErrNone;
+    }
+
+    if(iThreadRunning)
+    {//-- apply new triggers immediately
+        Wakeup();
+        return KErrNone;
+    }
+
+    iStopPending = false;
+    iWakeupPending = false;
+
+    const int nRes = pthread_create(&iThread, NULL, ThreadFunction, this);
+    if(nRes != 0)
+    {
+        DBG_LOG("Error creating flusher thread! code:%d", nRes);
+        iMaxAgeMs = iMaxDirtyWrites = 0;
+        return -nRes;
+    }
+
+    iThreadRunning = true;
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/** Stop the flusher thread if it is running */
+void CMetadataFlusher::DoStopThread()
+{
+    if(!iThreadRunning)
+        return;
+
+    pthread_mutex_lock(&iWakeLock);
+    iStopPending = true;
+    pthread_cond_signal(&iWakeCond);
+    pthread_mutex_unlock(&iWakeLock);
+
+    pthread_join(iThread, NULL);
+    iThreadRunning = false;
+}
+
+//--------------------------------------------------------------------
+/**
+    Register a VHD object; its metadata will be flushed in background when the flusher is enabled.
+    @param  apVhd   VHD object opened for writing
+*/
+void CMetadataFlusher::Register(CVhdFileBase* apVhd)
+{
+    pthread_mutex_lock(&iLock);
+    iClients.push_back(apVhd);
+    pthread_mutex_unlock(&iLock);
+}
+
+//--------------------------------------------------------------------
+/**
+    Unregister a VHD object. Waits for the flush pass in progress to finish, so that the object can be safely deleted afterwards.
+    @param  apVhd   VHD object, does nothing if it isn't registered
+*/
+void CMetadataFlusher::Unregister(CVhdFileBase* apVhd)
+{
+    pthread_mutex_lock(&iLock);
+
+    vector<CVhdFileBase*>::iterator it = std::find(iClients.begin(), iClients.end(), apVhd);
+    if(it != iClients.end())
+        iClients.erase(it);
+
+    pthread_mutex_unlock(&iLock);
+}
+
+//--------------------------------------------------------------------
+/** Ask the flusher thread for a flush pass without waiting for the poll interval. Doesn't wait for the flush pass itself. */
+void CMetadataFlusher::Wakeup()
+{
+    pthread_mutex_lock(&iWakeLock);
+    iWakeupPending = true;
+    pthread_cond_signal(&iWakeCond);
+    pthread_mutex_unlock(&iWakeLock);
+}
+
+//--------------------------------------------------------------------
+/** flusher thread entry point */
+void* CMetadataFlusher::ThreadFunction(void* apThis)
+{
+    CMetadataFlusher* pThis = reinterpret_cast<CMetadataFlusher*>(apThis);
+    pThis->DoProcessClients();
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------
+/**
+    Flusher thread loop. Makes a flush pass every KMetadataFlusher_PollMs or when woken up, until asked to stop.
+*/
+void CMetadataFlusher::DoProcessClients()
+{
+    DBG_LOG("CMetadataFlusher worker thread started");
+
+    pthread_mutex_lock(&iWakeLock);
+
+    while(!iStopPending)
+    {
+        if(!iWakeupPending)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+
+            ts.tv_nsec += (long)KMetadataFlusher_PollMs * 1000000;
+            ts.tv_sec  += ts.tv_nsec / 1000000000;
+            ts.tv_nsec %= 1000000000;
+
+            pthread_cond_timedwait(&iWakeCond, &iWakeLock, &ts);
+
+            if(iStopPending)
+                break;
+        }
+
+        iWakeupPending = false;
+
+        pthread_mutex_unlock(&iWakeLock);
+        DoFlushPass();
+        pthread_mutex_lock(&iWakeLock);
+    }
+
+    pthread_mutex_unlock(&iWakeLock);
+
+    DBG_LOG("CMetadataFlusher worker thread finished");
+}
+
+//--------------------------------------------------------------------
+/**
+    Commit the metadata of every registered VHD object that is due for it and isn't being accessed by its client.
+*/
+void CMetadataFlusher::DoFlushPass()
+{
+    pthread_mutex_lock(&iLock);
+
+    for(size_t i=0; i<iClients.size(); ++i)
+    {
+        CVhdFileBase* pVhd = iClients[i];
+
+        if(!pVhd->TryLockAccess())
+            continue; //-- busy, will be checked on the next pass
+
+        try
+        {
+            if(pVhd->MetadataFlushDue(iMaxAgeMs, iMaxDirtyWrites))
+            {
+                const int nRes = pVhd->CommitMetadata();
+                if(nRes != KErrNone)
+                {
+                    DBG_LOG("CMetadataFlusher: error flushing VHD[0x%p]! code:%d", pVhd, nRes);
+                }
+            }
+        }
+        catch(std::exception& e)
+        {
+            DBG_LOG("std::exception:%s", e.what());
+        }
+        catch(...)
+        {
+            DBG_LOG("!!! non-standard exception !!!");
+        }
+
+        pVhd->UnlockAccess();
+    }
+
+    pthread_mutex_unlock(&iLock);
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file process-wide background metadata flusher, see VHD_SetBackgroundFlush()
+*/
+
+
+#ifndef __FLUSHER_H__
+#define __FLUSHER_H__
+
+#include <pthread.h>
+
+#include "vhd.h"
+
+//--------------------------------------------------------------------
+/**
+    Process-wide background metadata flusher. Its thread periodically looks through the registered VHD objects and commits
+    the metadata of those that have been dirty for too long or have accumulated too many dirty writes (@see CVhdFileBase::MetadataFlushDue()),
+    so that foreground writes and cache evictions mostly find the metadata clean.
+
+    The thread accesses a VHD object only if its access lock is free (@see CVhdFileBase::TryLockAccess()); a busy object is
+    skipped till the next pass, thus the flusher never makes the client wait for it to get the lock.
+
+    Thread-safe, there is only one instance of this class, @see Instance()
+*/
+class CMetadataFlusher
+{
+ public:
+    static CMetadataFlusher& Instance();
+
+    int  Configure(uint32_t aMaxAgeMs, uint32_t aMaxDirtyWrites);
+    uint32_t MaxAgeMs() const       {return iMaxAgeMs;}         ///< @return max. age of dirty metadata, 0 if not used
+    uint32_t MaxDirtyWrites() const {return iMaxDirtyWrites;}   ///< @return max. number of dirty writes, 0 if not used
+
+    void Register(CVhdFileBase* apVhd);
+    void Unregister(CVhdFileBase* apVhd);
+    void Wakeup();
+
+ private:
+    CMetadataFlusher();
+   ~CMetadataFlusher();
+    CMetadataFlusher(const CMetadataFlusher&);
+    CMetadataFlusher& operator=(const CMetadataFlusher&);
+
+    static void* ThreadFunction(void* apThis);
+    void DoProcessClients();
+    void DoFlushPass();
+    void DoStopThread();
+
+ private:
+    pthread_mutex_t iLock;          ///< protects the list of clients; held by the flusher thread during a flush pass
+    vector<CVhdFileBase*> iClients; ///< registered VHD objects
+
+    pthread_mutex_t iWakeLock;      ///< protects the thread control members below
+    pthread_cond_t  iWakeCond;      ///< signalled to wake up or stop the flusher thread
+    bool            iWakeupPending; ///< true if the thread is asked for a flush pass
+    bool            iStopPending;   ///< true if the thread is asked to finish
+
+    pthread_t       iThread;        ///< flusher thread
+    bool            iThreadRunning; ///< true if the flusher thread is created; changed only by Configure()
+
+    volatile uint32_t iMaxAgeMs;        ///< max. age of dirty metadata, 0 if not used
+    volatile uint32_t iMaxDirtyWrites;  ///< max. number of write calls that left metadata dirty, 0 if not used
+};
+
+
+#endif //__FLUSHER_H__
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file implementation of the generic and synchronous I/O engines
+*/
+
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "io_engine.h"
+
+ASSERT_COMPILE(!(KDefScratchBufSize& (KDefSecSize-1))); //-- scratch buffer size must be a multiple of sectors
+
+//####################################################################
+//#  CIoEngine class implementation
+//####################################################################
+
+//--------------------------------------------------------------------
+/**
+    Factory method. Creates an I/O engine for the given file descriptor.
+    If the io_uring engine is requested, but can't be used (not supported by the kernel or the library build), the synchronous one is used instead.
+
+    @param  aFd         opened file descriptor
+    @param  aModeFlags  VHD opening mode flags, see VHDF_OPEN_IO_URING
+
+    @return pointer to the engine object
+*/
+CIoEngine* CIoEngine::New(int aFd, uint32_t aModeFlags)
+{
+    ASSERT(aFd > 0);
+
+    if(aModeFlags & VHDF_OPEN_IO_URING)
+    {
+#ifdef LIBVHD2_WITH_IO_URING
+        CIoEngine* pEngine = CIoEngine_Uring::New(aFd);
+        if(pEngine)
+            return pEngine;
+
+        DBG_LOG("io_uring engine isn't available, falling back to the synchronous one");
+#else
+        DBG_LOG("the library is built without io_uring support, using the synchronous engine");
+#endif
+    }
+
+    return new CIoEngine_Sync(aFd);
+}
+
+//--------------------------------------------------------------------
+CIoEngine::CIoEngine(int aFd)
+          :iFd(aFd), iScratchBuf(KDefScratchBufSize)
+{
+}
+
+CIoEngine::~CIoEngine()
+{
+    //-- all queued requests must have been submitted
+    ASSERT(iBatch.empty());
+}
+
+//--------------------------------------------------------------------
+/**
+    Read data from the file.
+    @param  aFilePos    absolute position in the file
+    @param  aBytes      number of bytes to read
+    @param  apBuf       out: data read
+
+    @return	positive number of read bytes on success, negative value corresponding system error code otherwise.
+*/
+int CIoEngine::Read(uint64_t aFilePos, uint32_t aBytes, void* apBuf)
+{
+    const ssize_t bytesRead = pread64(iFd, apBuf, aBytes, aFilePos);
+
+    if(bytesRead != (ssize_t)aBytes)
+    {
+        const int nRes = (bytesRead < 0) ? -errno : KErrCorrupt; //-- short read means that the file is shorter than expected
+        DBG_LOG("CIoEngine::Read() error! val:%d, code:%d", (int)bytesRead, nRes);
+        return nRes;
+    }
+
+    return bytesRead;
+}
+
+//--------------------------------------------------------------------
+/**
+    Write data to the file.
+    @param  aFilePos    absolute position in the file
+    @param  aBytes      number of bytes to write
+    @param  apBuf       data to write
+
+    @return	positive number of written bytes on success, negative value corresponding system error code otherwise.
+*/
+int CIoEngine::Write(uint64_t aFilePos, uint32_t aBytes, const void* apBuf)
+{
+    const ssize_t bytesWritten = pwrite64(iFd, apBuf, aBytes, aFilePos);
+
+    if(bytesWritten != (ssize_t)aBytes)
+    {
+        const int nRes = (bytesWritten < 0) ? -errno : KErrDiskFull;
+        DBG_LOG("CIoEngine::Write() error! val:%d, code:%d", (int)bytesWritten, nRes);
+        return nRes;
+    }
+
+    return bytesWritten;
+}
+
+//--------------------------------------------------------------------
+/**
+    Queue a read request to the batch. @see SubmitBatch()
+    @param  aFilePos    absolute position in the file
+    @param  aBytes      number of bytes to read
+    @param  apBuf       out: data read. Must be valid until SubmitBatch() returns
+*/
+void CIoEngine::QueueRead(uint64_t aFilePos, uint32_t aBytes, void* apBuf)
+{
+    ASSERT(aBytes);
+
+    TIoReq req;
+    req.iWrite   = false;
+    req.iFilePos = aFilePos;
+    req.iBytes   = aBytes;
+    req.ipBuf    = (uint8_t*)apBuf;
+
+    iBatch.push_back(req);
+}
+
+//--------------------------------------------------------------------
+/**
+    Queue a write request to the batch. @see SubmitBatch()
+    @param  aFilePos    absolute position in the file
+    @param  aBytes      number of bytes to write
+    @param  apBuf       data to write. Must be valid until SubmitBatch() returns
+*/
+void CIoEngine::QueueWrite(uint64_t aFilePos, uint32_t aBytes, const void* apBuf)
+{
+    ASSERT(aBytes);
+
+    TIoReq req;
+    req.iWrite   = true;
+    req.iFilePos = aFilePos;
+    req.iBytes   = aBytes;
+    req.ipBuf    = (uint8_t*)apBuf;
+
+    iBatch.push_back(req);
+}
+
+//--------------------------------------------------------------------
+/**
+    Execute all queued requests and wait for their completion. The batch becomes empty even if there was an error.
+    @return KErrNone on success, negative error code otherwise
+*/
+int CIoEngine::SubmitBatch()
+{
+    if(iBatch.empty())
+        return KErrNone;
+
+    const int nRes = DoSubmitBatch(iBatch);
+    iBatch.clear();
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/**
+    Execute a batch of requests by synchronous calls. Runs of requests of the same type that are adjacent in the file
+    go out as a single vectored call.
+
+    @param  aBatch      batch of requests
+    @param  aStartIdx   index of the first request in the batch to execute
+    @return KErrNone on success, negative error code otherwise
+*/
+int CIoEngine::DoSubmitBatch_Sync(const TIoBatch& aBatch, size_t aStartIdx)
+{
+    const size_t KMaxIov = 256;
+    ASSERT_COMPILE(KMaxIov <= IOV_MAX);
+    iovec iov[KMaxIov];
+
+    size_t i = aStartIdx;
+    while(i < aBatch.size())
+    {
+        const TIoReq& first = aBatch[i];
+        uint64_t nextPos = first.iFilePos;
+        size_t   totalBytes = 0;
+        size_t   numIov = 0;
+
+        //-- collect a run of requests that are adjacent in the file
+        while(i < aBatch.size() && numIov < KMaxIov)
+        {
+            const TIoReq& req = aBatch[i];
+            if(req.iWrite != first.iWrite || req.iFilePos != nextPos)
+                break;
+
+            iov[numIov].iov_base = req.ipBuf;
+            iov[numIov].iov_len  = req.iBytes;
+            ++numIov;
+
+            nextPos    += req.iBytes;
+            totalBytes += req.iBytes;
+            ++i;
+        }
+
+        ASSERT(numIov);
+
+        ssize_t nBytes;
+        if(first.iWrite)
+            nBytes = pwritev64(iFd, iov, numIov, first.iFilePos);
+        else
+            nBytes = preadv64(iFd, iov, numIov, first.iFilePos);
+
+        if(nBytes != (ssize_t)totalBytes)
+        {
+            const int nRes = (nBytes < 0) ? -errno : (first.iWrite ? KErrDiskFull : KErrCorrupt);
+            DBG_LOG("CIoEngine::DoSubmitBatch_Sync() error! write:%d, val:%d, code:%d", first.iWrite, (int)nBytes, nRes);
+            return nRes;
+        }
+    }
+
+    return KErrNone;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file pluggable I/O engines that perform raw data transfers between VHD files and memory
+*/
+
+
+#ifndef __IO_ENGINE_H__
+#define __IO_ENGINE_H__
+
+#include <sys/uio.h>
+
+#include "vhd.h"
+
+
+//--------------------------------------------------------------------
+/** Number of io_uring submission queue entries; batches bigger than this are submitted in several goes */
+const uint32_t KIoUring_Entries = 64;
+
+
+//--------------------------------------------------------------------
+/**
+    An abstract I/O engine, performs raw data transfers between the VHD file and memory buffers.
+
+    Single requests, Read() and Write(), are executed synchronously by pread64()/pwrite64() calls.
+    A number of requests can be queued by QueueRead()/QueueWrite() and executed all together by SubmitBatch(); the
+    way the batch is executed depends on the engine. The order of execution of requests in a batch is not defined, thus
+    requests in the same batch must not overlap.
+
+    The engine also owns a scratch buffer of KDefScratchBufSize bytes that can be used for filling / checking media. Some engines
+    can use this buffer more efficiently than arbitrary ones, see CIoEngine_Uring.
+
+    Not thread-safe. Objects are created by New() factory method only.
+*/
+class CIoEngine
+{
+ public:
+    static CIoEngine* New(int aFd, uint32_t aModeFlags);
+    virtual ~CIoEngine();
+
+    virtual const char* Name() const = 0;   ///< @return engine name, for information purposes
+
+    int Read (uint64_t aFilePos, uint32_t aBytes, void* apBuf);
+    int Write(uint64_t aFilePos, uint32_t aBytes, const void* apBuf);
+
+    void QueueRead (uint64_t aFilePos, uint32_t aBytes, void* apBuf);
+    void QueueWrite(uint64_t aFilePos, uint32_t aBytes, const void* apBuf);
+    int  SubmitBatch();
+
+    uint8_t* ScratchBuf()           {return iScratchBuf.Ptr();}     ///< @return pointer to the engine scratch buffer
+    uint32_t ScratchBufSize() const {return iScratchBuf.Size();}    ///< @return scratch buffer size in bytes
+
+ protected:
+    CIoEngine(int aFd);
+
+    /** describes a single request in a batch */
+    struct TIoReq
+    {
+        bool     iWrite;    ///< true for write requests, false for read
+        uint64_t iFilePos;  ///< absolute position in the file
+        uint32_t iBytes;    ///< number of bytes to transfer
+        uint8_t* ipBuf;     ///< memory buffer
+    };
+
+    typedef vector<TIoReq> TIoBatch;
+
+    /**
+        Execute a batch of requests. All requests must be completed in full on return.
+        @return KErrNone on success, negative error code otherwise
+    */
+    virtual int DoSubmitBatch(const TIoBatch& aBatch) = 0;
+    int DoSubmitBatch_Sync(const TIoBatch& aBatch, size_t aStartIdx);
+
+    int Fd() const {return iFd;} ///< @return file descriptor the engine works with
+
+ private:
+    CIoEngine(const CIoEngine&);
+    CIoEngine& operator=(const CIoEngine&);
+
+ private:
+    const int   iFd;        ///< file descriptor, the engine doesn't own it
+    TIoBatch    iBatch;     ///< queued requests, see QueueRead(), QueueWrite()
+    CDynBuffer  iScratchBuf;///< scratch buffer
+};
+
+
+//--------------------------------------------------------------------
+/**
+    Default I/O engine based on synchronous system calls.
+    Requests in a batch that are adjacent in the file are coalesced and executed by a single preadv64() / pwritev64() call.
+*/
+class CIoEngine_Sync : public CIoEngine
+{
+ public:
+    CIoEngine_Sync(int aFd) : CIoEngine(aFd) {}
+
+    virtual const char* Name() const {return "sync";}
+
+ protected:
+    virtual int DoSubmitBatch(const TIoBatch& aBatch) {return DoSubmitBatch_Sync(aBatch, 0);}
+};
+
+
+#ifdef LIBVHD2_WITH_IO_URING
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+//--------------------------------------------------------------------
+/**
+    I/O engine based on Linux io_uring interface, uses raw system calls, doesn't require liburing.
+    Batched requests are submitted to the kernel with a single io_uring_enter() call per KIoUring_Entries requests.
+    The file descriptor is registered with the ring as a "fixed file"; the engine scratch buffer is registered as a "fixed buffer",
+    so requests that use it don't need mapping user pages on every call.
+*/
+class CIoEngine_Uring : public CIoEngine
+{
+ public:
+    static CIoEngine_Uring* New(int aFd);
+   ~CIoEngine_Uring();
+
+    virtual const char* Name() const {return "io_uring";}
+
+ protected:
+    CIoEngine_Uring(int aFd);
+    virtual int DoSubmitBatch(const TIoBatch& aBatch);
+
+ private:
+    int  DoSetupRing();
+    int  DoSubmitAndWait(const TIoBatch& aBatch, size_t aStartIdx, uint32_t aNumReqs);
+    uint32_t DoReapCompletions(const TIoBatch& aBatch, uint32_t& aNumCompleted, int& aResult);
+    void DoWaitInFlight(const TIoBatch& aBatch, uint32_t aNumSubmitted, uint32_t aNumCompleted);
+    int  DoCompleteShortTransfer(const TIoReq& aReq, int aResult);
+    bool IsInScratchBuf(const TIoReq& aReq);
+
+ private:
+    int         iRingFd;        ///< io_uring file descriptor
+    uint32_t    iNumEntries;    ///< number of submission queue entries, max. number of requests submitted in one go
+    bool        iRingBroken;    ///< true if the ring state is unknown after an error; the engine works synchronously then
+    vector<iovec> iIov;         ///< iovecs for the vectored requests in flight, one per submission queue entry
+
+    void*       ipSqRingPtr;    ///< mmapped submission queue ring
+    size_t      iSqRingSize;    ///< its size
+    void*       ipCqRingPtr;    ///< mmapped completion queue ring; the same as ipSqRingPtr if the kernel supports single mmap
+    size_t      iCqRingSize;    ///< its size
+    io_uring_sqe* ipSqes;       ///< mmapped array of submission queue entries
+    size_t      iSqesSize;      ///< its size
+
+    //-- pointers to the ring fields shared with the kernel
+    uint32_t*   ipSqHead;
+    uint32_t*   ipSqTail;
+    uint32_t*   ipSqMask;
+    uint32_t*   ipSqArray;
+    uint32_t*   ipCqHead;
+    uint32_t*   ipCqTail;
+    uint32_t*   ipCqMask;
+    io_uring_cqe* ipCqes;
+};
+
+#endif //LIBVHD2_WITH_IO_URING
+
+
+#endif //__IO_ENGINE_H__
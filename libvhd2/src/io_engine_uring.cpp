@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file implementation of the io_uring I/O engine. Uses raw system calls, doesn't depend on liburing.
+*/
+
+#include "io_engine.h"
+
+#ifdef LIBVHD2_WITH_IO_URING
+
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+//--------------------------------------------------------------------
+//-- io_uring system calls wrappers
+
+static inline int Sys_io_uring_setup(uint32_t aEntries, io_uring_params* apParams)
+{
+    return (int)syscall(__NR_io_uring_setup, aEntries, apParams);
+}
+
+static inline int Sys_io_uring_enter(int aRingFd, uint32_t aToSubmit, uint32_t aMinComplete, uint32_t aFlags)
+{
+    return (int)syscall(__NR_io_uring_enter, aRingFd, aToSubmit, aMinComplete, aFlags, NULL, 0);
+}
+
+static inline int Sys_io_uring_register(int aRingFd, uint32_t aOpcode, const void* apArg, uint32_t aNumArgs)
+{
+    return (int)syscall(__NR_io_uring_register, aRingFd, aOpcode, apArg, aNumArgs);
+}
+
+//####################################################################
+//#  CIoEngine_Uring class implementation
+//####################################################################
+
+//--------------------------------------------------------------------
+/**
+    Factory method.
+    @param  aFd opened file descriptor
+    @return pointer to the engine object, NULL if io_uring isn't supported or can't be set up
+*/
+CIoEngine_Uring* CIoEngine_Uring::New(int aFd)
+{
+    CIoEngine_Uring* pEngine = new CIoEngine_Uring(aFd);
+
+    const int nRes = pEngine->DoSetupRing();
+    if(nRes != KErrNone)
+    {
+        DBG_LOG("Error setting up io_uring! code:%d", nRes);
+        delete pEngine;
+        return NULL;
+    }
+
+    return pEngine;
+}
+
+//--------------------------------------------------------------------
+CIoEngine_Uring::CIoEngine_Uring(int aFd)
+                :CIoEngine(aFd), iRingFd(-1), iNumEntries(0), iRingBroken(false),
+                 ipSqRingPtr(NULL), iSqRingSize(0), ipCqRingPtr(NULL), iCqRingSize(0), ipSqes(NULL), iSqesSize(0)
+{
+}
+
+CIoEngine_Uring::~CIoEngine_Uring()
+{
+    if(ipSqes)
+        munmap(ipSqes, iSqesSize);
+
+    if(ipCqRingPtr && ipCqRingPtr != ipSqRingPtr)
+        munmap(ipCqRingPtr, iCqRingSize);
+
+    if(ipSqRingPtr)
+        munmap(ipSqRingPtr, iSqRingSize);
+
+    //-- closing the ring also unregisters the file and the buffer
+    if(iRingFd >= 0)
+        close(iRingFd);
+}
+
+//--------------------------------------------------------------------
+/**
+    Create io_uring, map its queues into the process address space, register the file descriptor and the scratch buffer.
+    @return KErrNone on success, negative error code otherwise
+*/
+int CIoEngine_Uring::DoSetupRing()
+{
+    io_uring_params params;
+    FillZ(params);
+
+    iRingFd = Sys_io_uring_setup(KIoUring_Entries, &params);
+    if(iRingFd < 0)
+        return -errno;
+
+    //-- 1. map submission and completion queue rings. Modern kernels allow mapping both with a single mmap() call
+    iSqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    iCqRingSize = params.cq_off.cqes  + params.cq_entries * sizeof(io_uring_cqe);
+
+    const bool bSingleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(bSingleMmap)
+        iSqRingSize = iCqRingSize = Max(iSqRingSize, iCqRingSize);
+
+    void* pMem = mmap(NULL, iSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, iRingFd, IORING_OFF_SQ_RING);
+    if(pMem == MAP_FAILED)
+        return -errno;
+
+    ipSqRingPtr = pMem;
+
+    if(bSingleMmap)
+    {
+        ipCqRingPtr = ipSqRingPtr;
+    }
+    else
+    {
+        pMem = mmap(NULL, iCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, iRingFd, IORING_OFF_CQ_RING);
+        if(pMem == MAP_FAILED)
+            return -errno;
+
+        ipCqRingPtr = pMem;
+    }
+
+    //-- 2. map submission queue entries array
+    iSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    pMem = mmap(NULL, iSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, iRingFd, IORING_OFF_SQES);
+    if(pMem == MAP_FAILED)
+        return -errno;
+
+    ipSqes = (io_uring_sqe*)pMem;
+
+    uint8_t* pSq = (uint8_t*)ipSqRingPtr;
+    ipSqHead  = (uint32_t*)(pSq + params.sq_off.head);
+    ipSqTail  = (uint32_t*)(pSq + params.sq_off.tail);
+    ipSqMask  = (uint32_t*)(pSq + params.sq_off.ring_mask);
+    ipSqArray = (uint32_t*)(pSq + params.sq_off.array);
+
+    uint8_t* pCq = (uint8_t*)ipCqRingPtr;
+    ipCqHead  = (uint32_t*)(pCq + params.cq_off.head);
+    ipCqTail  = (uint32_t*)(pCq + params.cq_off.tail);
+    ipCqMask  = (uint32_t*)(pCq + params.cq_off.ring_mask);
+    ipCqes    = (io_uring_cqe*)(pCq + params.cq_off.cqes);
+
+    //-- we never have more requests in flight than SQ entries, so the completion queue can't overflow
+    ASSERT(params.cq_entries >= params.sq_entries);
+    iNumEntries = params.sq_entries;
+    iIov.resize(iNumEntries);
+
+    //-- 3. register the file descriptor and the scratch buffer
+    const int fd = Fd();
+    if(Sys_io_uring_register(iRingFd, IORING_REGISTER_FILES, &fd, 1) < 0)
+        return -errno;
+
+    iovec iov;
+    iov.iov_base = ScratchBuf();
+    iov.iov_len  = ScratchBufSize();
+    if(Sys_io_uring_register(iRingFd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+        return -errno;
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/** @return true if the request's buffer lies within the registered scratch buffer */
+bool CIoEngine_Uring::IsInScratchBuf(const TIoReq& aReq)
+{
+    const uint8_t* pBufStart = ScratchBuf();
+    const uint8_t* pBufEnd   = pBufStart + ScratchBufSize();
+
+    return aReq.ipBuf >= pBufStart && (aReq.ipBuf + aReq.iBytes) <= pBufEnd;
+}
+
+//--------------------------------------------------------------------
+/**
+    Execute a batch of requests, submitting up to iNumEntries requests to the kernel at a time.
+*/
+int CIoEngine_Uring::DoSubmitBatch(const TIoBatch& aBatch)
+{
+    size_t idx = 0;
+    while(idx < aBatch.size())
+    {
+        if(iRingBroken)
+            return DoSubmitBatch_Sync(aBatch, idx);
+
+        const uint32_t numReqs = Min((size_t)iNumEntries, aBatch.size() - idx);
+
+        const int nRes = DoSubmitAndWait(aBatch, idx, numReqs);
+        if(nRes != KErrNone)
+            return nRes;
+
+        idx += numReqs;
+    }
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Put a number of requests to the submission queue, submit them with a single system call and wait for all of them to complete.
+
+    @param  aBatch      batch of requests
+    @param  aStartIdx   index of the first request in the batch to submit
+    @param  aNumReqs    number of requests to submit, <= iNumEntries
+
+    @return KErrNone on success, negative error code otherwise
+*/
+int CIoEngine_Uring::DoSubmitAndWait(const TIoBatch& aBatch, size_t aStartIdx, uint32_t aNumReqs)
+{
+    ASSERT(aNumReqs && aNumReqs <= iNumEntries);
+
+    //-- 1. fill in submission queue entries. The SQ is empty here, all previous requests have been completed.
+    const uint32_t sqMask = *ipSqMask;
+    uint32_t sqTail = *ipSqTail; //-- only this process modifies the tail
+
+    for(uint32_t i=0; i<aNumReqs; ++i)
+    {
+        const TIoReq& req = aBatch[aStartIdx + i];
+        const uint32_t sqIdx = sqTail & sqMask;
+
+        io_uring_sqe* pSqe = &ipSqes[sqIdx];
+        FillZ(*pSqe);
+
+        pSqe->flags = IOSQE_FIXED_FILE;
+        pSqe->fd    = 0; //-- index in the registered files table
+        pSqe->off   = req.iFilePos;
+        pSqe->user_data = aStartIdx + i;
+
+        if(IsInScratchBuf(req))
+        {//-- use the registered buffer
+            pSqe->opcode = req.iWrite ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            pSqe->addr   = (uint64_t)(uintptr_t)req.ipBuf;
+            pSqe->len    = req.iBytes;
+            pSqe->buf_index = 0;
+        }
+        else
+        {//-- vectored requests are supported by all kernels that have io_uring
+            iIov[i].iov_base = req.ipBuf;
+            iIov[i].iov_len  = req.iBytes;
+
+            pSqe->opcode = req.iWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+            pSqe->addr   = (uint64_t)(uintptr_t)&iIov[i];
+            pSqe->len    = 1;
+        }
+
+        ipSqArray[sqIdx] = sqIdx;
+        ++sqTail;
+    }
+
+    //-- make SQ entries visible to the kernel before the new tail value
+    __atomic_store_n(ipSqTail, sqTail, __ATOMIC_RELEASE);
+
+    //-- 2. submit requests and reap completions
+    int nResult = KErrNone;
+    uint32_t toSubmit = aNumReqs;
+    uint32_t numCompleted = 0;
+
+    while(numCompleted < aNumReqs)
+    {
+        const int nRes = Sys_io_uring_enter(iRingFd, toSubmit, 1, IORING_ENTER_GETEVENTS);
+        if(nRes < 0)
+        {
+            const int nErr = errno;
+            if(nErr == EINTR)
+                continue;
+
+            if(nErr == EAGAIN || nErr == EBUSY)
+            {//-- transient: the kernel is short of resources or wants the completions reaped first. Reap them and retry
+                if(!DoReapCompletions(aBatch, numCompleted, nResult))
+                    sched_yield();
+
+                continue;
+            }
+
+            //-- the state of the ring is unknown now, can't use it any more. The requests taken by the kernel can still be
+            //-- transferring data to/from the caller's buffers, they must finish before the buffers are given back.
+            DBG_LOG("io_uring_enter() error! code:%d", -nErr);
+            iRingBroken = true;
+            DoWaitInFlight(aBatch, aNumReqs - toSubmit, numCompleted);
+
+            return -nErr;
+        }
+
+        ASSERT((uint32_t)nRes <= toSubmit);
+        toSubmit -= nRes;
+
+        DoReapCompletions(aBatch, numCompleted, nResult);
+    }
+
+    return nResult;
+}
+
+//--------------------------------------------------------------------
+/**
+    Reap the completion queue entries posted by the kernel; the requests that have transferred less data than asked are finished
+    synchronously.
+
+    @param  aBatch          batch of submitted requests
+    @param  aNumCompleted   in/out: number of completed requests, increased by the number of the reaped entries
+    @param  aResult         in/out: result of the batch, set to the first request error if it is KErrNone
+
+    @return number of the reaped entries
+*/
+uint32_t CIoEngine_Uring::DoReapCompletions(const TIoBatch& aBatch, uint32_t& aNumCompleted, int& aResult)
+{
+    uint32_t cqHead = *ipCqHead;
+    const uint32_t cqTail = __atomic_load_n(ipCqTail, __ATOMIC_ACQUIRE);
+    const uint32_t numReaped = cqTail - cqHead;
+
+    while(cqHead != cqTail)
+    {
+        const io_uring_cqe& cqe = ipCqes[cqHead & *ipCqMask];
+        const TIoReq& req = aBatch[cqe.user_data];
+
+        if(cqe.res != (int)req.iBytes)
+        {
+            const int nRes = DoCompleteShortTransfer(req, cqe.res);
+            if(nRes != KErrNone && aResult == KErrNone)
+                aResult = nRes;
+        }
+
+        ++cqHead;
+    }
+
+    __atomic_store_n(ipCqHead, cqHead, __ATOMIC_RELEASE);
+
+    aNumCompleted += numReaped;
+    return numReaped;
+}
+
+//--------------------------------------------------------------------
+/**
+    Wait for the requests already taken by the kernel to complete, after io_uring_enter() has failed. Their results are ignored.
+    If the ring can't be entered any more, the completion queue is polled: the kernel posts completions without being entered.
+
+    @param  aBatch          batch of submitted requests
+    @param  aNumSubmitted   number of requests taken by the kernel
+    @param  aNumCompleted   number of those requests already reaped
+*/
+void CIoEngine_Uring::DoWaitInFlight(const TIoBatch& aBatch, uint32_t aNumSubmitted, uint32_t aNumCompleted)
+{
+    int nResult = KErrNone;
+    bool bCanEnter = true;
+
+    DoReapCompletions(aBatch, aNumCompleted, nResult);
+
+    while(aNumCompleted < aNumSubmitted)
+    {
+        if(bCanEnter && Sys_io_uring_enter(iRingFd, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+        {
+            if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                bCanEnter = false;
+        }
+
+        if(!DoReapCompletions(aBatch, aNumCompleted, nResult) && !bCanEnter)
+            usleep(1000);
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Handle a request that completed with an error or transferred less data than requested.
+    The rest of the data is transferred synchronously.
+
+    @param  aReq        the request
+    @param  aResult     completion result from the CQ entry; negative errno or number of bytes transferred
+    @return KErrNone on success, negative error code otherwise
+*/
+int CIoEngine_Uring::DoCompleteShortTransfer(const TIoReq& aReq, int aResult)
+{
+    if(aResult < 0)
+    {
+        DBG_LOG("request failed! write:%d, pos:%llu, code:%d", aReq.iWrite, (unsigned long long)aReq.iFilePos, aResult);
+        return aResult;
+    }
+
+    ASSERT((uint32_t)aResult < aReq.iBytes);
+
+    const uint64_t filePos = aReq.iFilePos + aResult;
+    const uint32_t bytes   = aReq.iBytes - aResult;
+    uint8_t* pBuf = aReq.ipBuf + aResult;
+
+    const int nRes = aReq.iWrite ? Write(filePos, bytes, pBuf) : Read(filePos, bytes, pBuf);
+    return (nRes < 0) ? nRes : KErrNone;
+}
+
+#endif //LIBVHD2_WITH_IO_URING
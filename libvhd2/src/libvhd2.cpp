@@ -24,6 +24,9 @@
 #include <unistd.h>
 
 #include "vhd.h"
+#include "async_io.h"
+#include "cache_mng.h"
+#include "flusher.h"
 
 
 
@@ -156,6 +159,10 @@ static TVhdHandle  Do_VHD_Open(const char *aFileName, uint32_t aModeFlags)
         return vhdHandle; //-- this will be the error code
     }
 
+    //-- 4. the metadata of the file opened for writing can be flushed in background
+    if(!pVhd->ReadOnly())
+        CMetadataFlusher::Instance().Register(pVhd.get());
+
     //-- everything is fine now.
     (void)pVhd.release();
     return vhdHandle;
@@ -180,6 +187,9 @@ TVhdHandle  VHD_Open(const char *aFileName, uint32_t aModeFlags)
         {//-- put here combinations of invalid flags to be checked
             VHDF_OPEN_IGNORE_PARENT | VHDF_OPEN_RDWR,
             VHDF_OPMODE_PURE_BLOCKS | VHDF_OPEN_ENABLE_TRIM,
+            VHDF_OPMODE_WRITEBACK | VHDF_OPMODE_ORDERED,
+            VHDF_OPMODE_WRITEBACK | VHDF_OPMODE_WRITETHROUGH,
+            VHDF_OPMODE_ORDERED   | VHDF_OPMODE_WRITETHROUGH,
         };
 
         const int arrSize = sizeof(incompatFlags) / sizeof(uint32_t);
@@ -238,6 +248,12 @@ void VHD_Close(TVhdHandle aVhdHandle)
         int nRes = handleMapper.UnmapHandle(aVhdHandle);
         ASSERT(nRes == KErrNone);
 
+        //-- the background flusher must not access the object any more
+        CMetadataFlusher::Instance().Unregister(pVhd);
+
+        //-- execute all pending asynchronous requests and stop the queue
+        pVhd->CloseAsyncIoQueue();
+
         //-- make the best effort to flush data/metadata
         nRes = pVhd->Flush();
         if(nRes != KErrNone)
@@ -305,6 +321,8 @@ static int Do_VHD_ParentInfo(TVhdHandle aVhdHandle, TVHD_ParamsStruct* pVhdInfo,
         return KErrBadHandle;
     }
 
+    TVhdAccessGuard accessGuard(*pVhd);
+
     TVHD_Params tmpParams;
     int nRes = pVhd->GetInfo(tmpParams, aParentIndex);
     if(nRes != KErrNone)
@@ -391,6 +409,8 @@ int VHD_PrintInfo(TVhdHandle aVhdHandle, void* apBuf, uint32_t aBufSize)
     int nRes = KErrGeneral;
     try
     {
+        TVhdAccessGuard accessGuard(*pVhd);
+
         //-- dump information to the dynamic buffer
         std::string str;
         pVhd->PrintInfo(str);
@@ -442,6 +462,7 @@ int VHD_Flush(TVhdHandle aVhdHandle)
     int nRes = KErrGeneral;
     try
     {
+        TVhdAccessGuard accessGuard(*pVhd);
         nRes = pVhd->Flush();
     }
 	catch(std::exception& e)
@@ -456,6 +477,47 @@ int VHD_Flush(TVhdHandle aVhdHandle)
     return nRes;
 }
 
+//--------------------------------------------------------------------
+/*
+	Change operational mode flags of the opened VHD, see VHDF_OPMODE_* flags.
+	Currently only the durability mode can be changed; metadata pending in the old mode is committed before switching.
+
+	@param 	aVhdHandle  VHD hadle obtained from VHD_Open()
+	@param  aModeFlags  new set of VHDF_OPMODE_* flags. At most one durability mode flag; VHDF_OPMODE_WRITETHROUGH and
+                        VHDF_OPMODE_PURE_BLOCKS must be the same as specified in VHD_Open().
+
+	@return KErrNone on success, KErrArgument on invalid flags, KErrNotSupported if the flags can't be changed at runtime,
+            negative error code otherwise.
+*/
+int VHD_SetMode(TVhdHandle aVhdHandle, uint32_t aModeFlags)
+{
+    DBG_LOG("aVhdHandle:%d, aModeFlags:0x%x", aVhdHandle, aModeFlags);
+
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
+
+    int nRes = KErrGeneral;
+    try
+    {
+        TVhdAccessGuard accessGuard(*pVhd);
+        nRes = pVhd->SetMode(aModeFlags);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
 //--------------------------------------------------------------------
 /*
     Invalidates cached data and metadata. Thus, on the next access internal caches will be re-populated.
@@ -480,6 +542,7 @@ int VHD_InvalidateCaches(TVhdHandle aVhdHandle)
     int nRes = KErrGeneral;
     try
     {
+        TVhdAccessGuard accessGuard(*pVhd);
         pVhd->InvalidateCache();
         nRes = KErrNone;
     }
@@ -523,6 +586,7 @@ int VHD_ReadSectors(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors,
     int nRes = KErrGeneral;
     try
     {
+        TVhdAccessGuard accessGuard(*pVhd);
         nRes = pVhd->ReadSectors(aStartSector, aSectors, apBuffer, aBufSize);
     }
 	catch(std::exception& e)
@@ -564,6 +628,7 @@ int VHD_WriteSectors(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors,
     int nRes = KErrGeneral;
     try
     {
+        TVhdAccessGuard accessGuard(*pVhd);
         nRes = pVhd->WriteSectors(aStartSector, aSectors, apBuffer, aBufSize);
     }
 	catch(std::exception& e)
@@ -578,6 +643,92 @@ int VHD_WriteSectors(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors,
     return nRes;
 }
 
+//--------------------------------------------------------------------
+/*
+	Read a number of sectors from VHD to a scatter-gather list of buffers.
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aStartSector	starting sector.
+	@param	aSectors		number of sectors to read 0..LONG_MAX
+	@param	apIov		    array of iovecs describing the buffers for the read data
+    @param  aIovCnt         number of elements in the array
+
+	@return	positive number of read sectors on success, negative error code otherwise.
+*/
+int VHD_ReadSectorsV(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors, const struct iovec* apIov, int aIovCnt)
+{
+    DBG_LOG("aVhdHandle:%d, aStartSector:%d, aSectors:%d, aIovCnt:%d", aVhdHandle, aStartSector, aSectors, aIovCnt);
+
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
+
+    if(!apIov || aIovCnt <= 0)
+        return KErrArgument;
+
+    int nRes = KErrGeneral;
+    try
+    {
+        TVhdAccessGuard accessGuard(*pVhd);
+        nRes = pVhd->ReadSectorsV(aStartSector, aSectors, TIoVecBuf(apIov, aIovCnt));
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/*
+	Write a number of sectors to VHD from a scatter-gather list of buffers.
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aStartSector	starting sector.
+	@param	aSectors		number of sectors to write 0..LONG_MAX
+	@param	apIov		    array of iovecs describing the buffers with data to write
+    @param  aIovCnt         number of elements in the array
+
+	@return	positive number of written sectors on success, negative error code otherwise.
+*/
+int VHD_WriteSectorsV(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors, const struct iovec* apIov, int aIovCnt)
+{
+    DBG_LOG("aVhdHandle:%d, aStartSector:%d, aSectors:%d, aIovCnt:%d", aVhdHandle, aStartSector, aSectors, aIovCnt);
+
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
+
+    if(!apIov || aIovCnt <= 0)
+        return KErrArgument;
+
+    int nRes = KErrGeneral;
+    try
+    {
+        TVhdAccessGuard accessGuard(*pVhd);
+        nRes = pVhd->WriteSectorsV(aStartSector, aSectors, TIoVecBuf(apIov, aIovCnt));
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
 
 //--------------------------------------------------------------------
 /*
@@ -610,6 +761,7 @@ int VHD_DiscardSectors(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSector
     int nRes = KErrGeneral;
     try
     {
+        TVhdAccessGuard accessGuard(*pVhd);
         nRes = pVhd->DiscardSectors(aStartSector, aSectors);
     }
 	catch(std::exception& e)
@@ -662,6 +814,7 @@ static int Do_VHD_CoalesceChain(TVhdHandle aVhdHandle, uint32_t aChainLength, ui
     if(!pVhd)
         return KErrBadHandle;
 
+    TVhdAccessGuard accessGuard(*pVhd);
 
     int nRes;
     TVHD_Params vhdParams;
@@ -740,10 +893,619 @@ int VHD_CoalesceChain(TVhdHandle aVhdHandle, uint32_t aChainLength, uint32_t aCh
 }
 
 
+//--------------------------------------------------------------------
+/*
+    Submit a number of asynchronous I/O requests. The call doesn't block waiting for requests completion.
+    Requests submitted to the same VHD handle are executed one after another in the order of submission by the library worker thread.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param  apReqs          array of pointers to the requests to submit. @see TVhdIoRequest
+	@param  aNumReqs        number of requests in the array
+
+	@return	number of requests submitted, it can be less than aNumReqs if the maximal number of requests in flight is reached.
+            -EAGAIN if no requests can be submitted at present, other negative error code otherwise.
+*/
+static int Do_VHD_SubmitIo(TVhdHandle aVhdHandle, TVhdIoRequest* apReqs[], int aNumReqs)
+{
+    //-- find object corresponding to the handle
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+        return KErrBadHandle;
+
+    CAsyncIoQueue* pQueue = NULL;
+    const int nRes = pVhd->GetAsyncIoQueue(pQueue);
+    if(nRes != KErrNone)
+        return nRes;
+
+    return pQueue->Submit(apReqs, aNumReqs);
+}
+
+//--------------------------------------------------------------------
+int VHD_SubmitIo(TVhdHandle aVhdHandle, TVhdIoRequest* apReqs[], int aNumReqs)
+{
+    DBG_LOG("aVhdHandle:%d, aNumReqs:%d", aVhdHandle, aNumReqs);
+
+    int nRes = KErrGeneral;
+    try
+    {
+        nRes = Do_VHD_SubmitIo(aVhdHandle, apReqs, aNumReqs);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/*
+	Collect completed asynchronous I/O requests.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param  apReqs          out: array of pointers to the completed requests.
+	@param  aMaxReqs        max. number of requests to collect, size of the apReqs array
+	@param  aMinReqs        min. number of requests to collect; the call will block until this number of requests complete.
+
+	@return	number of collected requests on success, negative error code otherwise.
+*/
+static int Do_VHD_PollCompletions(TVhdHandle aVhdHandle, TVhdIoRequest* apReqs[], int aMaxReqs, int aMinReqs)
+{
+    //-- find object corresponding to the handle
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+        return KErrBadHandle;
+
+    CAsyncIoQueue* pQueue = NULL;
+    const int nRes = pVhd->GetAsyncIoQueue(pQueue);
+    if(nRes != KErrNone)
+        return nRes;
+
+    return pQueue->PollCompletions(apReqs, aMaxReqs, aMinReqs);
+}
+
+//--------------------------------------------------------------------
+int VHD_PollCompletions(TVhdHandle aVhdHandle, TVhdIoRequest* apReqs[], int aMaxReqs, int aMinReqs)
+{
+    DBG_LOG("aVhdHandle:%d, aMaxReqs:%d, aMinReqs:%d", aVhdHandle, aMaxReqs, aMinReqs);
+
+    int nRes = KErrGeneral;
+    try
+    {
+        nRes = Do_VHD_PollCompletions(aVhdHandle, apReqs, aMaxReqs, aMinReqs);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/*
+	Get a file descriptor that can be used to wait for asynchronous I/O requests completion with poll(), select() etc.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@return	file descriptor on success, negative error code otherwise.
+*/
+static int Do_VHD_GetIoEventFd(TVhdHandle aVhdHandle)
+{
+    //-- find object corresponding to the handle
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+        return KErrBadHandle;
+
+    CAsyncIoQueue* pQueue = NULL;
+    const int nRes = pVhd->GetAsyncIoQueue(pQueue);
+    if(nRes != KErrNone)
+        return nRes;
+
+    return pQueue->EventFd();
+}
+
+//--------------------------------------------------------------------
+int VHD_GetIoEventFd(TVhdHandle aVhdHandle)
+{
+    DBG_LOG("aVhdHandle:%d", aVhdHandle);
+
+    int nRes = KErrGeneral;
+    try
+    {
+        nRes = Do_VHD_GetIoEventFd(aVhdHandle);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+
+//--------------------------------------------------------------------
+/*
+    Translate an extent of logical sectors into a list of extents describing where the sectors data are located in the VHD chain files.
+
+	@param 	aVhdHandle          VHD hadle obtained from VHD_Open()
+	@param	aStartSector	    starting sector.
+	@param	aSectors		    number of sectors to map 1..LONG_MAX
+	@param	aAllocateOnWrite	if non-zero, allocate VHD blocks for writing.
+	@param  apExtents           out: array of the extents
+	@param  aMaxExtents         max. number of the extents in the array
+
+	@return	number of the extents filled in on success, negative error code otherwise.
+*/
+int VHD_MapExtents(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors, int aAllocateOnWrite, TVhdExtent* apExtents, int aMaxExtents)
+{
+    DBG_LOG("aVhdHandle:%d, aStartSector:%d, aSectors:%d, aAllocateOnWrite:%d", aVhdHandle, aStartSector, aSectors, aAllocateOnWrite);
+
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
+
+    if(!apExtents || aMaxExtents <= 0 || aSectors <= 0)
+        return KErrArgument;
+
+    int nRes = KErrGeneral;
+    try
+    {
+        TVhdAccessGuard accessGuard(*pVhd);
 
+        TVhdExtentList extList(apExtents, aMaxExtents);
+        nRes = pVhd->MapExtents(aStartSector, aSectors, aAllocateOnWrite != 0, extList, 0);
+        if(nRes >= 0)
+            nRes = extList.Count();
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
 
+    return nRes;
+}
 
+//--------------------------------------------------------------------
+/*
+    Mark an extent of sectors as containing valid data after the client has written them directly to the file.
 
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aStartSector	starting sector.
+	@param	aSectors		number of sectors 1..LONG_MAX
 
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_CommitExtents(TVhdHandle aVhdHandle, uint32_t aStartSector, int aSectors)
+{
+    DBG_LOG("aVhdHandle:%d, aStartSector:%d, aSectors:%d", aVhdHandle, aStartSector, aSectors);
 
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
 
+    if(aSectors <= 0)
+        return KErrArgument;
+
+    int nRes = KErrGeneral;
+    try
+    {
+        TVhdAccessGuard accessGuard(*pVhd);
+        nRes = pVhd->CommitExtents(aStartSector, aSectors);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/*
+    Set the max. number of sector allocation bitmaps cached per VHD file. Applies to every Dynamic and Differencing VHD in the chain,
+    including parents that will be opened later. The default is 64. A bitmap takes about 512 bytes of RAM for the 2MB blocks.
+    Random I/O over a large area of a VHD chain may benefit from a larger cache.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aMaxBitmaps     max. number of cached bitmaps per VHD file, 1..65536
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetBitmapCacheSize(TVhdHandle aVhdHandle, uint32_t aMaxBitmaps)
+{
+    DBG_LOG("aVhdHandle:%d, aMaxBitmaps:%d", aVhdHandle, aMaxBitmaps);
+
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
+
+    int nRes = KErrGeneral;
+    try
+    {
+        TVhdAccessGuard accessGuard(*pVhd);
+        nRes = pVhd->SetBitmapCacheSize(aMaxBitmaps);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/*
+    Set the sector allocation bitmaps cache replacement policy for every Dynamic and Differencing VHD in the chain,
+    including parents that will be opened later. The default is EVhdCache_LRU.
+
+    EVhdCache_2Q makes the cache scan-resistant: a bitmap read for the first time is cached in a small "probation" FIFO queue and
+    is evicted from it soon unless it's accessed again after having been evicted recently. Thus, a sequential pass over whole VHD
+    doesn't wipe out the bitmaps of the blocks that are accessed frequently.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aPolicy         replacement policy, see TVhdCachePolicy
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetBitmapCachePolicy(TVhdHandle aVhdHandle, TVhdCachePolicy aPolicy)
+{
+    DBG_LOG("aVhdHandle:%d, aPolicy:%d", aVhdHandle, aPolicy);
+
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
+
+    int nRes = KErrGeneral;
+    try
+    {
+        TVhdAccessGuard accessGuard(*pVhd);
+        nRes = pVhd->SetBitmapCachePolicy(aPolicy);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/*
+    Set the Block Allocation Table cache parameters for every Dynamic and Differencing VHD in the chain, including parents that will be
+    opened later. BAT is read from the file on demand by pages of 2^aPageSizeLog2 sectors, each sector describes 128 blocks; the least
+    recently used pages are evicted when there are aMaxPages pages cached. The default is 8-sector (4K) pages, 16 pages per VHD file.
+    Random I/O over a huge VHD may benefit from more pages; smaller pages save memory when the I/O is scattered over few areas.
+    Changing the page size writes the modified BAT sectors to the media and drops the cached pages.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aPageSizeLog2   Log2(sectors per cache page), 0..5
+	@param	aMaxPages       max. number of cached BAT pages per VHD file, 1..65536
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetBatCacheSize(TVhdHandle aVhdHandle, uint32_t aPageSizeLog2, uint32_t aMaxPages)
+{
+    DBG_LOG("aVhdHandle:%d, aPageSizeLog2:%d, aMaxPages:%d", aVhdHandle, aPageSizeLog2, aMaxPages);
+
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
+
+    int nRes = KErrGeneral;
+    try
+    {
+        TVhdAccessGuard accessGuard(*pVhd);
+        nRes = pVhd->SetBatCacheSize(aPageSizeLog2, aMaxPages);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/*
+    Compact a Dynamic or Differencing VHD file while it stays opened. The blocks that don't have any sectors in use (e.g. discarded by
+    VHD_DiscardSectors()) are taken out of the BAT, the blocks from the end of the file are moved to the free space in front of them,
+    the footer is moved after the last block and the file is truncated. The VHD file remains valid on the media if the operation
+    is interrupted at any point.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open() with VHDF_OPEN_RDWR flag
+	@param	aFlags          a set of VHDF_COMPACT_* flags, 0 by default
+
+	@return	KErrNone on success, KErrNotSupported for Fixed VHDs, negative error code otherwise.
+*/
+int VHD_Compact(TVhdHandle aVhdHandle, uint32_t aFlags)
+{
+    DBG_LOG("aVhdHandle:%d, aFlags:0x%x", aVhdHandle, aFlags);
+
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
+
+    int nRes = KErrGeneral;
+    try
+    {
+        TVhdAccessGuard accessGuard(*pVhd);
+        nRes = pVhd->Compact(aFlags);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/**
+    Defragment the VHD by steps of KDefragStepBlocks blocks, locking the VHD for each step and sleeping between the steps if the
+    data are copied faster than aMaxMBps. The blocks order worked out by the first step is carried to the next ones, see TDefragState.
+    Parameters are the same as for VHD_Defragment()
+*/
+static int Do_VHD_Defragment(TVhdHandle aVhdHandle, uint32_t aMaxBlocks, uint32_t aMaxMBps)
+{
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
+
+    const uint64_t startTime = MonotonicTimeMs();
+
+    uint32_t blocksMoved = 0;
+    uint64_t bytesCopied = 0;
+    TDefragState defragState;
+
+    for(;;)
+    {
+        uint32_t stepBlocks = KDefragStepBlocks;
+        if(aMaxBlocks)
+            stepBlocks = Min(stepBlocks, aMaxBlocks - blocksMoved);
+
+        uint32_t stepMoved = 0;
+        uint64_t stepBytes = 0;
+        int nRes;
+
+        {
+            TVhdAccessGuard accessGuard(*pVhd);
+            nRes = pVhd->Defragment(defragState, stepBlocks, stepMoved, stepBytes);
+        }
+
+        if(nRes <= 0)
+            return nRes; //-- done or error
+
+        ASSERT(stepMoved);
+        blocksMoved += stepMoved;
+        bytesCopied += stepBytes;
+
+        if(aMaxBlocks && blocksMoved >= aMaxBlocks)
+            return nRes;
+
+        if(aMaxMBps)
+        {//-- wait until the average copying rate drops to the limit
+            const uint64_t dueMs     = bytesCopied * 1000 / (((uint64_t)aMaxMBps) << 20);
+            const uint64_t elapsedMs = MonotonicTimeMs() - startTime;
+
+            if(dueMs > elapsedMs)
+                usleep((dueMs - elapsedMs) * 1000);
+        }
+    }
+}
+
+//--------------------------------------------------------------------
+/*
+    Defragment a Dynamic or Differencing VHD file while it stays opened: move the blocks so that their order in the file matches
+    their logical order, thus sequential reads of the VHD become sequential reads of the file. A block is copied to its new place and
+    synced before the BAT refers to it, so the VHD file remains valid on the media if the operation is interrupted at any point;
+    calling the API again continues the defragmentation, even after reopening the VHD. The blocks in the way are moved to the free space
+    after the others, the file may grow by a few blocks meanwhile; it is truncated after the last block when all blocks are in place.
+    The VHD is locked only for a step of a few blocks at a time, so it can be used by other threads while the defragmentation goes on.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open() with VHDF_OPEN_RDWR flag
+	@param	aMaxBlocks      max. number of blocks to put into their places by this call, 0 means no limit
+	@param	aMaxMBps        max. data copying rate, MB per second; 0 means no limit
+
+	@return	number of the blocks that aren't in their places yet, 0 if the VHD is defragmented.
+            KErrNotSupported for Fixed VHDs, negative error code otherwise.
+*/
+int VHD_Defragment(TVhdHandle aVhdHandle, uint32_t aMaxBlocks, uint32_t aMaxMBps)
+{
+    DBG_LOG("aVhdHandle:%d, aMaxBlocks:%d, aMaxMBps:%d", aVhdHandle, aMaxBlocks, aMaxMBps);
+
+    int nRes = KErrGeneral;
+    try
+    {
+        nRes = Do_VHD_Defragment(aVhdHandle, aMaxBlocks, aMaxMBps);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/*
+    Set the size of the host file region preallocated ahead of the blocks appended to a Dynamic or Differencing VHD.
+    When a new block is appended beyond the preallocated region, the file system space for it and for the next aWindowMB megabytes
+    is allocated in one go without changing the file size, so the VHD footer stays at the end of the file and the file gets large
+    contiguous extents instead of growing one block at a time. The space that hasn't been used is released when the VHD is closed.
+    Has no effect on Fixed VHDs, on VHDs opened read-only and on file systems that don't support preallocation. The default is 64MB.
+
+	@param 	aVhdHandle      VHD hadle obtained from VHD_Open()
+	@param	aWindowMB       preallocation window size in MB, 0..4096. 0 disables preallocation and releases the preallocated space.
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetPreallocation(TVhdHandle aVhdHandle, uint32_t aWindowMB)
+{
+    DBG_LOG("aVhdHandle:%d, aWindowMB:%d", aVhdHandle, aWindowMB);
+
+    CVhdFileBase* pVhd = handleMapper.GetPtrByHandle(aVhdHandle);
+    if(!pVhd)
+    {//-- object already closed or invalid descriptor
+        ASSERT(0);
+        return KErrBadHandle;
+    }
+
+    int nRes = KErrGeneral;
+    try
+    {
+        TVhdAccessGuard accessGuard(*pVhd);
+        nRes = pVhd->SetPreallocWindow(aWindowMB);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/*
+    Set the process-wide memory budget for the metadata caches (BAT and sector allocation bitmaps) of all opened VHD files.
+    When a cache needs a new page and the budget is exhausted, it reuses one of its own pages, and the least recently active cache of
+    another VHD file is asked to release some memory. Caches release memory when they are accessed next time, so the actual usage can
+    exceed a lowered budget for a while. One page per cache is always allowed and isn't limited by the budget.
+
+    The per-file limits still apply, @see VHD_SetBitmapCacheSize(), VHD_SetBatCacheSize().
+
+	@param	aBytes          the budget in bytes; 0 means "unlimited", this is the default.
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetCacheBudget(uint64_t aBytes)
+{
+    DBG_LOG("aBytes:%llu", (unsigned long long)aBytes);
+
+    int nRes = KErrGeneral;
+    try
+    {
+        CCacheManager::Instance().SetBudget(aBytes);
+        nRes = KErrNone;
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/*
+    @return number of bytes used by the metadata caches of all opened VHD files. @see VHD_SetCacheBudget()
+*/
+uint64_t VHD_GetCacheUsage()
+{
+    return CCacheManager::Instance().UsedBytes();
+}
+
+//--------------------------------------------------------------------
+/*
+    Enable or disable the process-wide background metadata flusher. When enabled, a thread writes dirty BAT and sector bitmaps
+    of all VHD files opened for writing in background: the metadata of a file is committed when it has been dirty for aMaxAgeMs or
+    aMaxDirtyWrites write calls have left it dirty, whichever comes first. The commit syncs the file data before writing the metadata,
+    as in VHDF_OPMODE_ORDERED mode. A file being accessed by its client is skipped till the next flusher pass.
+
+    The flusher reduces the amount of metadata I/O done by write calls and cache evictions, and in VHDF_OPMODE_WRITEBACK mode
+    it limits the amount of metadata that can be lost on crash.
+
+	@param	aMaxAgeMs       max. time the metadata can stay dirty, in milliseconds. 0 disables this trigger.
+	@param	aMaxDirtyWrites max. number of write calls that left the metadata dirty. 0 disables this trigger.
+                            If both values are 0, the flusher is disabled; this is the default.
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int VHD_SetBackgroundFlush(uint32_t aMaxAgeMs, uint32_t aMaxDirtyWrites)
+{
+    DBG_LOG("aMaxAgeMs:%d, aMaxDirtyWrites:%d", aMaxAgeMs, aMaxDirtyWrites);
+
+    int nRes = KErrGeneral;
+    try
+    {
+        nRes = CMetadataFlusher::Instance().Configure(aMaxAgeMs, aMaxDirtyWrites);
+    }
+	catch(std::exception& e)
+	{
+		DBG_LOG("std::exception:%s", e.what());
+	}
+	catch(...)
+	{
+        DBG_LOG("!!! non-standard exception !!!");
+	}
+
+    return nRes;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file implementation of the process-wide registry of the shared parent VHDs
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "parent_registry.h"
+
+
+//####################################################################
+//#  CParentRegistry class implementation
+//####################################################################
+
+//--------------------------------------------------------------------
+/** @return reference to the single instance of the registry */
+CParentRegistry& CParentRegistry::Instance()
+{
+    static CParentRegistry registry;
+    return registry;
+}
+
+CParentRegistry::CParentRegistry()
+{
+    pthread_mutex_init(&iLock, NULL);
+}
+
+CParentRegistry::~CParentRegistry()
+{
+    pthread_mutex_destroy(&iLock);
+}
+
+//--------------------------------------------------------------------
+/**
+    Get a parent VHD opened read-only. If the parent with the same real path, UUID and mode flags is already opened by another child
+    in this process, it is shared; otherwise the file is opened and registered. Every successful call must be paired with Release().
+
+    The file is opened without holding the registry lock: opening a Differencing parent may need its own parent from the registry.
+    If another thread has opened the same parent meanwhile, its object is used and this one is closed.
+
+    @param  aFileName       path to the parent VHD file
+    @param  aUUID           UUID the child expects the parent to have
+    @param  aModeFlags      open mode flags, must not have VHDF_OPEN_RDWR
+    @param  apVhd           out: the opened parent VHD
+    @param  aNewlyOpened    out: true if the parent has just been opened, false if it is shared with other children
+
+    @return KErrNone on success, KErr_VhdDiff_ParentId if the parent's UUID doesn't match; negative error code otherwise
+*/
+int CParentRegistry::Acquire(const char* aFileName, const uuid_t& aUUID, uint32_t aModeFlags, CVhdFileBase*& apVhd, bool& aNewlyOpened)
+{
+    ASSERT(!(aModeFlags & VHDF_OPEN_RDWR));
+
+    apVhd = NULL;
+    aNewlyOpened = false;
+
+    //-- 1. make the key; the same file can be reached by different paths
+    char realPath[PATH_MAX];
+    if(!realpath(aFileName, realPath))
+        return -errno;
+
+    char uuidStr[40];
+    uuid_unparse(aUUID, uuidStr);
+
+    char modeStr[16];
+    sprintf(modeStr, "%x", aModeFlags);
+
+    std::string strKey = realPath;
+    strKey += '|';
+    strKey += uuidStr;
+    strKey += '|';
+    strKey += modeStr;
+
+    //-- 2. look for the parent opened by another child
+    pthread_mutex_lock(&iLock);
+
+    TEntries::iterator it = iEntries.find(strKey);
+    if(it != iEntries.end())
+    {
+        it->second.iRefCnt++;
+        apVhd = it->second.ipVhd;
+        pthread_mutex_unlock(&iLock);
+
+        DBG_LOG("CParentRegistry::Acquire() shared '%s'", realPath);
+        return KErrNone;
+    }
+
+    pthread_mutex_unlock(&iLock);
+
+    //-- 3. open the parent VHD and check that this is the one the child expects
+    int nRes;
+    CAutoClosePtr<CVhdFileBase> pVhd(CVhdFileBase::CreateFromFile(realPath, aModeFlags, nRes));
+
+    if(!pVhd.get())
+    {
+        ASSERT(nRes < 0);
+        return nRes;
+    }
+
+    nRes = pVhd->Open();
+    if(nRes != KErrNone)
+    {
+        ASSERT(nRes < 0);
+        return nRes;
+    }
+
+    /*
+    strange enough, parent's time stamp seems to be ignored by VPC (though specs say that it should be checked). Don't check it.
+    */
+    if(uuid_compare(aUUID, pVhd->Footer().UUID()) != 0)
+    {
+        DBG_LOG("Parent & Diff VHDs UUID mismatch!");
+        return KErr_VhdDiff_ParentId;
+    }
+
+    //-- 4. register the parent, unless another thread has done it meanwhile
+    pthread_mutex_lock(&iLock);
+
+    it = iEntries.find(strKey);
+    if(it != iEntries.end())
+    {
+        it->second.iRefCnt++;
+        apVhd = it->second.ipVhd;
+    }
+    else
+    {
+        it = iEntries.insert(TEntries::value_type(strKey, TEntry())).first;
+
+        TEntry& entry = it->second;
+        entry.ipVhd   = pVhd.release();
+        entry.iRefCnt = 1;
+
+        iIndex[entry.ipVhd] = it;
+
+        apVhd = entry.ipVhd;
+        aNewlyOpened = true;
+    }
+
+    pthread_mutex_unlock(&iLock);
+
+    DBG_LOG("CParentRegistry::Acquire() opened '%s', new:%d", realPath, aNewlyOpened);
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Release the parent VHD got by Acquire(). The last release closes and deletes the parent VHD object.
+    The caller must not hold the parent's access lock.
+
+    @param  apVhd   the parent VHD
+*/
+void CParentRegistry::Release(CVhdFileBase* apVhd)
+{
+    ASSERT(apVhd);
+
+    pthread_mutex_lock(&iLock);
+
+    TEntryIndex::iterator idxIt = iIndex.find(apVhd);
+    if(idxIt == iIndex.end())
+    {
+        ASSERT(0);
+        pthread_mutex_unlock(&iLock);
+        return;
+    }
+
+    TEntries::iterator it = idxIt->second;
+    ASSERT(it->second.ipVhd == apVhd);
+
+    if(--it->second.iRefCnt)
+    {
+        pthread_mutex_unlock(&iLock);
+        return;
+    }
+
+    iEntries.erase(it);
+    iIndex.erase(idxIt);
+    pthread_mutex_unlock(&iLock);
+
+    //-- nobody else can get this object now; closing a Differencing parent releases its own parent
+    DBG_LOG("CParentRegistry::Release() closing '%s'", apVhd->FilePath());
+    apVhd->Close();
+    delete apVhd;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file process-wide registry of the parent VHDs shared by the chains of Differencing VHDs
+*/
+
+
+#ifndef __PARENT_REGISTRY_H__
+#define __PARENT_REGISTRY_H__
+
+#include <pthread.h>
+
+#include "vhd.h"
+
+//--------------------------------------------------------------------
+/**
+    Process-wide registry of the parent VHD objects opened read-only by the Differencing VHDs. A parent used by many chains,
+    e.g. a "golden image" under many desktops' VHDs, is opened once: its file descriptor, BAT and sector bitmap caches are shared
+    by all the chains opened in the process.
+
+    The parents are keyed by the real file path, the UUID expected by the child and the open mode flags; they are reference
+    counted and closed when the last child releases them. A shared parent can be accessed by several client threads at once,
+    all access to it must be done under its access lock, @see TVhdChainGuard
+
+    Thread-safe, there is only one instance of this class, @see Instance()
+*/
+class CParentRegistry
+{
+ public:
+    static CParentRegistry& Instance();
+
+    int  Acquire(const char* aFileName, const uuid_t& aUUID, uint32_t aModeFlags, CVhdFileBase*& apVhd, bool& aNewlyOpened);
+    void Release(CVhdFileBase* apVhd);
+
+ private:
+    CParentRegistry();
+   ~CParentRegistry();
+    CParentRegistry(const CParentRegistry&);
+    CParentRegistry& operator=(const CParentRegistry&);
+
+    /** a shared parent VHD */
+    struct TEntry
+    {
+        CVhdFileBase*   ipVhd;      ///< opened parent VHD object
+        uint32_t        iRefCnt;    ///< number of children using it
+    };
+
+    typedef map<std::string, TEntry> TEntries;
+    typedef map<const CVhdFileBase*, TEntries::iterator> TEntryIndex;
+
+ private:
+    pthread_mutex_t iLock;      ///< protects the entries
+    TEntries        iEntries;   ///< shared parents by the key made of the real path, UUID and mode flags
+    TEntryIndex     iIndex;     ///< iEntries by the parent VHD object, for Release()
+};
+
+
+#endif //__PARENT_REGISTRY_H__
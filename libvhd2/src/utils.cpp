@@ -23,6 +23,8 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdexcept>
 
 #include "vhd.h"
@@ -310,6 +312,125 @@ uint32_t VHD_Time(time_t aTime /*=(time_t)-1*/)
 	return (uint32_t)(aTime - micro_epoch);
 }
 
+//-----------------------------------------------------------------------------
+/**
+    @return monotonic clock value in milliseconds, not affected by the system time changes. Only the differences make sense.
+*/
+uint64_t MonotonicTimeMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+//-----------------------------------------------------------------------------
+/**
+    Make a region of the file read as zeroes without writing the data, so that file systems like ext4 or xfs only update
+    their metadata. The file is extended if the region goes beyond its end.
+
+    fallocate(FALLOC_FL_ZERO_RANGE) is tried first, it keeps the region allocated. If it isn't supported, the region
+    is preallocated (this extends the file) and then deallocated by punching a hole.
+
+    @param  aFd     file descriptor
+    @param  aPos    start position of the region, in bytes
+    @param  aLen    region length, in bytes
+
+    @return KErrNone on success
+            KErrNotSupported if the file system can't do it, the caller should write zeroes
+            negative error code otherwise
+*/
+int ZeroFileRange(int aFd, uint64_t aPos, uint64_t aLen)
+{
+    if(!aLen)
+        return KErrNone;
+
+#if defined(FALLOC_FL_ZERO_RANGE) && defined(FALLOC_FL_PUNCH_HOLE)
+
+    if(fallocate64(aFd, FALLOC_FL_ZERO_RANGE, aPos, aLen) == 0)
+        return KErrNone;
+
+    if(errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL)
+        return -errno; //-- e.g. ENOSPC, writing zeroes won't help
+
+    if(fallocate64(aFd, 0, aPos, aLen) == 0 &&
+       fallocate64(aFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, aPos, aLen) == 0)
+    {
+        return KErrNone;
+    }
+
+    if(errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL)
+        return -errno;
+
+#endif
+
+    return KErrNotSupported;
+}
+
+//-----------------------------------------------------------------------------
+/**
+    Allocate the file system space for a region of the file without changing the file size, so that the region can be written
+    later without allocating. Can be used beyond the end of the file, then the file system can give it large contiguous extents.
+    Truncating the file to its size releases the space preallocated beyond its end.
+
+    @param  aFd     file descriptor
+    @param  aPos    start position of the region, in bytes
+    @param  aLen    region length, in bytes
+
+    @return KErrNone on success
+            KErrNotSupported if the file system can't do it
+            negative error code otherwise
+*/
+int PreallocFileRange(int aFd, uint64_t aPos, uint64_t aLen)
+{
+    if(!aLen)
+        return KErrNone;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+
+    if(fallocate64(aFd, FALLOC_FL_KEEP_SIZE, aPos, aLen) == 0)
+        return KErrNone;
+
+    if(errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL)
+        return -errno;
+
+#endif
+
+    return KErrNotSupported;
+}
+
+//-----------------------------------------------------------------------------
+/**
+    Deallocate a region of the file by punching a hole in it, without changing the file size. The region reads as zeroes
+    afterwards and its space is given back to the file system. Only the host file system blocks that are entirely
+    within the region are deallocated, so the region is better aligned to the file system block size.
+
+    @param  aFd     file descriptor
+    @param  aPos    start position of the region, in bytes
+    @param  aLen    region length, in bytes
+
+    @return KErrNone on success
+            KErrNotSupported if the file system can't do it
+            negative error code otherwise
+*/
+int PunchFileHole(int aFd, uint64_t aPos, uint64_t aLen)
+{
+    if(!aLen)
+        return KErrNone;
+
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+
+    if(fallocate64(aFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, aPos, aLen) == 0)
+        return KErrNone;
+
+    if(errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL)
+        return -errno;
+
+#endif
+
+    return KErrNotSupported;
+}
+
 //####################################################################
 //# class CBitVector implementation
 //####################################################################
@@ -614,7 +735,7 @@ bool CBitVector::IsFilledWith(uint32_t aIndexFrom, uint32_t aIndexTo, uint32_t a
 
     if(aIndexFrom == aIndexTo)
     {
-        return operator[](aIndexFrom);
+        return (operator[](aIndexFrom) != 0) == (aVal != 0);
     }
 
     //-- swap indexes if they are not in order
@@ -1108,3 +1229,111 @@ bool TBitExtentFinder::FindExtent()
 
 
 
+
+//####################################################################
+//# class TIoVecBuf implementation
+//####################################################################
+
+/** Constructor. Creates an empty buffer */
+TIoVecBuf::TIoVecBuf()
+          :ipIov(NULL), iIovCnt(0), iCurrIov(0), iCurrOffset(0), iSize(0)
+{
+    FillZ(iSingleIov);
+}
+
+/**
+    Constructor.
+    @param  apBuf   pointer to the contiguous buffer
+    @param  aBytes  buffer size in bytes
+*/
+TIoVecBuf::TIoVecBuf(void* apBuf, size_t aBytes)
+          :ipIov(NULL), iIovCnt(1), iCurrIov(0), iCurrOffset(0), iSize(aBytes)
+{
+    iSingleIov.iov_base = apBuf;
+    iSingleIov.iov_len  = aBytes;
+
+    DoSkipEmptySegments();
+}
+
+/**
+    Constructor.
+    @param  apIov   pointer to the array of iovecs describing the buffer
+    @param  aIovCnt number of elements in the array
+*/
+TIoVecBuf::TIoVecBuf(const iovec* apIov, uint32_t aIovCnt)
+          :ipIov(apIov), iIovCnt(aIovCnt), iCurrIov(0), iCurrOffset(0), iSize(0)
+{
+    ASSERT(apIov || !aIovCnt);
+    FillZ(iSingleIov);
+
+    for(uint32_t i=0; i<aIovCnt; ++i)
+        iSize += apIov[i].iov_len;
+
+    DoSkipEmptySegments();
+}
+
+/** @return pointer to the current position in the buffer */
+uint8_t* TIoVecBuf::Ptr() const
+{
+    ASSERT(iSize);
+    return (uint8_t*)Iov(iCurrIov).iov_base + iCurrOffset;
+}
+
+/** @return number of bytes from the current position to the end of the current contiguous memory segment */
+size_t TIoVecBuf::SegLen() const
+{
+    if(!iSize)
+        return 0;
+
+    return Iov(iCurrIov).iov_len - iCurrOffset;
+}
+
+/**
+    Move the current position forward.
+    @param  aBytes  number of bytes to skip, must not exceed Size()
+*/
+void TIoVecBuf::Advance(size_t aBytes)
+{
+    ASSERT(aBytes <= iSize);
+
+    while(aBytes && iSize)
+    {
+        const size_t bytes = Min(aBytes, SegLen());
+
+        iCurrOffset += bytes;
+        iSize  -= bytes;
+        aBytes -= bytes;
+
+        DoSkipEmptySegments();
+    }
+}
+
+/**
+    Fill a part of the buffer with the given byte, starting from the current position. The position doesn't change.
+    @param  aBytes  number of bytes to fill, must not exceed Size()
+    @param  aFill   filling byte
+*/
+void TIoVecBuf::Fill(size_t aBytes, uint8_t aFill) const
+{
+    ASSERT(aBytes <= iSize);
+    TIoVecBuf buf(*this);
+
+    while(aBytes && buf.Size())
+    {
+        const size_t bytes = Min(aBytes, buf.SegLen());
+        memset(buf.Ptr(), aFill, bytes);
+
+        buf.Advance(bytes);
+        aBytes -= bytes;
+    }
+}
+
+/** move the current position to the next non-empty segment if the current one is exhausted */
+void TIoVecBuf::DoSkipEmptySegments()
+{
+    while(iCurrIov < iIovCnt && iCurrOffset >= Iov(iCurrIov).iov_len)
+    {
+        ++iCurrIov;
+        iCurrOffset = 0;
+    }
+}
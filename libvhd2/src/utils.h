@@ -33,6 +33,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <asm-generic/errno-base.h>
+#include <sys/uio.h>
 
 #include <vector>
 using std::vector;
@@ -200,6 +201,11 @@ int ASCII_to_UNICODE(const void* apDataIn, void* apDataOut, size_t aOutBufSize,
 
 void VHD_Time_To_String(uint32_t aVhdTimeStamp, char *apBuf, size_t aBufLen);
 uint32_t VHD_Time(time_t aTime = (time_t)-1);
+uint64_t MonotonicTimeMs();
+
+int ZeroFileRange(int aFd, uint64_t aPos, uint64_t aLen);
+int PreallocFileRange(int aFd, uint64_t aPos, uint64_t aLen);
+int PunchFileHole(int aFd, uint64_t aPos, uint64_t aLen);
 
 //####################################################################
 /**
@@ -432,6 +438,44 @@ class TBitExtentFinder
 
 };
 
+//####################################################################
+/**
+    Describes a data buffer for the sectors read/write operations: a scatter-gather list of iovecs and a current position in it.
+    A single contiguous buffer is represented as a list of one element.
+    Doesn't own the memory it refers to, the iovecs array must be valid during this object lifetime.
+    Copying is cheap, a copy has its own current position.
+*/
+class TIoVecBuf
+{
+ public:
+    TIoVecBuf();
+    TIoVecBuf(void* apBuf, size_t aBytes);
+    TIoVecBuf(const iovec* apIov, uint32_t aIovCnt);
+
+    size_t   Size() const   {return iSize;} ///< @return number of bytes from the current position to the end of the buffer
+    uint8_t* Ptr() const;
+    size_t   SegLen() const;
+
+    /** @return true if aBytes from the current position are in the same contiguous memory segment */
+    bool IsContiguous(size_t aBytes) const {return aBytes <= SegLen();}
+
+    void Advance(size_t aBytes);
+    void Fill(size_t aBytes, uint8_t aFill) const;
+
+ private:
+    /** @return iovec by index */
+    const iovec& Iov(uint32_t aIdx) const {return ipIov ? ipIov[aIdx] : iSingleIov;}
+    void DoSkipEmptySegments();
+
+ private:
+    const iovec* ipIov;     ///< iovecs array, NULL if the buffer is described by iSingleIov
+    uint32_t    iIovCnt;    ///< number of elements in the array
+    iovec       iSingleIov; ///< describes a single contiguous buffer
+    uint32_t    iCurrIov;   ///< current iovec index
+    size_t      iCurrOffset;///< current position in the current iovec
+    size_t      iSize;      ///< number of bytes from the current position to the end of the buffer
+};
+
 
 #include "utils.inl"
 
@@ -26,8 +26,18 @@
 
 #include <iconv.h>
 #include <limits.h>
+#include <pthread.h>
 #include <string>
 
+#include <set>
+using std::set;
+
+#include <map>
+using std::map;
+
+#include <deque>
+using std::deque;
+
 #include "utils.h"
 #include "../include/libvhd2.h"
 //--------------------------------------------------------------------
@@ -42,9 +52,63 @@
 const uint32_t KDefScratchBufSize = 128*K1KiloByte;
 
 
-/** Max. number of SectorBitmaps cached in their LRU cache  */
+/** Default max. number of SectorBitmaps cached in their LRU cache, can be changed at runtime. @see VHD_SetBitmapCacheSize() */
 const uint32_t KMaxCached_SectorBitmaps = 64;
 
+/** Upper limit of the SectorBitmaps LRU cache size */
+const uint32_t KMaxCached_SectorBitmaps_Limit = 64*1024;
+
+/**
+    Max. number of blocks whose parent chain runs are cached by a Differencing VHD, the oldest ones are evicted first.
+    @see CVhdFileDiff::DoGetChainRuns()
+*/
+const uint32_t KMaxCached_ChainRunBlocks = 4096;
+
+/**
+    Max. number of evicted dirty SectorBitmaps waiting in the write-back queue. Evicting a dirty bitmap doesn't write it immediately;
+    when the queue is full, all queued bitmaps are written by a single batch of requests.
+*/
+const uint32_t KMaxDirtyBmpVictims = 8;
+
+/**
+    Default BAT cache page size, Log2(sectors), can be changed at runtime. @see VHD_SetBatCacheSize()
+    BAT is read from the media and cached by pages of this size on demand. 3 gives 4K pages, every page describes 1024 blocks.
+*/
+const uint32_t KBatCache_PageSizeLog2 = 3;
+
+/** Upper limit of the BAT cache page size, Log2(sectors); the page dirty sectors mask is 32 bits */
+const uint32_t KBatCache_PageSizeLog2_Limit = 5;
+
+/** Default max. number of BAT pages cached in their LRU cache per VHD file, can be changed at runtime. @see VHD_SetBatCacheSize() */
+const uint32_t KBatCache_MaxPages = 16;
+
+/** Upper limit of the BAT pages LRU cache size */
+const uint32_t KBatCache_MaxPages_Limit = 64*1024;
+
+/** Max. number of asynchronous I/O requests in flight (submitted and not collected yet) per VHD handle. @see VHD_SubmitIo() */
+const uint32_t KMaxAsyncIo_Requests = 256;
+
+/** Max. number of allocating asynchronous write requests that can wait for a single metadata group commit. @see VHDF_OPMODE_ORDERED */
+const uint32_t KMaxGroupCommit_Requests = 64;
+
+/** Min. interval between metadata commits caused by the block allocations in "writeback" mode. @see VHDF_OPMODE_WRITEBACK */
+const uint32_t KWriteback_CommitIntervalMs = 5000;
+
+/** Interval between the background metadata flusher passes. @see VHD_SetBackgroundFlush() */
+const uint32_t KMetadataFlusher_PollMs = 100;
+
+/** Default size of the host file region preallocated ahead of the appended blocks, in MB. @see VHD_SetPreallocation() */
+const uint32_t KDefPreallocWindowMB = 64;
+
+/** Max. size of the preallocation window, in MB */
+const uint32_t KMaxPreallocWindowMB = 4096;
+
+/**
+    Max. number of blocks put into their places by one defragmentation step. The VHD is locked for the step duration,
+    the other threads can access it between the steps. @see VHD_Defragment()
+*/
+const uint32_t KDefragStepBlocks = 8;
+
 
 /**
     controls how blocks are created for the Dynamic VHDs.
@@ -97,6 +161,7 @@ const uint32_t KDefSecPerBlockLog2 = 12;            ///< Log2(sectors per block)
 typedef uint32_t TBatEntry;                     ///< BAT entry type, 32 bits
 const TBatEntry KBatEntry_Unused = 0xFFFFFFFF;  ///< unused BAT entry value
 const TBatEntry KBatEntry_Invalid= 0x00;        ///< specifies invalid BAT entry
+const uint32_t  KBatEntrySizeLog2 = 2;          ///< Log2(sizeof(TBatEntry))
 
 
 const char KPathDelim = '/';
@@ -401,7 +466,58 @@ class TChkSum
 
 
 
+//--------------------------------------------------------------------
+/**
+    A helper class that fills in a client's array of TVhdExtent structures. @see VHD_MapExtents()
+    Logically adjacent extents of the same kind that are also adjacent in the file are merged into one.
+    Once the array has no room for an extent, the list becomes "overflown" and doesn't accept any more extents.
+*/
+class TVhdExtentList
+{
+ public:
+    TVhdExtentList(TVhdExtent* apExtents, uint32_t aMaxExtents);
+
+    bool Add(TVhdExtentKind aKind, uint32_t aStartSector, uint32_t aSectors, uint32_t aLayer, int aFd, uint64_t aFileOffset);
+
+    uint32_t Count() const  {return iCount;}     ///< @return number of extents in the list
+    bool Full() const       {return iCount >= iMaxExtents;} ///< @return true if there is no room for a new extent; it can still be merged with the last one
+    bool Overflown() const  {return iOverflown;} ///< @return true if some extent couldn't be added because the array is full
+
+ private:
+    TVhdExtentList();
+    TVhdExtentList(const TVhdExtentList&);
+    TVhdExtentList& operator=(const TVhdExtentList&);
+
+ private:
+    TVhdExtent* ipExtents;  ///< client's array of extents
+    uint32_t    iMaxExtents;///< array size
+    uint32_t    iCount;     ///< number of extents filled in
+    bool        iOverflown; ///< true if the array ran out of room
+};
+
+//--------------------------------------------------------------------
+/**
+    Defragmentation state carried between the steps of one VHD_Defragment() call, so that the BAT is scanned once rather than
+    by every step. It is worked out again if the BAT changes between the steps. @see CVhdDynDiffBase::Defragment()
+*/
+struct TDefragState
+{
+    TDefragState() :iValid(false), iNextIdx(0), iBlocksLeft(0), iBatChanges(0) {}
+
+    /** the blocks in the file, their starting sectors to the logical block numbers */
+    typedef map<TBatEntry, uint32_t> TBlockPlaces;
+
+    bool             iValid;        ///< true if the members below are worked out
+    vector<uint32_t> iLogicalOrder; ///< numbers of the blocks present in the BAT, in the logical order
+    TBlockPlaces     iPlaces;       ///< places of the blocks in the file
+    size_t           iNextIdx;      ///< the blocks in iLogicalOrder in front of this index are in their places
+    uint32_t         iBlocksLeft;   ///< number of the blocks that aren't in their places yet
+    uint32_t         iBatChanges;   ///< CBat::Changes() value the state is coherent with
+};
+
 
+class CAsyncIoQueue;
+class CIoEngine;
 //--------------------------------------------------------------------
 /**
     An abstract base class for various VHDs handling classes
@@ -419,12 +535,30 @@ class CVhdFileBase
     virtual int  Open();
     virtual void Close(bool aForceClose = false);
     virtual int Flush();
+    virtual int CommitMetadata();
     virtual void InvalidateCache(bool aIgnoreDirty=false);
 
-    virtual int ReadSectors(uint32_t aStartSector, int aSectors, void* apBuffer, uint32_t aBufSize) = 0;
-    virtual int WriteSectors(uint32_t aStartSector, int aSectors, const void* apBuffer, uint32_t aBufSize) = 0;
+    int ReadSectors(uint32_t aStartSector, int aSectors, void* apBuffer, uint32_t aBufSize);
+    int WriteSectors(uint32_t aStartSector, int aSectors, const void* apBuffer, uint32_t aBufSize);
+    virtual int ReadSectorsV(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf) = 0;
+    virtual int WriteSectorsV(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf) = 0;
     virtual int DiscardSectors(uint32_t aStartSector, int aSectors) = 0;
 
+    virtual int MapExtents(uint32_t aStartSector, int aSectors, bool aAllocate, TVhdExtentList& aList, uint32_t aLayer) = 0;
+    virtual int CommitExtents(uint32_t aStartSector, int aSectors) = 0;
+
+    /** a run of logical sectors of a single VHD file in a chain. @see MapLayerRun() */
+    struct TLayerRun
+    {
+        bool     iPresent;      ///< true if the sectors are in this file; false if they come from the parent VHD or read as zeroes
+        uint32_t iSectors;      ///< number of sectors in the run
+        uint32_t iFileSector;   ///< starting sector of the run data in the file, valid if iPresent is true
+    };
+
+    virtual int MapLayerRun(uint32_t aStartSector, uint32_t aSectors, TLayerRun& aRun) = 0;
+
+    /** @return counter of the changes of where the sectors are in the file; cached MapLayerRun() results are stale when it changes. A fixed VHD never changes it */
+    virtual uint32_t LayoutChanges() const {return 0;}
 
     virtual void PrintInfo(std::string& aStr) const;
     virtual int GetInfo(TVHD_Params& aVhdInfo, uint32_t aParentNo) const;
@@ -434,13 +568,42 @@ class CVhdFileBase
     virtual int CoalesceDataIn(uint32_t aVhdChainLength) {Fault(EMustNotBeCalled);}
     virtual const CVhdFileBase* GetParentOpened(uint32_t aParentNo);
     virtual int ChangeParentVHD(const char *aNewParentFileName) {Fault(EMustNotBeCalled);}
+    virtual int SetBitmapCacheSize(uint32_t aMaxPages);
+    virtual int SetBitmapCachePolicy(TVhdCachePolicy aPolicy);
+    virtual int SetBatCacheSize(uint32_t aPageSizeLog2, uint32_t aMaxPages);
+    virtual int SetPreallocWindow(uint32_t aWindowMB);
+    virtual int Compact(uint32_t aFlags) {return KErrNotSupported;}
+    virtual int Defragment(TDefragState& aState, uint32_t aMaxBlocks, uint32_t& aBlocksMoved, uint64_t& aBytesCopied) {return KErrNotSupported;}
 
 
 
+    /** durability modes, see VHDF_OPMODE_DURABILITY_MASK */
+    enum TDurability
+    {
+        EDurability_Default = 0,    ///< metadata is flushed on the block allocation
+        EDurability_WriteBack,      ///< VHDF_OPMODE_WRITEBACK
+        EDurability_Ordered,        ///< VHDF_OPMODE_ORDERED
+        EDurability_WriteThrough    ///< VHDF_OPMODE_WRITETHROUGH
+    };
+
     //-- non-virtual API
     inline bool ReadOnly() const;
     inline bool BlockPureMode() const;
     inline bool TrimEnabled() const;
+    inline bool GroupCommit() const;
+    inline TDurability Durability() const;
+    int SetMode(uint32_t aModeFlags);
+
+    //-- serialising access between the client and the background metadata flusher, @see TVhdAccessGuard
+    //-- and between the chains sharing a parent VHD, @see TVhdChainGuard
+    void LockAccess() const     {pthread_mutex_lock(&iAccessLock);}
+    void UnlockAccess() const   {pthread_mutex_unlock(&iAccessLock);}
+    bool TryLockAccess()    {return pthread_mutex_trylock(&iAccessLock) == 0;}
+
+    bool MetadataFlushDue(uint32_t aMaxAgeMs, uint32_t aMaxDirtyWrites) const;
+
+    void SetCommitDeferred(bool aDefer) {iCommitDeferred = aDefer;} ///< defer committing metadata of the allocated blocks, see CommitMetadata()
+    bool CommitPending() const {return iCommitPending;}             ///< @return true if there are allocations waiting for CommitMetadata()
 
     const TVhdFooter& Footer() const {return iFooter;}
     inline uint32_t VhdSizeInSectors() const;
@@ -454,6 +617,10 @@ class CVhdFileBase
     static CVhdFileBase* CreateFromFile(const char *aFileName, uint32_t aModeFlags, int& aErrCode);
     static int GenerateFile(TVHD_Params& aParams);
 
+    //-- asynchronous I/O support
+    int  GetAsyncIoQueue(CAsyncIoQueue*& apQueue);
+    void WaitAsyncIoIdle();
+    void CloseAsyncIoQueue();
 
 
     //-- low-level disk access internal interface, not a public API.
@@ -461,6 +628,16 @@ class CVhdFileBase
     int DoRaw_WriteData(uint32_t aStartSector, int aBytes, const void* apBuffer) const;
     int DoRaw_FillMedia(uint32_t aStartSector, uint32_t aSectors, uint8_t aFill) const;
     int DoRaw_CheckMediaFill(uint32_t aStartSector, uint32_t aSectors, uint8_t aFill) const;
+    int DoRaw_PunchHole(uint32_t aStartSector, uint32_t aSectors);
+
+    int DoRaw_ReadDataV (uint32_t aStartSector, int aBytes, const TIoVecBuf& aBuf) const;
+    int DoRaw_WriteDataV(uint32_t aStartSector, int aBytes, const TIoVecBuf& aBuf) const;
+
+    void DoRaw_QueueRead (uint32_t aStartSector, int aBytes, const TIoVecBuf& aBuf) const;
+    void DoRaw_QueueWrite(uint32_t aStartSector, int aBytes, const TIoVecBuf& aBuf) const;
+    void DoRaw_QueueReadGap(uint32_t aStartSector, uint32_t aBytes) const;
+    int  DoRaw_SubmitBatch() const;
+    int  DoRaw_DataBarrier() const;
 
 
 
@@ -485,13 +662,20 @@ class CVhdFileBase
     //--
 
     uint32_t ModeFlags() const {return iModeFlags;}
+    int FileDesc() const {return iFileDesc;}
     uint32_t SectorSzLog2() const {return KDefSecSizeLog2;}
     uint32_t SectorSize()   const {return KDefSecSize;}
 
     //--
-    int DoCheckRW_Args(uint32_t aStartSector, int aSectors, uint32_t aBufSize) const;
+    int DoCheckRW_Args(uint32_t aStartSector, int aSectors, size_t aBufSize) const;
     int GetFileSize(uint64_t& aFileSize) const;
 
+    int  DoSyncData() const;
+    int  DoAllocationCommit();
+    void DoCommitCompleted();
+    void DoNoteMetadataDirty();
+    void SetCommitPending(bool aPending) {iCommitPending = aPending;}
+
 
 
 
@@ -508,6 +692,60 @@ class CVhdFileBase
     uint32_t    iModeFlags; ///< open/operational mode bit flags
     uint32_t    iVhdSizeSec;///< VHD size in sectors, based on CHS value from VHD Footer. Not a real file size!
     TVhdFooter  iFooter;    ///< VHD Footer
+
+    CAsyncIoQueue* ipAsyncIo;///< asynchronous I/O requests queue, created on demand. NULL if not used. Protected by iAsyncIoLock
+    pthread_mutex_t iAsyncIoLock;///< protects ipAsyncIo
+    CIoEngine*  ipIoEngine; ///< I/O engine that performs raw file access, exists while the file is opened
+    uint32_t    iHostBlkSize;///< host file system block size, the holes are punched in units of it. 0 if holes can't be punched
+
+    bool        iCommitDeferred;///< if true, allocations only mark metadata as pending for CommitMetadata()
+    bool        iCommitPending; ///< true if there are allocated blocks whose metadata hasn't been committed yet
+    uint64_t    iLastCommitMs;  ///< time of the last metadata commit, see MonotonicTimeMs()
+
+    mutable pthread_mutex_t iAccessLock;///< held by the thread accessing this object, see LockAccess()
+    uint32_t    iDirtyWrites;   ///< number of write calls that left the metadata dirty since the last commit
+    uint64_t    iDirtySinceMs;  ///< time the metadata became dirty after the last commit, valid if iDirtyWrites != 0
+};
+
+//--------------------------------------------------------------------
+/**
+    Locks the VHD object access for the client for the life time of the guard. Waits for the asynchronous I/O requests to complete
+    first, so that the guard can be used before any synchronous access to the object, @see CVhdFileBase::WaitAsyncIoIdle()
+*/
+class TVhdAccessGuard
+{
+ public:
+    explicit TVhdAccessGuard(CVhdFileBase& aVhd) :iVhd(aVhd) {iVhd.WaitAsyncIoIdle(); iVhd.LockAccess();}
+   ~TVhdAccessGuard() {iVhd.UnlockAccess();}
+
+ private:
+    TVhdAccessGuard(const TVhdAccessGuard&);
+    TVhdAccessGuard& operator=(const TVhdAccessGuard&);
+
+ private:
+    CVhdFileBase& iVhd; ///< the object being accessed
+};
+
+//--------------------------------------------------------------------
+/**
+    Locks the parent VHDs of a chain for the life time of the guard; the parents can be shared with other chains in the process,
+    @see CParentRegistry. The parents must be locked in the order from the "Tail" towards the "Head", so that the chains sharing
+    a part of them can't deadlock; the locks are released in the reverse order.
+*/
+class TVhdChainGuard
+{
+ public:
+    TVhdChainGuard() {}
+   ~TVhdChainGuard() {for(size_t i=iLocked.size(); i; --i) iLocked[i-1]->UnlockAccess();}
+
+    void Lock(const CVhdFileBase& aVhd) {aVhd.LockAccess(); iLocked.push_back(&aVhd);}  ///< lock the next parent towards the "Head"
+
+ private:
+    TVhdChainGuard(const TVhdChainGuard&);
+    TVhdChainGuard& operator=(const TVhdChainGuard&);
+
+ private:
+    vector<const CVhdFileBase*> iLocked; ///< locked objects in the order of locking
 };
 
 
@@ -531,8 +769,20 @@ class CVhdDynDiffBase : public CVhdFileBase
     inline uint32_t SectorsPerBlockLog2() const;
     inline uint32_t SectorsPerBlock() const;
 
-    virtual int ReadSectors(uint32_t aStartSector, int aSectors, void* apBuffer, uint32_t aBufSize);
-    virtual int WriteSectors(uint32_t aStartSector, int aSectors, const void* apBuffer, uint32_t aBufSize);
+    virtual int ReadSectorsV(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf);
+    virtual int WriteSectorsV(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf);
+
+    virtual int MapExtents(uint32_t aStartSector, int aSectors, bool aAllocate, TVhdExtentList& aList, uint32_t aLayer);
+    virtual int CommitExtents(uint32_t aStartSector, int aSectors);
+    virtual int MapLayerRun(uint32_t aStartSector, uint32_t aSectors, TLayerRun& aRun);
+    virtual uint32_t LayoutChanges() const;
+
+    virtual int SetBitmapCacheSize(uint32_t aMaxPages);
+    virtual int SetBitmapCachePolicy(TVhdCachePolicy aPolicy);
+    virtual int SetBatCacheSize(uint32_t aPageSizeLog2, uint32_t aMaxPages);
+    virtual int SetPreallocWindow(uint32_t aWindowMB);
+    virtual int Compact(uint32_t aFlags);
+    virtual int Defragment(TDefragState& aState, uint32_t aMaxBlocks, uint32_t& aBlocksMoved, uint64_t& aBytesCopied);
 
  protected:
     CVhdDynDiffBase(const TVhdFooter* apFooter, const TVhdHeader* apHeader);
@@ -541,6 +791,7 @@ class CVhdDynDiffBase : public CVhdFileBase
     virtual int  Open();
     virtual void Close(bool aForceClose = false);
     virtual int Flush();
+    virtual int CommitMetadata();
     virtual void InvalidateCache(bool aIgnoreDirty = false);
 
     virtual void PrintInfo(std::string& aStr) const;
@@ -555,15 +806,16 @@ class CVhdDynDiffBase : public CVhdFileBase
     inline uint32_t SectorInBlock(uint32_t aSectorNumber) const;
     bool BlockNumberValid(uint32_t aLogicalBlockNumber) const;
 
-    int AppendBlock(TBatEntry& aBlockSector, bool aSecBmpFill, bool aZeroFillData);
+    int AppendBlock(TBatEntry& aBlockSector, bool aSecBmpFill, bool aZeroFillData, const TIoVecBuf* apData = NULL);
+    int AllocateBlock(uint32_t aBlockNumber, TBatEntry& aBlockSector, bool aSecBmpFill, bool aZeroFillData, const TIoVecBuf* apData = NULL);
 
     /** an internal helper structure describing some parameters for reading/writing sector extents from blocks*/
     struct TBlkOpParams
     {
-        TBlkOpParams() {FillZ(*this);}
+        TBlkOpParams() :iCurrBlock(0), iCurrSectorL(0), iNumSectors(0), iFlushMetadata(0) {}
 
         uint32_t iCurrBlock;    ///< current block number we are dealing with
-        uint8_t* ipData;        ///< pointer to the external buffer
+        TIoVecBuf iData;        ///< external buffer, its current position corresponds to iCurrSectorL
         uint32_t iCurrSectorL;  ///< current logical sector of the VHD
         uint32_t iNumSectors;   ///< number of sectors to process in the single block
         uint32_t iFlushMetadata;///< true if we need to flush metadata (applicable to write ops only)
@@ -572,6 +824,55 @@ class CVhdDynDiffBase : public CVhdFileBase
     virtual int DoReadSectorsFromBlock(TBlkOpParams &aParams) = 0;
     virtual int DoWriteSectorsToBlock(TBlkOpParams &aParams) = 0;
 
+    virtual int DoAllocateBlock(uint32_t aBlockNumber, uint32_t aStartSectorL, uint32_t aSectors, TBatEntry& aBlockSector, bool& aSetAllBmpBits) = 0;
+    virtual int DoMapUnallocated(uint32_t aStartSector, uint32_t aSectors, TVhdExtentList& aList, uint32_t aLayer) = 0;
+
+    uint32_t DoFindContiguousRun(uint32_t aStartBlock, uint32_t aMaxBlocks, TBatEntry& aBlockSector);
+    int DoContiguousRunIo(TBlkOpParams &aParams, TBatEntry aBlockSector, bool aWrite);
+
+    int DoMapBlockExtents(uint32_t aStartSector, uint32_t aSectors, TBatEntry aBlockSector, TVhdExtentList& aList, uint32_t aLayer);
+
+    int DoAppendFullBlock(TBlkOpParams &aParams);
+    int DoDiscardBlockSectors(uint32_t aBlockNumber, TBatEntry aBlockSector, uint32_t aSectorInBlock, uint32_t aSectors);
+    bool DoBlockBitmapEmpty(TBatEntry aBlockSector);
+
+    int DoWriteMetadata();
+    void DoCheckMetadataDirty();
+
+ private:
+    int DoLoadFileTail();
+    void DoPreallocate(uint32_t aEndSector);
+    void DoReleasePrealloc();
+
+    int  DoLoadFreeSlots();
+    void DoResetFreeSlots();
+    int  DoTakeFreeSlot(uint32_t aBlockNumber, TBatEntry& aBlockSector);
+    void DoQueueBlockWrite(TBatEntry aBlockSector, bool aSecBmpFill, CDynBuffer& aBmpBuf, const TIoVecBuf* apData);
+
+    /** a block being relocated by Compact() or Defragment() */
+    struct TBlockMove
+    {
+        uint32_t    iBlockNumber;   ///< logical block number
+        TBatEntry   iFromSector;    ///< current block starting sector
+        TBatEntry   iToSector;      ///< new block starting sector
+
+        bool operator<(const TBlockMove& aRhs) const {return iFromSector < aRhs.iFromSector;} ///< orders the blocks by their position in the file
+    };
+
+    uint32_t DoMetadataEndSector() const;
+    int  DoFindDeadBlocks(uint32_t aFlags, vector<TBlockMove>& aLiveBlocks);
+    int  DoRelocateBlocks(const vector<TBlockMove>& aMoves);
+    int  DoTruncateTail(uint32_t aNewFooterSector);
+
+    typedef TDefragState::TBlockPlaces TBlockPlaces;
+
+    int  DoScanBlockPlaces(TDefragState& aState);
+    bool DoPlaceFree(const TBlockPlaces& aPlaces, uint32_t aSector) const;
+    uint32_t DoFindFreePlace(const TBlockPlaces& aPlaces, uint32_t aFromSector) const;
+    int  DoCommitMoves(vector<TBlockMove>& aMoves, TBlockPlaces& aPlaces, uint64_t& aBytesCopied);
+    int  DoEvacuatePlace(TBlockPlaces& aPlaces, uint32_t aSector, uint32_t aFreeFromSector, uint64_t& aBytesCopied);
+    int  DoExtendTail(uint32_t aNewFooterSector);
+
  protected:
 
     CBat*           ipBAT;          ///< an object to work with the Block Allocation Table (BAT)
@@ -580,6 +881,16 @@ class CVhdDynDiffBase : public CVhdFileBase
  private:
     uint32_t    iSectPerBlockLog2;  ///< Log2(sectors per block)
     TVhdHeader  iHeader;            ///< VHD header.
+
+    uint32_t    iFooterSector;      ///< sector of the footer at the end of the file, 0 if not known yet. @see DoLoadFileTail()
+    CDynBuffer  iFooterBuf;         ///< image of the footer sector at the end of the file, valid if iFooterSector != 0
+
+    uint32_t    iPreallocWindowSec; ///< size of the host file region preallocated ahead of the appended blocks, in sectors. 0 disables it
+    uint32_t    iPreallocEndSec;    ///< sector past the end of the preallocated region, 0 if nothing has been preallocated
+
+    bool              iFreeSlotsLoaded; ///< true if iFreeSlots has been built from the BAT. @see DoLoadFreeSlots()
+    set<TBatEntry>    iFreeSlots;       ///< starting sectors of the block slots in the file that no BAT entry refers to, on the media as well
+    vector<TBatEntry> iPendingSlots;    ///< slots of the blocks unlinked from the BAT cache, can't be reused until the metadata is committed
 };
 
 //--------------------------------------------------------------------
@@ -596,10 +907,14 @@ class CVhdFileFixed : public CVhdFileBase
     virtual int GetInfo(TVHD_Params& aVhdInfo, uint32_t aParentNo) const;
 
 
-    virtual int ReadSectors(uint32_t aStartSector, int aSectors, void* apBuffer, uint32_t aBufSize);
-    virtual int WriteSectors(uint32_t aStartSector, int aSectors, const void* apBuffer, uint32_t aBufSize);
+    virtual int ReadSectorsV(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf);
+    virtual int WriteSectorsV(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf);
     virtual int DiscardSectors(uint32_t aStartSector, int aSectors);
 
+    virtual int MapExtents(uint32_t aStartSector, int aSectors, bool aAllocate, TVhdExtentList& aList, uint32_t aLayer);
+    virtual int CommitExtents(uint32_t aStartSector, int aSectors);
+    virtual int MapLayerRun(uint32_t aStartSector, uint32_t aSectors, TLayerRun& aRun);
+
 
     virtual bool IsBlockPresent(uint32_t aLogicalBlockNumber) const;
     virtual int GetBlockBitmap(uint32_t aLogicalBlockNumber, CBitVector& aSrcBitmap) const;
@@ -642,6 +957,9 @@ class CVhdFileDynamic: public CVhdDynDiffBase
     virtual int DoReadSectorsFromBlock(TBlkOpParams &aParams);
     virtual int DoWriteSectorsToBlock(TBlkOpParams &aParams);
 
+    virtual int DoAllocateBlock(uint32_t aBlockNumber, uint32_t aStartSectorL, uint32_t aSectors, TBatEntry& aBlockSector, bool& aSetAllBmpBits);
+    virtual int DoMapUnallocated(uint32_t aStartSector, uint32_t aSectors, TVhdExtentList& aList, uint32_t aLayer);
+
 };
 
 
@@ -670,6 +988,9 @@ class CVhdFileDiff : public CVhdDynDiffBase
     virtual int CoalesceDataIn(uint32_t aVhdChainLength);
     virtual const CVhdFileBase* GetParentOpened(uint32_t aParentNo);
     virtual int ChangeParentVHD(const char *aNewParentFileName);
+    virtual int SetBitmapCacheSize(uint32_t aMaxPages);
+    virtual int SetBitmapCachePolicy(TVhdCachePolicy aPolicy);
+    virtual int SetBatCacheSize(uint32_t aPageSizeLog2, uint32_t aMaxPages);
 
  protected:
     CVhdFileDiff();
@@ -680,7 +1001,28 @@ class CVhdFileDiff : public CVhdDynDiffBase
 
     int DoFindParentFile(std::string& aParentRealName) const;
     int DoReadParentLocator(uint aIndex, std::string& aLocator, bool aHackPathToUnix) const;
-    inline int DoReadSectorsFromParent(uint32_t aStartSector, int aSectors, void* apBuffer, uint32_t aBufSize);
+    int DoReadSectorsFromParent(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf);
+    int DoAddParentLayer(TVhdChainGuard& aGuard);
+
+    /** a run of sectors of a block resolved through the chain of the parents. @see DoGetChainRuns() */
+    struct TChainRun
+    {
+        uint32_t iLayer;        ///< index of the layer in iLayers the sectors are in, KChainRun_Zeroes if no layer has them
+        uint32_t iStart;        ///< first sector of the run in the block
+        uint32_t iSectors;      ///< number of sectors in the run
+        uint32_t iFileSector;   ///< starting sector of the run data in the layer file, valid if the layer has the sectors
+
+        enum {KChainRun_Zeroes = 0xFFFFFFFF};
+
+        static bool StartsAfter(uint32_t aSectorInBlock, const TChainRun& aRun) {return aSectorInBlock < aRun.iStart;}
+    };
+
+    typedef vector<TChainRun> TChainRuns;
+
+    int DoGetChainRuns(uint32_t aBlockNumber, const TChainRuns*& apRuns, TVhdChainGuard& aGuard);
+    int DoResolveChainRuns(uint32_t aStartSector, uint32_t aSectors, TChainRuns& aRuns, TVhdChainGuard& aGuard);
+    void DoCheckChainRuns() const;
+    void DoResetChainRuns() const;
     int DoCopySectorsFromParent(uint32_t aStartSectorParentL, uint32_t aStartSectorChildP, uint32_t aSectors);
     int ProcessPureBlocksMode();
 
@@ -694,9 +1036,16 @@ class CVhdFileDiff : public CVhdDynDiffBase
     virtual int DoReadSectorsFromBlock(TBlkOpParams &aParams);
     virtual int DoWriteSectorsToBlock(TBlkOpParams &aParams);
 
+    virtual int DoAllocateBlock(uint32_t aBlockNumber, uint32_t aStartSectorL, uint32_t aSectors, TBatEntry& aBlockSector, bool& aSetAllBmpBits);
+    virtual int DoMapUnallocated(uint32_t aStartSector, uint32_t aSectors, TVhdExtentList& aList, uint32_t aLayer);
+
 
  private:
-    mutable CVhdFileBase* iParent; ///< parent VHD, NULL if none
+    mutable CVhdFileBase* iParent; ///< parent VHD, NULL if none. Can be shared with other chains, @see CParentRegistry
+    mutable vector<CVhdFileBase*> iLayers; ///< flattened chain of the opened parents: iParent, its parent etc. up to the "Head". @see DoAddParentLayer()
+    mutable map<uint32_t, TChainRuns> iChainRuns; ///< cached runs of the blocks resolved through iLayers, by the logical block number
+    mutable deque<uint32_t> iChainRunsOrder;      ///< block numbers of iChainRuns in the order they were cached
+    mutable vector<uint32_t> iLayerChanges;       ///< LayoutChanges() of every layer the iChainRuns are coherent with
 
 };
 
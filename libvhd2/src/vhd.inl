@@ -105,6 +105,33 @@ bool CVhdFileBase::TrimEnabled() const
     return (iModeFlags & VHDF_OPEN_ENABLE_TRIM);
 }
 
+/**
+    @return true if metadata of the allocated blocks is group-committed
+*/
+bool CVhdFileBase::GroupCommit() const
+{
+    return Durability() == EDurability_Ordered;
+}
+
+/**
+    @return durability mode the VHD is operated in
+*/
+CVhdFileBase::TDurability CVhdFileBase::Durability() const
+{
+    ASSERT(State()==EOpened);
+
+    if(iModeFlags & VHDF_OPMODE_WRITEBACK)
+        return EDurability_WriteBack;
+
+    if(iModeFlags & VHDF_OPMODE_ORDERED)
+        return EDurability_Ordered;
+
+    if(iModeFlags & VHDF_OPMODE_WRITETHROUGH)
+        return EDurability_WriteThrough;
+
+    return EDurability_Default;
+}
+
 //####################################################################
 /** @return Log2(sectors per block) for dynamic & diff. VHDs*/
 uint32_t CVhdDynDiffBase::SectorsPerBlockLog2() const
@@ -153,7 +153,9 @@ static int DoWriteData(int aFd, uint64_t aStartPos, uint32_t aBytesToWrite, cons
 
 //--------------------------------------------------------------------
 /**
-    fill a portion of a file with some byte pattern.
+    fill a portion of a file with some byte pattern. Zero-filling is done by the file system without writing the data
+    if possible, @see ZeroFileRange().
+
     @param  aFd         file descriptor
     @param  aStartPos   Start position of the region to be filled
     @param  aLen        number of bytes to fill
@@ -166,6 +168,14 @@ static int DoFillMedia(int aFd, uint64_t aStartPos, uint64_t aLen, uint8_t aFill
     DBG_LOG("Fd:%d, aStartPos:%lld, aLen:%lld", aFd, aStartPos, aLen);
 
     ASSERT(aFd > 0);
+
+    if(!aFill)
+    {
+        const int nRes = ZeroFileRange(aFd, aStartPos, aLen);
+        if(nRes != KErrNotSupported)
+            return nRes;
+    }
+
     uint64_t remBytes =  aLen;
 
     const uint32_t KMaxBufSize = KDefScratchBufSize;    //-- max. buffer size for media filling
@@ -269,7 +279,7 @@ int DoGenerateVHD_Dynamic(int aFd, TVHD_Params& aParams, TVhdFooter& aFooter)
 
     //-- 2. calculate BAT parameters
     ASSERT(vhdHeader.iMaxBatEntries);
-    const uint32_t KBatSizeInSectors = 1 + ((vhdHeader.iMaxBatEntries - 1) >> aParams.secSizeLog2); //-- rounded-up multiples of sector
+    const uint32_t KBatSizeInSectors = 1 + ((vhdHeader.iMaxBatEntries*sizeof(TBatEntry) - 1) >> aParams.secSizeLog2); //-- rounded-up multiples of sector
     const uint32_t KBatFillBytes = vhdHeader.iMaxBatEntries * sizeof(TBatEntry); //-- amount of bytes to fil with 0xFF, "unallocated" BAT entries.
 
     int nRes;
@@ -485,7 +495,7 @@ int DoGenerateVHD_Differencing(int aFd, TVHD_Params& aParams, TVhdFooter& aFoote
 
     //-- calculate BAT parameters
     ASSERT(vhdHeader.iMaxBatEntries);
-    const uint32_t KBatSizeInSectors = 1 + ((vhdHeader.iMaxBatEntries - 1) >> KSectorSizeLog2); //-- rounded-up multiples of sector
+    const uint32_t KBatSizeInSectors = 1 + ((vhdHeader.iMaxBatEntries*sizeof(TBatEntry) - 1) >> KSectorSizeLog2); //-- rounded-up multiples of sector
     const uint32_t KBatFillBytes = vhdHeader.iMaxBatEntries * sizeof(TBatEntry); //-- amount of bytes to fil with 0xFF, "unallocated" BAT entries.
 
 
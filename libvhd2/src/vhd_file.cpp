@@ -26,9 +26,14 @@
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
 
 #include "vhd.h"
 #include "block_mng.h"
+#include "async_io.h"
+#include "io_engine.h"
+#include "flusher.h"
 
 ASSERT_COMPILE(!(KDefScratchBufSize& (KDefSecSize-1))); //-- max buffer size must be a multiple of sectors
 ASSERT_COMPILE(sizeof(T_CHS) == sizeof (uint32_t));
@@ -217,6 +222,18 @@ CVhdFileBase::CVhdFileBase(const TVhdFooter* apFooter)
     iFooter = *apFooter;
 
     iVhdSizeSec = 0;
+    ipAsyncIo = NULL;
+    ipIoEngine = NULL;
+    iHostBlkSize = 0;
+
+    iCommitDeferred = false;
+    iCommitPending = false;
+    iLastCommitMs = 0;
+
+    pthread_mutex_init(&iAccessLock, NULL);
+    pthread_mutex_init(&iAsyncIoLock, NULL);
+    iDirtyWrites = 0;
+    iDirtySinceMs = 0;
 }
 
 CVhdFileBase::~CVhdFileBase()
@@ -228,6 +245,12 @@ CVhdFileBase::~CVhdFileBase()
      //-- this is because Close() may try flushing data onto media, etc., which may fail, can't afford this in destructor
         Fault(EInvalidState);
     }
+
+    ASSERT(!ipAsyncIo);
+    ASSERT(!ipIoEngine);
+
+    pthread_mutex_destroy(&iAsyncIoLock);
+    pthread_mutex_destroy(&iAccessLock);
 }
 
 
@@ -258,10 +281,16 @@ void CVhdFileBase::Close(bool aForceClose)
 {
     DBG_LOG("CVhdFileBase::Close(%d)[0x%p] State:%d", aForceClose, this, State());
 
+    //-- normally the async. I/O queue is closed before flushing, see VHD_Close()
+    CloseAsyncIoQueue();
+
     //-- make best effort to flush data/metadata
     DoFlush();
     (void)aForceClose;
 
+    delete ipIoEngine;
+    ipIoEngine = NULL;
+
     close(iFileDesc); //-- close file descriptor
     iFileDesc = -1;
 
@@ -293,6 +322,157 @@ int CVhdFileBase::DoFlush()
     return nRes;
 }
 
+//--------------------------------------------------------------------
+/**
+    Sync file data to the media with fdatasync(). This also makes the file size change durable, but not the timestamps.
+    @return standard error code, 0 on success.
+*/
+int CVhdFileBase::DoSyncData() const
+{
+    if(State() != EOpened)
+        return KErrGeneral;
+
+    ASSERT(iFileDesc > 0);
+
+    if(fdatasync(iFileDesc) == 0)
+        return KErrNone;
+
+    const int nRes = -errno;
+    DBG_LOG("CVhdFileBase::DoSyncData() error! code:%d  ", nRes);
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/**
+    Commit metadata of the allocated blocks in data-before-metadata order. There is no metadata to write for this class,
+    so just sync the file data.
+    @return standard error code, 0 on success.
+*/
+int CVhdFileBase::CommitMetadata()
+{
+    const int nRes = DoSyncData();
+    if(nRes == KErrNone)
+        DoCommitCompleted();
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/** Must be called by CommitMetadata() on success; clears the "commit pending" state. */
+void CVhdFileBase::DoCommitCompleted()
+{
+    SetCommitPending(false);
+    iLastCommitMs = MonotonicTimeMs();
+    iDirtyWrites = 0;
+}
+
+//--------------------------------------------------------------------
+/**
+    Account a write call that left the metadata dirty, for the background metadata flusher. @see MetadataFlushDue()
+    Wakes up the flusher if the dirty writes threshold is reached.
+*/
+void CVhdFileBase::DoNoteMetadataDirty()
+{
+    if(!iDirtyWrites)
+        iDirtySinceMs = MonotonicTimeMs();
+
+    ++iDirtyWrites;
+
+    if(iDirtyWrites == CMetadataFlusher::Instance().MaxDirtyWrites())
+        CMetadataFlusher::Instance().Wakeup();
+}
+
+//--------------------------------------------------------------------
+/**
+    Check if the metadata needs to be committed by the background flusher.
+    @param  aMaxAgeMs       max. time the metadata can stay dirty, ms. 0 disables this check
+    @param  aMaxDirtyWrites max. number of write calls that left the metadata dirty. 0 disables this check
+    @return true if the metadata is dirty and one of the limits is reached
+    @pre the caller holds the access lock
+*/
+bool CVhdFileBase::MetadataFlushDue(uint32_t aMaxAgeMs, uint32_t aMaxDirtyWrites) const
+{
+    if(!iDirtyWrites || State() != EOpened)
+        return false;
+
+    if(aMaxDirtyWrites && iDirtyWrites >= aMaxDirtyWrites)
+        return true;
+
+    return aMaxAgeMs && MonotonicTimeMs() - iDirtySinceMs >= aMaxAgeMs;
+}
+
+//--------------------------------------------------------------------
+/**
+    Called by write methods after they have allocated new blocks. Commits the metadata according to the durability mode:
+        - default mode: flushes everything immediately.
+        - "writeback": marks the metadata as pending; commits it if KWriteback_CommitIntervalMs passed since the last commit.
+        - "ordered": marks the metadata as pending and commits it with CommitMetadata(), unless the commit is deferred
+          (see SetCommitDeferred()); in this case the caller is responsible for committing the batch later.
+
+    "Write-through" mode writes the metadata after every write call and doesn't use this method.
+
+    @return standard error code, 0 on success.
+*/
+int CVhdFileBase::DoAllocationCommit()
+{
+    switch(Durability())
+    {
+        case EDurability_WriteBack:
+        SetCommitPending(true);
+        if(MonotonicTimeMs() - iLastCommitMs < KWriteback_CommitIntervalMs)
+            return KErrNone;
+        return CommitMetadata();
+
+        case EDurability_Ordered:
+        SetCommitPending(true);
+        if(iCommitDeferred)
+            return KErrNone;
+        return CommitMetadata();
+
+        case EDurability_WriteThrough:
+        Fault(EMustNotBeCalled);
+        return KErrGeneral;
+
+        default:
+        return Flush();
+    };
+}
+
+//--------------------------------------------------------------------
+/**
+    Change operational mode flags at runtime; only the durability mode can be changed. @see VHD_SetMode()
+    Metadata pending in the current mode is committed before switching.
+
+    @param  aModeFlags  new set of VHDF_OPMODE_* flags
+    @return KErrNone on success, KErrArgument on invalid flags, KErrNotSupported if the flags can't be changed at runtime,
+            other negative error code otherwise.
+*/
+int CVhdFileBase::SetMode(uint32_t aModeFlags)
+{
+    DBG_LOG("CVhdFileBase::SetMode[0x%p] aModeFlags:0x%x, current:0x%x", this, aModeFlags, iModeFlags);
+
+    if(aModeFlags & ~(VHDF_OPMODE_PURE_BLOCKS | VHDF_OPMODE_DURABILITY_MASK))
+        return KErrArgument;
+
+    const uint32_t durability = aModeFlags & VHDF_OPMODE_DURABILITY_MASK;
+    if(durability & (durability-1))
+        return KErrArgument; //-- more than one durability mode flag
+
+    if((aModeFlags ^ iModeFlags) & (VHDF_OPMODE_PURE_BLOCKS | VHDF_OPMODE_WRITETHROUGH))
+        return KErrNotSupported; //-- these flags can be specified only on opening
+
+    if(CommitPending())
+    {
+        const int nRes = CommitMetadata();
+        if(nRes != KErrNone)
+            return nRes;
+    }
+
+    iModeFlags = (iModeFlags & ~VHDF_OPMODE_DURABILITY_MASK) | durability;
+
+    return KErrNone;
+}
+
 //--------------------------------------------------------------------
 /**
     Implements "Open" semantics for the abstract generic VHD file.
@@ -327,6 +507,18 @@ int  CVhdFileBase::Open()
         }
     }
 
+    //-- create the I/O engine for the raw file access
+    if(!ipIoEngine)
+        ipIoEngine = CIoEngine::New(iFileDesc, ModeFlags());
+
+    //-- the host file system block size, discarded regions aligned to it can be given back to the file system
+    struct stat64 st;
+    iHostBlkSize = (fstat64(iFileDesc, &st) == 0) ? (uint32_t)st.st_blksize : 0;
+    if(!IsPowerOf2(iHostBlkSize) || iHostBlkSize < SectorSize())
+        iHostBlkSize = 0;
+
+    iLastCommitMs = MonotonicTimeMs(); //-- the file on the media is consistent at this point
+
     return KErrNone;
 }
 
@@ -342,6 +534,9 @@ void CVhdFileBase::PrintInfo(std::string& aStr) const
     StrLog(&aStr, "File:'%s'", FilePath());
     StrLog(&aStr, "VHD Mode Flags: 0x%08x", ModeFlags());
 
+    if(ipIoEngine)
+        StrLog(&aStr, "I/O engine: %s", ipIoEngine->Name());
+
     //-- dump footer
     iFooter.Dump(&aStr);
 
@@ -421,6 +616,9 @@ int CVhdFileBase::DoOpenFile(const char *aFileName, uint32_t aModeFlags, int& aF
     if(aModeFlags & VHDF_OPEN_DIRECTIO)
             openFlags |= O_DIRECT;  //-- don't use FS caching
 
+    if((aModeFlags & VHDF_OPEN_RDWR) && (aModeFlags & VHDF_OPMODE_WRITETHROUGH))
+            openFlags |= O_DSYNC;   //-- every write reaches the media before returning
+
     if(aModeFlags & VHDF_OPEN_EXCLUSIVE_LOCK)
             lockType = F_WRLCK; //-- explicit request to apply write or "exclusive" lock
 
@@ -504,6 +702,38 @@ CVhdFileBase* CVhdFileBase::CreateFromFile(const char *aFileName, uint32_t aMode
 
 }
 
+//--------------------------------------------------------------------
+/**
+    Read a number of sectors from the VHD file to a contiguous buffer. Sector numbers are logical, i.e. 0..VhdSizeInSectors()
+
+	@param	aStartSector	starting logical sector.
+	@param	aSectors		number of logical sectors to read 0..LONG_MAX
+	@param	apBuffer		out: read data
+    @param  aBufSize        buffer size in bytes
+
+    @return	positive number of read sectors on success, negative value corresponding system error code otherwise.
+*/
+int CVhdFileBase::ReadSectors(uint32_t aStartSector, int aSectors, void* apBuffer, uint32_t aBufSize)
+{
+    return ReadSectorsV(aStartSector, aSectors, TIoVecBuf(apBuffer, aBufSize));
+}
+
+//--------------------------------------------------------------------
+/**
+	Write a number of sectors from a contiguous buffer to the VHD file. Sector numbers are logical, i.e. 0..VhdSizeInSectors()
+	@param	aStartSector	starting logical sector.
+	@param	aSectors		number of logical sectors to write 0..LONG_MAX
+	@param	apBuffer		in: data to write
+    @param  aBufSize        buffer size in bytes
+
+	@return	positive number of written sectors on success, negative value corresponding system error code otherwise.
+*/
+int CVhdFileBase::WriteSectors(uint32_t aStartSector, int aSectors, const void* apBuffer, uint32_t aBufSize)
+{
+    //-- the data are only read from the buffer
+    return WriteSectorsV(aStartSector, aSectors, TIoVecBuf(const_cast<void*>(apBuffer), aBufSize));
+}
+
 //--------------------------------------------------------------------
 /**
     A helper method. Checks ReadSectors() / WriteSectors() parameters and adjsuts number of sectors to be accessed
@@ -515,7 +745,7 @@ CVhdFileBase* CVhdFileBase::CreateFromFile(const char *aFileName, uint32_t aMode
     @return on success: number of sectors that can be read/written
             on error:   negative error code
 */
-int CVhdFileBase::DoCheckRW_Args(uint32_t aStartSector, int aSectors, uint32_t aBufSize) const
+int CVhdFileBase::DoCheckRW_Args(uint32_t aStartSector, int aSectors, size_t aBufSize) const
 {
     if(State() != EOpened)
     {
@@ -544,8 +774,8 @@ int CVhdFileBase::DoCheckRW_Args(uint32_t aStartSector, int aSectors, uint32_t a
     ASSERT(sectors <= (uint32_t)aSectors);
 
     //-- check if we have buffer large enough
-    const uint32_t bufSectors = aBufSize >> SectorSzLog2();
-    sectors = Min(sectors, bufSectors);
+    const size_t bufSectors = aBufSize >> SectorSzLog2();
+    sectors = (uint32_t)Min((size_t)sectors, bufSectors);
 
     ASSERT(sectors && !U32High(sectors));
 
@@ -569,21 +799,12 @@ int CVhdFileBase::DoRaw_ReadData(uint32_t aStartSector, int aBytes, void* apBuff
     DBG_LOG("CVhdFileBase::DoRaw_ReadData[0x%p](FileSector:%d, aBytes:%d) ",this, aStartSector, aBytes);
 
     ASSERT(State() == EOpened);
-    ASSERT(iFileDesc > 0);
+    ASSERT(ipIoEngine);
     ASSERT(aBytes > 0);
 
-    const __off64_t filePos = ((uint64_t)aStartSector) << SectorSzLog2();
-
-    const ssize_t bytesRead = pread64(iFileDesc, apBuffer, aBytes, filePos);
-
-    if(bytesRead != aBytes)
-    {
-        const int nRes = -errno;
-        DBG_LOG("CVhdFileBase::DoRaw_ReadData() error! val:%d, code:%d  ", bytesRead, nRes);
-        return nRes;
-    }
+    const uint64_t filePos = ((uint64_t)aStartSector) << SectorSzLog2();
 
-    return bytesRead;
+    return ipIoEngine->Read(filePos, aBytes, apBuffer);
 }
 
 //--------------------------------------------------------------------
@@ -599,20 +820,173 @@ int CVhdFileBase::DoRaw_WriteData(uint32_t aStartSector, int aBytes, const void*
 {
     DBG_LOG("CVhdFileBase::DoRaw_WriteData[0x%p](FileSector:%d, aBytes:%d) ", this, aStartSector, aBytes);
     ASSERT(State() == EOpened);
-    ASSERT(iFileDesc > 0);
+    ASSERT(ipIoEngine);
     ASSERT(aBytes > 0);
 
-    const __off64_t filePos     = ((uint64_t)aStartSector) << SectorSzLog2();
-    const ssize_t bytesWritten = pwrite64(iFileDesc, apBuffer, aBytes, filePos);
+    const uint64_t filePos = ((uint64_t)aStartSector) << SectorSzLog2();
 
-    if(bytesWritten != aBytes)
-    {
-        const int nRes = -errno;
-        DBG_LOG("CVhdFileBase::DoRaw_WriteData() error! val:%d, code:%d  ", bytesWritten, nRes);
+    return ipIoEngine->Write(filePos, aBytes, apBuffer);
+}
+
+//--------------------------------------------------------------------
+/**
+    Raw read a number of bytes from the VHD file to a scatter-gather buffer.
+    If the data go to a single memory segment, it is the same as DoRaw_ReadData(). Otherwise all segments are read
+    by one batch of the I/O engine; the synchronous engine does it with a single preadv64() call.
+
+	@param	aStartSector	starting sector.
+	@param	aBytes		    number of bytes to read 0..LONG_MAX
+	@param	aBuf		    out: read data go to the buffer from its current position; the position doesn't change
+
+    @return	positive number of read bytes on success, negative value corresponding system error code otherwise.
+*/
+int CVhdFileBase::DoRaw_ReadDataV(uint32_t aStartSector, int aBytes, const TIoVecBuf& aBuf) const
+{
+    if(aBuf.IsContiguous(aBytes))
+        return DoRaw_ReadData(aStartSector, aBytes, aBuf.Ptr());
+
+    DoRaw_QueueRead(aStartSector, aBytes, aBuf);
+
+    const int nRes = DoRaw_SubmitBatch();
+    if(nRes < 0)
+        return nRes;
+
+    return aBytes;
+}
+
+//--------------------------------------------------------------------
+/**
+    Write a number of bytes from a scatter-gather buffer to the VHD file. @see DoRaw_ReadDataV()
+
+	@param	aStartSector	starting sector.
+	@param	aBytes		    number of bytes to write 0..LONG_MAX
+	@param	aBuf		    in: data to write, starting from the buffer current position; the position doesn't change
+
+	@return	positive number of written bytes on success, negative value corresponding system error code otherwise.
+*/
+int CVhdFileBase::DoRaw_WriteDataV(uint32_t aStartSector, int aBytes, const TIoVecBuf& aBuf) const
+{
+    if(aBuf.IsContiguous(aBytes))
+        return DoRaw_WriteData(aStartSector, aBytes, aBuf.Ptr());
+
+    DoRaw_QueueWrite(aStartSector, aBytes, aBuf);
+
+    const int nRes = DoRaw_SubmitBatch();
+    if(nRes < 0)
         return nRes;
+
+    return aBytes;
+}
+
+//--------------------------------------------------------------------
+/**
+    Queue a raw read request to the I/O engine batch. The data will be read by DoRaw_SubmitBatch() call.
+    Requests in the batch can be executed in any order, they must not overlap.
+    Every memory segment of the buffer becomes a separate request in the batch.
+
+	@param	aStartSector	starting sector.
+	@param	aBytes		    number of bytes to read 0..LONG_MAX
+	@param	aBuf		    out: read data go to the buffer from its current position. Must be valid until DoRaw_SubmitBatch() is called.
+*/
+void CVhdFileBase::DoRaw_QueueRead(uint32_t aStartSector, int aBytes, const TIoVecBuf& aBuf) const
+{
+    DBG_LOG("CVhdFileBase::DoRaw_QueueRead[0x%p](FileSector:%d, aBytes:%d) ",this, aStartSector, aBytes);
+
+    ASSERT(State() == EOpened);
+    ASSERT(ipIoEngine);
+    ASSERT(aBytes > 0 && (size_t)aBytes <= aBuf.Size());
+
+    uint64_t filePos = ((uint64_t)aStartSector) << SectorSzLog2();
+    TIoVecBuf buf(aBuf);
+
+    while(aBytes > 0)
+    {
+        const uint32_t segBytes = (uint32_t)Min((size_t)aBytes, buf.SegLen());
+        ipIoEngine->QueueRead(filePos, segBytes, buf.Ptr());
+
+        filePos += segBytes;
+        aBytes  -= segBytes;
+        buf.Advance(segBytes);
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Queue a raw write request to the I/O engine batch. @see DoRaw_QueueRead()
+
+	@param	aStartSector	starting sector.
+	@param	aBytes		    number of bytes to write 0..LONG_MAX
+	@param	aBuf		    in: data to write, starting from the buffer current position. Must be valid until DoRaw_SubmitBatch() is called.
+*/
+void CVhdFileBase::DoRaw_QueueWrite(uint32_t aStartSector, int aBytes, const TIoVecBuf& aBuf) const
+{
+    DBG_LOG("CVhdFileBase::DoRaw_QueueWrite[0x%p](FileSector:%d, aBytes:%d) ",this, aStartSector, aBytes);
+
+    ASSERT(State() == EOpened);
+    ASSERT(ipIoEngine);
+    ASSERT(aBytes > 0 && (size_t)aBytes <= aBuf.Size());
+
+    uint64_t filePos = ((uint64_t)aStartSector) << SectorSzLog2();
+    TIoVecBuf buf(aBuf);
+
+    while(aBytes > 0)
+    {
+        const uint32_t segBytes = (uint32_t)Min((size_t)aBytes, buf.SegLen());
+        ipIoEngine->QueueWrite(filePos, segBytes, buf.Ptr());
+
+        filePos += segBytes;
+        aBytes  -= segBytes;
+        buf.Advance(segBytes);
     }
+}
+
+//--------------------------------------------------------------------
+/**
+    Queue reading of the file sectors whose data are not needed, e.g. metadata between the data sectors being read.
+    The data go to the I/O engine scratch buffer and are discarded. This allows the engine to merge adjacent requests
+    into a single system call. If the gap doesn't fit into the scratch buffer, nothing is queued.
+
+	@param	aStartSector	starting sector.
+	@param	aBytes		    number of bytes to skip
+*/
+void CVhdFileBase::DoRaw_QueueReadGap(uint32_t aStartSector, uint32_t aBytes) const
+{
+    ASSERT(State() == EOpened);
+    ASSERT(ipIoEngine);
+
+    if(!aBytes || aBytes > ipIoEngine->ScratchBufSize())
+        return;
 
-    return bytesWritten;
+    ipIoEngine->QueueRead(((uint64_t)aStartSector) << SectorSzLog2(), aBytes, ipIoEngine->ScratchBuf());
+}
+
+//--------------------------------------------------------------------
+/**
+    Execute all requests queued by DoRaw_QueueRead() and wait for their completion.
+    Must be called even if the caller has got an error after queueing some requests.
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int CVhdFileBase::DoRaw_SubmitBatch() const
+{
+    ASSERT(ipIoEngine);
+    return ipIoEngine->SubmitBatch();
+}
+
+//--------------------------------------------------------------------
+/**
+    Must be called before metadata is written outside of CommitMetadata(), e.g. when a dirty cache page is evicted.
+    In "writeback" and "ordered" modes syncs the file data, so that the metadata never refers to data that didn't reach the media.
+
+	@return	KErrNone on success, negative error code otherwise.
+*/
+int CVhdFileBase::DoRaw_DataBarrier() const
+{
+    const TDurability durability = Durability();
+    if(durability == EDurability_WriteBack || durability == EDurability_Ordered)
+        return DoSyncData();
+
+    return KErrNone;
 }
 
 
@@ -638,25 +1012,25 @@ int CVhdFileBase::DoRaw_CheckMediaFill(uint32_t aStartSector, uint32_t aSectors,
         return KErrNone;
     }
 
-    const uint32_t KMaxBufSize = KDefScratchBufSize;    //-- max buffer size for media fill checking
-    ASSERT_COMPILE(!(KMaxBufSize& (KDefSecSize-1)));    //-- max buffer size must be a multiple of sectors
+    ASSERT(ipIoEngine);
 
-    uint32_t remBytes =  aSectors << SectorSzLog2();
-    const uint32_t KBufSize = Min(remBytes, KMaxBufSize);
+    //-- use the I/O engine scratch buffer, its size is a multiple of sectors
+    uint8_t* pBuf = ipIoEngine->ScratchBuf();
+    const uint32_t KBufSize = ipIoEngine->ScratchBufSize();
 
-    CDynBuffer buf(KBufSize);
+    uint32_t remBytes =  aSectors << SectorSzLog2();
 
     while(remBytes)
     {
         const uint32_t bytesToRead = Min(KBufSize, remBytes);
 
-        int nRes = DoRaw_ReadData(aStartSector, bytesToRead, buf.Ptr());
+        int nRes = DoRaw_ReadData(aStartSector, bytesToRead, pBuf);
         if(nRes <0)
             return nRes;//-- this is the error code
 
         ASSERT(nRes == (int)bytesToRead);
 
-        if(!CheckFill(buf.Ptr(), bytesToRead, aFill))
+        if(!CheckFill(pBuf, bytesToRead, aFill))
             return KErrNotFound; //-- other data that required
 
         aStartSector += (bytesToRead >> SectorSzLog2());
@@ -670,6 +1044,7 @@ int CVhdFileBase::DoRaw_CheckMediaFill(uint32_t aStartSector, uint32_t aSectors,
 //--------------------------------------------------------------------
 /**
     Fill media with a given data. Does not perform any geometry checks.
+    Zero-filling is done by the file system without writing the data if possible, @see ZeroFileRange().
 
 	@param	aStartSector	starting sector.
 	@param	aSectors        number of sector to write
@@ -684,34 +1059,81 @@ int CVhdFileBase::DoRaw_FillMedia(uint32_t aStartSector, uint32_t aSectors, uint
     if(!aSectors)
         return KErrNone;
 
-    const uint32_t KMaxBufSize = KDefScratchBufSize;    //-- max buffer size for media filling
-    ASSERT_COMPILE(!(KMaxBufSize& (KDefSecSize-1)));    //-- max buffer size must be a multiple of sectors
+    ASSERT(State() == EOpened);
+    ASSERT(ipIoEngine);
+
+    if(!aFill)
+    {
+        const int nRes = ZeroFileRange(iFileDesc, ((uint64_t)aStartSector) << SectorSzLog2(), ((uint64_t)aSectors) << SectorSzLog2());
+        if(nRes == KErrNone && Durability() == EDurability_WriteThrough)
+            return DoSyncData(); //-- the file system metadata describing the zeroed region must be durable as well
+
+        if(nRes != KErrNotSupported)
+            return nRes;
+    }
+
+    //-- use the I/O engine scratch buffer, its size is a multiple of sectors.
+    //-- all chunks are written from the same buffer as a single batch
+    uint8_t* pBuf = ipIoEngine->ScratchBuf();
+    const uint32_t KBufSize = ipIoEngine->ScratchBufSize();
 
     uint32_t remBytes =  aSectors << SectorSzLog2();
-    const uint32_t KBufSize = Min(remBytes, KMaxBufSize);
+    memset(pBuf, aFill, Min(KBufSize, remBytes));
 
-    CDynBuffer buf(KBufSize);
-    buf.Fill(aFill);
+    uint64_t filePos = ((uint64_t)aStartSector) << SectorSzLog2();
 
     while(remBytes)
     {
         const uint32_t bytesToWrite = Min(KBufSize, remBytes);
 
-        int nRes = DoRaw_WriteData(aStartSector, bytesToWrite, buf.Ptr());
+        ipIoEngine->QueueWrite(filePos, bytesToWrite, pBuf);
 
-        if(nRes <0)
-            return nRes;//-- this is the error code
+        filePos  += bytesToWrite;
+        remBytes -= bytesToWrite;
+    }
+
+    return ipIoEngine->SubmitBatch();
+}
 
-        ASSERT(nRes == (int)bytesToWrite);
 
-        aStartSector += (bytesToWrite >> SectorSzLog2());
-        remBytes -= bytesToWrite;
+//--------------------------------------------------------------------
+/**
+    Give the file space of a region back to the host file system by punching a hole in it. The region reads as zeroes afterwards.
+    Only the host file system blocks that are entirely within the region are deallocated, the rest of it is left intact.
+
+	@param	aStartSector	starting sector.
+	@param	aSectors        number of sectors in the region
+
+	@return	KErrNone on success, KErrNotSupported if the host file system can't punch holes, negative error code otherwise.
+*/
+int CVhdFileBase::DoRaw_PunchHole(uint32_t aStartSector, uint32_t aSectors)
+{
+    DBG_LOG("CVhdFileBase::DoRaw_PunchHole[0x%p](aStartSector:%d, aSectors:%d)", this, aStartSector, aSectors);
+
+    ASSERT(State() == EOpened);
+
+    if(!iHostBlkSize)
+        return KErrNotSupported;
 
+    const uint64_t KAlignMask = iHostBlkSize - 1;
+    const uint64_t startPos   = ((((uint64_t)aStartSector) << SectorSzLog2()) + KAlignMask) & ~KAlignMask;
+    const uint64_t endPos     = (((uint64_t)aStartSector + aSectors) << SectorSzLog2()) & ~KAlignMask;
+
+    if(endPos <= startPos)
+        return KErrNone; //-- no whole host blocks in the region
+
+    const int nRes = PunchFileHole(iFileDesc, startPos, endPos - startPos);
+    if(nRes == KErrNotSupported)
+    {//-- don't try again
+        iHostBlkSize = 0;
+        return nRes;
     }
 
-    return KErrNone;
-}
+    if(nRes == KErrNone && Durability() == EDurability_WriteThrough)
+        return DoSyncData();
 
+    return nRes;
+}
 
 //--------------------------------------------------------------------
 /**
@@ -770,20 +1192,154 @@ const CVhdFileBase* CVhdFileBase::GetParentOpened(uint32_t aParentNo)
     return NULL;
 }
 
+//--------------------------------------------------------------------
+/**
+    Set the max. number of sector allocation bitmaps cached for this VHD.
+    This VHD type doesn't have sector allocation bitmaps, so only the argument is checked.
 
+    @param  aMaxPages   number of cached bitmaps, 1..KMaxCached_SectorBitmaps_Limit
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdFileBase::SetBitmapCacheSize(uint32_t aMaxPages)
+{
+    if(!aMaxPages || aMaxPages > KMaxCached_SectorBitmaps_Limit)
+        return KErrArgument;
 
-//####################################################################
-//#  CVhdDynDiffBase class implementation
-//####################################################################
+    return KErrNone;
+}
 
 //--------------------------------------------------------------------
 /**
-    constructor.
-    @param  apFooter a valid VHD footer
+    Set the sector allocation bitmaps cache replacement policy for this VHD.
+    This VHD type doesn't have sector allocation bitmaps, so only the argument is checked.
+
+    @param  aPolicy replacement policy
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdFileBase::SetBitmapCachePolicy(TVhdCachePolicy aPolicy)
+{
+    if(aPolicy != EVhdCache_LRU && aPolicy != EVhdCache_2Q)
+        return KErrArgument;
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Set the BAT cache page size and the max. number of cached BAT pages for this VHD.
+    This VHD type doesn't have BAT, so only the arguments are checked.
+
+    @param  aPageSizeLog2   Log2(sectors per cache page), 0..KBatCache_PageSizeLog2_Limit
+    @param  aMaxPages       max. number of cached pages, 1..KBatCache_MaxPages_Limit
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdFileBase::SetBatCacheSize(uint32_t aPageSizeLog2, uint32_t aMaxPages)
+{
+    if(aPageSizeLog2 > KBatCache_PageSizeLog2_Limit || !aMaxPages || aMaxPages > KBatCache_MaxPages_Limit)
+        return KErrArgument;
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Set the size of the host file region preallocated ahead of the appended blocks.
+    This VHD type doesn't append blocks, so only the argument is checked.
+
+    @param  aWindowMB   window size in MB, 0..KMaxPreallocWindowMB
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdFileBase::SetPreallocWindow(uint32_t aWindowMB)
+{
+    if(aWindowMB > KMaxPreallocWindowMB)
+        return KErrArgument;
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Get the asynchronous I/O requests queue associated with this VHD. The queue is created and started on the first call.
+    The queue is created under iAsyncIoLock, so the threads making their first asynchronous call at once share the same queue.
+
+    @param  apQueue out: pointer to the queue
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdFileBase::GetAsyncIoQueue(CAsyncIoQueue*& apQueue)
+{
+    if(State() != EOpened)
+        return KErrGeneral;
+
+    int nRes = KErrNone;
+
+    pthread_mutex_lock(&iAsyncIoLock);
+
+    if(!ipAsyncIo)
+    {
+        CAsyncIoQueue* pQueue = new CAsyncIoQueue(*this);
+
+        nRes = pQueue->Open();
+        if(nRes == KErrNone)
+            ipAsyncIo = pQueue;
+        else
+            delete pQueue;
+    }
+
+    apQueue = ipAsyncIo;
+
+    pthread_mutex_unlock(&iAsyncIoLock);
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/**
+    Wait until all submitted asynchronous I/O requests are executed.
+    Must be called before synchronous access to this object if the asynchronous I/O queue might be in use.
+*/
+void CVhdFileBase::WaitAsyncIoIdle()
+{
+    pthread_mutex_lock(&iAsyncIoLock);
+    CAsyncIoQueue* pQueue = ipAsyncIo;
+    pthread_mutex_unlock(&iAsyncIoLock);
+
+    //-- the queue lives until the VHD is closed; don't hold the lock while waiting, the queue can be looked up meanwhile
+    if(pQueue)
+        pQueue->WaitIdle();
+}
+
+//--------------------------------------------------------------------
+/**
+    Execute all pending asynchronous I/O requests, stop and delete the asynchronous I/O queue.
+*/
+void CVhdFileBase::CloseAsyncIoQueue()
+{
+    pthread_mutex_lock(&iAsyncIoLock);
+    CAsyncIoQueue* pQueue = ipAsyncIo;
+    ipAsyncIo = NULL;
+    pthread_mutex_unlock(&iAsyncIoLock);
+
+    if(!pQueue)
+        return;
+
+    pQueue->Close();
+    delete pQueue;
+}
+
+
+
+//####################################################################
+//#  CVhdDynDiffBase class implementation
+//####################################################################
+
+//--------------------------------------------------------------------
+/**
+    constructor.
+    @param  apFooter a valid VHD footer
     @param  apHeader a valid VHD header
 */
 CVhdDynDiffBase::CVhdDynDiffBase(const TVhdFooter* apFooter, const TVhdHeader* apHeader)
-                :CVhdFileBase(apFooter), ipBAT(NULL), ipSectorMapper(NULL)
+                :CVhdFileBase(apFooter), ipBAT(NULL), ipSectorMapper(NULL), iFooterSector(0), iPreallocEndSec(0), iFreeSlotsLoaded(false)
 {
     //-- 1. process footer
     ASSERT(Footer().IsValid());
@@ -799,6 +1355,7 @@ CVhdDynDiffBase::CVhdDynDiffBase(const TVhdFooter* apFooter, const TVhdHeader* a
     ASSERT(iSectPerBlockLog2 > SectorSzLog2());
     iSectPerBlockLog2 -= SectorSzLog2();
 
+    iPreallocWindowSec = KDefPreallocWindowMB << (20 - SectorSzLog2());
 }
 
 //--------------------------------------------------------------------
@@ -882,6 +1439,13 @@ void CVhdDynDiffBase::Close(bool aForceClose /*=false*/)
         ipSectorMapper = NULL;
     }
 
+    //-- give back the space preallocated beyond the footer
+    DoReleasePrealloc();
+    DoResetFreeSlots();
+
+    iFooterSector = 0;
+    iFooterBuf.Resize(0);
+
     CVhdFileBase::Close(aForceClose);
 }
 
@@ -895,19 +1459,79 @@ int CVhdDynDiffBase::Flush()
     if(State() != EOpened)
         return KErrGeneral;
 
+    if(CommitPending() || Durability() != EDurability_Default)
+    {//-- keep data-before-metadata order
+        return CommitMetadata();
+    }
+
     //-- @todo better error handling here
     int nRes1 = ipBAT->Flush();
     int nRes2 = ipSectorMapper->Flush();
     int nRes3 = CVhdFileBase::Flush();
 
     if(nRes1 == KErrNone && nRes2 == KErrNone && nRes3 == KErrNone)
+    {
+        DoCommitCompleted();
         return KErrNone;
+    }
 
     DBG_LOG("CVhdDynDiffBase::Flush[0x%p], Errors! %d, %d, %d", this, nRes1, nRes2, nRes3);
 
     return KErrGeneral;
 }
 
+//--------------------------------------------------------------------
+/**
+    Commit metadata of the allocated blocks, see VHDF_OPMODE_ORDERED.
+    The file data (including newly appended blocks) is synced first, then dirty BAT sectors and sector bitmaps are written
+    and synced, so that after a crash the BAT never points to a block with data that didn't reach the media.
+
+    @return standard error code, 0 on success.
+*/
+int CVhdDynDiffBase::CommitMetadata()
+{
+    if(State() != EOpened)
+        return KErrGeneral;
+
+    int nRes = DoSyncData();
+    if(nRes == KErrNone)
+        nRes = DoWriteMetadata();
+
+    if(nRes == KErrNone)
+        nRes = DoSyncData();
+
+    if(nRes != KErrNone)
+    {
+        DBG_LOG("CVhdDynDiffBase::CommitMetadata[0x%p], Error! %d", this, nRes);
+        return nRes;
+    }
+
+    DoCommitCompleted();
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Write dirty BAT sectors and sector bitmaps to the media, without syncing.
+    @return standard error code, 0 on success.
+*/
+int CVhdDynDiffBase::DoWriteMetadata()
+{
+    const int nRes = ipBAT->Flush();
+    if(nRes != KErrNone)
+        return nRes;
+
+    return ipSectorMapper->Flush();
+}
+
+//--------------------------------------------------------------------
+/** Called after the operations that can modify the metadata; accounts them for the background metadata flusher if the metadata is dirty */
+void CVhdDynDiffBase::DoCheckMetadataDirty()
+{
+    if(ipBAT->State() == CBat::EDirty || (ipSectorMapper && ipSectorMapper->State() == CSectorMapper::EDirty))
+        DoNoteMetadataDirty();
+}
+
 //--------------------------------------------------------------------
 /**
     Invalidates cache data. If the client will try to access data with cache invalid, it will result in
@@ -928,6 +1552,78 @@ void CVhdDynDiffBase::InvalidateCache(bool aIgnoreDirty /*=false*/)
     CVhdFileBase::InvalidateCache(aIgnoreDirty);
 }
 
+//--------------------------------------------------------------------
+/**
+    Set the max. number of sector allocation bitmaps cached for this VHD.
+    If there are more bitmaps cached, the least recently used ones are flushed and evicted.
+
+    @param  aMaxPages   number of cached bitmaps, 1..KMaxCached_SectorBitmaps_Limit
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::SetBitmapCacheSize(uint32_t aMaxPages)
+{
+    DBG_LOG("CVhdDynDiffBase::SetBitmapCacheSize[0x%p](%d)", this, aMaxPages);
+    ASSERT(ipSectorMapper);
+
+    return ipSectorMapper->SetCapacity(aMaxPages);
+}
+
+//--------------------------------------------------------------------
+/**
+    Set the sector allocation bitmaps cache replacement policy for this VHD.
+    @param  aPolicy replacement policy
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::SetBitmapCachePolicy(TVhdCachePolicy aPolicy)
+{
+    DBG_LOG("CVhdDynDiffBase::SetBitmapCachePolicy[0x%p](%d)", this, aPolicy);
+    ASSERT(ipSectorMapper);
+
+    return ipSectorMapper->SetPolicy(aPolicy);
+}
+
+//--------------------------------------------------------------------
+/**
+    Set the BAT cache page size and the max. number of cached BAT pages for this VHD.
+    Changing the page size writes the dirty BAT sectors and drops the cached pages; if there are more pages cached than aMaxPages,
+    the least recently used ones are evicted.
+
+    @param  aPageSizeLog2   Log2(sectors per cache page), 0..KBatCache_PageSizeLog2_Limit
+    @param  aMaxPages       max. number of cached pages, 1..KBatCache_MaxPages_Limit
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::SetBatCacheSize(uint32_t aPageSizeLog2, uint32_t aMaxPages)
+{
+    DBG_LOG("CVhdDynDiffBase::SetBatCacheSize[0x%p](%d, %d)", this, aPageSizeLog2, aMaxPages);
+    ASSERT(ipBAT);
+
+    return ipBAT->SetCacheSize(aPageSizeLog2, aMaxPages);
+}
+
+//--------------------------------------------------------------------
+/**
+    Set the size of the host file region preallocated ahead of the appended blocks. Reducing the window doesn't release
+    the space preallocated already except for disabling preallocation.
+
+    @param  aWindowMB   window size in MB, 0..KMaxPreallocWindowMB. 0 disables preallocation and releases the preallocated space.
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::SetPreallocWindow(uint32_t aWindowMB)
+{
+    DBG_LOG("CVhdDynDiffBase::SetPreallocWindow[0x%p](%d)", this, aWindowMB);
+
+    int nRes = CVhdFileBase::SetPreallocWindow(aWindowMB);
+    if(nRes != KErrNone)
+        return nRes;
+
+    iPreallocWindowSec = aWindowMB << (20 - SectorSzLog2());
+
+    if(!iPreallocWindowSec)
+        DoReleasePrealloc();
+
+    return KErrNone;
+}
+
 
 //--------------------------------------------------------------------
 /**
@@ -1010,98 +1706,467 @@ bool CVhdDynDiffBase::IsBlockPresent(uint32_t aLogicalBlockNumber) const
 
 
 
+//--------------------------------------------------------------------
+/**
+    Find out the position of the footer at the end of the VHD file and read its image. This is done once, on the first
+    block appending; then the footer position is tracked by AppendBlock() and the image is kept in memory.
+
+    @return standard error code, KErrNone on success
+*/
+int CVhdDynDiffBase::DoLoadFileTail()
+{
+    if(iFooterSector)
+        return KErrNone; //-- already loaded
+
+    uint64_t filePos;
+
+    //-- 1. check VHD file size; it must be multiple of sector size
+    int nRes = GetFileSize(filePos);
+    if(nRes != KErrNone)
+        return nRes;
+
+    if(filePos & (SectorSize()-1))
+    {//-- file size is supposed to be a multiple of sectors
+        DBG_LOG(" Wrong file size! %llx", filePos);
+        return KErrCorrupt;
+    }
+
+    //-- 2. read footer from the last sector of the file
+    const uint32_t footerSector = U64Low((filePos >> SectorSzLog2()));
+    if(!footerSector)
+        return KErrCorrupt;
+
+    iFooterBuf.Resize(SectorSize());
+
+    nRes = DoRaw_ReadData(footerSector-1, SectorSize(), iFooterBuf.Ptr());
+    if(nRes <0)
+        return nRes;//-- this is the error code
+
+    ASSERT(nRes == (int)SectorSize());
+
+    //-- in theory, we need to check VHD footer fields OriginalSize & CurrentSize;
+    //-- they might need to be updated. Many VHDs are created with these fields already containing max. VHD size.
+    //-- updating these fields implies recalculating footer checksums etc. Leave it for later if we need to implement it.
+
+    iFooterSector = footerSector-1;
+
+    return KErrNone;
+}
+
 //--------------------------------------------------------------------
 /**
     Append a new block with its allocation bitmap to the end of the VHD file. The footer is moved to the very last sector of the file.
+    The bitmap and the footer are written by a single batch of I/O requests. If the data for the whole block are given,
+    they go to the same batch, so that the sequence "bitmap, data, footer" is written by a single pwritev64() call.
 
     @param  aBlockSector    out: sector number of the appended block. This value should go to BAT
     @param  aSecBmpFill     if true, all bits in the block bitmap will be set to '1', otherwise to '0'
     @param  aZeroFillData   if true, the block will be explicitly filled with 0s
+    @param  apData          if not NULL, the data for the whole block, starting from the buffer current position. Incompatible with aZeroFillData
 
     @return standard error code, KErrNone on success
 */
-int CVhdDynDiffBase::AppendBlock(TBatEntry& aBlockSector, bool aSecBmpFill, bool aZeroFillData)
+int CVhdDynDiffBase::AppendBlock(TBatEntry& aBlockSector, bool aSecBmpFill, bool aZeroFillData, const TIoVecBuf* apData /*=NULL*/)
 {
-    DBG_LOG("CVhdDynDiffBase::AppendBlock[0x%p], SecBmpFill:%d, DataZFill:%d", this, aSecBmpFill, aZeroFillData );
+    DBG_LOG("CVhdDynDiffBase::AppendBlock[0x%p], SecBmpFill:%d, DataZFill:%d, Data:%d", this, aSecBmpFill, aZeroFillData, apData != NULL);
+    ASSERT(!(apData && aZeroFillData));
 
-    int nRes;
+    //-- 1. get the footer position and its image
+    int nRes = DoLoadFileTail();
+    if(nRes != KErrNone)
+        return nRes;
 
-    uint64_t filePos;
+    const uint32_t blockSector  = iFooterSector;
+    const uint32_t newFooterSec = blockSector + SBmp_SizeInSectors() + SectorsPerBlock();
 
-    //-- 1. check VHD file size; it must be multiple of sector size
-    nRes = GetFileSize(filePos);
+    DoPreallocate(newFooterSec + 1);
+
+    //-- 2. write the bitmap, the data if any and the footer at the end of a new block, expanding the file
+    CDynBuffer bmpBuf;
+    DoQueueBlockWrite(blockSector, aSecBmpFill, bmpBuf, apData);
+
+    DoRaw_QueueWrite(newFooterSec, SectorSize(), TIoVecBuf(iFooterBuf.Ptr(), SectorSize()));
+
+    nRes = DoRaw_SubmitBatch();
     if(nRes != KErrNone)
         return nRes;
 
-    if(filePos & (SectorSize()-1))
-    {//-- file size is supposed to be a multiple of sectors
-        DBG_LOG(" Wrong file size! %llx", filePos);
+    aBlockSector  = blockSector;
+    iFooterSector = newFooterSec;
+
+    //-- 3. zero-fill block body if requested
+    if(aZeroFillData)
+    {
+        nRes = DoRaw_FillMedia(blockSector + SBmp_SizeInSectors(), SectorsPerBlock(), 0);
+        if(nRes != KErrNone)
+            return nRes;//-- this is the error code
+    }
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Make the sector allocation bitmap for a new block and queue writing it and the block data, if given. The caller submits the batch.
+
+    @param  aBlockSector    starting sector of the block in the file
+    @param  aSecBmpFill     if true, all bits in the block bitmap will be set to '1', otherwise to '0'
+    @param  aBmpBuf         buffer for the bitmap image, must stay alive until the batch is submitted
+    @param  apData          if not NULL, the data for the whole block, starting from the buffer current position
+*/
+void CVhdDynDiffBase::DoQueueBlockWrite(TBatEntry aBlockSector, bool aSecBmpFill, CDynBuffer& aBmpBuf, const TIoVecBuf* apData)
+{
+    const uint32_t secBmpSizeInBytes = SBmp_SizeInSectors()<<SectorSzLog2();
+    aBmpBuf.Resize(secBmpSizeInBytes);
+    aBmpBuf.FillZ();
+
+    if(aSecBmpFill)
+    {//-- mark all sectors in bitmap as "mapped", setting appropriate bits to '1'
+        const uint32_t secBmpFillBytes = 1 << (SectorsPerBlockLog2() - KBitsInByteLog2);
+        ASSERT(secBmpFillBytes <= secBmpSizeInBytes);
+
+        aBmpBuf.Fill(0, secBmpFillBytes, 0xFF);
+    }
+
+    DoRaw_QueueWrite(aBlockSector, secBmpSizeInBytes, TIoVecBuf(aBmpBuf.Ptr(), secBmpSizeInBytes));
+
+    if(apData)
+    {
+        const uint32_t blockBytes = SectorsPerBlock() << SectorSzLog2();
+        DoRaw_QueueWrite(aBlockSector + SBmp_SizeInSectors(), blockBytes, *apData);
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Allocate a new block for the given logical block: reuse a free block slot inside the file if there is one, see DoTakeFreeSlot(),
+    otherwise append the block to the end of the file. The caller places the block entry to the BAT.
+    Parameters are the same as for AppendBlock(). The data of a reused slot is always zero-filled if it isn't given, because the slot
+    may keep the data of the block that used it, e.g. if the file system can't punch holes; an appended block reads as zeroes anyway.
+
+    @param  aBlockNumber    logical block number the block is allocated for
+
+    @return standard error code, KErrNone on success
+*/
+int CVhdDynDiffBase::AllocateBlock(uint32_t aBlockNumber, TBatEntry& aBlockSector, bool aSecBmpFill, bool aZeroFillData, const TIoVecBuf* apData /*=NULL*/)
+{
+    ASSERT(!(apData && aZeroFillData));
+
+    TBatEntry blockSector;
+    int nRes = DoTakeFreeSlot(aBlockNumber, blockSector);
+    if(nRes == KErrNotFound)
+        return AppendBlock(aBlockSector, aSecBmpFill, aZeroFillData, apData);
+
+    if(nRes != KErrNone)
+        return nRes;
+
+    DBG_LOG("CVhdDynDiffBase::AllocateBlock[0x%p] block:%d reuses sector:%d, SecBmpFill:%d, DataZFill:%d, Data:%d", this, aBlockNumber, blockSector, aSecBmpFill, aZeroFillData, apData != NULL);
+
+    //-- the bitmap page of the block that used the slot may still be cached
+    if(!BlockPureMode())
+        ipSectorMapper->DiscardBlock(blockSector);
+
+    CDynBuffer bmpBuf;
+    DoQueueBlockWrite(blockSector, aSecBmpFill, bmpBuf, apData);
+
+    nRes = DoRaw_SubmitBatch();
+    if(nRes != KErrNone)
+    {//-- the slot is still free
+        iFreeSlots.insert(blockSector);
+        return nRes;
+    }
+
+    aBlockSector = blockSector;
+
+    if(!apData)
+    {
+        nRes = DoRaw_FillMedia(blockSector + SBmp_SizeInSectors(), SectorsPerBlock(), 0);
+        if(nRes != KErrNone)
+            return nRes;
+    }
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Take a free block slot for the given logical block out of the free slots list. The slot following the block in front of the
+    given one is preferred, so that logically adjacent blocks stay adjacent in the file; otherwise the first free slot is taken.
+    The slots freed since the last BAT flush become usable after committing the metadata, so that a crash can't leave the BAT on
+    the media referring to a slot that has been given to another block, @see CommitMetadata()
+
+    @param  aBlockNumber    logical block number the slot is taken for
+    @param  aBlockSector    out: starting sector of the slot
+
+    @return KErrNone on success, KErrNotFound if there are no free slots, negative error code otherwise
+*/
+int CVhdDynDiffBase::DoTakeFreeSlot(uint32_t aBlockNumber, TBatEntry& aBlockSector)
+{
+    int nRes = DoLoadFreeSlots();
+    if(nRes != KErrNone)
+        return nRes;
+
+    if(iFreeSlots.empty())
+    {
+        if(iPendingSlots.empty())
+            return KErrNotFound;
+
+        //-- the data of the blocks allocated since the last commit must reach the media before the BAT that refers to them
+        nRes = CommitMetadata();
+        if(nRes != KErrNone)
+            return nRes;
+
+        iFreeSlots.insert(iPendingSlots.begin(), iPendingSlots.end());
+        iPendingSlots.clear();
+    }
+
+    set<TBatEntry>::iterator it = iFreeSlots.begin();
+
+    if(aBlockNumber)
+    {
+        const TBatEntry prevBlockSector = ipBAT->ReadEntry(aBlockNumber-1);
+        if(prevBlockSector != KBatEntry_Unused)
+        {
+            set<TBatEntry>::iterator itNear = iFreeSlots.lower_bound(prevBlockSector + SBmp_SizeInSectors() + SectorsPerBlock());
+            if(itNear != iFreeSlots.end())
+                it = itNear;
+        }
+    }
+
+    aBlockSector = *it;
+    iFreeSlots.erase(it);
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Build the list of free block slots from the BAT once, on the first block allocation: the slots in the space between the
+    metadata and the footer that no BAT entry refers to. E.g. the places of the blocks unlinked by discarding their sectors.
+    The list is built from the BAT cache without committing the metadata: the slots unlinked since the last commit may still be
+    referred to by the BAT on the media, they stay in iPendingSlots until the next commit, @see DoTakeFreeSlot()
+
+    @return standard error code, KErrNone on success
+*/
+int CVhdDynDiffBase::DoLoadFreeSlots()
+{
+    if(iFreeSlotsLoaded)
+        return KErrNone;
+
+    const int nRes = DoLoadFileTail();
+    if(nRes != KErrNone)
+        return nRes;
+
+    //-- 1. collect the used blocks sorted by their position in the file
+    vector<TBatEntry> usedBlocks;
+    const uint32_t KBlocks = Header().MaxBatEntries();
+
+    for(uint32_t blk = 0; blk < KBlocks; ++blk)
+    {
+        const TBatEntry blockSector = ipBAT->ReadEntry(blk);
+        if(blockSector == KBatEntry_Unused)
+            continue;
+
+        if(!BatEntryValid(blockSector) || blockSector >= iFooterSector)
+            return KErrCorrupt;
+
+        usedBlocks.push_back(blockSector);
+    }
+
+    std::sort(usedBlocks.begin(), usedBlocks.end());
+
+    //-- 2. every gap between the used blocks gives as many slots as fit into it
+    const uint32_t KBlockSectors = SBmp_SizeInSectors() + SectorsPerBlock();
+
+    iFreeSlots.clear();
+
+    uint32_t freePos = DoMetadataEndSector();
+
+    for(size_t i = 0; i <= usedBlocks.size(); ++i)
+    {
+        const uint32_t gapEnd = (i < usedBlocks.size()) ? usedBlocks[i] : iFooterSector;
+
+        for(; freePos + KBlockSectors <= gapEnd; freePos += KBlockSectors)
+            iFreeSlots.insert(freePos);
+
+        if(i < usedBlocks.size())
+            freePos = Max(freePos, usedBlocks[i] + KBlockSectors);
+    }
+
+    //-- 3. the slots unlinked since the last commit can't be reused yet
+    for(size_t i = 0; i < iPendingSlots.size(); ++i)
+        iFreeSlots.erase(iPendingSlots[i]);
+
+    DBG_LOG("CVhdDynDiffBase::DoLoadFreeSlots[0x%p] free slots:%d, pending:%d", this, iFreeSlots.size(), iPendingSlots.size());
+
+    iFreeSlotsLoaded = true;
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/** Forget the free block slots, the list will be rebuilt from the BAT on the next block allocation */
+void CVhdDynDiffBase::DoResetFreeSlots()
+{
+    iFreeSlots.clear();
+    iPendingSlots.clear();
+    iFreeSlotsLoaded = false;
+}
+
+//--------------------------------------------------------------------
+/**
+    Check if the block's sector allocation bitmap has no sectors mapped.
+    @param  aBlockSector    block starting sector from the BAT
+    @return true if all bits of the bitmap are '0'. Always false in VHDF_OPMODE_PURE_BLOCKS mode, all sectors are mapped then.
+*/
+bool CVhdDynDiffBase::DoBlockBitmapEmpty(TBatEntry aBlockSector)
+{
+    if(BlockPureMode())
+        return false;
+
+    const CSectorBmpPage* pPage = ipSectorMapper->GetSectorAllocBitmap(aBlockSector);
+
+    if(pPage->State() == ESB_FullyUnmapped)
+        return true;
+
+    if(pPage->State() == ESB_FullyMapped)
+        return false;
+
+    return pPage->GetAllocBitmap_Raw().IsFilledWith(0, SectorsPerBlock()-1, 0);
+}
+
+//--------------------------------------------------------------------
+/**
+    Discard a range of sectors within a present block: reset their bits in the sector allocation bitmap and give the space of the data
+    sectors back to the host file system. If no sectors of the block are left in use, the block is taken out of the BAT and all its
+    space is given back, so that it reads as it was never written. This is safe in any order on the media, because a block with
+    all-zero bitmap reads the same as an absent one.
+
+    @param  aBlockNumber    logical block number
+    @param  aBlockSector    block starting sector from the BAT
+    @param  aSectorInBlock  first sector to discard, relative to the block start
+    @param  aSectors        number of sectors to discard, all within the block
+
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::DoDiscardBlockSectors(uint32_t aBlockNumber, TBatEntry aBlockSector, uint32_t aSectorInBlock, uint32_t aSectors)
+{
+    ASSERT(BatEntryValid(aBlockSector));
+    ASSERT(aSectors && aSectorInBlock + aSectors <= SectorsPerBlock());
+
+    const TSectorBitmapState sectBmpState = ipSectorMapper->ResetSectorAllocBits(aBlockSector, aSectorInBlock, aSectors);
+    if(sectBmpState == ESB_Invalid)
+    {//-- something really bad happened
+        ASSERT(0);
         return KErrCorrupt;
     }
 
-    //-- 2. read footer from the last sector of the file
-    uint32_t currSector = U64Low((filePos >> SectorSzLog2()));
-    ASSERT(currSector > 0);
-    --currSector;
+    const uint32_t KDataSector = aBlockSector + SBmp_SizeInSectors();
+
+    //-- check if there is anything left in the block
+    if(!DoBlockBitmapEmpty(aBlockSector))
+    {
+        const int nRes = DoRaw_PunchHole(KDataSector + aSectorInBlock, aSectors);
+        return (nRes == KErrNotSupported) ? KErrNone : nRes;
+    }
+
+    //-- the whole block is discarded, unlink it from the BAT. Its slot in the file is reused by a next block allocation,
+    //-- see AllocateBlock(), or given back by compacting the VHD
+    DBG_LOG("CVhdDynDiffBase::DoDiscardBlockSectors[0x%p] unlinking block:%d, sector:%d", this, aBlockNumber, aBlockSector);
 
-    CDynBuffer buf(SectorSize());
+    ipSectorMapper->DiscardBlock(aBlockSector);
 
-    nRes = DoRaw_ReadData(currSector, SectorSize(), buf.Ptr());
-    if(nRes <0)
-        return nRes;//-- this is the error code
+    int nRes = ipBAT->WriteEntry(aBlockNumber, KBatEntry_Unused);
+    if(nRes != KErrNone)
+        return nRes;
 
-    ASSERT(nRes == (int)SectorSize());
+    iPendingSlots.push_back(aBlockSector);
 
-    //-- 2.1
-    //-- in theory, we need to check VHD footer fields OriginalSize & CurrentSize;
-    //-- they might need to be updated. Many VHDs are created with these fields already containing max. VHD size.
-    //-- updating these fields implies recalculating footer checksums etc. Leave it for later if we need to implement it.
+    nRes = DoRaw_PunchHole(aBlockSector, SBmp_SizeInSectors() + SectorsPerBlock());
+    return (nRes == KErrNotSupported) ? KErrNone : nRes;
+}
 
+//--------------------------------------------------------------------
+/**
+    Make sure that the host file space is preallocated up to the given sector. If it isn't, preallocate the region from the
+    current end of the file up to aEndSector plus the preallocation window, without changing the file size, so that the footer
+    stays at the end of the file. Thus the file system gets large contiguous extents instead of one block at a time.
+    Preallocation is an optimisation, its failures are ignored.
 
-    //-- 3. write footer at the end of a new block, expand the file
-    {
-        const uint32_t newFooterSec = currSector + SBmp_SizeInSectors() + SectorsPerBlock();
+    @param  aEndSector  sector past the end of the region that is going to be written
+*/
+void CVhdDynDiffBase::DoPreallocate(uint32_t aEndSector)
+{
+    if(!iPreallocWindowSec || aEndSector <= iPreallocEndSec)
+        return;
 
-        nRes = DoRaw_WriteData(newFooterSec, SectorSize(), buf.Ptr());
-        if(nRes <0)
-            return nRes;//-- this is the error code
+    ASSERT(iFooterSector);
+
+    const uint32_t startSec = Max(iPreallocEndSec, iFooterSector);
+    const uint64_t endSec   = Min((uint64_t)aEndSector + iPreallocWindowSec, (uint64_t)UINT_MAX);
+
+    const int nRes = PreallocFileRange(FileDesc(), ((uint64_t)startSec) << SectorSzLog2(), (endSec - startSec) << SectorSzLog2());
+    DBG_LOG("CVhdDynDiffBase::DoPreallocate[0x%p] sectors:%d-%lld, res:%d", this, startSec, endSec, nRes);
 
-        ASSERT(nRes == (int)SectorSize());
+    if(nRes == KErrNotSupported)
+    {//-- don't try again
+        iPreallocWindowSec = 0;
+        return;
     }
 
-    //-- 4. Create  sector allocation bitmap with required filling
-    {
-        const uint32_t secBmpSizeInBytes = SBmp_SizeInSectors()<<SectorSzLog2();
+    if(nRes == KErrNone)
+        iPreallocEndSec = (uint32_t)endSec;
+}
 
-        buf.Resize(secBmpSizeInBytes);//-- expand buffer if necessary
-        buf.FillZ();                  //-- zero-fill buffer
+//--------------------------------------------------------------------
+/** Release the host file space preallocated beyond the footer by truncating the file to its size */
+void CVhdDynDiffBase::DoReleasePrealloc()
+{
+    if(!iPreallocEndSec)
+        return;
 
-        if(aSecBmpFill)
-        {//-- mark all sectors in bitmap as "mapped", setting appropriate bits to '1'
-            const uint32_t secBmpFillBytes = 1 << (SectorsPerBlockLog2() - KBitsInByteLog2);
-            ASSERT(secBmpFillBytes <= secBmpSizeInBytes);
+    ASSERT(iFooterSector);
+    iPreallocEndSec = 0;
 
-            buf.Fill(0, secBmpFillBytes, 0xFF);
-        }
+    if(ftruncate64(FileDesc(), ((uint64_t)iFooterSector + 1) << SectorSzLog2()) != 0)
+    {
+        DBG_LOG("CVhdDynDiffBase::DoReleasePrealloc[0x%p] error:%d", this, errno);
+    }
+}
 
-        nRes = DoRaw_WriteData(currSector, secBmpSizeInBytes, buf.Ptr());
-        if(nRes <0)
-            return nRes;//-- this is the error code
+//--------------------------------------------------------------------
+/**
+    Allocate a new block that is going to be written entirely, with its data. The block doesn't need zero-filling or copying sectors
+    from the parent and its bitmap has all bits set, so the bitmap, the data and the footer, if the block is appended, are written by a single I/O.
+    Places the block entry to the BAT cache.
 
-        ASSERT(nRes == (int)secBmpSizeInBytes);
+    @param  aParams parameters, describing the operation; the extent must cover the whole block. Adjusted on completion.
+    @return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdDynDiffBase::DoAppendFullBlock(TBlkOpParams &aParams)
+{
+    ASSERT(ipBAT->ReadEntry(aParams.iCurrBlock) == KBatEntry_Unused);
+    ASSERT(aParams.iNumSectors == SectorsPerBlock() && !SectorInBlock(aParams.iCurrSectorL));
 
-        aBlockSector = currSector;
-        currSector += SBmp_SizeInSectors();
-    }
+    const uint32_t KBytesToWrite = aParams.iNumSectors << SectorSzLog2();
 
-    //-- 5. zero-fill block body if requested
-    if(aZeroFillData)
+    TBatEntry blockSector;
+    int nRes = AllocateBlock(aParams.iCurrBlock, blockSector, true, false, &aParams.iData);
+    if(nRes != KErrNone)
+        return nRes;
+
+    nRes = ipBAT->WriteEntry(aParams.iCurrBlock, blockSector);
+    if(nRes < 0)
     {
-        nRes = DoRaw_FillMedia(currSector, SectorsPerBlock(), 0);
-        if(nRes != KErrNone)
-            return nRes;//-- this is the error code
+        ASSERT(0);
+        return nRes;
     }
 
+    aParams.iFlushMetadata = true; //-- indicate that the metadata caches need flushing
+
+    //-- update parameters data
+    aParams.iCurrSectorL += aParams.iNumSectors;
+    aParams.iData.Advance(KBytesToWrite);
+
     return KErrNone;
 }
 
@@ -1112,18 +2177,17 @@ int CVhdDynDiffBase::AppendBlock(TBatEntry& aBlockSector, bool aSecBmpFill, bool
 
 	@param	aStartSector	starting logical sector.
 	@param	aSectors		number of logical sectors to read 0..LONG_MAX
-	@param	apBuffer		out: read data
-    @param  aBufSize        buffer size in bytes
+	@param	aBuf		    out: read data go to the buffer starting from its current position
 
     @return	positive number of read sectors on success, negative value corresponding system error code otherwise.
 */
 
-int CVhdDynDiffBase::ReadSectors(uint32_t aStartSector, int aSectors, void* apBuffer, uint32_t aBufSize)
+int CVhdDynDiffBase::ReadSectorsV(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf)
 {
     DBG_LOG("#--- CVhdDynDiffBase::ReadSectors[0x%p] startSec:%d, num:%d",this, aStartSector, aSectors);
 
     //-- check arguments and adjust number of sectors to read if necessary
-    int nRes = DoCheckRW_Args(aStartSector, aSectors, aBufSize);
+    int nRes = DoCheckRW_Args(aStartSector, aSectors, aBuf.Size());
     if(nRes <= 0 )
         return nRes; //-- something is wrong with the arguments
 
@@ -1138,10 +2202,33 @@ int CVhdDynDiffBase::ReadSectors(uint32_t aStartSector, int aSectors, void* apBu
 
     blkParams.iCurrBlock    = startBlock;
     blkParams.iCurrSectorL  = aStartSector;
-    blkParams.ipData        = (uint8_t*)apBuffer;
+    blkParams.iData         = aBuf;
 
     do
     {
+        //-- try to find a run of blocks that can be read by a single I/O
+        TBatEntry runBlockSector;
+        const uint32_t KRunBlocks = DoFindContiguousRun(blkParams.iCurrBlock, cntBlocks, runBlockSector);
+        if(KRunBlocks > 1)
+        {
+            cntBlocks -= KRunBlocks;
+
+            const uint32_t KSectorsToRead = (cntBlocks) ? (KRunBlocks << SectorsPerBlockLog2()) - SectorInBlock(blkParams.iCurrSectorL)
+                                                        : remSectors;
+            blkParams.iNumSectors = KSectorsToRead;
+
+            nRes = DoContiguousRunIo(blkParams, runBlockSector, false);
+            if(nRes <0)
+            {
+                DBG_LOG("#--- CVhdDynDiffBase::DoContiguousRunIo[0x%p] error!, code:%d", this, nRes);
+                return nRes;
+            }
+
+            remSectors -= KSectorsToRead;
+            blkParams.iCurrBlock += KRunBlocks;
+            continue;
+        }
+
         --cntBlocks;
 
         //-- amount of sectors we can read from the _current_ block
@@ -1173,13 +2260,12 @@ int CVhdDynDiffBase::ReadSectors(uint32_t aStartSector, int aSectors, void* apBu
 	Write a number of sectors to the VHD file. Sector numbers are logical, i.e. 0..VhdSizeInSectors()
 	@param	aStartSector	starting logical sector.
 	@param	aSectors		number of logical sectors to write 0..LONG_MAX
-	@param	apBuffer		in: data to write
-    @param  aBufSize        buffer size in bytes
+	@param	aBuf		    in: data to write, starting from the buffer current position
 
 	@return	positive number of written sectors on success, negative value corresponding system error code otherwise.
 */
 
-int CVhdDynDiffBase::WriteSectors(uint32_t aStartSector, int aSectors, const void* apBuffer, uint32_t aBufSize)
+int CVhdDynDiffBase::WriteSectorsV(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf)
 {
     DBG_LOG("#--- CVhdDynDiffBase::WriteSectors[0x%p] startSec:%d, num:%d",this, aStartSector, aSectors);
 
@@ -1187,7 +2273,7 @@ int CVhdDynDiffBase::WriteSectors(uint32_t aStartSector, int aSectors, const voi
         return -EBADF;
 
     //-- check arguments and adjust number of sectors to write if necessary
-    int nRes = DoCheckRW_Args(aStartSector, aSectors, aBufSize);
+    int nRes = DoCheckRW_Args(aStartSector, aSectors, aBuf.Size());
     if(nRes <= 0 )
         return nRes; //-- something is wrong with the arguments
 
@@ -1201,10 +2287,33 @@ int CVhdDynDiffBase::WriteSectors(uint32_t aStartSector, int aSectors, const voi
     TBlkOpParams blkParams;
     blkParams.iCurrBlock    = startBlock;
     blkParams.iCurrSectorL  = aStartSector;
-    blkParams.ipData        = (uint8_t*)apBuffer;
+    blkParams.iData         = aBuf;
 
     do
     {
+        //-- try to find a run of blocks that can be written by a single batch of I/O requests
+        TBatEntry runBlockSector;
+        const uint32_t KRunBlocks = DoFindContiguousRun(blkParams.iCurrBlock, cntBlocks, runBlockSector);
+        if(KRunBlocks > 1)
+        {
+            cntBlocks -= KRunBlocks;
+
+            const uint32_t KSectorsToWrite = (cntBlocks) ? (KRunBlocks << SectorsPerBlockLog2()) - SectorInBlock(blkParams.iCurrSectorL)
+                                                         : remSectors;
+            blkParams.iNumSectors = KSectorsToWrite;
+
+            nRes = DoContiguousRunIo(blkParams, runBlockSector, true);
+            if(nRes <0)
+            {
+                DBG_LOG("#--- CVhdDynDiffBase::DoContiguousRunIo[0x%p] error!, code:%d", this, nRes);
+                return nRes;
+            }
+
+            remSectors -= KSectorsToWrite;
+            blkParams.iCurrBlock += KRunBlocks;
+            continue;
+        }
+
         --cntBlocks;
 
         //-- amount of sectors we can write to the _current_ block
@@ -1227,8 +2336,12 @@ int CVhdDynDiffBase::WriteSectors(uint32_t aStartSector, int aSectors, const voi
 
     ASSERT(!remSectors);
 
-    if(blkParams.iFlushMetadata)
-        nRes = Flush();
+    if(Durability() == EDurability_WriteThrough)
+        nRes = DoWriteMetadata(); //-- the file is opened with O_DSYNC, the data is already on the media
+    else if(blkParams.iFlushMetadata)
+        nRes = DoAllocationCommit();
+
+    DoCheckMetadataDirty();
 
     if(nRes < 0)
         return nRes;
@@ -1241,6 +2354,399 @@ int CVhdDynDiffBase::WriteSectors(uint32_t aStartSector, int aSectors, const voi
 
 
 
+//--------------------------------------------------------------------
+/**
+    Translate an extent of logical sectors into the list of extents describing where the sectors data are located in the VHD chain.
+    Sector numbers are logical, i.e. 0..VhdSizeInSectors()
+
+	@param	aStartSector	starting logical sector.
+	@param	aSectors		number of logical sectors to map 1..LONG_MAX
+	@param	aAllocate		if true, the sectors are going to be written by the client; absent blocks will be appended to the file and
+                            all sectors will be mapped to this VHD file. CommitExtents() must be called after writing the data.
+	@param	aList		    out: list of extents. If it overflows, the rest of the sectors range is not mapped
+	@param	aLayer		    index of this VHD in the chain
+
+	@return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdDynDiffBase::MapExtents(uint32_t aStartSector, int aSectors, bool aAllocate, TVhdExtentList& aList, uint32_t aLayer)
+{
+    DBG_LOG("#--- CVhdDynDiffBase::MapExtents[0x%p] startSec:%d, num:%d, alloc:%d",this, aStartSector, aSectors, aAllocate);
+
+    if(aAllocate && ReadOnly())
+        return -EBADF;
+
+    //-- check arguments and adjust number of sectors to map if necessary
+    int nRes = DoCheckRW_Args(aStartSector, aSectors, ((size_t)aSectors) << SectorSzLog2());
+    if(nRes <= 0 )
+        return nRes; //-- something is wrong with the arguments
+
+    uint32_t remSectors = (uint32_t)nRes;
+    uint32_t currSector = aStartSector;
+    uint32_t currBlock  = SectorToBlockNumber(aStartSector);
+    bool     bFlushMetadata = false; //-- true if some blocks were appended to the file
+
+    nRes = KErrNone;
+    while(remSectors && !aList.Overflown())
+    {
+        //-- amount of sectors in the _current_ block
+        const uint32_t KSectors = Min(remSectors, SectorsPerBlock()-SectorInBlock(currSector));
+
+        TBatEntry blockSector = ipBAT->ReadEntry(currBlock);
+
+        if(aAllocate)
+        {
+            if(blockSector == KBatEntry_Unused)
+            {//-- the block isn't present; need to extend VHD file by one block
+                if(aList.Full())
+                    break; //-- don't allocate a block that can't be reported to the client
+
+                bool bSetAllBmpBits = false;
+                nRes = DoAllocateBlock(currBlock, currSector, KSectors, blockSector, bSetAllBmpBits);
+                if(nRes < 0)
+                    break;
+
+                bFlushMetadata = true;
+
+                if(bSetAllBmpBits && !BlockPureMode())
+                {//-- the sectors outside the range had been populated, mark the whole block as mapped, as WriteSectors() does
+                    if(ipSectorMapper->SetSectorAllocBits(blockSector, 0, SectorsPerBlock()) == ESB_Invalid)
+                    {
+                        ASSERT(0);
+                        nRes = KErrCorrupt;
+                        break;
+                    }
+                }
+            }
+
+            ASSERT(BatEntryValid(blockSector));
+            const uint64_t KFileOffset = ((uint64_t)(blockSector + SBmp_SizeInSectors() + SectorInBlock(currSector))) << SectorSzLog2();
+            aList.Add(EVhdExt_Data, currSector, KSectors, aLayer, FileDesc(), KFileOffset);
+        }
+        else
+        {
+            nRes = (blockSector == KBatEntry_Unused) ? DoMapUnallocated(currSector, KSectors, aList, aLayer)
+                                                     : DoMapBlockExtents(currSector, KSectors, blockSector, aList, aLayer);
+            if(nRes < 0)
+                break;
+        }
+
+        currSector += KSectors;
+        remSectors -= KSectors;
+        ++currBlock;
+    }
+
+    if(bFlushMetadata)
+    {//-- new blocks must be persistent before the client starts writing data to them
+        const int nFlushRes = Flush();
+        if(nRes >= 0)
+            nRes = nFlushRes;
+    }
+
+    return (nRes < 0) ? nRes : KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Map an extent of sectors that belongs to a single present block according to the block sector allocation bitmap.
+
+	@param	aStartSector	starting logical sector.
+	@param	aSectors		number of logical sectors to map, all of them must be in the same block
+	@param	aBlockSector	block starting sector in the file
+	@param	aList		    out: list of extents
+	@param	aLayer		    index of this VHD in the chain
+
+	@return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdDynDiffBase::DoMapBlockExtents(uint32_t aStartSector, uint32_t aSectors, TBatEntry aBlockSector, TVhdExtentList& aList, uint32_t aLayer)
+{
+    ASSERT(BatEntryValid(aBlockSector));
+
+    const uint32_t KDataSectorP = aBlockSector + SBmp_SizeInSectors(); //-- physical sector number of the block data in the file
+
+    if(BlockPureMode())
+    {//-- if we are operating in PURE mode, it is _guaranteed_ that the bitmap contains all bits set to 1
+        ASSERT(ipSectorMapper->State() == CSectorMapper::EInvalid);
+        aList.Add(EVhdExt_Data, aStartSector, aSectors, aLayer, FileDesc(), ((uint64_t)(KDataSectorP + SectorInBlock(aStartSector))) << SectorSzLog2());
+        return KErrNone;
+    }
+
+    const CSectorBmpPage* pBitmap = ipSectorMapper->GetSectorAllocBitmap(aBlockSector);
+    if(!pBitmap)
+        return KErrCorrupt;
+
+    const TSectorBitmapState bmpState = pBitmap->State();
+
+    if(bmpState == ESB_FullyMapped)
+    {
+        aList.Add(EVhdExt_Data, aStartSector, aSectors, aLayer, FileDesc(), ((uint64_t)(KDataSectorP + SectorInBlock(aStartSector))) << SectorSzLog2());
+        return KErrNone;
+    }
+    else if(bmpState == ESB_FullyUnmapped)
+    {
+        return DoMapUnallocated(aStartSector, aSectors, aList, aLayer);
+    }
+
+    //-- a mixture of '1's and '0's in the bitmap
+    ASSERT(bmpState == ESB_Clean || bmpState == ESB_Dirty);
+
+    TBitExtentFinder extFinder(pBitmap->GetAllocBitmap_Raw(), SectorInBlock(aStartSector), aSectors);
+    while(!aList.Overflown() && extFinder.FindExtent())
+    {
+        const uint32_t extSectorL = aStartSector + (extFinder.ExtStartPos() - SectorInBlock(aStartSector));
+
+        if(extFinder.ExtBitVal())
+        {//-- '1's: the sectors are in this file
+            aList.Add(EVhdExt_Data, extSectorL, extFinder.ExtLen(), aLayer, FileDesc(), ((uint64_t)(KDataSectorP + extFinder.ExtStartPos())) << SectorSzLog2());
+        }
+        else
+        {//-- '0's: the meaning depends on the VHD type
+            const int nRes = DoMapUnallocated(extSectorL, extFinder.ExtLen(), aList, aLayer);
+            if(nRes < 0)
+                return nRes;
+        }
+    }
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Find the run of sectors starting at the given one that are either all present in this file or all absent from it.
+    The run doesn't go beyond the block the starting sector belongs to. Used for resolving reads through the chain of VHDs
+    without calling the parents' ReadSectorsV(), see CVhdFileDiff::DoReadSectorsFromParent().
+
+	@param	aStartSector	starting logical sector, must be less than VhdSizeInSectors()
+	@param	aSectors		max. number of sectors in the run, > 0
+	@param	aRun		    out: the run description
+
+	@return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdDynDiffBase::MapLayerRun(uint32_t aStartSector, uint32_t aSectors, TLayerRun& aRun)
+{
+    ASSERT(State() == EOpened);
+    ASSERT(aSectors && aStartSector < VhdSizeInSectors());
+
+    const uint32_t KSectorInBlock = SectorInBlock(aStartSector);
+
+    aRun.iPresent    = false;
+    aRun.iSectors    = Min(aSectors, SectorsPerBlock() - KSectorInBlock);
+    aRun.iFileSector = 0;
+
+    const TBatEntry KBlockSector = ipBAT->ReadEntry(SectorToBlockNumber(aStartSector));
+    if(KBlockSector == KBatEntry_Unused)
+        return KErrNone; //-- the whole block isn't present
+
+    ASSERT(BatEntryValid(KBlockSector));
+
+    const uint32_t KDataSectorP = KBlockSector + SBmp_SizeInSectors(); //-- physical sector number of the block data in the file
+
+    if(!BlockPureMode())
+    {
+        const CSectorBmpPage* pBitmap = ipSectorMapper->GetSectorAllocBitmap(KBlockSector);
+        if(!pBitmap)
+            return KErrCorrupt;
+
+        const TSectorBitmapState bmpState = pBitmap->State();
+
+        if(bmpState == ESB_FullyUnmapped)
+            return KErrNone;
+
+        if(bmpState != ESB_FullyMapped)
+        {//-- a mixture of '1's and '0's in the bitmap, the run is the first extent of the same bits
+            ASSERT(bmpState == ESB_Clean || bmpState == ESB_Dirty);
+
+            TBitExtentFinder extFinder(pBitmap->GetAllocBitmap_Raw(), KSectorInBlock, aRun.iSectors);
+            if(!extFinder.FindExtent())
+            {
+                ASSERT(0);
+                return KErrCorrupt;
+            }
+
+            ASSERT(extFinder.ExtStartPos() == KSectorInBlock);
+            aRun.iSectors = extFinder.ExtLen();
+
+            if(!extFinder.ExtBitVal())
+                return KErrNone;
+        }
+    }
+
+    //-- PURE mode guarantees that the bitmap contains all bits set to 1
+    aRun.iPresent    = true;
+    aRun.iFileSector = KDataSectorP + KSectorInBlock;
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    @return counter of the changes of where the sectors are in the file: the BAT changes (block allocation, relocation, unlinking)
+    plus the sector bitmap changes. Wraps around, only comparing it for equality makes sense.
+*/
+uint32_t CVhdDynDiffBase::LayoutChanges() const
+{
+    return (ipBAT ? ipBAT->Changes() : 0) + (ipSectorMapper ? ipSectorMapper->Changes() : 0);
+}
+
+//--------------------------------------------------------------------
+/**
+    Mark an extent of sectors, written by the client directly to the file, as containing valid data. @see MapExtents()
+    All sectors must belong to the blocks that are present in the VHD.
+    Metadata are updated in the same way as WriteSectors() does.
+
+	@param	aStartSector	starting logical sector.
+	@param	aSectors		number of logical sectors 1..LONG_MAX
+
+	@return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdDynDiffBase::CommitExtents(uint32_t aStartSector, int aSectors)
+{
+    DBG_LOG("#--- CVhdDynDiffBase::CommitExtents[0x%p] startSec:%d, num:%d",this, aStartSector, aSectors);
+
+    if(ReadOnly())
+        return -EBADF;
+
+    int nRes = DoCheckRW_Args(aStartSector, aSectors, ((size_t)aSectors) << SectorSzLog2());
+    if(nRes <= 0 )
+        return nRes; //-- something is wrong with the arguments
+
+    uint32_t remSectors = (uint32_t)nRes;
+    uint32_t currSector = aStartSector;
+    uint32_t currBlock  = SectorToBlockNumber(aStartSector);
+
+    while(remSectors)
+    {
+        const uint32_t KSectors = Min(remSectors, SectorsPerBlock()-SectorInBlock(currSector));
+
+        const TBatEntry blockSector = ipBAT->ReadEntry(currBlock);
+        if(blockSector == KBatEntry_Unused)
+        {//-- the sectors weren't mapped for writing
+            DBG_LOG("block %d isn't allocated!", currBlock);
+            return KErrArgument;
+        }
+
+        if(!BlockPureMode())
+        {//-- in PURE mode the bitmap already contains all bits set to 1
+            const TSectorBitmapState sectBmpState = ipSectorMapper->SetSectorAllocBits(blockSector, SectorInBlock(currSector), KSectors);
+            if(sectBmpState == ESB_Invalid)
+            {//-- something really bad happened
+                ASSERT(0);
+                return KErrCorrupt;
+            }
+        }
+
+        currSector += KSectors;
+        remSectors -= KSectors;
+        ++currBlock;
+    }
+
+    return KErrNone;
+}
+
+
+
+
+//--------------------------------------------------------------------
+/**
+    Find a run of consecutive logical blocks that can be accessed as a single extent of the file, i.e. blocks that are
+    present in the file, located one after another and have all sectors mapped. Such blocks don't need looking into the
+    parent VHD or updating sector bitmaps on write; their data are separated only by the sector bitmap of the next block.
+
+    @param  aStartBlock     logical block number to start from
+    @param  aMaxBlocks      max. number of blocks to look at
+    @param  aBlockSector    out: starting sector of the first block in the run
+
+    @return number of blocks in the run; 0 if the first block can't be a part of it.
+*/
+uint32_t CVhdDynDiffBase::DoFindContiguousRun(uint32_t aStartBlock, uint32_t aMaxBlocks, TBatEntry& aBlockSector)
+{
+    const uint32_t KBlockSizeInSectors = SBmp_SizeInSectors() + SectorsPerBlock(); //-- block size in the file, including the bitmap
+
+    uint32_t  cntBlocks = 0;
+    TBatEntry nextBlockSector = KBatEntry_Unused;
+
+    for(; cntBlocks < aMaxBlocks; ++cntBlocks)
+    {
+        const TBatEntry blockSector = ipBAT->ReadEntry(aStartBlock + cntBlocks);
+
+        if(blockSector == KBatEntry_Unused)
+            break;
+
+        if(cntBlocks && blockSector != nextBlockSector)
+            break; //-- the block doesn't follow the previous one in the file
+
+        if(!BlockPureMode())
+        {//-- in PURE mode it is guaranteed that all sectors are mapped, otherwise need to check the bitmap
+            const CSectorBmpPage* pBitmap = ipSectorMapper->GetSectorAllocBitmap(blockSector);
+            if(!pBitmap || pBitmap->State() != ESB_FullyMapped)
+                break;
+        }
+
+        if(!cntBlocks)
+            aBlockSector = blockSector;
+
+        nextBlockSector = blockSector + KBlockSizeInSectors;
+    }
+
+    return cntBlocks;
+}
+
+//--------------------------------------------------------------------
+/**
+    Read or write sectors that belong to the run of blocks found by DoFindContiguousRun().
+    All requests are put to a single I/O engine batch. On reading, the bitmaps between the blocks are read to the scratch buffer,
+    so that the whole run is read by a single system call.
+
+    @param  aParams         parameters, describing the operation. iNumSectors is the number of sectors in the whole run.
+                            Some of them will be adjusted on completion.
+    @param  aBlockSector    starting sector of the first block in the run
+    @param  aWrite          true for writing, false for reading
+
+    @return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdDynDiffBase::DoContiguousRunIo(TBlkOpParams &aParams, TBatEntry aBlockSector, bool aWrite)
+{
+    const uint32_t KBitmapSectors = SBmp_SizeInSectors(); //-- block allocation bitmap size, in sectors
+
+    uint32_t  sectorL     = aParams.iCurrSectorL;
+    uint32_t  remSectors  = aParams.iNumSectors;
+    TBatEntry blockSector = aBlockSector;
+
+    for(;;)
+    {
+        const uint32_t KSectors  = Min(remSectors, SectorsPerBlock() - SectorInBlock(sectorL));
+        const uint32_t KBytes    = KSectors << SectorSzLog2();
+        const uint32_t KSectorP  = blockSector + KBitmapSectors + SectorInBlock(sectorL);
+
+        if(aWrite)
+            DoRaw_QueueWrite(KSectorP, KBytes, aParams.iData);
+        else
+            DoRaw_QueueRead(KSectorP, KBytes, aParams.iData);
+
+        aParams.iData.Advance(KBytes);
+        sectorL    += KSectors;
+        remSectors -= KSectors;
+
+        if(!remSectors)
+            break;
+
+        //-- the next block follows this one in the file
+        blockSector += KBitmapSectors + SectorsPerBlock();
+
+        if(!aWrite)
+            DoRaw_QueueReadGap(blockSector, KBitmapSectors << SectorSzLog2());
+    }
+
+    const int nRes = DoRaw_SubmitBatch();
+    if(nRes < 0)
+        return nRes;
+
+    aParams.iCurrSectorL = sectorL;
+
+    return KErrNone;
+}
+
+
+
 //####################################################################
 //#  CHandleMapper class implementation
 //####################################################################
@@ -1429,5 +2935,75 @@ void TVHD_Params::Dump() const
 
 
 
+//####################################################################
+//#  TVhdExtentList class implementation
+//####################################################################
+
+//--------------------------------------------------------------------
+/**
+    Constructor.
+    @param  apExtents   client's array of extents to be filled in
+    @param  aMaxExtents array size
+*/
+TVhdExtentList::TVhdExtentList(TVhdExtent* apExtents, uint32_t aMaxExtents)
+               :ipExtents(apExtents), iMaxExtents(aMaxExtents), iCount(0), iOverflown(false)
+{
+    ASSERT(ipExtents);
+}
+
+//--------------------------------------------------------------------
+/**
+    Append an extent to the list. If the extent logically and physically continues the last one, they are merged.
+
+    @param  aKind           extent kind
+    @param  aStartSector    starting logical sector, must follow the last extent in the list
+    @param  aSectors        number of sectors in the extent
+    @param  aLayer          index of the VHD in the chain
+    @param  aFd             file descriptor of the VHD, EVhdExt_Data only
+    @param  aFileOffset     extent offset in the file in bytes, EVhdExt_Data only
+
+    @return true if the extent is added, false if there is no room for it.
+*/
+bool TVhdExtentList::Add(TVhdExtentKind aKind, uint32_t aStartSector, uint32_t aSectors, uint32_t aLayer, int aFd, uint64_t aFileOffset)
+{
+    ASSERT(aSectors);
 
+    if(iOverflown)
+        return false;
+
+    if(aKind != EVhdExt_Data)
+    {
+        aFd = -1;
+        aFileOffset = 0;
+    }
+
+    if(iCount)
+    {
+        TVhdExtent& last = ipExtents[iCount-1];
+        ASSERT(last.extStartSector + last.extSectors == aStartSector);
+
+        if(last.extKind == aKind && last.extLayer == aLayer && last.extFd == aFd &&
+           (aKind != EVhdExt_Data || last.extFileOffset + (((uint64_t)last.extSectors) << KDefSecSizeLog2) == aFileOffset))
+        {//-- merge the extent with the last one
+            last.extSectors += aSectors;
+            return true;
+        }
+    }
 
+    if(iCount >= iMaxExtents)
+    {
+        iOverflown = true;
+        return false;
+    }
+
+    TVhdExtent& ext = ipExtents[iCount++];
+
+    ext.extKind         = aKind;
+    ext.extStartSector  = aStartSector;
+    ext.extSectors      = aSectors;
+    ext.extLayer        = aLayer;
+    ext.extFd           = aFd;
+    ext.extFileOffset   = aFileOffset;
+
+    return true;
+}
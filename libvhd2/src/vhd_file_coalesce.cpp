@@ -79,6 +79,10 @@ int CVhdFileDiff::DoCoalesceBlock(uint32_t aLogicalBlockNumber, uint32_t aVhdCha
         //-- and use it instead of walking the list for every block
         const CVhdFileBase* pParentVhd = GetParentOpened(parentNo);
 
+        //-- the parent can be shared with other chains
+        TVhdChainGuard guard;
+        guard.Lock(*pParentVhd);
+
         //-- get parent's block information
         if(! pParentVhd->IsBlockPresent(aLogicalBlockNumber))
             continue; //-- given block doesn't exist in the parent VHD
@@ -112,7 +116,7 @@ int CVhdFileDiff::DoCoalesceBlock(uint32_t aLogicalBlockNumber, uint32_t aVhdCha
     if(!blockPresent)
     {
         TBatEntry batEntry;
-        nRes = AppendBlock(batEntry, false, false);
+        nRes = AllocateBlock(aLogicalBlockNumber, batEntry, false, false);
         if(nRes < 0)
             return nRes;
 
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+
+    @file imlementation of Dynamic and Differencing VHD file online compacting
+*/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "vhd.h"
+#include "block_mng.h"
+
+//--------------------------------------------------------------------
+/**
+    Compact the VHD file while it is opened: take the dead blocks out of the BAT, move the blocks from the end of the file to the free
+    space in front of them and cut the file.
+
+    The dead blocks are the ones with no sectors mapped in their allocation bitmaps, e.g. fully discarded by TRIM. With
+    VHDF_COMPACT_ZERO_BLOCKS flag the Dynamic VHD blocks containing only zeroes are dead as well. A Differencing VHD block
+    containing zeroes isn't dead, because it hides the parent's data.
+
+    Every step leaves the file consistent on the media:
+        1. dead blocks are unlinked from the BAT, the BAT is written and synced
+        2. live blocks are copied to the free space, the copies are synced to the media before the BAT refers to them
+        3. the BAT is updated and synced, the old copies are now free
+        4. the footer is written to the new end of the file, then the file is truncated after it
+
+    @param  aFlags  VHDF_COMPACT_* flags
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::Compact(uint32_t aFlags)
+{
+    DBG_LOG("CVhdDynDiffBase::Compact[0x%p] flags:0x%x", this, aFlags);
+
+    if(ReadOnly())
+        return -EBADF;
+
+    if(aFlags & ~VHDF_COMPACT_ZERO_BLOCKS)
+        return KErrArgument;
+
+    ASSERT(State() == EOpened);
+
+    //-- 1. make the metadata on the media coherent with the caches, the blocks will be moved by copying the media.
+    //-- the data of the allocated blocks goes to the media first; the blocks unlinked before are free on the media afterwards
+    int nRes = CommitMetadata();
+    if(nRes != KErrNone)
+        return nRes;
+
+    nRes = DoLoadFileTail();
+    if(nRes != KErrNone)
+        return nRes;
+
+    //-- the blocks are going to be moved, the free block slots will be found again on the next block allocation
+    DoResetFreeSlots();
+
+    //-- 2. unlink the dead blocks, get the live ones sorted by their position in the file
+    vector<TBlockMove> liveBlocks;
+    nRes = DoFindDeadBlocks(aFlags, liveBlocks);
+    if(nRes != KErrNone)
+        return nRes;
+
+    //-- the dead blocks must be out of the BAT on the media before their space is reused
+    nRes = ipBAT->Flush();
+    if(nRes == KErrNone)
+        nRes = DoSyncData();
+
+    if(nRes != KErrNone)
+        return nRes;
+
+    //-- 3. walk the space after the metadata; move the last block in the file to the first gap that can take a block.
+    //-- the gaps are in front of the remaining blocks, so the moves never overlap the blocks being moved
+    const uint32_t KBlockSectors = SBmp_SizeInSectors() + SectorsPerBlock();
+
+    vector<TBlockMove> moves;
+    uint32_t freePos = DoMetadataEndSector(); //-- start of the free space being looked at
+    size_t   currIdx = 0;                     //-- the first block after freePos
+
+    for(;;)
+    {
+        //-- skip the blocks that don't leave room for another block in front of them
+        while(currIdx < liveBlocks.size() && liveBlocks[currIdx].iFromSector < freePos + KBlockSectors)
+        {
+            freePos = Max(freePos, liveBlocks[currIdx].iFromSector + KBlockSectors);
+            ++currIdx;
+        }
+
+        if(currIdx >= liveBlocks.size())
+            break; //-- no more gaps in front of the blocks
+
+        TBlockMove move = liveBlocks.back();
+        liveBlocks.pop_back();
+
+        move.iToSector = freePos;
+        moves.push_back(move);
+
+        freePos += KBlockSectors;
+    }
+
+    nRes = DoRelocateBlocks(moves);
+    if(nRes != KErrNone)
+        return nRes;
+
+    //-- 4. the file ends after the last block now
+    uint32_t newFooterSec = freePos;
+    if(!liveBlocks.empty())
+        newFooterSec = Max(newFooterSec, liveBlocks.back().iFromSector + KBlockSectors);
+
+    if(newFooterSec < iFooterSector)
+        nRes = DoTruncateTail(newFooterSec);
+
+    DoCheckMetadataDirty();
+
+    return nRes;
+}
+
+//--------------------------------------------------------------------
+/**
+    @return the sector after the VHD metadata that precede the blocks: header, BAT and parent locators data
+*/
+uint32_t CVhdDynDiffBase::DoMetadataEndSector() const
+{
+    uint64_t endPos = Footer().DataOffset() + TVhdHeader::KSize;
+
+    endPos = Max(endPos, Header().BatOffset() + ((uint64_t)Header().MaxBatEntries() << KBatEntrySizeLog2));
+
+    for(uint i=0; i<TVhdHeader::KNumParentLoc; ++i)
+    {
+        const TParentLocatorEntry& locEntry = Header().GetParentLocatorEntry(i);
+        if(locEntry.PlatCode() == TParentLocatorEntry::EPlatCode_NONE)
+            continue;
+
+        endPos = Max(endPos, locEntry.DataOffset() + Max(locEntry.DataSpace(), locEntry.DataLen()));
+    }
+
+    return U64Low((endPos + SectorSize() - 1) >> SectorSzLog2());
+}
+
+//--------------------------------------------------------------------
+/**
+    Walk through the BAT, unlink the dead blocks from it, see Compact().
+    @param  aFlags          VHDF_COMPACT_* flags
+    @param  aLiveBlocks     out: the blocks left in the BAT, sorted by their starting sectors
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::DoFindDeadBlocks(uint32_t aFlags, vector<TBlockMove>& aLiveBlocks)
+{
+    const bool bCheckData = (aFlags & VHDF_COMPACT_ZERO_BLOCKS) && VhdType() == EVhd_Dynamic;
+
+    aLiveBlocks.clear();
+
+    int nRes;
+    const uint32_t KBlocks = Header().MaxBatEntries();
+
+    for(uint32_t blk = 0; blk < KBlocks; ++blk)
+    {
+        const TBatEntry blockSector = ipBAT->ReadEntry(blk);
+        if(blockSector == KBatEntry_Unused)
+            continue;
+
+        if(!BatEntryValid(blockSector) || blockSector >= iFooterSector)
+            return KErrCorrupt;
+
+        bool bDead = DoBlockBitmapEmpty(blockSector);
+
+        if(!bDead && bCheckData)
+        {
+            nRes = DoRaw_CheckMediaFill(blockSector + SBmp_SizeInSectors(), SectorsPerBlock(), 0);
+            if(nRes != KErrNone && nRes != KErrNotFound)
+                return nRes;
+
+            bDead = (nRes == KErrNone);
+        }
+
+        if(bDead)
+        {
+            DBG_LOG("CVhdDynDiffBase::DoFindDeadBlocks[0x%p] unlinking block:%d, sector:%d", this, blk, blockSector);
+
+            if(!BlockPureMode())
+                ipSectorMapper->DiscardBlock(blockSector);
+
+            nRes = ipBAT->WriteEntry(blk, KBatEntry_Unused);
+            if(nRes != KErrNone)
+                return nRes;
+
+            continue;
+        }
+
+        TBlockMove block;
+        block.iBlockNumber = blk;
+        block.iFromSector  = blockSector;
+        block.iToSector    = blockSector;
+
+        aLiveBlocks.push_back(block);
+    }
+
+    //-- the blocks are appended in the order they are written, not in the BAT order
+    std::sort(aLiveBlocks.begin(), aLiveBlocks.end());
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Move the blocks to the new places in the file: copy them, sync the copies and then switch the BAT entries to them.
+    The new places must not be referred to by the BAT.
+
+    @param  aMoves  the blocks to move
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::DoRelocateBlocks(const vector<TBlockMove>& aMoves)
+{
+    if(aMoves.empty())
+        return KErrNone;
+
+    int nRes;
+
+    const uint32_t KBlockSectors = SBmp_SizeInSectors() + SectorsPerBlock();
+    const uint32_t KBufSectors   = Min(KBlockSectors, KDefScratchBufSize >> SectorSzLog2());
+
+    CDynBuffer buf(KBufSectors << SectorSzLog2());
+
+    //-- 1. copy the bitmaps and the data
+    for(size_t i = 0; i < aMoves.size(); ++i)
+    {
+        const TBlockMove& move = aMoves[i];
+        DBG_LOG("CVhdDynDiffBase::DoRelocateBlocks[0x%p] block:%d, sector:%d -> %d", this, move.iBlockNumber, move.iFromSector, move.iToSector);
+
+        ASSERT(move.iToSector + KBlockSectors <= move.iFromSector || move.iFromSector + KBlockSectors <= move.iToSector);
+
+        for(uint32_t secOffset = 0; secOffset < KBlockSectors; )
+        {
+            const uint32_t numSectors = Min(KBufSectors, KBlockSectors - secOffset);
+            const int      numBytes   = numSectors << SectorSzLog2();
+
+            nRes = DoRaw_ReadData(move.iFromSector + secOffset, numBytes, buf.Ptr());
+            if(nRes < 0)
+                return nRes;
+
+            nRes = DoRaw_WriteData(move.iToSector + secOffset, numBytes, buf.Ptr());
+            if(nRes < 0)
+                return nRes;
+
+            secOffset += numSectors;
+        }
+    }
+
+    //-- 2. the copies must be on the media before the BAT refers to them
+    nRes = DoSyncData();
+    if(nRes != KErrNone)
+        return nRes;
+
+    //-- 3. switch the BAT entries to the copies; the cached bitmaps are clean, drop the ones keyed by the old places
+    for(size_t i = 0; i < aMoves.size(); ++i)
+    {
+        if(!BlockPureMode())
+            ipSectorMapper->DiscardBlock(aMoves[i].iFromSector);
+
+        nRes = ipBAT->WriteEntry(aMoves[i].iBlockNumber, aMoves[i].iToSector);
+        if(nRes != KErrNone)
+            return nRes;
+    }
+
+    nRes = ipBAT->Flush();
+    if(nRes != KErrNone)
+        return nRes;
+
+    return DoSyncData();
+}
+
+//--------------------------------------------------------------------
+/**
+    Move the footer to the new end of the file and cut the file after it. The space after the new end must not be used.
+    @param  aNewFooterSector    new footer sector, less than the current one
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::DoTruncateTail(uint32_t aNewFooterSector)
+{
+    DBG_LOG("CVhdDynDiffBase::DoTruncateTail[0x%p] footer sector:%d -> %d", this, iFooterSector, aNewFooterSector);
+
+    ASSERT(iFooterSector && aNewFooterSector < iFooterSector);
+
+    //-- the old footer stays at the end of the file till truncation, so that the file is valid if it's interrupted
+    int nRes = DoRaw_WriteData(aNewFooterSector, SectorSize(), iFooterBuf.Ptr());
+    if(nRes < 0)
+        return nRes;
+
+    nRes = DoSyncData();
+    if(nRes != KErrNone)
+        return nRes;
+
+    if(ftruncate64(FileDesc(), ((uint64_t)aNewFooterSector + 1) << SectorSzLog2()) != 0)
+        return -errno;
+
+    iFooterSector   = aNewFooterSector;
+    iPreallocEndSec = 0; //-- truncation has released the preallocated space
+
+    return DoSyncData();
+}
@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+
+    @file imlementation of Dynamic and Differencing VHD file online defragmentation
+*/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "vhd.h"
+#include "block_mng.h"
+
+//--------------------------------------------------------------------
+/**
+    Move the blocks of the VHD file, so that their order in the file matches the logical order: the block with the n-th smallest
+    logical number goes to the n-th block place after the metadata. The blocks are placed in the logical order; if the place of a
+    block is used by another one, that one is moved out of the way first, to the free space after the places of all blocks or to the
+    end of the file. When all blocks are in place, the file is cut after the last one.
+
+    Every block is moved by Compact() protocol: the copy is synced to the media before the BAT refers to it and the BAT is synced
+    before its old place is reused, so the file is consistent on the media at any point.
+
+    The defragmentation goes by steps, the VHD can be accessed by other threads between them. The blocks order and places are worked
+    out from the BAT by the first step and carried to the next ones in aState; they are worked out again if the BAT has changed
+    between the steps. An interrupted defragmentation continues from where it has stopped with a new state, even after reopening the VHD.
+
+    @param  aState          defragmentation state, a new one for the first step
+    @param  aMaxBlocks      max. number of blocks to put into their places, > 0
+    @param  aBlocksMoved    out: number of blocks put into their places
+    @param  aBytesCopied    out: number of bytes copied, including the blocks moved out of the way
+
+    @return number of the blocks that aren't in their places yet, 0 if the VHD is defragmented; negative error code on error.
+*/
+int CVhdDynDiffBase::Defragment(TDefragState& aState, uint32_t aMaxBlocks, uint32_t& aBlocksMoved, uint64_t& aBytesCopied)
+{
+    DBG_LOG("CVhdDynDiffBase::Defragment[0x%p] maxBlocks:%d", this, aMaxBlocks);
+
+    aBlocksMoved = 0;
+    aBytesCopied = 0;
+
+    if(ReadOnly())
+        return -EBADF;
+
+    ASSERT(State() == EOpened);
+    ASSERT(aMaxBlocks);
+
+    //-- 1. make the metadata on the media coherent with the caches, the blocks will be moved by copying the media.
+    //-- the data of the allocated blocks goes to the media before the BAT refers to them
+    int nRes = CommitMetadata();
+    if(nRes != KErrNone)
+        return nRes;
+
+    nRes = DoLoadFileTail();
+    if(nRes != KErrNone)
+        return nRes;
+
+    //-- the blocks are going to be moved, the free block slots will be found again on the next block allocation
+    DoResetFreeSlots();
+
+    //-- 2. collect the blocks in the logical order and their places in the file, unless the previous step has done it
+    if(!aState.iValid || aState.iBatChanges != ipBAT->Changes())
+    {
+        nRes = DoScanBlockPlaces(aState);
+        if(nRes != KErrNone)
+            return nRes;
+    }
+
+    //-- the next step works the state out again if this one fails half way
+    aState.iValid = false;
+
+    //-- 3. put the blocks into their places, the moves to the free places are batched
+    const vector<uint32_t>& logicalOrder = aState.iLogicalOrder;
+    TBlockPlaces& places = aState.iPlaces;
+
+    const uint32_t KBlockSectors = SBmp_SizeInSectors() + SectorsPerBlock();
+    const uint32_t KDataStart    = DoMetadataEndSector();
+    const uint32_t KDataEnd      = KDataStart + logicalOrder.size()*KBlockSectors; //-- the blocks fit there, they don't overlap
+
+    vector<TBlockMove> moves;
+    size_t i;
+
+    for(i = aState.iNextIdx; i < logicalOrder.size(); ++i)
+    {
+        const uint32_t blk       = logicalOrder[i];
+        const uint32_t targetSec = KDataStart + i*KBlockSectors;
+
+        if(ipBAT->ReadEntry(blk) == targetSec)
+            continue;
+
+        if(aBlocksMoved >= aMaxBlocks)
+            break;
+
+        //-- the blocks in front of the data area, if any, push the target places beyond the footer; don't overwrite it
+        if(targetSec + KBlockSectors > iFooterSector)
+        {
+            nRes = DoExtendTail(targetSec + KBlockSectors);
+            if(nRes != KErrNone)
+                return nRes;
+        }
+
+        if(!DoPlaceFree(places, targetSec))
+        {//-- the pending moves may free the place, otherwise move the blocks that are in the way
+            nRes = DoCommitMoves(moves, places, aBytesCopied);
+            if(nRes != KErrNone)
+                return nRes;
+
+            if(!DoPlaceFree(places, targetSec))
+            {
+                nRes = DoEvacuatePlace(places, targetSec, KDataEnd, aBytesCopied);
+                if(nRes != KErrNone)
+                    return nRes;
+            }
+        }
+
+        ASSERT(targetSec + KBlockSectors <= iFooterSector);
+
+        //-- the block is in both places until the move is committed
+        TBlockMove move;
+        move.iBlockNumber = blk;
+        move.iFromSector  = ipBAT->ReadEntry(blk);
+        move.iToSector    = targetSec;
+
+        moves.push_back(move);
+        places[targetSec] = blk;
+        ++aBlocksMoved;
+
+        if(moves.size() >= KDefragStepBlocks)
+        {
+            nRes = DoCommitMoves(moves, places, aBytesCopied);
+            if(nRes != KErrNone)
+                return nRes;
+        }
+    }
+
+    nRes = DoCommitMoves(moves, places, aBytesCopied);
+    if(nRes != KErrNone)
+        return nRes;
+
+    //-- the blocks moved out of the way weren't in their places and still aren't, only the placed ones count
+    ASSERT(aState.iBlocksLeft >= aBlocksMoved);
+    aState.iBlocksLeft -= aBlocksMoved;
+    aState.iNextIdx = i;
+
+    //-- 4. the file ends after the last block when all blocks are in place
+    if(!aState.iBlocksLeft && KDataEnd < iFooterSector)
+    {
+        nRes = DoTruncateTail(KDataEnd);
+        if(nRes != KErrNone)
+            return nRes;
+    }
+
+    DoCheckMetadataDirty();
+
+    //-- the BAT changes made by this step are in the state already
+    aState.iBatChanges = ipBAT->Changes();
+    aState.iValid = true;
+
+    DBG_LOG("CVhdDynDiffBase::Defragment[0x%p] moved:%d, left:%d, copied:%lld", this, aBlocksMoved, aState.iBlocksLeft, aBytesCopied);
+
+    return aState.iBlocksLeft;
+}
+
+//--------------------------------------------------------------------
+/**
+    Work out the defragmentation state from the BAT: the blocks in the logical order, their places in the file and the number of
+    the blocks that aren't in their places. @see Defragment()
+
+    @param  aState  out: defragmentation state
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::DoScanBlockPlaces(TDefragState& aState)
+{
+    aState.iValid = false;
+    aState.iLogicalOrder.clear();
+    aState.iPlaces.clear();
+    aState.iNextIdx = 0;
+    aState.iBlocksLeft = 0;
+
+    const uint32_t KBlocks       = Header().MaxBatEntries();
+    const uint32_t KBlockSectors = SBmp_SizeInSectors() + SectorsPerBlock();
+    const uint32_t KDataStart    = DoMetadataEndSector();
+
+    for(uint32_t blk = 0; blk < KBlocks; ++blk)
+    {
+        const TBatEntry blockSector = ipBAT->ReadEntry(blk);
+        if(blockSector == KBatEntry_Unused)
+            continue;
+
+        if(!BatEntryValid(blockSector) || blockSector >= iFooterSector)
+            return KErrCorrupt;
+
+        if(blockSector != KDataStart + aState.iLogicalOrder.size()*KBlockSectors)
+            aState.iBlocksLeft++;
+
+        aState.iLogicalOrder.push_back(blk);
+        aState.iPlaces[blockSector] = blk;
+    }
+
+    aState.iBatChanges = ipBAT->Changes();
+    aState.iValid = true;
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    @param  aPlaces     the places of the blocks in the file
+    @param  aSector     starting sector of the place to check
+    @return true if no block overlaps the block place starting at aSector
+*/
+bool CVhdDynDiffBase::DoPlaceFree(const TBlockPlaces& aPlaces, uint32_t aSector) const
+{
+    const uint32_t KBlockSectors = SBmp_SizeInSectors() + SectorsPerBlock();
+
+    //-- the first block that ends after aSector
+    TBlockPlaces::const_iterator it = (aSector >= KBlockSectors) ? aPlaces.upper_bound(aSector - KBlockSectors) : aPlaces.begin();
+
+    return (it == aPlaces.end() || it->first >= aSector + KBlockSectors);
+}
+
+//--------------------------------------------------------------------
+/**
+    Find the first free block place starting at or after the given sector. It can go beyond the footer.
+
+    @param  aPlaces     the places of the blocks in the file
+    @param  aFromSector sector to start looking from
+    @return starting sector of the free place
+*/
+uint32_t CVhdDynDiffBase::DoFindFreePlace(const TBlockPlaces& aPlaces, uint32_t aFromSector) const
+{
+    const uint32_t KBlockSectors = SBmp_SizeInSectors() + SectorsPerBlock();
+
+    uint32_t freeSec = aFromSector;
+    TBlockPlaces::const_iterator it = (freeSec >= KBlockSectors) ? aPlaces.upper_bound(freeSec - KBlockSectors) : aPlaces.begin();
+
+    //-- the blocks don't overlap, skip the ones in the way in the order of their places
+    for(; it != aPlaces.end() && it->first < freeSec + KBlockSectors; ++it)
+        freeSec = Max(freeSec, it->first + KBlockSectors);
+
+    return freeSec;
+}
+
+//--------------------------------------------------------------------
+/**
+    Move the blocks to their new places, see DoRelocateBlocks(), and free their old places.
+
+    @param  aMoves          the blocks to move, emptied on success
+    @param  aPlaces         the places of the blocks in the file, both the old and the new places of the moved blocks are there
+    @param  aBytesCopied    the number of bytes copied is added here
+
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::DoCommitMoves(vector<TBlockMove>& aMoves, TBlockPlaces& aPlaces, uint64_t& aBytesCopied)
+{
+    const int nRes = DoRelocateBlocks(aMoves);
+    if(nRes != KErrNone)
+        return nRes;
+
+    const uint32_t KBlockSectors = SBmp_SizeInSectors() + SectorsPerBlock();
+
+    for(size_t i = 0; i < aMoves.size(); ++i)
+    {
+        aPlaces.erase(aMoves[i].iFromSector);
+        aBytesCopied += ((uint64_t)KBlockSectors) << SectorSzLog2();
+    }
+
+    aMoves.clear();
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Move the blocks overlapping the given block place to the free places at or after aFreeFromSector, extending the file if needed.
+
+    @param  aPlaces         the places of the blocks in the file
+    @param  aSector         starting sector of the place to free
+    @param  aFreeFromSector sector to look for the free places from, the place being freed must be in front of it
+    @param  aBytesCopied    the number of bytes copied is added here
+
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::DoEvacuatePlace(TBlockPlaces& aPlaces, uint32_t aSector, uint32_t aFreeFromSector, uint64_t& aBytesCopied)
+{
+    const uint32_t KBlockSectors = SBmp_SizeInSectors() + SectorsPerBlock();
+    ASSERT(aSector + KBlockSectors <= aFreeFromSector);
+
+    int nRes;
+    vector<TBlockMove> moves;
+
+    TBlockPlaces::iterator it = (aSector >= KBlockSectors) ? aPlaces.upper_bound(aSector - KBlockSectors) : aPlaces.begin();
+
+    //-- a block place can be overlapped by two blocks, their places aren't aligned to the place being freed
+    for(; it != aPlaces.end() && it->first < aSector + KBlockSectors; ++it)
+    {
+        TBlockMove move;
+        move.iBlockNumber = it->second;
+        move.iFromSector  = it->first;
+        move.iToSector    = DoFindFreePlace(aPlaces, aFreeFromSector);
+
+        if(move.iToSector + KBlockSectors > iFooterSector)
+        {
+            nRes = DoExtendTail(move.iToSector + KBlockSectors);
+            if(nRes != KErrNone)
+                return nRes;
+        }
+
+        DBG_LOG("CVhdDynDiffBase::DoEvacuatePlace[0x%p] block:%d, sector:%d -> %d", this, move.iBlockNumber, move.iFromSector, move.iToSector);
+
+        moves.push_back(move);
+        aPlaces[move.iToSector] = move.iBlockNumber;
+    }
+
+    return DoCommitMoves(moves, aPlaces, aBytesCopied);
+}
+
+//--------------------------------------------------------------------
+/**
+    Move the footer further, extending the file. The footer is written to its new place before anything is written over the old one,
+    so that the file always ends with a footer; the caller syncs it.
+
+    @param  aNewFooterSector    new footer sector, greater than the current one
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdDynDiffBase::DoExtendTail(uint32_t aNewFooterSector)
+{
+    DBG_LOG("CVhdDynDiffBase::DoExtendTail[0x%p] footer sector:%d -> %d", this, iFooterSector, aNewFooterSector);
+
+    ASSERT(iFooterSector && aNewFooterSector > iFooterSector);
+
+    DoPreallocate(aNewFooterSector + 1);
+
+    const int nRes = DoRaw_WriteData(aNewFooterSector, SectorSize(), iFooterBuf.Ptr());
+    if(nRes < 0)
+        return nRes;
+
+    iFooterSector = aNewFooterSector;
+    return KErrNone;
+}
@@ -26,8 +26,11 @@
 #include <errno.h>
 #include <libgen.h>
 
+#include <algorithm>
+
 #include "vhd.h"
 #include "block_mng.h"
+#include "parent_registry.h"
 
 
 //####################################################################
@@ -53,7 +56,7 @@ CVhdFileDiff::CVhdFileDiff(const TVhdFooter* apFooter, const TVhdHeader* apHeade
 
 CVhdFileDiff::~CVhdFileDiff()
 {
-    delete iParent;
+    CloseParentVHD();
 }
 
 //--------------------------------------------------------------------
@@ -185,7 +188,11 @@ int CVhdFileDiff::Flush()
     int nRes = CVhdDynDiffBase::Flush();
 
     if(iParent)
+    {
+        TVhdChainGuard guard;
+        guard.Lock(*iParent);
         iParent->Flush(); //-- this is just in case; parents are opened RO
+    }
 
     return nRes;
 }
@@ -203,9 +210,14 @@ int CVhdFileDiff::Flush()
 void CVhdFileDiff::InvalidateCache(bool aIgnoreDirty /*=false*/)
 {
     CVhdDynDiffBase::InvalidateCache(aIgnoreDirty);
+    DoResetChainRuns();
 
     if(iParent)
+    {
+        TVhdChainGuard guard;
+        guard.Lock(*iParent);
         iParent->InvalidateCache(aIgnoreDirty);
+    }
 }
 
 
@@ -213,6 +225,7 @@ void CVhdFileDiff::InvalidateCache(bool aIgnoreDirty /*=false*/)
 //--------------------------------------------------------------------
 /**
     Find (by parent locator) and open parent VHD file in RO mode.
+    The parent VHD object is shared with the other children of the same parent opened in this process, @see CParentRegistry
 
     @param  apParentFileName    if specified, it should be path to the existing parent VHD
                                 if NULL, then the parent VHD will be sought by parent locators
@@ -246,66 +259,65 @@ int  CVhdFileDiff::OpenParentVHD(const char* apParentFileName/*= NULL*/) const
     else
         strParentPath = apParentFileName;
 
-    //-- 2. try to open the parent VHD.
+    //-- 2. get the parent VHD opened; the registry checks that its UUID is the one from this file header
     const uint32_t parentModeFlags = ModeFlags() & (~VHDF_OPEN_RDWR); //-- parent must be opened RO
 
-    CAutoClosePtr<CVhdFileBase> pVhdParent(CVhdFileBase::CreateFromFile(strParentPath.c_str(), parentModeFlags, nRes));
+    CVhdFileBase* pVhdParent = NULL;
+    bool bNewlyOpened = false;
 
-    if(!pVhdParent.get())
+    nRes = CParentRegistry::Instance().Acquire(strParentPath.c_str(), Header().Parent_UUID(), parentModeFlags, pVhdParent, bNewlyOpened);
+    if(nRes != KErrNone)
     {
         ASSERT(nRes < 0);
         return nRes;
     }
 
-    //-- 3. try to open parent VHD file object
-    nRes = pVhdParent->Open();
-    if(nRes != KErrNone)
+    //-- 3. check parent and child geometry matching.
+    if(! DoValidateParentGeometry(pVhdParent))
     {
-        ASSERT(nRes < 0);
-        return nRes;
+        CParentRegistry::Instance().Release(pVhdParent);
+        return KErr_VhdDiff_Geometry;
     }
 
-    //-- 4. check Parent's UUID, TimeStamp and geometry.
-    /*
-    strange enough, parent's time stamp seems to be ignored by VPC (though specs say that it should be checked). Don't check it.
-    const uint32_t ts1 = Header().Parent_TimeStamp();
-    const uint32_t ts2 = pVhdParent->Footer().TimeStamp();
-    */
-
-    const uuid_t& uuid1 = Header().Parent_UUID();       //-- Parent's UUID from this file header
-    const uuid_t& uuid2 = pVhdParent->Footer().UUID();  //-- what is recorded in the header of the file we opened
+    //-- 4. the parent caches BAT and bitmaps in the same way as this VHD does; a shared parent keeps the settings it has got
+    if(bNewlyOpened)
+    {
+        TVhdChainGuard guard;
+        guard.Lock(*pVhdParent);
 
-    nRes = uuid_compare(uuid1, uuid2);
-    const bool bParentMatch = (nRes == 0);
+        nRes = pVhdParent->SetBitmapCacheSize(ipSectorMapper->Capacity());
+        if(nRes == KErrNone)
+            nRes = pVhdParent->SetBitmapCachePolicy(ipSectorMapper->Policy());
+        if(nRes == KErrNone)
+            nRes = pVhdParent->SetBatCacheSize(ipBAT->PageSizeLog2(), ipBAT->MaxPages());
+    }
 
-    if(!bParentMatch)
+    if(nRes != KErrNone)
     {
-        DBG_LOG("Parent & Diff VHDs UUID mismatch!");
-        return KErr_VhdDiff_ParentId;
+        CParentRegistry::Instance().Release(pVhdParent);
+        return nRes;
     }
 
-    //-- check parent and child geometry matching.
-    if(! DoValidateParentGeometry(pVhdParent.get()))
-        return KErr_VhdDiff_Geometry;
-
-    iParent = pVhdParent.release();
+    iParent = pVhdParent;
 
     return KErrNone;
 }
 
 //--------------------------------------------------------------------
 /**
-    Close parent VHD file, delete an object responcible to handle it and set iParent to NULL
+    Release the parent VHD, it is closed when no other child in this process uses it, and set iParent to NULL. @see CParentRegistry
 */
 void CVhdFileDiff::CloseParentVHD() const
 {
     DBG_LOG("CVhdFileDiff::CloseParentVHD()[0x%p]", this);
 
+    iLayers.clear();
+    DoResetChainRuns();
+
     if(!iParent)
         return;
 
-    iParent->Close();
-    delete iParent;
+    CParentRegistry::Instance().Release(iParent);
     iParent = NULL;
 }
 
@@ -391,6 +403,9 @@ int CVhdFileDiff::GetInfo(TVHD_Params& aVhdInfo, uint32_t aParentNo) const
     if(!iParent)
         return (ModeFlags() & VHDF_OPEN_IGNORE_PARENT) ? KErr_VhdDiff_NoParent : nRes;
 
+    TVhdChainGuard guard;
+    guard.Lock(*iParent);
+
     return iParent->GetInfo(aVhdInfo, aParentNo-1);
 }
 
@@ -660,23 +675,303 @@ int CVhdFileDiff::ProcessPureBlocksMode()
 
 //--------------------------------------------------------------------
 /**
-    Read a number of sectors from the Parent VHD file.
-    Parameters and return value are the same as in ReadSectors()
+    Read a number of sectors from the Parent VHD files.
+    The reads aren't passed down the chain by calling parents' ReadSectorsV(). Every block is resolved through the flattened table
+    of the chain layers once, see DoGetChainRuns(); then the sectors are read by a single request per run of the sectors that are in
+    the same layer. Runs absent from all layers read as zeroes. The reads from every layer go out as a single batch.
+    The layers can be shared with other chains, all of them are locked for the time of the read, @see TVhdChainGuard
+
+	@param	aStartSector	starting logical sector
+	@param	aSectors		number of logical sectors to read, all of them must be within the VHD
+	@param	aBuf		    out: read data go to the buffer from its current position
+
+    @return	number of read sectors on success, negative value corresponding system error code otherwise.
 */
-int CVhdFileDiff::DoReadSectorsFromParent(uint32_t aStartSector, int aSectors, void* apBuffer, uint32_t aBufSize)
+int CVhdFileDiff::DoReadSectorsFromParent(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf)
 {
     DBG_LOG("CVhdFileDiff::DoReadSectorsFromParent[0x%p] startSec:%d, num:%d",this, aStartSector, aSectors);
 
-    if(!iParent)
-    {   //-- no parent VHD is opened. This can be because of "lazy parent opening" or no parent found at all
-        //-- try opening parent VHD
-        int nRes = OpenParentVHD();
-        if(nRes != KErrNone)
+    ASSERT(aSectors > 0 && aStartSector + aSectors <= VhdSizeInSectors());
+    ASSERT(aBuf.Size() >= (((size_t)aSectors) << SectorSzLog2()));
+
+    TVhdChainGuard guard;
+
+    if(iLayers.empty())
+    {//-- no parent VHD is opened. This can be because of "lazy parent opening" or no parent found at all.
+        //-- open as many layers of the chain as possible, the missing ones will be tried again when they are needed
+        if(DoAddParentLayer(guard) != KErrNone)
             return KErr_VhdDiff_NoParent;
+
+        while(iLayers.back()->VhdType() == EVhd_Diff && DoAddParentLayer(guard) == KErrNone)
+        {}
+    }
+    else
+    {
+        for(uint32_t i=0; i<iLayers.size(); ++i)
+            guard.Lock(*iLayers[i]);
     }
 
-    ASSERT(iParent);
-    return iParent->ReadSectors(aStartSector, aSectors, apBuffer, aBufSize);
+    uint32_t  currSector = aStartSector;
+    uint32_t  remSectors = aSectors;
+    TIoVecBuf buf(aBuf);
+
+    TChainRuns blockRuns; //-- runs of a block that couldn't be cached
+    int nRes = KErrNone;
+
+    while(remSectors)
+    {
+        const uint32_t KSectorInBlock = SectorInBlock(currSector);
+        const uint32_t KBlockSectors  = Min(remSectors, SectorsPerBlock() - KSectorInBlock); //-- sectors to read from the current block
+
+        const TChainRuns* pRuns = NULL;
+        nRes = DoGetChainRuns(SectorToBlockNumber(currSector), pRuns, guard);
+        if(nRes == KErr_VhdDiff_NoParent)
+        {//-- some sectors of the block are in a layer that can't be opened; the ones being read may not be
+            blockRuns.clear();
+            nRes = DoResolveChainRuns(currSector, KBlockSectors, blockRuns, guard);
+            pRuns = &blockRuns;
+        }
+
+        if(nRes != KErrNone)
+            break;
+
+        //-- the first run that contains the current sector
+        TChainRuns::const_iterator it = std::upper_bound(pRuns->begin(), pRuns->end(), KSectorInBlock, TChainRun::StartsAfter);
+        ASSERT(it != pRuns->begin());
+        --it;
+
+        for(uint32_t sectors = KBlockSectors; sectors; ++it)
+        {
+            ASSERT(it != pRuns->end());
+
+            const uint32_t KRunOffset   = SectorInBlock(currSector) - it->iStart;
+            const uint32_t KRunSectors  = Min(sectors, it->iSectors - KRunOffset);
+            const uint32_t KRunBytes    = KRunSectors << SectorSzLog2();
+
+            if(it->iLayer == TChainRun::KChainRun_Zeroes)
+                buf.Fill(KRunBytes, 0);
+            else
+                iLayers[it->iLayer]->DoRaw_QueueRead(it->iFileSector + KRunOffset, KRunBytes, buf);
+
+            currSector += KRunSectors;
+            remSectors -= KRunSectors;
+            sectors    -= KRunSectors;
+            buf.Advance(KRunBytes);
+        }
+    }
+
+    //-- execute queued reads; it must be done even if there was an error, the batches must not be left in the I/O engines
+    for(uint32_t i=0; i<iLayers.size(); ++i)
+    {
+        const int nBatchRes = iLayers[i]->DoRaw_SubmitBatch();
+        if(nRes == KErrNone)
+            nRes = nBatchRes;
+    }
+
+    if(nRes != KErrNone)
+        return nRes;
+
+    return aSectors;
+}
+
+//--------------------------------------------------------------------
+/**
+    Get the runs of the sectors of the block resolved through the chain of the parents. The runs are cached for up to
+    KMaxCached_ChainRunBlocks blocks; the writes to this VHD don't affect them, its own sector bitmaps are looked up before the runs.
+    A parent can be shared with other handles and changed by them (coalesce, compact, defragment), so the cache is dropped when
+    the LayoutChanges() of any layer differs from the one it was filled with. @see DoResolveChainRuns()
+
+    @param  aBlockNumber    logical block number
+    @param  apRuns          out: pointer to the runs of the block, valid until the next call
+    @param  aGuard          holds the locks of all layers, @see DoAddParentLayer()
+
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdFileDiff::DoGetChainRuns(uint32_t aBlockNumber, const TChainRuns*& apRuns, TVhdChainGuard& aGuard)
+{
+    DoCheckChainRuns();
+
+    map<uint32_t, TChainRuns>::const_iterator it = iChainRuns.find(aBlockNumber);
+    if(it != iChainRuns.end())
+    {
+        apRuns = &it->second;
+        return KErrNone;
+    }
+
+    const uint32_t KStartSector = aBlockNumber << SectorsPerBlockLog2();
+    const uint32_t KSectors     = Min(SectorsPerBlock(), VhdSizeInSectors() - KStartSector); //-- the last block can be incomplete
+
+    TChainRuns runs;
+    const int nRes = DoResolveChainRuns(KStartSector, KSectors, runs, aGuard);
+    if(nRes != KErrNone)
+        return nRes;
+
+    if(iChainRuns.size() >= KMaxCached_ChainRunBlocks)
+    {//-- evict the oldest block
+        iChainRuns.erase(iChainRunsOrder.front());
+        iChainRunsOrder.pop_front();
+    }
+
+    TChainRuns& cachedRuns = iChainRuns[aBlockNumber];
+    cachedRuns.swap(runs);
+    iChainRunsOrder.push_back(aBlockNumber);
+
+    apRuns = &cachedRuns;
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Resolve the sectors of a block through the flattened table of the chain layers, see iLayers. The layers are walked from the
+    nearest parent towards the "Head", every sector belongs to the first layer that has it; in the same way as OR-ing the layers'
+    sector bitmaps does in DoCoalesceBlock(). Adjacent runs of the same layer that are contiguous in its file are merged.
+
+    @param  aStartSector    starting logical sector
+    @param  aSectors        number of sectors, all of them must be in the same block
+    @param  aRuns           out: the runs are appended here; their starting sectors are counted from the block start
+    @param  aGuard          holds the locks of all layers, @see DoAddParentLayer()
+
+    @return KErrNone on success, KErr_VhdDiff_NoParent if some sectors are in the layer that can't be opened; negative error code otherwise
+*/
+int CVhdFileDiff::DoResolveChainRuns(uint32_t aStartSector, uint32_t aSectors, TChainRuns& aRuns, TVhdChainGuard& aGuard)
+{
+    ASSERT(!iLayers.empty());
+    ASSERT(aSectors && SectorInBlock(aStartSector) + aSectors <= SectorsPerBlock());
+
+    //-- the last run found in every layer, runEnds[i] is the sector after the run in the layer i, the run is valid if it is after the current sector
+    vector<TLayerRun> layerRuns(iLayers.size());
+    vector<uint32_t>  runEnds(iLayers.size(), 0);
+
+    uint32_t currSector = aStartSector;
+    uint32_t remSectors = aSectors;
+
+    while(remSectors)
+    {
+        uint32_t runSectors = remSectors;
+
+        TChainRun run;
+        run.iLayer      = TChainRun::KChainRun_Zeroes;
+        run.iFileSector = 0;
+
+        for(uint32_t i=0; ; ++i)
+        {
+            if(i == iLayers.size())
+            {//-- the sectors are absent from all opened layers
+                if(iLayers.back()->VhdType() != EVhd_Diff)
+                    break; //-- the "Head" doesn't have them, they read as zeroes
+
+                //-- the chain is broken, try opening the missing parent again
+                if(DoAddParentLayer(aGuard) != KErrNone)
+                    return KErr_VhdDiff_NoParent;
+
+                layerRuns.resize(iLayers.size());
+                runEnds.resize(iLayers.size(), 0);
+            }
+
+            TLayerRun& layerRun = layerRuns[i];
+
+            if(runEnds[i] <= currSector)
+            {
+                const int nRes = iLayers[i]->MapLayerRun(currSector, runSectors, layerRun);
+                if(nRes != KErrNone)
+                    return nRes;
+
+                runEnds[i] = currSector + layerRun.iSectors;
+            }
+
+            runSectors = Min(runSectors, runEnds[i] - currSector);
+
+            if(layerRun.iPresent)
+            {
+                run.iLayer      = i;
+                run.iFileSector = layerRun.iFileSector + (currSector - (runEnds[i] - layerRun.iSectors));
+                break;
+            }
+        }
+
+        run.iStart   = SectorInBlock(currSector);
+        run.iSectors = runSectors;
+
+        TChainRun* pLast = aRuns.empty() ? NULL : &aRuns.back();
+        if(pLast && pLast->iLayer == run.iLayer && pLast->iStart + pLast->iSectors == run.iStart &&
+           (run.iLayer == TChainRun::KChainRun_Zeroes || pLast->iFileSector + pLast->iSectors == run.iFileSector))
+        {
+            pLast->iSectors += run.iSectors;
+        }
+        else
+        {
+            aRuns.push_back(run);
+        }
+
+        currSector += runSectors;
+        remSectors -= runSectors;
+    }
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Drop the cached chain runs if any layer's layout has changed since they were cached; start tracking the layers appended
+    to iLayers since then. The caller must hold the locks of all layers. @see DoGetChainRuns()
+*/
+void CVhdFileDiff::DoCheckChainRuns() const
+{
+    ASSERT(iLayerChanges.size() <= iLayers.size());
+
+    for(uint32_t i=0; i<iLayerChanges.size(); ++i)
+    {
+        if(iLayerChanges[i] != iLayers[i]->LayoutChanges())
+        {
+            DoResetChainRuns();
+            break;
+        }
+    }
+
+    //-- the runs cached before a layer was appended didn't need it, they are still valid
+    for(uint32_t i=iLayerChanges.size(); i<iLayers.size(); ++i)
+        iLayerChanges.push_back(iLayers[i]->LayoutChanges());
+}
+
+//--------------------------------------------------------------------
+/** Drop all cached chain runs, @see DoGetChainRuns() */
+void CVhdFileDiff::DoResetChainRuns() const
+{
+    iChainRuns.clear();
+    iChainRunsOrder.clear();
+    iLayerChanges.clear();
+}
+
+//--------------------------------------------------------------------
+/**
+    Append the parent of the last layer in the chain layers table to the table, opening the parent VHD if necessary. @see iLayers
+    The parents are owned by the differencing VHDs that have opened them; the table is cleared when this VHD closes its parent.
+
+    @param  aGuard  must hold the locks of all layers in the table; the appended layer gets locked as well
+
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdFileDiff::DoAddParentLayer(TVhdChainGuard& aGuard)
+{
+    ASSERT(iLayers.empty() || iLayers.back()->VhdType() == EVhd_Diff); //-- only a Differencing VHD has a parent
+    CVhdFileDiff* pVhd = iLayers.empty() ? this : static_cast<CVhdFileDiff*>(iLayers.back());
+
+    if(!pVhd->iParent)
+    {
+        const int nRes = pVhd->OpenParentVHD();
+        if(nRes != KErrNone)
+            return nRes;
+    }
+
+    ASSERT(pVhd->iParent);
+    aGuard.Lock(*pVhd->iParent);
+    iLayers.push_back(pVhd->iParent);
+
+    //-- the runs resolved with this layer must notice its changes made after they are cached
+    if(iLayerChanges.size() + 1 == iLayers.size())
+        iLayerChanges.push_back(pVhd->iParent->LayoutChanges());
+
+    return KErrNone;
 }
 
 
@@ -701,7 +996,7 @@ int CVhdFileDiff::DoReadSectorsFromBlock(TBlkOpParams &aParams)
 
     if(KBlockSector == KBatEntry_Unused)
     {//-- 1. whole block isn't present, need to read data from the parent VHD
-        nRes = DoReadSectorsFromParent(KStartSectorL, KSectorsToRead, aParams.ipData, KBytesToRead);
+        nRes = DoReadSectorsFromParent(KStartSectorL, KSectorsToRead, aParams.iData);
         if(nRes != (int)KSectorsToRead)
             return nRes; //-- it is negative error code here
     }
@@ -732,13 +1027,13 @@ int CVhdFileDiff::DoReadSectorsFromBlock(TBlkOpParams &aParams)
         if(bmpState == ESB_FullyMapped)
         {//-- all '1' bits in the bitmap, read a chunk of sectors from this VHD
             const uint32_t startDataSecP = KBlockSector + KBitmapSectors + SectorInBlock(KStartSectorL);
-            nRes = DoRaw_ReadData(startDataSecP, KBytesToRead, aParams.ipData);
+            nRes = DoRaw_ReadDataV(startDataSecP, KBytesToRead, aParams.iData);
             if(nRes >= 0)
                 {ASSERT(nRes == (int)KBytesToRead);}
         }
         else if(bmpState == ESB_FullyUnmapped)
         {//-- all '0' bits in the bitmap, read a chunk of sectors from parent VHD
-            nRes = DoReadSectorsFromParent(KStartSectorL, KSectorsToRead, aParams.ipData, KBytesToRead);
+            nRes = DoReadSectorsFromParent(KStartSectorL, KSectorsToRead, aParams.iData);
             if(nRes >= 0)
                 {ASSERT(nRes == (int)KSectorsToRead);}
 
@@ -749,11 +1044,12 @@ int CVhdFileDiff::DoReadSectorsFromBlock(TBlkOpParams &aParams)
 
             uint32_t sectorInBlock = SectorInBlock(KStartSectorL);                  //-- sector number _in_ the block
             uint32_t sectorP       = KBlockSector + KBitmapSectors + sectorInBlock; //-- Physical sector number in the _file_
-            uint8_t* pBuf = aParams.ipData;  //-- local pointer in the user's buffer
+            TIoVecBuf buf(aParams.iData);  //-- local position in the user's buffer
 
             //-- try finding extents of '0's and '1's in the bitmap and read multiple of sectors corresponding to the contuguous block of the same bit value
             TBitExtentFinder extFinder(pBitmap->GetAllocBitmap_Raw(), sectorInBlock, KSectorsToRead);
 
+            nRes = KErrNone;
             for(;;)
             {
                 if(!extFinder.FindExtent())
@@ -763,25 +1059,30 @@ int CVhdFileDiff::DoReadSectorsFromBlock(TBlkOpParams &aParams)
                 const uint extBytes   = extSectors << SectorSzLog2();
 
                 if(extFinder.ExtBitVal())
-                {//-- found an extent of '1's, read corresponding sectors from this VHD
-                    nRes = DoRaw_ReadData(sectorP, extBytes, pBuf);
-                    if(nRes >= 0)
-                        {ASSERT(nRes == (int)extBytes);}
+                {//-- found an extent of '1's, queue reading corresponding sectors from this VHD; all of them go out as a single batch
+                    DoRaw_QueueRead(sectorP, extBytes, buf);
                 }
                 else
                 {//-- found an extent of '0's, read corresponding sectors from parent VHDs
-                    const uint32_t parentSectorL = KStartSectorL + (extFinder.ExtStartPos()-sectorInBlock);
-                    nRes = DoReadSectorsFromParent(parentSectorL, extSectors, pBuf, extBytes);
-                    if(nRes >= 0)
-                        {ASSERT(nRes == (int)extSectors);}
+                    const uint32_t parentSectorL = KStartSectorL + (extFinder.ExtStartPos()-SectorInBlock(KStartSectorL));
+                    nRes = DoReadSectorsFromParent(parentSectorL, extSectors, buf);
+                    if(nRes < 0)
+                        break;
+
+                    ASSERT(nRes == (int)extSectors);
                 }
 
                 sectorInBlock += extSectors;
                 sectorP += extSectors;
-                pBuf    += extBytes;
+                buf.Advance(extBytes);
 
             }//for(;;)
 
+            //-- execute queued reads; it must be done even if there was an error, the batch must not be left in the I/O engine
+            const int nBatchRes = DoRaw_SubmitBatch();
+            if(nRes >= 0)
+                nRes = nBatchRes;
+
         }
 
         if(nRes <0)
@@ -791,7 +1092,7 @@ int CVhdFileDiff::DoReadSectorsFromBlock(TBlkOpParams &aParams)
 
     //-- update parameters data
     aParams.iCurrSectorL += KSectorsToRead;
-    aParams.ipData       += KBytesToRead;
+    aParams.iData.Advance(KBytesToRead);
 
     return KErrNone;
 }
@@ -799,95 +1100,159 @@ int CVhdFileDiff::DoReadSectorsFromBlock(TBlkOpParams &aParams)
 
 //--------------------------------------------------------------------
 /**
-    Write a sector extent to given _single_ block in the VHD file.
+    Allocate a new block in the VHD file, see AllocateBlock(), and place its entry to the BAT cache.
+    Depending on the settings, the block sectors that are not going to be written by the caller are either copied from the parent VHD or zero-filled.
+
+    @param  aBlockNumber    logical block number
+    @param  aStartSectorL   logical sector number the caller is going to start writing from, must belong to the block
+    @param  aSectors        number of sectors the caller is going to write to the block
+    @param  aBlockSector    out: block starting sector in the file
+    @param  aSetAllBmpBits  out: true if all bits in the block sector bitmap must be set after writing data
 
-    @param  aParams parameters, describing the operation. Some of them will be adjusted on completion.
     @return	KErrNone on success, negative value corresponding system error code otherwise.
 */
-int CVhdFileDiff::DoWriteSectorsToBlock(TBlkOpParams &aParams)
+int CVhdFileDiff::DoAllocateBlock(uint32_t aBlockNumber, uint32_t aStartSectorL, uint32_t aSectors, TBatEntry& aBlockSector, bool& aSetAllBmpBits)
 {
-
     int nRes;
 
-    const uint32_t KStartSectorL  = aParams.iCurrSectorL;
-    const uint32_t KSectorsToWrite= aParams.iNumSectors;
-    const uint32_t KBytesToWrite  = KSectorsToWrite << SectorSzLog2();
     const uint32_t KBitmapSectors = SBmp_SizeInSectors(); //-- block allocation bitmap size, in sectors
 
-    bool bSetAllBmpBits = false; //-- if true, then ALL block bitmap bits will be set
+    ASSERT(ipBAT->ReadEntry(aBlockNumber) == KBatEntry_Unused);
+    ASSERT(SectorToBlockNumber(aStartSectorL) == aBlockNumber && SectorInBlock(aStartSectorL) + aSectors <= SectorsPerBlock());
 
+    //-- 1.1 find out if we need to have all bits in the alloc. bitmap set. If true, then sector bitmap will have all bits set
+    aSetAllBmpBits = (BlockPureMode() || KDiffVhd_CreateFullyMappedBlock)  //-- in 'pure mode' everything is done to avoid using bitmap caches for the performance sake
+                      && (!TrimEnabled());                                 //-- when using TRIM '0' bits indicate sectors that can be discarded and should be read as zeros.
 
-    //-- get BAT entry.
-    TBatEntry blockSector = ipBAT->ReadEntry(aParams.iCurrBlock); //-- Block starting sector in the file
-
-    if(blockSector == KBatEntry_Unused)
-    {//-- the block isn't present; need to extend VHD file by one block
 
-        //-- 1.1 find out if we need to have all bits in the alloc. bitmap set. If true, then sector bitmap will have all bits set
-        bSetAllBmpBits = (BlockPureMode() || KDiffVhd_CreateFullyMappedBlock)  //-- in 'pure mode' everything is done to avoid using bitmap caches for the performance sake
-                          && (!TrimEnabled());                                 //-- when using TRIM '0' bits indicate sectors that can be discarded and should be read as zeros.
+    //-- 1. append an empty block with appropriate bitmap fill
+    nRes = AllocateBlock(aBlockNumber, aBlockSector, aSetAllBmpBits, false);
+    if(nRes < 0)
+        return nRes;
 
+    const uint32_t chunk1_SecStart_L = (aStartSectorL >> SectorsPerBlockLog2())<<SectorsPerBlockLog2(); //-- logical starting sector of chunk1
+    const uint32_t chunk1_SecStart_P = aBlockSector + KBitmapSectors;//-- physical starting sector of chunk1
+    const uint32_t chunk1_SecLen     = SectorInBlock(aStartSectorL);   //-- number of sectors in chunk1
 
-        //-- 1. append an empty block with appropriate bitmap fill
-        nRes = AppendBlock(blockSector, bSetAllBmpBits, false);
-        if(nRes < 0)
-            return nRes;
+    const uint32_t chunk2_SecStart_L = chunk1_SecStart_L + chunk1_SecLen + aSectors; //-- logical starting sector of chunk2
+    const uint32_t chunk2_SecStart_P = chunk1_SecStart_P + chunk1_SecLen + aSectors; //-- physical starting sector of chunk2
+          uint32_t chunk2_SecLen     = SectorsPerBlock()- (chunk1_SecLen + aSectors);//-- number of sectors in chunk2
 
-        const uint32_t chunk1_SecStart_L = (KStartSectorL >> SectorsPerBlockLog2())<<SectorsPerBlockLog2(); //-- logical starting sector of chunk1
-        const uint32_t chunk1_SecStart_P = blockSector + KBitmapSectors;//-- physical starting sector of chunk1
-        const uint32_t chunk1_SecLen     = SectorInBlock(KStartSectorL);   //-- number of sectors in chunk1
+    //-- check that chunk2 doesn't span over the VHD sectors space.
+    if(chunk2_SecStart_L + chunk2_SecLen >= VhdSizeInSectors())
+    {
+        chunk2_SecLen -= (chunk2_SecStart_L + chunk2_SecLen - VhdSizeInSectors());
+    }
 
-        const uint32_t chunk2_SecStart_L = chunk1_SecStart_L + chunk1_SecLen + KSectorsToWrite; //-- logical starting sector of chunk2
-        const uint32_t chunk2_SecStart_P = chunk1_SecStart_P + chunk1_SecLen + KSectorsToWrite; //-- physical starting sector of chunk2
-              uint32_t chunk2_SecLen     = SectorsPerBlock()- (chunk1_SecLen + KSectorsToWrite);//-- number of sectors in chunk2
 
-        //-- check that chunk2 doesn't span over the VHD sectors space.
-        if(chunk2_SecStart_L + chunk2_SecLen >= VhdSizeInSectors())
-        {
-            chunk2_SecLen -= (chunk2_SecStart_L + chunk2_SecLen - VhdSizeInSectors());
-        }
+    if(aSetAllBmpBits)
+    {   //-- request to add a block that contains all relevant sectors from parent VHD(s)
+        //-- copy the necessary data sectors from parents in order to have all allocation bitmap bits set to '1'
 
+        //-- 1. copy extent before block of data to be written later
+        nRes = DoCopySectorsFromParent(chunk1_SecStart_L, chunk1_SecStart_P, chunk1_SecLen);
+        if(nRes != KErrNone)
+            return nRes;
 
-        if(bSetAllBmpBits)
-        {   //-- request to add a block that contains all relevant sectors from parent VHD(s)
-            //-- copy the necessary data sectors from parents in order to have all allocation bitmap bits set to '1'
+        //-- 2. copy extent after block of our data
+        nRes = DoCopySectorsFromParent(chunk2_SecStart_L, chunk2_SecStart_P, chunk2_SecLen);
+        if(nRes != KErrNone)
+            return nRes;
 
-            //-- 1. copy extent before block of data to be written later
-            nRes = DoCopySectorsFromParent(chunk1_SecStart_L, chunk1_SecStart_P, chunk1_SecLen);
+        //-- all bits in the block bitmap will be set later on.
+        aSetAllBmpBits = true;
+    }
+    else
+    {//-- request to add an empty block
+        if(KDiffVhd_ZeroFillAppendedBlock)
+        {//-- need to zero-fill it
+            //-- 1. zero fill extent before block of data to be written later
+            nRes = DoRaw_FillMedia(chunk1_SecStart_P, chunk1_SecLen, 0x00);
             if(nRes != KErrNone)
                 return nRes;
 
-            //-- 2. copy extent after block of our data
-            nRes = DoCopySectorsFromParent(chunk2_SecStart_L, chunk2_SecStart_P, chunk2_SecLen);
+            //-- 2. zero fill extent after block of our data
+            nRes = DoRaw_FillMedia(chunk2_SecStart_P, chunk2_SecLen, 0x00);
             if(nRes != KErrNone)
                 return nRes;
-
-            //-- all bits in the block bitmap will be set later on.
-            bSetAllBmpBits = true;
         }
-        else
-        {//-- request to add an empty block
-            if(KDiffVhd_ZeroFillAppendedBlock)
-            {//-- need to zero-fill it
-                //-- 1. zero fill extent before block of data to be written later
-                nRes = DoRaw_FillMedia(chunk1_SecStart_P, chunk1_SecLen, 0x00);
-                if(nRes != KErrNone)
-                    return nRes;
+    }
 
-                //-- 2. zero fill extent after block of our data
-                nRes = DoRaw_FillMedia(chunk2_SecStart_P, chunk2_SecLen, 0x00);
-                if(nRes != KErrNone)
-                    return nRes;
-            }
+    //-- place entry to BAT cache
+    nRes = ipBAT->WriteEntry(aBlockNumber, aBlockSector);
+    if(nRes < 0)
+    {
+        ASSERT(0);
+        return nRes;
+    }
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Map an extent of sectors that are not allocated in the file. For the Differencing VHD these sectors belong to the parent VHD,
+    so mapping is delegated to it. If the parent VHD can't be opened, the sectors are reported as EVhdExt_Parent extent.
+
+	@param	aStartSector	starting logical sector.
+	@param	aSectors		number of logical sectors to map
+	@param	aList		    out: list of extents
+	@param	aLayer		    index of this VHD in the chain
+
+	@return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdFileDiff::DoMapUnallocated(uint32_t aStartSector, uint32_t aSectors, TVhdExtentList& aList, uint32_t aLayer)
+{
+    if(!iParent)
+    {   //-- no parent VHD is opened. This can be because of "lazy parent opening" or no parent found at all
+        if(OpenParentVHD() != KErrNone)
+        {
+            aList.Add(EVhdExt_Parent, aStartSector, aSectors, aLayer+1, -1, 0);
+            return KErrNone;
         }
+    }
 
-        //-- place entry to BAT cache
-        nRes = ipBAT->WriteEntry(aParams.iCurrBlock, blockSector);
+    ASSERT(iParent);
+
+    TVhdChainGuard guard;
+    guard.Lock(*iParent);
+
+    return iParent->MapExtents(aStartSector, aSectors, false, aList, aLayer+1);
+}
+
+//--------------------------------------------------------------------
+/**
+    Write a sector extent to given _single_ block in the VHD file.
+
+    @param  aParams parameters, describing the operation. Some of them will be adjusted on completion.
+    @return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdFileDiff::DoWriteSectorsToBlock(TBlkOpParams &aParams)
+{
+
+    int nRes;
+
+    const uint32_t KStartSectorL  = aParams.iCurrSectorL;
+    const uint32_t KSectorsToWrite= aParams.iNumSectors;
+    const uint32_t KBytesToWrite  = KSectorsToWrite << SectorSzLog2();
+    const uint32_t KBitmapSectors = SBmp_SizeInSectors(); //-- block allocation bitmap size, in sectors
+
+    bool bSetAllBmpBits = false; //-- if true, then ALL block bitmap bits will be set
+
+
+    //-- get BAT entry.
+    TBatEntry blockSector = ipBAT->ReadEntry(aParams.iCurrBlock); //-- Block starting sector in the file
+
+    if(blockSector == KBatEntry_Unused && KSectorsToWrite == SectorsPerBlock())
+    {//-- the block isn't present and is going to be written entirely; append it with the data by a single I/O
+        return DoAppendFullBlock(aParams);
+    }
+
+    if(blockSector == KBatEntry_Unused)
+    {//-- the block isn't present; need to extend VHD file by one block
+        nRes = DoAllocateBlock(aParams.iCurrBlock, KStartSectorL, KSectorsToWrite, blockSector, bSetAllBmpBits);
         if(nRes < 0)
-        {
-            ASSERT(0);
             return nRes;
-        }
 
         aParams.iFlushMetadata = true; //-- indicate that the metadata caches need flushing
     }//if(blockSector == KBatEntry_Unused)
@@ -898,7 +1263,7 @@ int CVhdFileDiff::DoWriteSectorsToBlock(TBlkOpParams &aParams)
 
     const uint32_t startDataSecP = blockSector + KBitmapSectors + SectorInBlock(KStartSectorL);
 
-    nRes = DoRaw_WriteData(startDataSecP, KBytesToWrite, aParams.ipData);
+    nRes = DoRaw_WriteDataV(startDataSecP, KBytesToWrite, aParams.iData);
     if(nRes <0)
         return nRes;//-- this is the error code
 
@@ -927,7 +1292,7 @@ int CVhdFileDiff::DoWriteSectorsToBlock(TBlkOpParams &aParams)
 
     //-- update parameters data
     aParams.iCurrSectorL += KSectorsToWrite;
-    aParams.ipData       += KBytesToWrite;
+    aParams.iData.Advance(KBytesToWrite);
 
     return KErrNone;
 }
@@ -964,6 +1329,7 @@ int CVhdFileDiff::DiscardSectors(uint32_t aStartSector, int aSectors)
     uint32_t cntBlocks = SectorToBlockNumber(aStartSector + remSectors -1) - currBlock + 1; //-- number of blocks the range of sectors spans
     ASSERT(cntBlocks && cntBlocks <= (VhdSizeInSectors()>>SectorsPerBlockLog2()));
 
+    nRes = KErrNone;
     for(;;)
     {
         --cntBlocks;
@@ -977,16 +1343,10 @@ int CVhdFileDiff::DiscardSectors(uint32_t aStartSector, int aSectors)
 
         if(blockSector != KBatEntry_Unused)
         {   //-- the block is present,
-            //-- mark range of sectors in the block as 'discarded' by resetting corresponding bits in the allocation bitmaps
-            ASSERT(BatEntryValid(blockSector));
-
-            const uint32_t startBit = SectorInBlock(currSectorL);
-            const TSectorBitmapState sectBmpState = ipSectorMapper->ResetSectorAllocBits(blockSector, startBit, KSectorsToMark);
-            if(sectBmpState == ESB_Invalid)
-            {//-- something really bad happened
-                ASSERT(0);
-                return KErrCorrupt;
-            }
+            //-- mark range of sectors in the block as 'discarded' and give their space back to the host file system
+            nRes = DoDiscardBlockSectors(currBlock, blockSector, SectorInBlock(currSectorL), KSectorsToMark);
+            if(nRes != KErrNone)
+                break;
         }
 
         //============================================================
@@ -1001,9 +1361,11 @@ int CVhdFileDiff::DiscardSectors(uint32_t aStartSector, int aSectors)
 
     };
 
-    ASSERT(!remSectors);
+    ASSERT(nRes != KErrNone || !remSectors);
 
-    return KErrNone;
+    DoCheckMetadataDirty();
+
+    return nRes;
 }
 
 
@@ -1040,7 +1402,7 @@ int CVhdFileDiff::DoCopySectorsFromParent(uint32_t aStartSectorParentL, uint32_t
         const uint sectorsToRead = Min(KBufSizeSectors, aSectors);
 
         //-- read _logical_ sectors from the parent VHD(s)
-        nRes = DoReadSectorsFromParent(aStartSectorParentL, sectorsToRead, buf.Ptr(), KBufSize);
+        nRes = DoReadSectorsFromParent(aStartSectorParentL, sectorsToRead, TIoVecBuf(buf.Ptr(), KBufSize));
         if(nRes <0)
             return nRes;//-- this is the error code
 
@@ -1118,9 +1480,74 @@ const CVhdFileBase* CVhdFileDiff::GetParentOpened(uint32_t aParentNo)
     }
 
     ASSERT(iParent);
+
+    TVhdChainGuard guard;
+    guard.Lock(*iParent);
+
     return iParent->GetParentOpened(aParentNo - 1);
 }
 
+//--------------------------------------------------------------------
+/**
+    Set the max. number of sector allocation bitmaps cached for this VHD and for the parent VHDs that are opened,
+    parents opened later will use the same value.
+
+    @param  aMaxPages   number of cached bitmaps per VHD file, 1..KMaxCached_SectorBitmaps_Limit
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdFileDiff::SetBitmapCacheSize(uint32_t aMaxPages)
+{
+    int nRes = CVhdDynDiffBase::SetBitmapCacheSize(aMaxPages);
+    if(nRes != KErrNone || !iParent)
+        return nRes;
+
+    TVhdChainGuard guard;
+    guard.Lock(*iParent);
+
+    return iParent->SetBitmapCacheSize(aMaxPages);
+}
+
+//--------------------------------------------------------------------
+/**
+    Set the sector allocation bitmaps cache replacement policy for this VHD and for the parent VHDs that are opened,
+    parents opened later will use the same policy.
+
+    @param  aPolicy replacement policy
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdFileDiff::SetBitmapCachePolicy(TVhdCachePolicy aPolicy)
+{
+    int nRes = CVhdDynDiffBase::SetBitmapCachePolicy(aPolicy);
+    if(nRes != KErrNone || !iParent)
+        return nRes;
+
+    TVhdChainGuard guard;
+    guard.Lock(*iParent);
+
+    return iParent->SetBitmapCachePolicy(aPolicy);
+}
+
+//--------------------------------------------------------------------
+/**
+    Set the BAT cache page size and the max. number of cached BAT pages for this VHD and for the parent VHDs that are opened,
+    parents opened later will use the same values.
+
+    @param  aPageSizeLog2   Log2(sectors per cache page), 0..KBatCache_PageSizeLog2_Limit
+    @param  aMaxPages       max. number of cached pages per VHD file, 1..KBatCache_MaxPages_Limit
+    @return KErrNone on success, negative error code otherwise
+*/
+int CVhdFileDiff::SetBatCacheSize(uint32_t aPageSizeLog2, uint32_t aMaxPages)
+{
+    int nRes = CVhdDynDiffBase::SetBatCacheSize(aPageSizeLog2, aMaxPages);
+    if(nRes != KErrNone || !iParent)
+        return nRes;
+
+    TVhdChainGuard guard;
+    guard.Lock(*iParent);
+
+    return iParent->SetBatCacheSize(aPageSizeLog2, aMaxPages);
+}
+
 //--------------------------------------------------------------------
 /**
     A helper method that checks if the parent VHD's geometry matches this one.
@@ -222,7 +222,7 @@ int CVhdFileDynamic::DoReadSectorsFromBlock(TBlkOpParams &aParams)
 
     if(KBlockSector == KBatEntry_Unused)
     {//-- if whole block isn't present, then simulate reading zeroes
-        FillZ(aParams.ipData, KBytesToRead);
+        aParams.iData.Fill(KBytesToRead, 0);
     }
     else
     {//-- block is present in the VHD, read sectors. Sector bitmap contains '1' if the sector contains valid data and '0' if the data never been written there or discarded by TRIM
@@ -251,7 +251,7 @@ int CVhdFileDynamic::DoReadSectorsFromBlock(TBlkOpParams &aParams)
         if(bmpState == ESB_FullyMapped)
         {//-- all '1' bits in the bitmap, read a chunk of sectors from this VHD
             const uint32_t startDataSecP = KBlockSector + KBitmapSectors + SectorInBlock(KStartSectorL); //-- Physical sector number in the _file_
-            const int nRes = DoRaw_ReadData(startDataSecP, KBytesToRead, aParams.ipData);
+            const int nRes = DoRaw_ReadDataV(startDataSecP, KBytesToRead, aParams.iData);
             if(nRes <0)
                 return nRes;//-- this is the error code
 
@@ -259,7 +259,7 @@ int CVhdFileDynamic::DoReadSectorsFromBlock(TBlkOpParams &aParams)
         }
         else if(bmpState == ESB_FullyUnmapped)
         {//-- all '0' bits in the bitmap, simulate reading zeros
-            FillZ(aParams.ipData, KBytesToRead);
+            aParams.iData.Fill(KBytesToRead, 0);
         }
         else
         {//-- a mixture of '1's and '0's in the bitmap, need a selective read
@@ -267,7 +267,7 @@ int CVhdFileDynamic::DoReadSectorsFromBlock(TBlkOpParams &aParams)
 
             uint32_t sectorInBlock = SectorInBlock(KStartSectorL);                  //-- sector number _in_ the block
             uint32_t sectorP       = KBlockSector + KBitmapSectors + sectorInBlock; //-- Physical sector number in the _file_
-            uint8_t* pBuf = aParams.ipData;  //-- local pointer in the user's buffer
+            TIoVecBuf buf(aParams.iData);  //-- local position in the user's buffer
 
             //-- try finding extents of '0's and '1's in the bitmap and read multiple of sectors corresponding to the contuguous block of the same bit value
             TBitExtentFinder extFinder(pBitmap->GetAllocBitmap_Raw(), sectorInBlock, KSectorsToRead);
@@ -281,35 +281,114 @@ int CVhdFileDynamic::DoReadSectorsFromBlock(TBlkOpParams &aParams)
                 const uint extBytes   = extSectors << SectorSzLog2();
 
                 if(extFinder.ExtBitVal())
-                {//-- found an extent of '1's, read corresponding sectors from this VHD
-                    const int nRes = DoRaw_ReadData(sectorP, extBytes, pBuf);
-                    if(nRes < 0)
-                        return nRes;
-
-                    ASSERT(nRes == (int)extBytes);
+                {//-- found an extent of '1's, queue reading corresponding sectors from this VHD; all of them go out as a single batch
+                    DoRaw_QueueRead(sectorP, extBytes, buf);
                 }
                 else
                 {//-- found an extent of '0's, simulate reading zeros
-                    FillZ(pBuf, extBytes);
+                    buf.Fill(extBytes, 0);
                 }
 
                 sectorInBlock += extSectors;
                 sectorP += extSectors;
-                pBuf    += extBytes;
+                buf.Advance(extBytes);
 
             }//for(;;)
 
+            const int nRes = DoRaw_SubmitBatch();
+            if(nRes < 0)
+                return nRes;
+
         }
 
     }
 
     //-- update parameters data
     aParams.iCurrSectorL += KSectorsToRead;
-    aParams.ipData       += KBytesToRead;
+    aParams.iData.Advance(KBytesToRead);
+
+    return KErrNone;
+}
+
+
+//--------------------------------------------------------------------
+/**
+    Allocate a new block in the VHD file, see AllocateBlock(), and place its entry to the BAT cache.
+    The block sectors that are not going to be written by the caller are zero-filled.
+
+    @param  aBlockNumber    logical block number
+    @param  aStartSectorL   logical sector number the caller is going to start writing from, must belong to the block
+    @param  aSectors        number of sectors the caller is going to write to the block
+    @param  aBlockSector    out: block starting sector in the file
+    @param  aSetAllBmpBits  out: true if all bits in the block sector bitmap must be set after writing data
+
+    @return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdFileDynamic::DoAllocateBlock(uint32_t aBlockNumber, uint32_t aStartSectorL, uint32_t aSectors, TBatEntry& aBlockSector, bool& aSetAllBmpBits)
+{
+    int nRes;
+
+    const uint32_t KBitmapSectors = SBmp_SizeInSectors(); //-- block allocation bitmap size, in sectors
+
+    ASSERT(ipBAT->ReadEntry(aBlockNumber) == KBatEntry_Unused);
+    ASSERT(SectorToBlockNumber(aStartSectorL) == aBlockNumber && SectorInBlock(aStartSectorL) + aSectors <= SectorsPerBlock());
+
+    //-- 1. append a block without zero-filling it
+
+    //-- 1.1 find out if we need to have all bits in the alloc. bitmap set. If true, then sector bitmap will have all bits set
+    aSetAllBmpBits = (BlockPureMode() || KDynVhd_CreateFullyMappedBlock)   //-- in 'pure mode' everything is done to avoid using bitmap caches for the performance sake
+                      && (!TrimEnabled());                                 //-- when using TRIM '0' bits indicate sectors that can be discarded and should be read as zeros.
+
+
+    nRes = AllocateBlock(aBlockNumber, aBlockSector, aSetAllBmpBits, false);
+    if(nRes < 0)
+        return nRes;
+
+    {//-- 2. zero-fill bits of the block if necessary
+        const uint32_t chunk1_SecStart_P = aBlockSector + KBitmapSectors;//-- physical starting sector of chunk1
+        const uint32_t chunk1_SecLen     = SectorInBlock(aStartSectorL);   //-- number of sectors in chunk1
+
+        const uint32_t chunk2_SecStart_P = chunk1_SecStart_P + chunk1_SecLen + aSectors; //-- physical starting sector of chunk2
+        const uint32_t chunk2_SecLen     = SectorsPerBlock()- (chunk1_SecLen + aSectors);//-- number of sectors in chunk2
+
+        //-- 1. zero fill extent before block of data to be written later
+        nRes = DoRaw_FillMedia(chunk1_SecStart_P, chunk1_SecLen, 0x00);
+        if(nRes != KErrNone)
+            return nRes;
+
+        //-- 2. zero fill extent after block of our data
+        nRes = DoRaw_FillMedia(chunk2_SecStart_P, chunk2_SecLen, 0x00);
+        if(nRes != KErrNone)
+            return nRes;
+    }
+
+    //-- 3. place entry to BAT cache
+    nRes = ipBAT->WriteEntry(aBlockNumber, aBlockSector);
+    if(nRes < 0)
+    {
+        ASSERT(0);
+        return nRes;
+    }
 
     return KErrNone;
 }
 
+//--------------------------------------------------------------------
+/**
+    Map an extent of sectors that are not allocated in the file. For the Dynamic VHD such sectors are read as zeros.
+
+	@param	aStartSector	starting logical sector.
+	@param	aSectors		number of logical sectors to map
+	@param	aList		    out: list of extents
+	@param	aLayer		    index of this VHD in the chain
+
+	@return	KErrNone
+*/
+int CVhdFileDynamic::DoMapUnallocated(uint32_t aStartSector, uint32_t aSectors, TVhdExtentList& aList, uint32_t aLayer)
+{
+    aList.Add(EVhdExt_Zero, aStartSector, aSectors, aLayer, -1, 0);
+    return KErrNone;
+}
 
 //--------------------------------------------------------------------
 /**
@@ -335,45 +414,16 @@ int CVhdFileDynamic::DoWriteSectorsToBlock(TBlkOpParams &aParams)
     TBatEntry blockSector = ipBAT->ReadEntry(aParams.iCurrBlock);
 
 
+    if(blockSector == KBatEntry_Unused && KSectorsToWrite == SectorsPerBlock())
+    {//-- the block isn't present and is going to be written entirely; append it with the data by a single I/O
+        return DoAppendFullBlock(aParams);
+    }
+
     if(blockSector == KBatEntry_Unused)
     {//-- the block isn't present; need to extend VHD file by one block
-
-        //-- 1. append a block without zero-filling it
-
-        //-- 1.1 find out if we need to have all bits in the alloc. bitmap set. If true, then sector bitmap will have all bits set
-        bSetAllBmpBits = (BlockPureMode() || KDynVhd_CreateFullyMappedBlock)   //-- in 'pure mode' everything is done to avoid using bitmap caches for the performance sake
-                          && (!TrimEnabled());                                 //-- when using TRIM '0' bits indicate sectors that can be discarded and should be read as zeros.
-
-
-        nRes = AppendBlock(blockSector, bSetAllBmpBits, false);
-        if(nRes < 0)
-            return nRes;
-
-        {//-- 2. zero-fill bits of the block if necessary
-            const uint32_t chunk1_SecStart_P = blockSector + KBitmapSectors;//-- physical starting sector of chunk1
-            const uint32_t chunk1_SecLen     = SectorInBlock(KStartSectorL);   //-- number of sectors in chunk1
-
-            const uint32_t chunk2_SecStart_P = chunk1_SecStart_P + chunk1_SecLen + KSectorsToWrite; //-- physical starting sector of chunk2
-            const uint32_t chunk2_SecLen     = SectorsPerBlock()- (chunk1_SecLen + KSectorsToWrite);//-- number of sectors in chunk2
-
-            //-- 1. zero fill extent before block of data to be written later
-            nRes = DoRaw_FillMedia(chunk1_SecStart_P, chunk1_SecLen, 0x00);
-            if(nRes != KErrNone)
-                return nRes;
-
-            //-- 2. zero fill extent after block of our data
-            nRes = DoRaw_FillMedia(chunk2_SecStart_P, chunk2_SecLen, 0x00);
-            if(nRes != KErrNone)
-                return nRes;
-        }
-
-        //-- 3. place entry to BAT cache
-        nRes = ipBAT->WriteEntry(aParams.iCurrBlock, blockSector);
+        nRes = DoAllocateBlock(aParams.iCurrBlock, KStartSectorL, KSectorsToWrite, blockSector, bSetAllBmpBits);
         if(nRes < 0)
-        {
-            ASSERT(0);
             return nRes;
-        }
 
         aParams.iFlushMetadata = true; //-- indicate that the metadata caches need flushing
     }
@@ -385,7 +435,7 @@ int CVhdFileDynamic::DoWriteSectorsToBlock(TBlkOpParams &aParams)
 
     const uint32_t startDataSecP = blockSector + KBitmapSectors + SectorInBlock(KStartSectorL);
 
-    nRes = DoRaw_WriteData(startDataSecP, KBytesToWrite, aParams.ipData);
+    nRes = DoRaw_WriteDataV(startDataSecP, KBytesToWrite, aParams.iData);
     if(nRes <0)
         return nRes;//-- this is the error code
 
@@ -417,7 +467,7 @@ int CVhdFileDynamic::DoWriteSectorsToBlock(TBlkOpParams &aParams)
 
     //-- update parameters data
     aParams.iCurrSectorL += KSectorsToWrite;
-    aParams.ipData       += KBytesToWrite;
+    aParams.iData.Advance(KBytesToWrite);
 
     return KErrNone;
 }
@@ -457,6 +507,7 @@ int CVhdFileDynamic::DiscardSectors(uint32_t aStartSector, int aSectors)
     uint32_t cntBlocks = SectorToBlockNumber(aStartSector + remSectors -1) - currBlock + 1; //-- number of blocks the range of sectors spans
     ASSERT(cntBlocks && cntBlocks <= (VhdSizeInSectors()>>SectorsPerBlockLog2()));
 
+    nRes = KErrNone;
     for(;;)
     {
         --cntBlocks;
@@ -470,16 +521,10 @@ int CVhdFileDynamic::DiscardSectors(uint32_t aStartSector, int aSectors)
 
         if(blockSector != KBatEntry_Unused)
         {   //-- the block is present,
-            //-- mark range of sectors in the block as 'discarded' by resetting corresponding bits in the allocation bitmaps
-            ASSERT(BatEntryValid(blockSector));
-
-            const uint32_t startBit = SectorInBlock(currSectorL);
-            const TSectorBitmapState sectBmpState = ipSectorMapper->ResetSectorAllocBits(blockSector, startBit, KSectorsToMark);
-            if(sectBmpState == ESB_Invalid)
-            {//-- something really bad happened
-                ASSERT(0);
-                return KErrCorrupt;
-            }
+            //-- mark range of sectors in the block as 'discarded' and give their space back to the host file system
+            nRes = DoDiscardBlockSectors(currBlock, blockSector, SectorInBlock(currSectorL), KSectorsToMark);
+            if(nRes != KErrNone)
+                break;
         }
 
         //============================================================
@@ -494,9 +539,11 @@ int CVhdFileDynamic::DiscardSectors(uint32_t aStartSector, int aSectors)
 
     };
 
-    ASSERT(!remSectors);
+    ASSERT(nRes != KErrNone || !remSectors);
 
-    return KErrNone;
+    DoCheckMetadataDirty();
+
+    return nRes;
 }
 
 
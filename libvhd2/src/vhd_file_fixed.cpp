@@ -22,6 +22,7 @@
 */
 
 #include <unistd.h>
+#include <limits.h>
 #include <errno.h>
 
 #include "vhd.h"
@@ -102,18 +103,17 @@ int CVhdFileFixed::GetInfo(TVHD_Params& aVhdInfo, uint32_t aParentNo) const
 
 	@param	aStartSector	starting logical sector.
 	@param	aSectors		number of logical sectors to read 0..LONG_MAX
-	@param	apBuffer		out: read data
-    @param  aBufSize        buffer size in bytes
+	@param	aBuf		    out: read data go to the buffer starting from its current position
 
     @return	positive number of read sectors on success, negative value corresponding system error code otherwise.
 */
-int CVhdFileFixed::ReadSectors(uint32_t aStartSector, int aSectors, void* apBuffer, uint32_t aBufSize)
+int CVhdFileFixed::ReadSectorsV(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf)
 {
 
     DBG_LOG("#--- CVhdFileFixed::ReadSectors[0x%p] startSec:%d, num:%d",this, aStartSector, aSectors);
 
     //-- check arguments and adjust number of sectors to read if necessary
-    int nRes = DoCheckRW_Args(aStartSector, aSectors, aBufSize);
+    int nRes = DoCheckRW_Args(aStartSector, aSectors, aBuf.Size());
     if(nRes <= 0 )
         return nRes; //-- something is wrong with the arguments
 
@@ -121,7 +121,7 @@ int CVhdFileFixed::ReadSectors(uint32_t aStartSector, int aSectors, void* apBuff
     const uint32_t  KSectorsToRead     = nRes;
     const int       KBytesToRead = KSectorsToRead << SectorSzLog2();
 
-    const int bytesRead = DoRaw_ReadData(aStartSector, KBytesToRead, apBuffer);
+    const int bytesRead = DoRaw_ReadDataV(aStartSector, KBytesToRead, aBuf);
 
     if(bytesRead < 0)
         return bytesRead; //-- this is the error code
@@ -136,12 +136,11 @@ int CVhdFileFixed::ReadSectors(uint32_t aStartSector, int aSectors, void* apBuff
 	Write a number of sectors to the VHD file. Sector numbers are logical, i.e. 0..VhdSizeInSectors()
 	@param	aStartSector	starting logical sector.
 	@param	aSectors		number of logical sectors to write 0..LONG_MAX
-	@param	apBuffer		in: data to write
-    @param  aBufSize        buffer size in bytes
+	@param	aBuf		    in: data to write, starting from the buffer current position
 
 	@return	positive number of written sectors on success, negative value corresponding system error code otherwise.
 */
-int CVhdFileFixed::WriteSectors(uint32_t aStartSector, int aSectors, const void* apBuffer, uint32_t aBufSize)
+int CVhdFileFixed::WriteSectorsV(uint32_t aStartSector, int aSectors, const TIoVecBuf& aBuf)
 {
     DBG_LOG("#--- CVhdFileFixed::WriteSectors[0x%p] startSec:%d, num:%d",this, aStartSector, aSectors);
 
@@ -149,7 +148,7 @@ int CVhdFileFixed::WriteSectors(uint32_t aStartSector, int aSectors, const void*
         return -EBADF;
 
     //-- check arguments and adjust number of sectors to write if necessary
-    int nRes = DoCheckRW_Args(aStartSector, aSectors, aBufSize);
+    int nRes = DoCheckRW_Args(aStartSector, aSectors, aBuf.Size());
     if(nRes <= 0 )
         return nRes; //-- something is wrong with the arguments
 
@@ -157,7 +156,7 @@ int CVhdFileFixed::WriteSectors(uint32_t aStartSector, int aSectors, const void*
     const uint32_t  KSectorsToWrite = nRes;
     const int       KBytesToWrite = KSectorsToWrite << SectorSzLog2();
 
-    const int bytesWritten = DoRaw_WriteData(aStartSector, KBytesToWrite, apBuffer);
+    const int bytesWritten = DoRaw_WriteDataV(aStartSector, KBytesToWrite, aBuf);
     if(bytesWritten < 0)
         return bytesWritten; //-- this is the error code
 
@@ -167,10 +166,87 @@ int CVhdFileFixed::WriteSectors(uint32_t aStartSector, int aSectors, const void*
 }
 
 
+//--------------------------------------------------------------------
+/**
+    Translate an extent of logical sectors into the file extents. Fixed VHD is just a linear mapping of the sectors to the file.
+
+	@param	aStartSector	starting logical sector.
+	@param	aSectors		number of logical sectors to map 1..LONG_MAX
+	@param	aAllocate		if true, the sectors are going to be written by the client
+	@param	aList		    out: list of extents
+	@param	aLayer		    index of this VHD in the chain
+
+	@return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdFileFixed::MapExtents(uint32_t aStartSector, int aSectors, bool aAllocate, TVhdExtentList& aList, uint32_t aLayer)
+{
+    DBG_LOG("#--- CVhdFileFixed::MapExtents[0x%p] startSec:%d, num:%d, alloc:%d",this, aStartSector, aSectors, aAllocate);
+
+    if(aAllocate && ReadOnly())
+        return -EBADF;
+
+    //-- check arguments and adjust number of sectors to map if necessary
+    const int nRes = DoCheckRW_Args(aStartSector, aSectors, ((size_t)aSectors) << SectorSzLog2());
+    if(nRes <= 0 )
+        return nRes; //-- something is wrong with the arguments
+
+    aList.Add(EVhdExt_Data, aStartSector, nRes, aLayer, FileDesc(), ((uint64_t)aStartSector) << SectorSzLog2());
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Find the run of sectors starting at the given one that are all present in this file or all absent from it.
+    All sectors of a Fixed VHD are present and linearly mapped to the file.
+
+	@param	aStartSector	starting logical sector, must be less than VhdSizeInSectors()
+	@param	aSectors		max. number of sectors in the run, > 0
+	@param	aRun		    out: the run description
+
+	@return	KErrNone
+*/
+int CVhdFileFixed::MapLayerRun(uint32_t aStartSector, uint32_t aSectors, TLayerRun& aRun)
+{
+    ASSERT(State() == EOpened);
+    ASSERT(aSectors && aStartSector < VhdSizeInSectors());
+
+    aRun.iPresent    = true;
+    aRun.iSectors    = Min(aSectors, VhdSizeInSectors() - aStartSector);
+    aRun.iFileSector = aStartSector;
+
+    return KErrNone;
+}
+
+//--------------------------------------------------------------------
+/**
+    Mark an extent of sectors, written by the client directly to the file, as containing valid data.
+    Fixed VHD doesn't have any metadata describing sectors, so there is nothing to do.
+
+	@param	aStartSector	starting logical sector.
+	@param	aSectors		number of logical sectors 1..LONG_MAX
+
+	@return	KErrNone on success, negative value corresponding system error code otherwise.
+*/
+int CVhdFileFixed::CommitExtents(uint32_t aStartSector, int aSectors)
+{
+    DBG_LOG("#--- CVhdFileFixed::CommitExtents[0x%p] startSec:%d, num:%d",this, aStartSector, aSectors);
+
+    if(ReadOnly())
+        return -EBADF;
+
+    const int nRes = DoCheckRW_Args(aStartSector, aSectors, ((size_t)aSectors) << SectorSzLog2());
+    if(nRes <= 0 )
+        return nRes;
+
+    return KErrNone;
+}
+
+
 //--------------------------------------------------------------------
 /**
     Mark an extent of sectors as "TRIMmed" or "Discarded". Such sectors will be treated as no longer containing a valid information.
-    Later on, some smart things can be done using information about "discarded" sectors. It depends on VHD type.
+    For the fixed VHD the host file system blocks entirely within the extent are deallocated, so the file becomes sparse.
 
 	@param	aStartSector	starting logical sector.
 	@param	aSectors		number of logical sectors to "discard" 0..LONG_MAX
@@ -184,8 +260,15 @@ int CVhdFileFixed::DiscardSectors(uint32_t aStartSector, int aSectors)
     if(ReadOnly())
         return -EBADF;
 
-    //-- Nothing to do, actually. Simulate normal completion
-    return KErrNone;
+    //-- check arguments and adjust number of sectors if necessary
+    int nRes = DoCheckRW_Args(aStartSector, aSectors, UINT_MAX);
+    if(nRes <= 0 )
+        return nRes; //-- something is wrong with the arguments
+
+    //-- logical sectors are the physical ones; give the space back to the host file system, discarded sectors read as zeroes.
+    //-- If the file system can't do this, there is nothing else to do, simulate normal completion
+    nRes = DoRaw_PunchHole(aStartSector, (uint32_t)nRes);
+    return (nRes == KErrNotSupported) ? KErrNone : nRes;
 }
 
 
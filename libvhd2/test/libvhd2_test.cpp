@@ -244,6 +244,25 @@ int main(int argc, char *argv[])
 {
 
     TrimTests_Execute();
+    AsyncIoTests_Execute();
+    IoEngineTests_Execute();
+    IoVecTests_Execute();
+    MapExtentsTests_Execute();
+    BatTests_Execute();
+    BmpCacheTests_Execute();
+    CacheBudgetTests_Execute();
+    GroupCommitTests_Execute();
+    DurabilityTests_Execute();
+    FlusherTests_Execute();
+    BmpWriteBackTests_Execute();
+    AppendTests_Execute();
+    PreallocTests_Execute();
+    CompactTests_Execute();
+    FreeSlotsTests_Execute();
+    DefragTests_Execute();
+    ChainLayersTests_Execute();
+    ChainRunsTests_Execute();
+    SharedParentTests_Execute();
 
 
     //---------------------------------------
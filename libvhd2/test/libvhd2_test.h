@@ -169,6 +169,11 @@ void LibVhd_2_WriteTestSequence(TVhdHandle aVhdHandle, uint aStartSector, uint a
 int LibVhd_2_CheckTestSequence(TVhdHandle aVhdHandle, uint aStartSector, uint aNumSectors, TRndSequenceGen& aSeqGen);
 int LibVhd_2_CheckFileFill(TVhdHandle aVhdHandle, uint aStartSector, uint aNumSectors, uint8_t aFill);
 int LibVhd_2_FillFile(TVhdHandle aVhdHandle, uint aStartSector, uint aNumSectors, uint8_t aFill);
+uint64_t LibVhd_2_GetFileSize(const char* aFileName);
+uint64_t LibVhd_2_GetFileSize(const char* aFileName, uint64_t& aAllocated);
+uint64_t LibVhd_2_GetBlockOffset(TVhdHandle aVhdHandle, uint aBlock);
+void LibVhd_2_ReadRawBat(const char* aFileName, vector<uint32_t>& aBat);
+uint32_t LibVhd_2_ReadRawBatEntry(const char* aFileName, uint aBlockNo);
 
 //-----------------------------------------------------------------------------
 
@@ -182,6 +187,44 @@ void CoalesceTests_Execute();
 
 void TrimTests_Execute();
 
+void AsyncIoTests_Execute();
+
+void IoEngineTests_Execute();
+
+void IoVecTests_Execute();
+
+void MapExtentsTests_Execute();
+
+void BatTests_Execute();
+
+void BmpCacheTests_Execute();
+
+void CacheBudgetTests_Execute();
+
+void GroupCommitTests_Execute();
+
+void DurabilityTests_Execute();
+
+void FlusherTests_Execute();
+
+void BmpWriteBackTests_Execute();
+
+void AppendTests_Execute();
+
+void PreallocTests_Execute();
+
+void CompactTests_Execute();
+
+void FreeSlotsTests_Execute();
+
+void DefragTests_Execute();
+
+void ChainLayersTests_Execute();
+
+void ChainRunsTests_Execute();
+
+void SharedParentTests_Execute();
+
 
 void Tests_Cleanup();
 
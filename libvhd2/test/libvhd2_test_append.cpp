@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test appending blocks to Dynamic and Differencing VHDs: writes covering whole new blocks, that are appended with their
+    data by a single I/O, mixed with partial block writes; checking the file size and the data after reopening.
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** number of blocks in the test VHDs */
+static const uint KVhdBlocks = 8;
+
+/** size of the appended block in the file: 1 sector bitmap and the data */
+static const uint KAppendedBlockBytes = (1 + KDefSecPerBlock) * KDefSecSize;
+
+//--------------------------------------------------------------------
+/**
+    Write whole blocks and a part of a block to the opened VHD:
+        block 2     a whole block
+        block 0     a single sector, the rest of the block is read as zeroes or from the parent
+        block 5,6   two whole blocks by a single call
+        block 7     a whole block from a scatter-gather buffer
+
+    @param  aFileName   VHD file name
+    @param  aVhdHandle  VHD handle opened for writing
+*/
+static void DoWriteBlocks(const char* aFileName, TVhdHandle aVhdHandle)
+{
+    int nRes;
+
+    const uint KBlockBytes = KDefSecPerBlock*KDefSecSize;
+    vector<uint8_t> buf(2*KBlockBytes);
+
+    const uint64_t initialSize = LibVhd_2_GetFileSize(aFileName);
+
+    //-- whole block 2
+    memset(&buf[0], 2, KBlockBytes);
+    nRes = VHD_WriteSectors(aVhdHandle, 2*KDefSecPerBlock, KDefSecPerBlock, &buf[0], KBlockBytes);
+    test_Val(nRes, (int)KDefSecPerBlock);
+
+    test(LibVhd_2_GetFileSize(aFileName) == initialSize + KAppendedBlockBytes);
+
+    //-- a single sector in block 0
+    memset(&buf[0], 'a', KDefSecSize);
+    nRes = VHD_WriteSectors(aVhdHandle, 10, 1, &buf[0], KDefSecSize);
+    test_Val(nRes, 1);
+
+    //-- whole blocks 5 and 6
+    memset(&buf[0], 5, KBlockBytes);
+    memset(&buf[KBlockBytes], 6, KBlockBytes);
+    nRes = VHD_WriteSectors(aVhdHandle, 5*KDefSecPerBlock, 2*KDefSecPerBlock, &buf[0], buf.size());
+    test_Val(nRes, (int)(2*KDefSecPerBlock));
+
+    //-- whole block 7 from 3 memory segments
+    memset(&buf[0], 7, KBlockBytes);
+
+    iovec iov[3];
+    iov[0].iov_base = &buf[0];
+    iov[0].iov_len  = 3*KDefSecSize;
+    iov[1].iov_base = &buf[3*KDefSecSize];
+    iov[1].iov_len  = KBlockBytes/2;
+    iov[2].iov_base = &buf[3*KDefSecSize + KBlockBytes/2];
+    iov[2].iov_len  = KBlockBytes - (3*KDefSecSize + KBlockBytes/2);
+
+    nRes = VHD_WriteSectorsV(aVhdHandle, 7*KDefSecPerBlock, KDefSecPerBlock, iov, 3);
+    test_Val(nRes, (int)KDefSecPerBlock);
+
+    test(LibVhd_2_GetFileSize(aFileName) == initialSize + 5*KAppendedBlockBytes);
+}
+
+//--------------------------------------------------------------------
+/**
+    Check the data written by DoWriteBlocks()
+    @param  aVhdHandle  VHD handle
+    @param  aParentFill fill byte of the parent's block 0, 0 for the Dynamic VHD
+*/
+static void DoCheckBlocks(TVhdHandle aVhdHandle, uint8_t aParentFill)
+{
+    int nRes;
+
+    nRes = LibVhd_2_CheckFileFill(aVhdHandle, 0, 10, aParentFill);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(aVhdHandle, 10, 1, 'a');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(aVhdHandle, 11, KDefSecPerBlock-11, aParentFill);
+    test_KErrNone(nRes);
+
+    for(uint blk=1; blk<KVhdBlocks; ++blk)
+    {
+        const bool written = (blk == 2 || blk >= 5);
+
+        nRes = LibVhd_2_CheckFileFill(aVhdHandle, blk*KDefSecPerBlock, KDefSecPerBlock, written ? blk : 0);
+        test_KErrNone(nRes);
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Write blocks to the VHD, check the data before and after reopening, then append one more block after reopening.
+    @param  aFileName   VHD file name
+    @param  aParentFill fill byte of the parent's block 0, 0 for the Dynamic VHD
+*/
+static void DoTestAppend(const char* aFileName, uint8_t aParentFill)
+{
+    int nRes;
+
+    TVhdHandle hVhd = VHD_Open(aFileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    DoWriteBlocks(aFileName, hVhd);
+    DoCheckBlocks(hVhd, aParentFill);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- the footer must be at the end of the file, check the data after reopening
+    hVhd = VHD_Open(aFileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    DoCheckBlocks(hVhd, aParentFill);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- append one more block, its position comes from the file size after reopening
+    hVhd = VHD_Open(aFileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    const uint64_t fileSize = LibVhd_2_GetFileSize(aFileName);
+
+    nRes = LibVhd_2_FillFile(hVhd, 3*KDefSecPerBlock, KDefSecPerBlock, 3);
+    test_KErrNone(nRes);
+
+    test(LibVhd_2_GetFileSize(aFileName) == fileSize + KAppendedBlockBytes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    hVhd = VHD_Open(aFileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 3*KDefSecPerBlock, KDefSecPerBlock, 3);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 7*KDefSecPerBlock, KDefSecPerBlock, 7);
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+}
+
+//--------------------------------------------------------------------
+/** Append whole and partial blocks to a Dynamic VHD */
+static void TestAppend_Dynamic()
+{
+    TEST_LOG();
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_Append.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+
+    DoTestAppend(fileName, 0);
+
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/** Append whole and partial blocks to a Differencing VHD; the whole block written in the child hides the parent's one */
+static void TestAppend_Diff()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strParentName = KVhdFilesPath;
+    strParentName += "!!Dynamic_AppendParent.vhd";
+    std::string strChildName = KVhdFilesPath;
+    strChildName += "!!Diff_Append.vhd";
+    const char* fileName = strChildName.c_str();
+
+    unlink(fileName);
+    unlink(strParentName.c_str());
+
+    //-- the parent has data in blocks 0 and 2
+    LibVhd_2_CreateVhd_Dynamic(strParentName.c_str(), KVhdBlocks*KDefSecPerBlock);
+
+    TVhdHandle hVhd = VHD_Open(strParentName.c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_FillFile(hVhd, 0, KDefSecPerBlock, 'p');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_FillFile(hVhd, 2*KDefSecPerBlock, KDefSecPerBlock, 'p');
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    LibVhd_2_CreateVhd_Diff(fileName, strParentName.c_str());
+
+    DoTestAppend(fileName, 'p');
+
+    unlink(fileName);
+    unlink(strParentName.c_str());
+}
+
+
+//--------------------------------------------------------------------
+/** Execute block appending tests */
+void AppendTests_Execute()
+{
+    TEST_LOG();
+    TestAppend_Dynamic();
+    TestAppend_Diff();
+}
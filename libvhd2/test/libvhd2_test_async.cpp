@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test asynchronous I/O API: VHD_SubmitIo(), VHD_PollCompletions(), VHD_GetIoEventFd()
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+static const uint KRndSeed1 = 0xdeadbeef;
+
+/** number of requests submitted in one go, more than one per block and more than the sector bitmaps cache can hold pages for */
+static const uint KNumReqs = 80;
+
+/** number of sectors in each request */
+static const uint KSectorsPerReq = 8;
+
+
+//--------------------------------------------------------------------
+/**
+    Submit a number of requests and collect their completions.
+    @param  hVhd        VHD handle
+    @param  apReqs      array of pointers to requests
+    @param  aNumReqs    number of requests in the array
+*/
+static void DoSubmitAndWait(TVhdHandle hVhd, TVhdIoRequest* apReqs[], uint aNumReqs)
+{
+    int nRes;
+
+    nRes = VHD_SubmitIo(hVhd, apReqs, aNumReqs);
+    test_Val(nRes, (int)aNumReqs);
+
+    //-- wait for the completion signal
+    const int fd = VHD_GetIoEventFd(hVhd);
+    test(fd >= 0);
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    nRes = poll(&pfd, 1, -1);
+    test(nRes == 1 && (pfd.revents & POLLIN));
+
+    //-- collect all completed requests, they must come in the order of submission
+    vector<TVhdIoRequest*> completed(aNumReqs);
+    uint numCompleted = 0;
+
+    while(numCompleted < aNumReqs)
+    {
+        nRes = VHD_PollCompletions(hVhd, &completed[numCompleted], aNumReqs-numCompleted, 1);
+        test(nRes > 0);
+        numCompleted += nRes;
+    }
+
+    for(uint i=0; i<aNumReqs; ++i)
+    {
+        test(completed[i] == apReqs[i]);
+    }
+
+    //-- nothing left in flight; non-blocking poll returns 0 and the eventfd isn't readable
+    nRes = VHD_PollCompletions(hVhd, &completed[0], aNumReqs, 1);
+    test_Val(nRes, 0);
+
+    pfd.revents = 0;
+    nRes = poll(&pfd, 1, 0);
+    test_Val(nRes, 0);
+}
+
+//--------------------------------------------------------------------
+/**
+    Test asynchronous I/O on a Dynamic VHD.
+    Writes a test sequence with the batch of asynchronous requests spread over several blocks, reads it back
+    with both asynchronous and synchronous API.
+*/
+static void TestAsyncIo_VHD_Dynamic()
+{
+    TEST_LOG();
+
+    int nRes;
+    TVhdHandle hVhd;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_Async.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, (16*K1MegaByte)>>KDefSecSizeLog2);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    const uint KReqBufSize = KSectorsPerReq*KDefSecSize;
+    vector<uint8_t> dataBuf(KNumReqs*KReqBufSize);
+
+    TVhdIoRequest reqs[KNumReqs];
+    TVhdIoRequest* pReqs[KNumReqs];
+
+    //-- 1. write the test sequence; each request writes to its own place, request "i" goes to the block "i % 7"
+    TRndSequenceGen seqGen(KRndSeed1);
+    seqGen.GenerateSequence(&dataBuf[0], dataBuf.size());
+
+    for(uint i=0; i<KNumReqs; ++i)
+    {
+        FillZ(reqs[i]);
+        reqs[i].ioOpcode = EVhdIo_Write;
+        reqs[i].ioStartSector = (i % 7)*KDefSecPerBlock + (i / 7)*KSectorsPerReq;
+        reqs[i].ioSectors = KSectorsPerReq;
+        reqs[i].ioBuffer = &dataBuf[i*KReqBufSize];
+        reqs[i].ioBufSize = KReqBufSize;
+        reqs[i].ioUserData = &reqs[i];
+        pReqs[i] = &reqs[i];
+    }
+
+    DoSubmitAndWait(hVhd, pReqs, KNumReqs);
+
+    for(uint i=0; i<KNumReqs; ++i)
+    {
+        test_Val(reqs[i].ioResult, (int)KSectorsPerReq);
+        test(reqs[i].ioUserData == &reqs[i]);
+    }
+
+    //-- 2. flush and read data back asynchronously
+    TVhdIoRequest reqFlush;
+    FillZ(reqFlush);
+    reqFlush.ioOpcode = EVhdIo_Flush;
+    TVhdIoRequest* pReqFlush = &reqFlush;
+
+    DoSubmitAndWait(hVhd, &pReqFlush, 1);
+    test_KErrNone(reqFlush.ioResult);
+
+    vector<uint8_t> readBuf(dataBuf.size());
+    for(uint i=0; i<KNumReqs; ++i)
+    {
+        reqs[i].ioOpcode = EVhdIo_Read;
+        reqs[i].ioBuffer = &readBuf[i*KReqBufSize];
+    }
+
+    DoSubmitAndWait(hVhd, pReqs, KNumReqs);
+
+    for(uint i=0; i<KNumReqs; ++i)
+    {
+        test_Val(reqs[i].ioResult, (int)KSectorsPerReq);
+    }
+
+    test(memcmp(&dataBuf[0], &readBuf[0], dataBuf.size()) == 0);
+
+    //-- 3. mix asynchronous and synchronous API; synchronous calls wait for pending requests
+    nRes = VHD_SubmitIo(hVhd, pReqs, KNumReqs);
+    test_Val(nRes, (int)KNumReqs);
+
+    uint8_t buf[KSectorsPerReq*KDefSecSize];
+    nRes = VHD_ReadSectors(hVhd, reqs[1].ioStartSector, KSectorsPerReq, buf, sizeof(buf));
+    test_Val(nRes, (int)KSectorsPerReq);
+    test(memcmp(buf, &dataBuf[KReqBufSize], sizeof(buf)) == 0);
+
+    //-- all requests must be completed by now, so collecting them doesn't block
+    TVhdIoRequest* completed[KNumReqs];
+    nRes = VHD_PollCompletions(hVhd, completed, KNumReqs, 0);
+    test_Val(nRes, (int)KNumReqs);
+
+    //-- 4. invalid and failing requests
+    reqs[0].ioOpcode = EVhdIo_None;
+    nRes = VHD_SubmitIo(hVhd, pReqs, 1);
+    test_Val(nRes, KErrArgument);
+
+    reqs[0].ioOpcode = EVhdIo_Discard; //-- TRIM isn't enabled
+    reqs[1].ioOpcode = EVhdIo_Read;
+    reqs[1].ioStartSector = (16*K1MegaByte)>>KDefSecSizeLog2; //-- beyond the end of the VHD
+    DoSubmitAndWait(hVhd, pReqs, 2);
+
+    test_Val(reqs[0].ioResult, KErrNotSupported);
+    test(reqs[1].ioResult < 0);
+
+    //-- 5. close VHD with requests in flight; they must be executed before closing
+    for(uint i=0; i<KNumReqs; ++i)
+    {
+        reqs[i].ioOpcode = EVhdIo_Write;
+        reqs[i].ioStartSector = (i % 7)*KDefSecPerBlock + (i / 7)*KSectorsPerReq;
+        reqs[i].ioBuffer = &dataBuf[i*KReqBufSize];
+    }
+
+    nRes = VHD_SubmitIo(hVhd, pReqs, KNumReqs);
+    test_Val(nRes, (int)KNumReqs);
+
+    VHD_Close(hVhd);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    for(uint i=0; i<KNumReqs; ++i)
+    {
+        nRes = VHD_ReadSectors(hVhd, reqs[i].ioStartSector, KSectorsPerReq, buf, sizeof(buf));
+        test_Val(nRes, (int)KSectorsPerReq);
+        test(memcmp(buf, &dataBuf[i*KReqBufSize], sizeof(buf)) == 0);
+    }
+
+    VHD_Close(hVhd);
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+
+/** parameters of a thread polling the completions */
+struct TPollerParams
+{
+    TVhdHandle      iVhdHandle;         ///< VHD handle
+    TVhdIoRequest*  iCompleted[KNumReqs];///< out: collected requests
+    int             iResult;            ///< out: VHD_PollCompletions() result
+};
+
+/** poller thread: waits for all submitted requests, though some of them can be collected by another thread */
+static void* DoPollerThread(void* apParams)
+{
+    TPollerParams* pParams = (TPollerParams*)apParams;
+    pParams->iResult = VHD_PollCompletions(pParams->iVhdHandle, pParams->iCompleted, KNumReqs, KNumReqs);
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------
+/**
+    Two threads poll the same VHD, both waiting for all requests in flight. The one that comes second must not wait for
+    the requests the first one has collected.
+*/
+static void TestAsyncIo_TwoPollers()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_AsyncPollers.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, (16*K1MegaByte)>>KDefSecSizeLog2);
+
+    //-- the writes are synced one by one, so that the threads start polling while the requests are still in flight
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPMODE_WRITETHROUGH);
+    test(hVhd > 0);
+
+    const uint KReqBufSize = KSectorsPerReq*KDefSecSize;
+    vector<uint8_t> dataBuf(KNumReqs*KReqBufSize, 'w');
+
+    TVhdIoRequest reqs[KNumReqs];
+    TVhdIoRequest* pReqs[KNumReqs];
+
+    for(uint i=0; i<KNumReqs; ++i)
+    {
+        FillZ(reqs[i]);
+        reqs[i].ioOpcode = EVhdIo_Write;
+        reqs[i].ioStartSector = (i % 7)*KDefSecPerBlock + (i / 7)*KSectorsPerReq;
+        reqs[i].ioSectors = KSectorsPerReq;
+        reqs[i].ioBuffer = &dataBuf[i*KReqBufSize];
+        reqs[i].ioBufSize = KReqBufSize;
+        pReqs[i] = &reqs[i];
+    }
+
+    TPollerParams params[2];
+    pthread_t threads[2];
+
+    for(uint i=0; i<2; ++i)
+        params[i].iVhdHandle = hVhd;
+
+    nRes = VHD_SubmitIo(hVhd, pReqs, KNumReqs);
+    test_Val(nRes, (int)KNumReqs);
+
+    for(uint i=0; i<2; ++i)
+        test(pthread_create(&threads[i], NULL, DoPollerThread, &params[i]) == 0);
+
+    for(uint i=0; i<2; ++i)
+        test(pthread_join(threads[i], NULL) == 0);
+
+    //-- every request is collected by one of the threads
+    test(params[0].iResult >= 0 && params[1].iResult >= 0);
+    test_Val(params[0].iResult + params[1].iResult, (int)KNumReqs);
+
+    for(uint i=0; i<2; ++i)
+    {
+        for(int j=0; j<params[i].iResult; ++j)
+            test_Val(params[i].iCompleted[j]->ioResult, (int)KSectorsPerReq);
+    }
+
+    VHD_Close(hVhd);
+    unlink(fileName);
+}
+
+
+//--------------------------------------------------------------------
+
+/** number of threads making the first asynchronous call at once */
+static const uint KNumFirstCallers = 8;
+
+/** parameters of a thread making the first asynchronous call */
+struct TFirstCallParams
+{
+    TVhdHandle  iVhdHandle; ///< VHD handle
+    int         iEventFd;   ///< out: VHD_GetIoEventFd() result
+};
+
+/** thread making the first asynchronous call on a VHD: gets the completion event descriptor */
+static void* DoFirstCallThread(void* apParams)
+{
+    TFirstCallParams* pParams = (TFirstCallParams*)apParams;
+    pParams->iEventFd = VHD_GetIoEventFd(pParams->iVhdHandle);
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------
+/**
+    Several threads make their first asynchronous call on a freshly opened VHD at once. They must all get the same queue,
+    i.e. the same completion event descriptor.
+*/
+static void TestAsyncIo_ConcurrentFirstCall()
+{
+    TEST_LOG();
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_AsyncFirstCall.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, (16*K1MegaByte)>>KDefSecSizeLog2);
+
+    for(uint pass=0; pass<10; ++pass)
+    {
+        TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+        test(hVhd > 0);
+
+        TFirstCallParams params[KNumFirstCallers];
+        pthread_t threads[KNumFirstCallers];
+
+        for(uint i=0; i<KNumFirstCallers; ++i)
+        {
+            params[i].iVhdHandle = hVhd;
+            test(pthread_create(&threads[i], NULL, DoFirstCallThread, &params[i]) == 0);
+        }
+
+        for(uint i=0; i<KNumFirstCallers; ++i)
+            test(pthread_join(threads[i], NULL) == 0);
+
+        test(params[0].iEventFd >= 0);
+        for(uint i=1; i<KNumFirstCallers; ++i)
+            test_Val(params[i].iEventFd, params[0].iEventFd);
+
+        VHD_Close(hVhd);
+    }
+
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/** Execute asynchronous I/O tests */
+void AsyncIoTests_Execute()
+{
+    TEST_LOG();
+    TestAsyncIo_VHD_Dynamic();
+    TestAsyncIo_TwoPollers();
+    TestAsyncIo_ConcurrentFirstCall();
+}
+
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test Block Allocation Table handling on VHDs with multi-sector BAT
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+static const uint KRndSeed1 = 0xdeadbeef;
+
+/** number of blocks in the test VHD; BAT takes several sectors */
+static const uint KVhdBlocks = 600;
+
+/** size of the test file */
+static const uint KVhdSizeInSectors = KVhdBlocks*KDefSecPerBlock;
+
+/** blocks to write; some of them are in the same BAT sector, some are in different ones */
+static const uint KTestBlocks[] = {0, 130, 131, 300, 590};
+static const uint KNumTestBlocks = sizeof(KTestBlocks)/sizeof(KTestBlocks[0]);
+
+/** blocks that are not written; one per each BAT sector */
+static const uint KUnusedBlocks[] = {1, 129, 256, 384, 589};
+static const uint KNumUnusedBlocks = sizeof(KUnusedBlocks)/sizeof(KUnusedBlocks[0]);
+
+/** number of blocks in the large test VHD; its BAT doesn't fit into the BAT cache (20 pages of 1024 entries) */
+static const uint KBigVhdBlocks = 20*1024;
+
+/** distance between written blocks in the large test VHD; every write touches a different BAT cache page */
+static const uint KBigVhdBlockStep = 1024 + 3;
+
+//--------------------------------------------------------------------
+/**
+    Write data to the blocks that are described by different BAT sectors and check that only the entries for these blocks
+    change on the media, and the data can be read back after reopening the VHD.
+*/
+static void TestBat_MultiSector()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_Bat.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdSizeInSectors);
+
+    vector<uint32_t> batOrig;
+    LibVhd_2_ReadRawBat(fileName, batOrig);
+    test(batOrig.size() >= KVhdBlocks);
+
+    //-- 1. write a sector to each test block; flush metadata after each write
+    TRndSequenceGen seqGen(KRndSeed1);
+    vector<uint8_t> dataBuf(KNumTestBlocks*KDefSecSize);
+    seqGen.GenerateSequence(&dataBuf[0], dataBuf.size());
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    for(uint i=0; i<KNumTestBlocks; ++i)
+    {
+        nRes = VHD_WriteSectors(hVhd, KTestBlocks[i]*KDefSecPerBlock + i, 1, &dataBuf[i*KDefSecSize], KDefSecSize);
+        test_Val(nRes, 1);
+
+        nRes = VHD_Flush(hVhd);
+        test_KErrNone(nRes);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 2. only the entries of the written blocks have changed, BAT padding is intact
+    vector<uint32_t> bat;
+    LibVhd_2_ReadRawBat(fileName, bat);
+    test(bat.size() == batOrig.size());
+
+    for(uint i=0; i<KNumTestBlocks; ++i)
+    {
+        test(batOrig[KTestBlocks[i]] == 0xFFFFFFFF);
+        test(bat[KTestBlocks[i]] != 0xFFFFFFFF);
+        bat[KTestBlocks[i]] = batOrig[KTestBlocks[i]];
+    }
+
+    test(bat == batOrig);
+
+    //-- 3. read the data back
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    uint8_t buf[KDefSecSize];
+    for(uint i=0; i<KNumTestBlocks; ++i)
+    {
+        nRes = VHD_ReadSectors(hVhd, KTestBlocks[i]*KDefSecPerBlock + i, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(memcmp(buf, &dataBuf[i*KDefSecSize], KDefSecSize) == 0);
+    }
+
+    for(uint i=0; i<KNumUnusedBlocks; ++i)
+    {
+        nRes = VHD_ReadSectors(hVhd, KUnusedBlocks[i]*KDefSecPerBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(CheckFilling(buf, sizeof(buf), 0));
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/**
+    Write data to the blocks described by all BAT cache pages of a large VHD without flushing, so that dirty pages are evicted
+    from the cache and re-read from the media. Check BAT on the media and the data after reopening the VHD.
+*/
+static void TestBat_Paged()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_BatPaged.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KBigVhdBlocks*KDefSecPerBlock);
+
+    vector<uint32_t> batOrig;
+    LibVhd_2_ReadRawBat(fileName, batOrig);
+    test(batOrig.size() >= KBigVhdBlocks);
+
+    vector<uint> blocks;
+    for(uint blk = 0; blk < KBigVhdBlocks - 1; blk += KBigVhdBlockStep)
+        blocks.push_back(blk);
+
+    TRndSequenceGen seqGen(KRndSeed1);
+    vector<uint8_t> dataBuf(blocks.size()*KDefSecSize);
+    seqGen.GenerateSequence(&dataBuf[0], dataBuf.size());
+
+    uint8_t buf[KDefSecSize];
+
+    //-- 1. write a sector to each test block, flush only at the end
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    for(uint i=0; i<blocks.size(); ++i)
+    {
+        nRes = VHD_WriteSectors(hVhd, blocks[i]*KDefSecPerBlock + i, 1, &dataBuf[i*KDefSecSize], KDefSecSize);
+        test_Val(nRes, 1);
+    }
+
+    //-- 2. read the data back; pages of the first blocks have been evicted and are read from the media again
+    for(uint i=0; i<blocks.size(); ++i)
+    {
+        nRes = VHD_ReadSectors(hVhd, blocks[i]*KDefSecPerBlock + i, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(memcmp(buf, &dataBuf[i*KDefSecSize], KDefSecSize) == 0);
+    }
+
+    nRes = VHD_Flush(hVhd);
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 3. only the entries of the written blocks have changed
+    vector<uint32_t> bat;
+    LibVhd_2_ReadRawBat(fileName, bat);
+    test(bat.size() == batOrig.size());
+
+    for(uint i=0; i<blocks.size(); ++i)
+    {
+        test(batOrig[blocks[i]] == 0xFFFFFFFF);
+        test(bat[blocks[i]] != 0xFFFFFFFF);
+        bat[blocks[i]] = batOrig[blocks[i]];
+    }
+
+    test(bat == batOrig);
+
+    //-- 4. read the data back after reopening, in reverse order
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    for(int i=blocks.size()-1; i>=0; --i)
+    {
+        nRes = VHD_ReadSectors(hVhd, blocks[i]*KDefSecPerBlock + i, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(memcmp(buf, &dataBuf[i*KDefSecSize], KDefSecSize) == 0);
+
+        nRes = VHD_ReadSectors(hVhd, (blocks[i]+1)*KDefSecPerBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(CheckFilling(buf, sizeof(buf), 0));
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/**
+    Change the BAT cache page size and capacity while the BAT cache is dirty, in the middle of writing to the blocks described by
+    all BAT pages of a large VHD. Check the data and BAT on the media after reopening the VHD.
+*/
+static void TestBat_CacheSize()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_BatCacheSize.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KBigVhdBlocks*KDefSecPerBlock);
+
+    vector<uint> blocks;
+    for(uint blk = 0; blk < KBigVhdBlocks - 1; blk += KBigVhdBlockStep)
+        blocks.push_back(blk);
+
+    TRndSequenceGen seqGen(KRndSeed1);
+    vector<uint8_t> dataBuf(blocks.size()*KDefSecSize);
+    seqGen.GenerateSequence(&dataBuf[0], dataBuf.size());
+
+    uint8_t buf[KDefSecSize];
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    //-- 1. invalid parameters
+    test_Val(VHD_SetBatCacheSize(hVhd, 6, 16), KErrArgument);
+    test_Val(VHD_SetBatCacheSize(hVhd, 3, 0), KErrArgument);
+    test_Val(VHD_SetBatCacheSize(hVhd, 3, 64*1024+1), KErrArgument);
+
+    //-- 2. write every test block, changing the page size and the capacity on the way
+    const uint32_t KCacheSizes[][2] = {{0, 2}, {5, 1}, {2, 64}};
+    const uint KNumCacheSizes = sizeof(KCacheSizes)/sizeof(KCacheSizes[0]);
+
+    for(uint i=0; i<blocks.size(); ++i)
+    {
+        if(i % (blocks.size() / KNumCacheSizes + 1) == 1)
+        {
+            const uint32_t* pSize = KCacheSizes[i / (blocks.size() / KNumCacheSizes + 1)];
+            nRes = VHD_SetBatCacheSize(hVhd, pSize[0], pSize[1]);
+            test_KErrNone(nRes);
+        }
+
+        nRes = VHD_WriteSectors(hVhd, blocks[i]*KDefSecPerBlock + i, 1, &dataBuf[i*KDefSecSize], KDefSecSize);
+        test_Val(nRes, 1);
+    }
+
+    for(uint i=0; i<blocks.size(); ++i)
+    {
+        nRes = VHD_ReadSectors(hVhd, blocks[i]*KDefSecPerBlock + i, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(memcmp(buf, &dataBuf[i*KDefSecSize], KDefSecSize) == 0);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 3. all written blocks are in the BAT on the media, the data can be read back
+    vector<uint32_t> bat;
+    LibVhd_2_ReadRawBat(fileName, bat);
+
+    for(uint i=0; i<blocks.size(); ++i)
+        test(bat[blocks[i]] != 0xFFFFFFFF);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    nRes = VHD_SetBatCacheSize(hVhd, 0, 1);
+    test_KErrNone(nRes);
+
+    for(int i=blocks.size()-1; i>=0; --i)
+    {
+        nRes = VHD_ReadSectors(hVhd, blocks[i]*KDefSecPerBlock + i, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(memcmp(buf, &dataBuf[i*KDefSecSize], KDefSecSize) == 0);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/** Execute BAT tests */
+void BatTests_Execute()
+{
+    TEST_LOG();
+    TestBat_MultiSector();
+    TestBat_Paged();
+    TestBat_CacheSize();
+}
+
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test sector bitmaps cache: VHD_SetBitmapCacheSize(), VHD_SetBitmapCachePolicy(), accessing many partially-mapped blocks in a VHD chain
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <endian.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** number of blocks in the test VHDs */
+static const uint KVhdBlocks = 256;
+
+/** sector in every block written in the parent VHD */
+static const uint KParentSecInBlock = 10;
+
+/** sector in every block written in the child VHD */
+static const uint KChildSecInBlock = 20;
+
+/** step for visiting blocks in the "random" order; must be coprime with KVhdBlocks */
+static const uint KBlockStep = 97;
+
+/** bitmap cache size for the scan resistance test */
+static const uint KScanTestCacheSize = 8;
+
+//--------------------------------------------------------------------
+/** @return fill byte for the given block and layer */
+static uint8_t DoFillByte(uint aBlock, bool aChild)
+{
+    return (uint8_t)(aChild ? ~aBlock : aBlock);
+}
+
+//--------------------------------------------------------------------
+/**
+    Read the sectors written to the parent and the child VHDs and a sector that wasn't written in all blocks, visiting the blocks
+    in the "random" order.
+*/
+static void DoCheckBlocks(TVhdHandle aVhdHandle)
+{
+    int nRes;
+    uint8_t buf[KDefSecSize];
+
+    for(uint i=0, blk=0; i<KVhdBlocks; ++i, blk = (blk + KBlockStep) % KVhdBlocks)
+    {
+        nRes = VHD_ReadSectors(aVhdHandle, blk*KDefSecPerBlock + KParentSecInBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(CheckFilling(buf, sizeof(buf), DoFillByte(blk, false)));
+
+        nRes = VHD_ReadSectors(aVhdHandle, blk*KDefSecPerBlock + KChildSecInBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(CheckFilling(buf, sizeof(buf), DoFillByte(blk, true)));
+
+        nRes = VHD_ReadSectors(aVhdHandle, blk*KDefSecPerBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(CheckFilling(buf, sizeof(buf), 0));
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Write a sector in every block of the parent and the child VHDs, so that all bitmaps are partially mapped, and read them back
+    with different bitmap cache sizes, including shrinking the cache that contains dirty bitmaps.
+*/
+static void TestBmpCache_Diff()
+{
+    TEST_LOG();
+
+    int nRes;
+    uint8_t buf[KDefSecSize];
+
+    std::string strParentName = KVhdFilesPath;
+    strParentName += "!!Dynamic_BmpCache.vhd";
+    std::string strChildName = KVhdFilesPath;
+    strChildName += "!!Diff_BmpCache.vhd";
+
+    unlink(strChildName.c_str());
+    unlink(strParentName.c_str());
+
+    //-- 1. create and populate the parent
+    LibVhd_2_CreateVhd_Dynamic(strParentName.c_str(), KVhdBlocks*KDefSecPerBlock);
+
+    TVhdHandle hVhd = VHD_Open(strParentName.c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    for(uint blk=0; blk<KVhdBlocks; ++blk)
+    {
+        memset(buf, DoFillByte(blk, false), sizeof(buf));
+        nRes = VHD_WriteSectors(hVhd, blk*KDefSecPerBlock + KParentSecInBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 2. create the child and check the argument validation
+    LibVhd_2_CreateVhd_Diff(strChildName.c_str(), strParentName.c_str());
+
+    hVhd = VHD_Open(strChildName.c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = VHD_SetBitmapCacheSize(hVhd, 0);
+    test_Val(nRes, KErrArgument);
+
+    nRes = VHD_SetBitmapCacheSize(hVhd, 64*1024+1);
+    test_Val(nRes, KErrArgument);
+
+    //-- 3. large cache, all bitmaps of both files fit into it
+    nRes = VHD_SetBitmapCacheSize(hVhd, 4*KVhdBlocks);
+    test_KErrNone(nRes);
+
+    for(uint i=0, blk=0; i<KVhdBlocks; ++i, blk = (blk + KBlockStep) % KVhdBlocks)
+    {
+        memset(buf, DoFillByte(blk, true), sizeof(buf));
+        nRes = VHD_WriteSectors(hVhd, blk*KDefSecPerBlock + KChildSecInBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+    }
+
+    DoCheckBlocks(hVhd);
+
+    //-- 4. shrink the cache that contains dirty bitmaps, they must be written to the media
+    memset(buf, DoFillByte(0, true), sizeof(buf));
+    nRes = VHD_WriteSectors(hVhd, KChildSecInBlock, 1, buf, sizeof(buf));
+    test_Val(nRes, 1);
+
+    nRes = VHD_SetBitmapCacheSize(hVhd, 4);
+    test_KErrNone(nRes);
+
+    DoCheckBlocks(hVhd);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 5. reopen with a tiny cache, every access evicts a bitmap
+    hVhd = VHD_Open(strChildName.c_str(), VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    nRes = VHD_SetBitmapCacheSize(hVhd, 1);
+    test_KErrNone(nRes);
+
+    DoCheckBlocks(hVhd);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(strChildName.c_str());
+    unlink(strParentName.c_str());
+}
+
+//--------------------------------------------------------------------
+/**
+    Zero-fill the sector allocation bitmap of the block directly in the VHD file, bypassing the library.
+    @param  aFileName   Dynamic VHD file name
+    @param  aBlock      block number, the block must be present
+*/
+static void DoZeroBlockBitmap(const char* aFileName, uint aBlock)
+{
+    const int fd = open(aFileName, O_RDWR);
+    test(fd >= 0);
+
+    //-- BAT offset is a big-endian 64-bit field at offset 16 in the VHD header that follows the footer copy
+    uint64_t batOffset;
+    test_Val(pread(fd, &batOffset, sizeof(batOffset), KDefSecSize + 16), (int)sizeof(batOffset));
+    batOffset = be64toh(batOffset);
+
+    uint32_t blockSector;
+    test_Val(pread(fd, &blockSector, sizeof(blockSector), batOffset + aBlock*sizeof(blockSector)), (int)sizeof(blockSector));
+    blockSector = be32toh(blockSector);
+    test(blockSector != 0xFFFFFFFF);
+
+    uint8_t buf[KDefSecSize];
+    memset(buf, 0, sizeof(buf));
+    test_Val(pwrite(fd, buf, sizeof(buf), (uint64_t)blockSector << KDefSecSizeLog2), (int)sizeof(buf));
+
+    close(fd);
+}
+
+//--------------------------------------------------------------------
+/**
+    Check that a frequently used bitmap survives a pass over the whole VHD with EVhdCache_2Q policy and doesn't with EVhdCache_LRU.
+    The bitmap of the "hot" block is zero-filled on the media behind the library's back, so the data written to the block are
+    visible only while the bitmap remains cached.
+
+    @param  aFileName   Dynamic VHD file name with a sector written in every block, @see TestBmpCache_ScanResistance()
+    @param  aPolicy     cache policy to use
+*/
+static void DoTestScan(const char* aFileName, TVhdCachePolicy aPolicy)
+{
+    TEST_LOG("policy:%d", aPolicy);
+
+    int nRes;
+    uint8_t buf[KDefSecSize];
+
+    TVhdHandle hVhd = VHD_Open(aFileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    nRes = VHD_SetBitmapCacheSize(hVhd, KScanTestCacheSize);
+    test_KErrNone(nRes);
+
+    nRes = VHD_SetBitmapCachePolicy(hVhd, aPolicy);
+    test_KErrNone(nRes);
+
+    //-- 1. access the "hot" block 0 repeatedly, interleaved with other blocks
+    for(uint i=0; i<2; ++i)
+    {
+        for(uint blk=0; blk<=KScanTestCacheSize; ++blk)
+        {
+            nRes = VHD_ReadSectors(hVhd, blk*KDefSecPerBlock + KParentSecInBlock, 1, buf, sizeof(buf));
+            test_Val(nRes, 1);
+            test(CheckFilling(buf, sizeof(buf), DoFillByte(blk, false)));
+        }
+    }
+
+    //-- 2. make the block 0 bitmap on the media say that the sector isn't written
+    DoZeroBlockBitmap(aFileName, 0);
+
+    //-- 3. read every other block once
+    for(uint blk=KScanTestCacheSize+1; blk<KVhdBlocks; ++blk)
+    {
+        nRes = VHD_ReadSectors(hVhd, blk*KDefSecPerBlock + KParentSecInBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(CheckFilling(buf, sizeof(buf), DoFillByte(blk, false)));
+    }
+
+    //-- 4. the data are visible only if the bitmap is still cached
+    nRes = VHD_ReadSectors(hVhd, KParentSecInBlock, 1, buf, sizeof(buf));
+    test_Val(nRes, 1);
+
+    if(aPolicy == EVhdCache_2Q)
+    {
+        test(CheckFilling(buf, sizeof(buf), DoFillByte(0, false)));
+    }
+    else
+    {
+        test(CheckFilling(buf, sizeof(buf), 0));
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+}
+
+//--------------------------------------------------------------------
+/** Scan resistance of EVhdCache_2Q policy compared to EVhdCache_LRU */
+static void TestBmpCache_ScanResistance()
+{
+    TEST_LOG();
+
+    int nRes;
+    uint8_t buf[KDefSecSize];
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_BmpCacheScan.vhd";
+    const char* fileName = strFileName.c_str();
+
+    static const TVhdCachePolicy KPolicies[] = {EVhdCache_2Q, EVhdCache_LRU};
+
+    for(uint i=0; i<sizeof(KPolicies)/sizeof(KPolicies[0]); ++i)
+    {
+        unlink(fileName);
+        LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+
+        TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+        test(hVhd > 0);
+
+        for(uint blk=0; blk<KVhdBlocks; ++blk)
+        {
+            memset(buf, DoFillByte(blk, false), sizeof(buf));
+            nRes = VHD_WriteSectors(hVhd, blk*KDefSecPerBlock + KParentSecInBlock, 1, buf, sizeof(buf));
+            test_Val(nRes, 1);
+        }
+
+        nRes = VHD_SetBitmapCachePolicy(hVhd, (TVhdCachePolicy)5);
+        test_Val(nRes, KErrArgument);
+
+        LibVhd_2_CloseVhd(hVhd);
+
+        DoTestScan(fileName, KPolicies[i]);
+    }
+
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/**
+    Switch the cache policy of a VHD chain while the cache contains pages in both queues, some of them dirty.
+*/
+static void TestBmpCache_SwitchPolicy()
+{
+    TEST_LOG();
+
+    int nRes;
+    uint8_t buf[KDefSecSize];
+
+    std::string strParentName = KVhdFilesPath;
+    strParentName += "!!Dynamic_BmpCachePolicy.vhd";
+    std::string strChildName = KVhdFilesPath;
+    strChildName += "!!Diff_BmpCachePolicy.vhd";
+
+    unlink(strChildName.c_str());
+    unlink(strParentName.c_str());
+
+    LibVhd_2_CreateVhd_Dynamic(strParentName.c_str(), KVhdBlocks*KDefSecPerBlock);
+
+    TVhdHandle hVhd = VHD_Open(strParentName.c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    for(uint blk=0; blk<KVhdBlocks; ++blk)
+    {
+        memset(buf, DoFillByte(blk, false), sizeof(buf));
+        nRes = VHD_WriteSectors(hVhd, blk*KDefSecPerBlock + KParentSecInBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    LibVhd_2_CreateVhd_Diff(strChildName.c_str(), strParentName.c_str());
+
+    hVhd = VHD_Open(strChildName.c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = VHD_SetBitmapCacheSize(hVhd, 16);
+    test_KErrNone(nRes);
+
+    nRes = VHD_SetBitmapCachePolicy(hVhd, EVhdCache_2Q);
+    test_KErrNone(nRes);
+
+    for(uint i=0, blk=0; i<KVhdBlocks; ++i, blk = (blk + KBlockStep) % KVhdBlocks)
+    {
+        memset(buf, DoFillByte(blk, true), sizeof(buf));
+        nRes = VHD_WriteSectors(hVhd, blk*KDefSecPerBlock + KChildSecInBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+    }
+
+    DoCheckBlocks(hVhd);
+
+    nRes = VHD_SetBitmapCachePolicy(hVhd, EVhdCache_LRU);
+    test_KErrNone(nRes);
+
+    DoCheckBlocks(hVhd);
+
+    nRes = VHD_SetBitmapCachePolicy(hVhd, EVhdCache_2Q);
+    test_KErrNone(nRes);
+
+    DoCheckBlocks(hVhd);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- check the data after reopening
+    hVhd = VHD_Open(strChildName.c_str(), VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    DoCheckBlocks(hVhd);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(strChildName.c_str());
+    unlink(strParentName.c_str());
+}
+
+//--------------------------------------------------------------------
+/** Fixed VHDs don't have bitmaps, setting the cache size is accepted and does nothing */
+static void TestBmpCache_Fixed()
+{
+    TEST_LOG();
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Fixed_BmpCache.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Fixed(fileName, 4*KDefSecPerBlock);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    int nRes = VHD_SetBitmapCacheSize(hVhd, 1000);
+    test_KErrNone(nRes);
+
+    nRes = VHD_SetBitmapCacheSize(hVhd, 0);
+    test_Val(nRes, KErrArgument);
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(fileName);
+}
+
+
+//--------------------------------------------------------------------
+/** Execute sector bitmaps cache tests */
+void BmpCacheTests_Execute()
+{
+    TEST_LOG();
+    TestBmpCache_Diff();
+    TestBmpCache_ScanResistance();
+    TestBmpCache_SwitchPolicy();
+    TestBmpCache_Fixed();
+}
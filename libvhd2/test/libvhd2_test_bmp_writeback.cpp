@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test write-back of the dirty sector bitmaps: writing and discarding sectors in many blocks of a differencing VHD
+    with a tiny bitmap cache, so that most of the dirty bitmaps are evicted to the write-back queue and reloaded from it;
+    writing only the modified sectors of large bitmaps.
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <endian.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** number of blocks in the test VHDs; more than the write-back queue holds */
+static const uint KVhdBlocks = 64;
+
+/** number of sector bitmaps to cache; every access to another block evicts a bitmap */
+static const uint KCacheSize = 2;
+
+/** sectors written in every block in the first pass */
+static const uint KFirstSecInBlock = 5;
+
+/** sectors written in every block in the second pass */
+static const uint KSecondSecInBlock = 300;
+
+/** step for visiting blocks in the "random" order; must be coprime with KVhdBlocks */
+static const uint KBlockStep = 7;
+
+/** Log2(sectors per block) for the large blocks test, 32MB blocks have 16-sector bitmaps */
+static const uint KLargeSecPerBlockLog2 = 16;
+
+/** number of sectors described by a single sector of the bitmap */
+static const uint KSectorsPerBmpSector = KDefSecSize*8;
+
+//--------------------------------------------------------------------
+/** @return fill byte for the given block and pass */
+static uint8_t DoFillByte(uint aBlock, uint aPass)
+{
+    return (uint8_t)(aBlock + 1 + aPass*KVhdBlocks);
+}
+
+//--------------------------------------------------------------------
+/** write a sector with the fill byte of the block and pass */
+static void DoWriteSector(TVhdHandle aVhdHandle, uint aBlock, uint aSecInBlock, uint aPass)
+{
+    uint8_t buf[KDefSecSize];
+    memset(buf, DoFillByte(aBlock, aPass), sizeof(buf));
+
+    const int nRes = VHD_WriteSectors(aVhdHandle, aBlock*KDefSecPerBlock + aSecInBlock, 1, buf, sizeof(buf));
+    test_Val(nRes, 1);
+}
+
+//--------------------------------------------------------------------
+/**
+    Check the sectors of all blocks.
+    @param  aDiscarded  if true, the sector written in the first pass must be discarded in the odd blocks
+*/
+static void DoCheckBlocks(TVhdHandle aVhdHandle, bool aDiscarded)
+{
+    int nRes;
+    uint8_t buf[KDefSecSize];
+
+    for(uint i=0, blk=0; i<KVhdBlocks; ++i, blk = (blk + KBlockStep) % KVhdBlocks)
+    {
+        nRes = VHD_ReadSectors(aVhdHandle, blk*KDefSecPerBlock + KFirstSecInBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(CheckFilling(buf, sizeof(buf), (aDiscarded && (blk & 1)) ? 0 : DoFillByte(blk, 0)));
+
+        nRes = VHD_ReadSectors(aVhdHandle, blk*KDefSecPerBlock + KSecondSecInBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(CheckFilling(buf, sizeof(buf), DoFillByte(blk, 1)));
+
+        nRes = VHD_ReadSectors(aVhdHandle, blk*KDefSecPerBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(CheckFilling(buf, sizeof(buf), 0));
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Dirty the bitmaps of many blocks of a differencing VHD with a tiny bitmap cache, then modify the bitmaps that are likely to be
+    in the write-back queue (it keeps the most recently evicted ones) and the ones that have been written already.
+    Check the data before and after flushing and reopening the VHD. The parent is empty, so the sectors not mapped in the child
+    read as zeroes.
+*/
+static void TestBmpWriteBack_Diff()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strParentName = KVhdFilesPath;
+    strParentName += "!!Dynamic_BmpWriteBack.vhd";
+    std::string strChildName = KVhdFilesPath;
+    strChildName += "!!Diff_BmpWriteBack.vhd";
+    const char* fileName = strChildName.c_str();
+
+    unlink(fileName);
+    unlink(strParentName.c_str());
+
+    LibVhd_2_CreateVhd_Dynamic(strParentName.c_str(), KVhdBlocks*KDefSecPerBlock);
+    LibVhd_2_CreateVhd_Diff(fileName, strParentName.c_str());
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    nRes = VHD_SetBitmapCacheSize(hVhd, KCacheSize);
+    test_KErrNone(nRes);
+
+    //-- 1. allocate all blocks, every write makes a bitmap dirty and evicts another one
+    for(uint blk=0; blk<KVhdBlocks; ++blk)
+        DoWriteSector(hVhd, blk, KFirstSecInBlock, 0);
+
+    //-- 2. modify the bitmaps in the reverse order, the recently evicted ones come from the write-back queue
+    for(uint i=0; i<KVhdBlocks; ++i)
+        DoWriteSector(hVhd, KVhdBlocks-1-i, KSecondSecInBlock, 1);
+
+    DoCheckBlocks(hVhd, false);
+
+    //-- 3. discard sectors in the odd blocks, this resets bits in the bitmaps
+    for(uint i=0, blk=0; i<KVhdBlocks; ++i, blk = (blk + KBlockStep) % KVhdBlocks)
+    {
+        if(!(blk & 1))
+            continue;
+
+        nRes = VHD_DiscardSectors(hVhd, blk*KDefSecPerBlock + KFirstSecInBlock, 1);
+        test_KErrNone(nRes);
+    }
+
+    DoCheckBlocks(hVhd, true);
+
+    //-- 4. flush the write-back queue and the cache
+    nRes = VHD_Flush(hVhd);
+    test_KErrNone(nRes);
+
+    DoCheckBlocks(hVhd, true);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 5. check the data after reopening with the default cache size
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    DoCheckBlocks(hVhd, true);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 6. dirty bitmaps in the write-back queue must be written on closing the VHD
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = VHD_SetBitmapCacheSize(hVhd, KCacheSize);
+    test_KErrNone(nRes);
+
+    for(uint blk=0; blk<KVhdBlocks; ++blk)
+        DoWriteSector(hVhd, blk, KSecondSecInBlock, 1);
+
+    for(uint blk=1; blk<KVhdBlocks; blk+=2)
+        DoWriteSector(hVhd, blk, KFirstSecInBlock, 0);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    DoCheckBlocks(hVhd, false);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(fileName);
+    unlink(strParentName.c_str());
+}
+
+
+//--------------------------------------------------------------------
+/**
+    Zero-fill a sector of the block's allocation bitmap directly in the VHD file, bypassing the library.
+    @param  aFileName   Differencing VHD file name
+    @param  aBlock      block number, the block must be present
+    @param  aBmpSector  sector number in the bitmap
+*/
+static void DoZeroBitmapSector(const char* aFileName, uint aBlock, uint aBmpSector)
+{
+    const int fd = open(aFileName, O_RDWR);
+    test(fd >= 0);
+
+    //-- BAT offset is a big-endian 64-bit field at offset 16 in the VHD header that follows the footer copy
+    uint64_t batOffset;
+    test_Val(pread(fd, &batOffset, sizeof(batOffset), KDefSecSize + 16), (int)sizeof(batOffset));
+    batOffset = be64toh(batOffset);
+
+    uint32_t blockSector;
+    test_Val(pread(fd, &blockSector, sizeof(blockSector), batOffset + aBlock*sizeof(blockSector)), (int)sizeof(blockSector));
+    blockSector = be32toh(blockSector);
+    test(blockSector != 0xFFFFFFFF);
+
+    uint8_t buf[KDefSecSize];
+    memset(buf, 0, sizeof(buf));
+    test_Val(pwrite(fd, buf, sizeof(buf), (uint64_t)(blockSector + aBmpSector) << KDefSecSizeLog2), (int)sizeof(buf));
+
+    close(fd);
+}
+
+//--------------------------------------------------------------------
+/**
+    Large blocks have multi-sector bitmaps; flushing a bitmap must write only the sectors that have been modified.
+    Check it by zero-filling an unmodified bitmap sector behind the library's back: the change must survive flushing.
+*/
+static void TestBmpWriteBack_DirtySectors()
+{
+    TEST_LOG();
+
+    int nRes;
+    uint8_t buf[KDefSecSize];
+
+    std::string strParentName = KVhdFilesPath;
+    strParentName += "!!Dynamic_BmpDirtySectors.vhd";
+    std::string strChildName = KVhdFilesPath;
+    strChildName += "!!Diff_BmpDirtySectors.vhd";
+    const char* fileName = strChildName.c_str();
+
+    unlink(fileName);
+    unlink(strParentName.c_str());
+
+    const uint KSecPerBlock = 1 << KLargeSecPerBlockLog2;
+
+    //-- 1. create an empty parent with large blocks and its child
+    TVHD_ParamsStruct  params;
+    memset(&params, 0, sizeof(params));
+
+    params.vhdFileName = strParentName.c_str();
+    params.vhdType = EVhd_Dynamic;
+    params.vhdSectors = 4*KSecPerBlock;
+    params.secPerBlockLog2 = KLargeSecPerBlockLog2;
+
+    TVhdHandle hVhd = VHD_Create(&params);
+    test(hVhd > 0);
+    LibVhd_2_CloseVhd(hVhd);
+
+    LibVhd_2_CreateVhd_Diff(fileName, strParentName.c_str());
+
+    //-- 2. write sectors described by the first and the last bitmap sectors of the block 1 and flush them
+    const uint KFirstSector = KSecPerBlock + 3;
+    const uint KLastSector  = 2*KSecPerBlock - 5;
+    const uint KMidSector   = KSecPerBlock + 5*KSectorsPerBmpSector + 1;
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    memset(buf, 'a', sizeof(buf));
+    nRes = VHD_WriteSectors(hVhd, KFirstSector, 1, buf, sizeof(buf));
+    test_Val(nRes, 1);
+
+    nRes = VHD_WriteSectors(hVhd, KLastSector, 1, buf, sizeof(buf));
+    test_Val(nRes, 1);
+
+    nRes = VHD_Flush(hVhd);
+    test_KErrNone(nRes);
+
+    //-- 3. zero the first bitmap sector on the media, the cached bitmap still has the sector mapped
+    DoZeroBitmapSector(fileName, 1, 0);
+
+    //-- 4. modify bits in the other bitmap sectors, flushing must not overwrite the first one
+    memset(buf, 'b', sizeof(buf));
+    nRes = VHD_WriteSectors(hVhd, KMidSector, 1, buf, sizeof(buf));
+    test_Val(nRes, 1);
+
+    nRes = VHD_DiscardSectors(hVhd, KLastSector, 1);
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 5. check: the first sector reads from the empty parent, the others are as written or discarded
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, KFirstSector, 1, 0);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, KMidSector, 1, 'b');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, KLastSector, 1, 0);
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(fileName);
+    unlink(strParentName.c_str());
+}
+
+//--------------------------------------------------------------------
+/** Execute the dirty sector bitmaps write-back tests */
+void BmpWriteBackTests_Execute()
+{
+    TEST_LOG();
+    TestBmpWriteBack_Diff();
+    TestBmpWriteBack_DirtySectors();
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test process-wide metadata cache budget: VHD_SetCacheBudget(), VHD_GetCacheUsage()
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** number of blocks in the test VHDs */
+static const uint KVhdBlocks = 256;
+
+/** sector in every block written in the test VHDs */
+static const uint KSecInBlock = 10;
+
+/** cache budget for the test */
+static const uint64_t KCacheBudget = 16*K1KiloByte;
+
+/** max. memory of the pages that are allowed to every cache regardless of the budget: one BAT and one bitmap page per VHD file */
+static const uint64_t KCacheBudgetSlack = 2*(5*K1KiloByte + K1KiloByte);
+
+//--------------------------------------------------------------------
+/** @return fill byte for the given block of the given file */
+static uint8_t DoFillByte(uint aFile, uint aBlock)
+{
+    return (uint8_t)(aFile*KVhdBlocks + aBlock + 1);
+}
+
+//--------------------------------------------------------------------
+/** Read the written sector of every block and check its contents */
+static void DoReadAllBlocks(TVhdHandle aVhdHandle, uint aFile)
+{
+    uint8_t buf[KDefSecSize];
+
+    for(uint blk=0; blk<KVhdBlocks; ++blk)
+    {
+        const int nRes = VHD_ReadSectors(aVhdHandle, blk*KDefSecPerBlock + KSecInBlock, 1, buf, sizeof(buf));
+        test_Val(nRes, 1);
+        test(CheckFilling(buf, sizeof(buf), DoFillByte(aFile, blk)));
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Two VHD files populate their caches without the budget, then the budget is set and the files are read again.
+    Check that the memory is given back, and the total usage fits into the budget.
+*/
+static void TestCacheBudget_TwoFiles()
+{
+    TEST_LOG();
+
+    int nRes;
+    uint8_t buf[KDefSecSize];
+
+    test(VHD_GetCacheUsage() == 0);
+
+    std::string strFileNames[2];
+    TVhdHandle  hVhd[2];
+
+    //-- 1. create VHDs with a sector written in every block, so that all bitmaps need caching
+    for(uint i=0; i<2; ++i)
+    {
+        strFileNames[i] = KVhdFilesPath;
+        strFileNames[i] += (i == 0) ? "!!Dynamic_CacheBudget1.vhd" : "!!Dynamic_CacheBudget2.vhd";
+        unlink(strFileNames[i].c_str());
+
+        LibVhd_2_CreateVhd_Dynamic(strFileNames[i].c_str(), KVhdBlocks*KDefSecPerBlock);
+
+        TVhdHandle hTmp = VHD_Open(strFileNames[i].c_str(), VHDF_OPEN_RDWR);
+        test(hTmp > 0);
+
+        for(uint blk=0; blk<KVhdBlocks; ++blk)
+        {
+            memset(buf, DoFillByte(i, blk), sizeof(buf));
+            nRes = VHD_WriteSectors(hTmp, blk*KDefSecPerBlock + KSecInBlock, 1, buf, sizeof(buf));
+            test_Val(nRes, 1);
+        }
+
+        LibVhd_2_CloseVhd(hTmp);
+        test(VHD_GetCacheUsage() == 0);
+    }
+
+    //-- 2. no budget, the first file caches all its bitmaps
+    for(uint i=0; i<2; ++i)
+    {
+        hVhd[i] = VHD_Open(strFileNames[i].c_str(), VHDF_OPEN_RDONLY);
+        test(hVhd[i] > 0);
+
+        nRes = VHD_SetBitmapCacheSize(hVhd[i], 2*KVhdBlocks);
+        test_KErrNone(nRes);
+    }
+
+    DoReadAllBlocks(hVhd[0], 0);
+
+    const uint64_t usage1 = VHD_GetCacheUsage();
+    test(usage1 > KVhdBlocks*KDefSecSize);
+
+    //-- 3. set the budget; the second file can't get much memory until the first one gives it back
+    nRes = VHD_SetCacheBudget(KCacheBudget);
+    test_KErrNone(nRes);
+
+    DoReadAllBlocks(hVhd[1], 1);
+    test(VHD_GetCacheUsage() <= usage1 + KCacheBudgetSlack);
+
+    //-- 4. the first file releases memory on access
+    DoReadAllBlocks(hVhd[0], 0);
+    DoReadAllBlocks(hVhd[1], 1);
+    test(VHD_GetCacheUsage() <= KCacheBudget + KCacheBudgetSlack);
+
+    //-- 5. remove the budget, the caches can grow again
+    nRes = VHD_SetCacheBudget(0);
+    test_KErrNone(nRes);
+
+    DoReadAllBlocks(hVhd[1], 1);
+    test(VHD_GetCacheUsage() > KVhdBlocks*KDefSecSize);
+
+    //-- 6. closing files releases all memory
+    for(uint i=0; i<2; ++i)
+    {
+        LibVhd_2_CloseVhd(hVhd[i]);
+        unlink(strFileNames[i].c_str());
+    }
+
+    test(VHD_GetCacheUsage() == 0);
+}
+
+
+//--------------------------------------------------------------------
+/** Execute cache budget tests */
+void CacheBudgetTests_Execute()
+{
+    TEST_LOG();
+    TestCacheBudget_TwoFiles();
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test reading from deep chains of Differencing VHDs: the sectors are resolved through the flattened table of the chain
+    layers, every sector must come from the nearest layer that has it.
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** number of blocks in the test VHDs */
+static const uint KVhdBlocks = 4;
+
+/** number of sectors in the test VHDs */
+static const uint KVhdSectors = KVhdBlocks*KDefSecPerBlock;
+
+/** number of Differencing VHDs in the deep chain */
+static const uint KChainLen = 12;
+
+//--------------------------------------------------------------------
+/** @return name of the VHD file of the given layer of the chain, 0 is the "Head" */
+static string DoLayerFileName(const char* aChainName, uint aLayer)
+{
+    char buf[16];
+    sprintf(buf, "_%02d.vhd", aLayer);
+
+    string strFileName = KVhdFilesPath;
+    strFileName += aChainName;
+    strFileName += buf;
+
+    return strFileName;
+}
+
+//--------------------------------------------------------------------
+/**
+    Fill the sectors of the VHD and the model of its contents with the given byte
+    @param  aVhdHandle  VHD handle
+    @param  aModel      fill bytes of all VHD sectors
+*/
+static void DoFill(TVhdHandle aVhdHandle, uint aStartSector, uint aNumSectors, uint8_t aFill, uint8_t aModel[])
+{
+    const int nRes = LibVhd_2_FillFile(aVhdHandle, aStartSector, aNumSectors, aFill);
+    test_KErrNone(nRes);
+
+    memset(aModel + aStartSector, aFill, aNumSectors);
+}
+
+//--------------------------------------------------------------------
+/**
+    Check the sectors of the VHD against the model of its contents, reading the sectors by chunks of the given size
+    @param  aVhdHandle  VHD handle
+    @param  aModel      fill bytes of all VHD sectors
+    @param  aChunk      number of sectors to read by one call
+*/
+static void DoCheckModel(TVhdHandle aVhdHandle, const uint8_t aModel[], uint aChunk)
+{
+    std::vector<uint8_t> buf(aChunk*KDefSecSize);
+
+    for(uint sec=0; sec<KVhdSectors; sec+=aChunk)
+    {
+        const uint sectors = Min(aChunk, KVhdSectors - sec);
+
+        const int nRes = VHD_ReadSectors(aVhdHandle, sec, sectors, &buf[0], buf.size());
+        test_Val(nRes, (int)sectors);
+
+        for(uint i=0; i<sectors*KDefSecSize; ++i)
+        {
+            if(buf[i] != aModel[sec + i/KDefSecSize])
+            {
+                TEST_LOG("sector:%d, offset:%d, expected:0x%x, read:0x%x", sec + i/KDefSecSize, i%KDefSecSize, aModel[sec + i/KDefSecSize], buf[i]);
+                test(0);
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------
+/** Read a chain of KChainLen Differencing VHDs on top of a Dynamic one, every layer overrides some sectors of its parents */
+static void TestChainLayers_Deep()
+{
+    TEST_LOG();
+
+    static const char KChainName[] = "!!Diff_ChainLayers";
+
+    uint8_t model[KVhdSectors];
+    memset(model, 0, sizeof(model));
+
+    for(uint layer=0; layer<=KChainLen; ++layer)
+        unlink(DoLayerFileName(KChainName, layer).c_str());
+
+    //-- 1. the "Head" has data in the first half of block 0 and in block 2, block 3 stays empty
+    LibVhd_2_CreateVhd_Dynamic(DoLayerFileName(KChainName, 0).c_str(), KVhdSectors);
+
+    TVhdHandle hVhd = VHD_Open(DoLayerFileName(KChainName, 0).c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    DoFill(hVhd, 0, KDefSecPerBlock/2, 'h', model);
+    DoFill(hVhd, 2*KDefSecPerBlock, KDefSecPerBlock, 'H', model);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 2. every Differencing VHD overrides a part of the previous layer's sectors in block 0, some of them hide all block 1
+    for(uint layer=1; layer<=KChainLen; ++layer)
+    {
+        LibVhd_2_CreateVhd_Diff(DoLayerFileName(KChainName, layer).c_str(), DoLayerFileName(KChainName, layer-1).c_str());
+
+        hVhd = VHD_Open(DoLayerFileName(KChainName, layer).c_str(), VHDF_OPEN_RDWR);
+        test(hVhd > 0);
+
+        const uint8_t fill = 'a' + layer;
+
+        DoFill(hVhd, layer*16, 24, fill, model);
+
+        if(layer % 4 == 0)
+            DoFill(hVhd, KDefSecPerBlock, KDefSecPerBlock, fill, model);
+
+        if(layer == 5)
+            DoFill(hVhd, 2*KDefSecPerBlock - 4, 8, fill, model);
+
+        LibVhd_2_CloseVhd(hVhd);
+    }
+
+    //-- 3. read the tail by chunks of different sizes, crossing the blocks and the runs of the layers
+    hVhd = VHD_Open(DoLayerFileName(KChainName, KChainLen).c_str(), VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    DoCheckModel(hVhd, model, KVhdSectors);
+    DoCheckModel(hVhd, model, 7);
+    DoCheckModel(hVhd, model, KDefSecPerBlock + 5);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 4. the same after writing to the tail
+    hVhd = VHD_Open(DoLayerFileName(KChainName, KChainLen).c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    DoFill(hVhd, 20, 100, 'T', model);
+    DoFill(hVhd, 3*KDefSecPerBlock + 1, 1, 'T', model);
+
+    DoCheckModel(hVhd, model, KVhdSectors);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    for(uint layer=0; layer<=KChainLen; ++layer)
+        unlink(DoLayerFileName(KChainName, layer).c_str());
+}
+
+//--------------------------------------------------------------------
+/** A missing layer deep in the chain fails only the reads that reach it; the missing layers are opened when they come back */
+static void TestChainLayers_Broken()
+{
+    TEST_LOG();
+
+    static const char KChainName[] = "!!Diff_ChainLayersBroken";
+    const uint KLayers = 3;
+    int nRes;
+
+    for(uint layer=0; layer<=KLayers; ++layer)
+        unlink(DoLayerFileName(KChainName, layer).c_str());
+
+    LibVhd_2_CreateVhd_Dynamic(DoLayerFileName(KChainName, 0).c_str(), KVhdSectors);
+
+    TVhdHandle hVhd = VHD_Open(DoLayerFileName(KChainName, 0).c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_FillFile(hVhd, 0, KVhdSectors, 'h');
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    for(uint layer=1; layer<=KLayers; ++layer)
+    {
+        LibVhd_2_CreateVhd_Diff(DoLayerFileName(KChainName, layer).c_str(), DoLayerFileName(KChainName, layer-1).c_str());
+
+        hVhd = VHD_Open(DoLayerFileName(KChainName, layer).c_str(), VHDF_OPEN_RDWR);
+        test(hVhd > 0);
+
+        nRes = LibVhd_2_FillFile(hVhd, layer*KDefSecPerBlock/2, KDefSecPerBlock/2, '0' + layer);
+        test_KErrNone(nRes);
+
+        LibVhd_2_CloseVhd(hVhd);
+    }
+
+    //-- the "Head" goes away, the first Differencing VHD can't be opened without it. The sectors of the other layers are still readable
+    const string strHeadName = DoLayerFileName(KChainName, 0);
+    const string strHiddenName = strHeadName + ".hidden";
+    test(rename(strHeadName.c_str(), strHiddenName.c_str()) == 0);
+
+    hVhd = VHD_Open(DoLayerFileName(KChainName, KLayers).c_str(), VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    for(uint layer=2; layer<=KLayers; ++layer)
+    {
+        nRes = LibVhd_2_CheckFileFill(hVhd, layer*KDefSecPerBlock/2, KDefSecPerBlock/2, '0' + layer);
+        test_KErrNone(nRes);
+    }
+
+    uint8_t buf[KDefSecSize];
+    nRes = VHD_ReadSectors(hVhd, 0, 1, buf, sizeof(buf));
+    test(nRes < 0);
+
+    nRes = VHD_ReadSectors(hVhd, KDefSecPerBlock/2, 1, buf, sizeof(buf));
+    test(nRes < 0);
+
+    //-- the "Head" is back, the missing layers are opened on the next read
+    test(rename(strHiddenName.c_str(), strHeadName.c_str()) == 0);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 0, KDefSecPerBlock/2, 'h');
+    test_KErrNone(nRes);
+
+    for(uint layer=1; layer<=KLayers; ++layer)
+    {
+        nRes = LibVhd_2_CheckFileFill(hVhd, layer*KDefSecPerBlock/2, KDefSecPerBlock/2, '0' + layer);
+        test_KErrNone(nRes);
+    }
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 2*KDefSecPerBlock, 2*KDefSecPerBlock, 'h');
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    for(uint layer=0; layer<=KLayers; ++layer)
+        unlink(DoLayerFileName(KChainName, layer).c_str());
+}
+
+
+//--------------------------------------------------------------------
+/** Execute reading from the chains of Differencing VHDs tests */
+void ChainLayersTests_Execute()
+{
+    TEST_LOG();
+    TestChainLayers_Deep();
+    TestChainLayers_Broken();
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test the cache of the block runs resolved through the chain of the parents: the sectors read through the cached runs must
+    stay correct while the tail VHD is written and trimmed, and after the cache is invalidated.
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** number of blocks in the test VHDs */
+static const uint KVhdBlocks = 4;
+
+/** number of sectors in the test VHDs */
+static const uint KVhdSectors = KVhdBlocks*KDefSecPerBlock;
+
+/** number of Differencing VHDs in the chain */
+static const uint KChainLen = 6;
+
+//--------------------------------------------------------------------
+/** @return name of the VHD file of the given layer of the chain, 0 is the "Head" */
+static string DoLayerFileName(uint aLayer)
+{
+    char buf[32];
+    sprintf(buf, "!!Diff_ChainRuns_%02d.vhd", aLayer);
+
+    string strFileName = KVhdFilesPath;
+    strFileName += buf;
+
+    return strFileName;
+}
+
+//--------------------------------------------------------------------
+/** Fill the sectors of the VHD and the model of its contents with the given byte */
+static void DoFill(TVhdHandle aVhdHandle, uint aStartSector, uint aNumSectors, uint8_t aFill, uint8_t aModel[])
+{
+    const int nRes = LibVhd_2_FillFile(aVhdHandle, aStartSector, aNumSectors, aFill);
+    test_KErrNone(nRes);
+
+    memset(aModel + aStartSector, aFill, aNumSectors);
+}
+
+//--------------------------------------------------------------------
+/** Check all sectors of the VHD against the model of its contents, the runs of the same fill are checked by one read */
+static void DoCheckModel(TVhdHandle aVhdHandle, const uint8_t aModel[])
+{
+    uint start = 0;
+    for(uint sec=1; sec<=KVhdSectors; ++sec)
+    {
+        if(sec < KVhdSectors && aModel[sec] == aModel[start])
+            continue;
+
+        const int nRes = LibVhd_2_CheckFileFill(aVhdHandle, start, sec - start, aModel[start]);
+        if(nRes != KErrNone)
+        {
+            TEST_LOG("sectors:%d-%d, expected:0x%x", start, sec - 1, aModel[start]);
+            test(0);
+        }
+
+        start = sec;
+    }
+}
+
+//--------------------------------------------------------------------
+/** The sectors resolved through the cached runs follow the changes of the tail: writes hide the parents, TRIM reveals them again */
+static void TestChainRuns_TailChanges()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    uint8_t model[KVhdSectors];        //-- contents of the tail
+    uint8_t parentModel[KVhdSectors];  //-- contents of the tail's parent
+    memset(model, 0, sizeof(model));
+
+    for(uint layer=0; layer<=KChainLen; ++layer)
+        unlink(DoLayerFileName(layer).c_str());
+
+    //-- 1. the chain: every layer writes interleaving extents over all blocks but the last one
+    LibVhd_2_CreateVhd_Dynamic(DoLayerFileName(0).c_str(), KVhdSectors);
+
+    TVhdHandle hVhd = VHD_Open(DoLayerFileName(0).c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    DoFill(hVhd, 0, 3*KDefSecPerBlock, 'h', model);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    for(uint layer=1; layer<=KChainLen; ++layer)
+    {
+        LibVhd_2_CreateVhd_Diff(DoLayerFileName(layer).c_str(), DoLayerFileName(layer-1).c_str());
+
+        if(layer == KChainLen)
+            memcpy(parentModel, model, sizeof(model));
+
+        hVhd = VHD_Open(DoLayerFileName(layer).c_str(), VHDF_OPEN_RDWR);
+        test(hVhd > 0);
+
+        for(uint sec = layer*5; sec + layer < 3*KDefSecPerBlock; sec += 97)
+            DoFill(hVhd, sec, layer, '0' + layer, model);
+
+        LibVhd_2_CloseVhd(hVhd);
+    }
+
+    //-- 2. read the tail, the runs get cached
+    hVhd = VHD_Open(DoLayerFileName(KChainLen).c_str(), VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    DoCheckModel(hVhd, model);
+
+    //-- 3. the tail overwrites the parents' sectors and gets a block of its own
+    DoFill(hVhd, 10, 300, 'T', model);
+    DoFill(hVhd, KDefSecPerBlock - 3, 6, 'U', model);
+    DoFill(hVhd, 3*KDefSecPerBlock + 7, 1, 'V', model);
+
+    DoCheckModel(hVhd, model);
+
+    //-- 4. TRIM makes the parents' sectors visible again
+    nRes = VHD_DiscardSectors(hVhd, 100, 50);
+    test_KErrNone(nRes);
+    memcpy(model + 100, parentModel + 100, 50);
+
+    nRes = VHD_DiscardSectors(hVhd, 2*KDefSecPerBlock, KDefSecPerBlock);
+    test_KErrNone(nRes);
+    memcpy(model + 2*KDefSecPerBlock, parentModel + 2*KDefSecPerBlock, KDefSecPerBlock);
+
+    DoCheckModel(hVhd, model);
+
+    //-- 5. the runs are resolved again after invalidating the caches
+    nRes = VHD_Flush(hVhd);
+    test_KErrNone(nRes);
+
+    nRes = VHD_InvalidateCaches(hVhd);
+    test_KErrNone(nRes);
+
+    DoCheckModel(hVhd, model);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 6. the same after reopening
+    hVhd = VHD_Open(DoLayerFileName(KChainLen).c_str(), VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    DoCheckModel(hVhd, model);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    for(uint layer=0; layer<=KChainLen; ++layer)
+        unlink(DoLayerFileName(layer).c_str());
+}
+
+
+//--------------------------------------------------------------------
+/** Execute chain runs cache tests */
+void ChainRunsTests_Execute()
+{
+    TEST_LOG();
+    TestChainRuns_TailChanges();
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test online compacting of Dynamic and Differencing VHDs: reclaiming discarded and zero-filled blocks, moving the blocks
+    from the end of the file to the free space and truncating the file while the VHD stays opened.
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** number of blocks in the test VHDs */
+static const uint KVhdBlocks = 8;
+
+/** size of a block in the file: 1 sector bitmap and the data */
+static const uint KBlockBytes = (1 + KDefSecPerBlock) * KDefSecSize;
+
+//--------------------------------------------------------------------
+/**
+    Check that every block of the VHD is filled with the given byte
+    @param  aVhdHandle  VHD handle
+    @param  aFill       array of KVhdBlocks fill bytes
+*/
+static void DoCheckBlocks(TVhdHandle aVhdHandle, const uint8_t aFill[])
+{
+    for(uint blk=0; blk<KVhdBlocks; ++blk)
+    {
+        const int nRes = LibVhd_2_CheckFileFill(aVhdHandle, blk*KDefSecPerBlock, KDefSecPerBlock, aFill[blk]);
+        test_KErrNone(nRes);
+    }
+}
+
+//--------------------------------------------------------------------
+/** Reclaim discarded and zero-filled blocks of a Dynamic VHD */
+static void TestCompact_Dynamic()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_Compact.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+    const uint64_t initialSize = LibVhd_2_GetFileSize(fileName);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    nRes = VHD_Compact(hVhd, 0x80);
+    test(nRes < 0);
+
+    //-- nothing to reclaim in the empty VHD
+    nRes = VHD_Compact(hVhd, 0);
+    test_KErrNone(nRes);
+    test(LibVhd_2_GetFileSize(fileName) == initialSize);
+
+    //-- all blocks are written, block 6 with zeroes
+    uint8_t fill[KVhdBlocks];
+    for(uint blk=0; blk<KVhdBlocks; ++blk)
+    {
+        fill[blk] = (blk == 6) ? 0 : 'A' + blk;
+
+        nRes = LibVhd_2_FillFile(hVhd, blk*KDefSecPerBlock, KDefSecPerBlock, fill[blk]);
+        test_KErrNone(nRes);
+    }
+
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + KVhdBlocks*KBlockBytes);
+
+    //-- discard blocks 1, 3, 4 and a part of block 5
+    nRes = VHD_DiscardSectors(hVhd, 1*KDefSecPerBlock, KDefSecPerBlock);
+    test_KErrNone(nRes);
+
+    nRes = VHD_DiscardSectors(hVhd, 3*KDefSecPerBlock, 2*KDefSecPerBlock + 10);
+    test_KErrNone(nRes);
+
+    fill[1] = fill[3] = fill[4] = 0;
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 5*KDefSecPerBlock, 10, 0);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_FillFile(hVhd, 5*KDefSecPerBlock, 10, fill[5]);
+    test_KErrNone(nRes);
+
+    //-- the discarded blocks are unlinked already, compacting moves blocks 5..7 to their places
+    nRes = VHD_Compact(hVhd, 0);
+    test_KErrNone(nRes);
+
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + 5*KBlockBytes);
+    DoCheckBlocks(hVhd, fill);
+
+    //-- the zero-filled block is reclaimed only on request
+    nRes = VHD_Compact(hVhd, VHDF_COMPACT_ZERO_BLOCKS);
+    test_KErrNone(nRes);
+
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + 4*KBlockBytes);
+    DoCheckBlocks(hVhd, fill);
+
+    //-- new blocks are appended after the compacted ones
+    nRes = LibVhd_2_FillFile(hVhd, 3*KDefSecPerBlock, 1, 'n');
+    test_KErrNone(nRes);
+
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + 5*KBlockBytes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- check the data after reopening
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 3*KDefSecPerBlock, 1, 'n');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 3*KDefSecPerBlock+1, KDefSecPerBlock-1, 0);
+    test_KErrNone(nRes);
+
+    fill[3] = 'n';
+    for(uint blk=0; blk<KVhdBlocks; ++blk)
+    {
+        if(blk == 3)
+            continue;
+
+        nRes = LibVhd_2_CheckFileFill(hVhd, blk*KDefSecPerBlock, KDefSecPerBlock, fill[blk]);
+        test_KErrNone(nRes);
+    }
+
+    nRes = VHD_Compact(hVhd, 0);
+    test(nRes == -EBADF);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/** Reclaim discarded blocks of a Differencing VHD; a zero-filled block hides the parent's data and stays */
+static void TestCompact_Diff()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strParentName = KVhdFilesPath;
+    strParentName += "!!Dynamic_CompactParent.vhd";
+    std::string strChildName = KVhdFilesPath;
+    strChildName += "!!Diff_Compact.vhd";
+    const char* fileName = strChildName.c_str();
+
+    unlink(fileName);
+    unlink(strParentName.c_str());
+
+    //-- the parent has data in all blocks
+    LibVhd_2_CreateVhd_Dynamic(strParentName.c_str(), KVhdBlocks*KDefSecPerBlock);
+
+    TVhdHandle hVhd = VHD_Open(strParentName.c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_FillFile(hVhd, 0, KVhdBlocks*KDefSecPerBlock, 'p');
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    LibVhd_2_CreateVhd_Diff(fileName, strParentName.c_str());
+    const uint64_t initialSize = LibVhd_2_GetFileSize(fileName);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    uint8_t fill[KVhdBlocks];
+    memset(fill, 'p', sizeof(fill));
+
+    //-- block 1 with zeroes, blocks 2, 3, 5 with data
+    fill[1] = 0;
+    fill[2] = 'c';
+    fill[3] = 'd';
+    fill[5] = 'e';
+
+    for(uint blk=1; blk<=5; ++blk)
+    {
+        if(blk == 4)
+            continue;
+
+        nRes = LibVhd_2_FillFile(hVhd, blk*KDefSecPerBlock, KDefSecPerBlock, fill[blk]);
+        test_KErrNone(nRes);
+    }
+
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + 4*KBlockBytes);
+
+    //-- discarded block 3 reads from the parent
+    nRes = VHD_DiscardSectors(hVhd, 3*KDefSecPerBlock, KDefSecPerBlock);
+    test_KErrNone(nRes);
+    fill[3] = 'p';
+
+    nRes = VHD_Compact(hVhd, VHDF_COMPACT_ZERO_BLOCKS);
+    test_KErrNone(nRes);
+
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + 3*KBlockBytes);
+    DoCheckBlocks(hVhd, fill);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    DoCheckBlocks(hVhd, fill);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(fileName);
+    unlink(strParentName.c_str());
+}
+
+//--------------------------------------------------------------------
+/** Fixed VHDs can't be compacted */
+static void TestCompact_Fixed()
+{
+    TEST_LOG();
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Fixed_Compact.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Fixed(fileName, 4096);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    const int nRes = VHD_Compact(hVhd, 0);
+    test(nRes == KErrNotSupported);
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(fileName);
+}
+
+
+//--------------------------------------------------------------------
+/** Execute VHD compacting tests */
+void CompactTests_Execute()
+{
+    TEST_LOG();
+    TestCompact_Dynamic();
+    TestCompact_Diff();
+    TestCompact_Fixed();
+}
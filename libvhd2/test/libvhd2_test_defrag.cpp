@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test online defragmentation of Dynamic and Differencing VHDs: putting the blocks into the logical order in the file,
+    continuing an interrupted defragmentation and limiting the copying rate.
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** size of a block in the file: 1 sector bitmap and the data */
+static const uint KBlockBytes = (1 + KDefSecPerBlock) * KDefSecSize;
+
+/** number of blocks put into their places by one defragmentation step, see KDefragStepBlocks in the library */
+static const uint KDefragStepBlocks = 8;
+
+//--------------------------------------------------------------------
+/** @return true if the present blocks follow each other in the file in the logical order */
+static bool DoCheckBlocksInOrder(TVhdHandle aVhdHandle, uint aBlocks)
+{
+    uint64_t prevOffset = 0;
+
+    for(uint blk=0; blk<aBlocks; ++blk)
+    {
+        const uint64_t offset = LibVhd_2_GetBlockOffset(aVhdHandle, blk);
+        if(!offset)
+            continue;
+
+        if(prevOffset && offset != prevOffset + KBlockBytes)
+            return false;
+
+        prevOffset = offset;
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------
+/**
+    Check that every block of the VHD is filled with the given byte
+    @param  aVhdHandle  VHD handle
+    @param  aFill       array of aBlocks fill bytes
+    @param  aBlocks     number of blocks
+*/
+static void DoCheckBlocks(TVhdHandle aVhdHandle, const uint8_t aFill[], uint aBlocks)
+{
+    for(uint blk=0; blk<aBlocks; ++blk)
+    {
+        const int nRes = LibVhd_2_CheckFileFill(aVhdHandle, blk*KDefSecPerBlock, KDefSecPerBlock, aFill[blk]);
+        test_KErrNone(nRes);
+    }
+}
+
+//--------------------------------------------------------------------
+/** Defragment a Dynamic VHD written in random order, interrupting the defragmentation and continuing it after reopening */
+static void TestDefrag_Dynamic()
+{
+    TEST_LOG();
+
+    const uint KVhdBlocks = 8;
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_Defrag.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+    const uint64_t initialSize = LibVhd_2_GetFileSize(fileName);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    //-- nothing to do in the empty VHD
+    nRes = VHD_Defragment(hVhd, 0, 0);
+    test_KErrNone(nRes);
+
+    //-- the blocks are appended in the order of writing; block 4 stays absent
+    static const uint KWriteOrder[] = {6, 2, 7, 0, 5, 1, 3};
+
+    uint8_t fill[KVhdBlocks];
+    memset(fill, 0, sizeof(fill));
+
+    for(uint i=0; i<sizeof(KWriteOrder)/sizeof(KWriteOrder[0]); ++i)
+    {
+        const uint blk = KWriteOrder[i];
+        fill[blk] = 'A' + blk;
+
+        nRes = LibVhd_2_FillFile(hVhd, blk*KDefSecPerBlock, KDefSecPerBlock, fill[blk]);
+        test_KErrNone(nRes);
+    }
+
+    const uint64_t fullSize = initialSize + 7*KBlockBytes;
+    test(LibVhd_2_GetFileSize(fileName) == fullSize);
+    test(!DoCheckBlocksInOrder(hVhd, KVhdBlocks));
+
+    //-- put 2 blocks into place and stop
+    nRes = VHD_Defragment(hVhd, 2, 0);
+    test(nRes > 0);
+
+    DoCheckBlocks(hVhd, fill, KVhdBlocks);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- continue after reopening
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    DoCheckBlocks(hVhd, fill, KVhdBlocks);
+
+    nRes = VHD_Defragment(hVhd, 0, 0);
+    test_KErrNone(nRes);
+
+    test(DoCheckBlocksInOrder(hVhd, KVhdBlocks));
+    test(LibVhd_2_GetFileSize(fileName) == fullSize);
+    DoCheckBlocks(hVhd, fill, KVhdBlocks);
+
+    //-- the defragmented VHD stays as it is
+    nRes = VHD_Defragment(hVhd, 0, 0);
+    test_KErrNone(nRes);
+    test(LibVhd_2_GetFileSize(fileName) == fullSize);
+
+    //-- a new block is appended
+    nRes = LibVhd_2_FillFile(hVhd, 4*KDefSecPerBlock, KDefSecPerBlock, 'E');
+    test_KErrNone(nRes);
+    fill[4] = 'E';
+
+    test(LibVhd_2_GetFileSize(fileName) == fullSize + KBlockBytes);
+
+    nRes = VHD_Defragment(hVhd, 0, 0);
+    test_KErrNone(nRes);
+
+    test(DoCheckBlocksInOrder(hVhd, KVhdBlocks));
+    test(LibVhd_2_GetFileSize(fileName) == fullSize + KBlockBytes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    DoCheckBlocks(hVhd, fill, KVhdBlocks);
+
+    nRes = VHD_Defragment(hVhd, 0, 0);
+    test(nRes == -EBADF);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/** Defragment a Differencing VHD written in the reverse order, with the copying rate limited */
+static void TestDefrag_Diff()
+{
+    TEST_LOG();
+
+    const uint KVhdBlocks = 16;
+    const uint KMaxMBps   = 64;
+    int nRes;
+
+    std::string strParentName = KVhdFilesPath;
+    strParentName += "!!Dynamic_DefragParent.vhd";
+    std::string strChildName = KVhdFilesPath;
+    strChildName += "!!Diff_Defrag.vhd";
+    const char* fileName = strChildName.c_str();
+
+    unlink(fileName);
+    unlink(strParentName.c_str());
+
+    LibVhd_2_CreateVhd_Dynamic(strParentName.c_str(), KVhdBlocks*KDefSecPerBlock);
+
+    TVhdHandle hVhd = VHD_Open(strParentName.c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_FillFile(hVhd, 0, KVhdBlocks*KDefSecPerBlock, 'p');
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    LibVhd_2_CreateVhd_Diff(fileName, strParentName.c_str());
+    const uint64_t initialSize = LibVhd_2_GetFileSize(fileName);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    //-- the first sector of every block is written, the rest comes from the parent
+    for(int blk=KVhdBlocks-1; blk>=0; --blk)
+    {
+        nRes = LibVhd_2_FillFile(hVhd, blk*KDefSecPerBlock, 1, 'a' + blk);
+        test_KErrNone(nRes);
+    }
+
+    test(!DoCheckBlocksInOrder(hVhd, KVhdBlocks));
+
+    //-- the blocks moved out of the way are copied twice, at least all blocks are copied
+    struct timespec tsStart, tsEnd;
+    clock_gettime(CLOCK_MONOTONIC, &tsStart);
+
+    nRes = VHD_Defragment(hVhd, 0, KMaxMBps);
+    test_KErrNone(nRes);
+
+    clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+
+    //-- all but the last step are followed by sleeping
+    const uint64_t elapsedMs = (tsEnd.tv_sec - tsStart.tv_sec)*1000 + tsEnd.tv_nsec/1000000 - tsStart.tv_nsec/1000000;
+    const uint64_t minMs     = ((uint64_t)(KVhdBlocks - KDefragStepBlocks)*KBlockBytes*1000) / (KMaxMBps << 20);
+    test(elapsedMs >= minMs);
+
+    test(DoCheckBlocksInOrder(hVhd, KVhdBlocks));
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + KVhdBlocks*KBlockBytes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    for(uint blk=0; blk<KVhdBlocks; ++blk)
+    {
+        nRes = LibVhd_2_CheckFileFill(hVhd, blk*KDefSecPerBlock, 1, 'a' + blk);
+        test_KErrNone(nRes);
+
+        nRes = LibVhd_2_CheckFileFill(hVhd, blk*KDefSecPerBlock + 1, KDefSecPerBlock - 1, 'p');
+        test_KErrNone(nRes);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(fileName);
+    unlink(strParentName.c_str());
+}
+
+//--------------------------------------------------------------------
+/** Fixed VHDs can't be defragmented */
+static void TestDefrag_Fixed()
+{
+    TEST_LOG();
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Fixed_Defrag.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Fixed(fileName, 4096);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    const int nRes = VHD_Defragment(hVhd, 0, 0);
+    test(nRes == KErrNotSupported);
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(fileName);
+}
+
+
+//--------------------------------------------------------------------
+/** Execute VHD defragmentation tests */
+void DefragTests_Execute()
+{
+    TEST_LOG();
+    TestDefrag_Dynamic();
+    TestDefrag_Diff();
+    TestDefrag_Fixed();
+}
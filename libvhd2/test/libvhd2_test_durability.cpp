@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test durability modes and VHD_SetMode() API, see VHDF_OPMODE_DURABILITY_MASK
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+static const uint KRndSeed1 = 0xdeadbeef;
+
+/** number of blocks in the test VHD */
+static const uint KVhdBlocks = 16;
+
+/** number of sectors written to each block */
+static const uint KSectorsToWrite = 8;
+
+//--------------------------------------------------------------------
+/**
+    Write test data to the given block.
+    @param  hVhd        VHD handle
+    @param  aBlockNo    block number
+    @param  aData       data buffer, KSectorsToWrite sectors per block
+*/
+static void DoWriteBlock(TVhdHandle hVhd, uint aBlockNo, const vector<uint8_t>& aData)
+{
+    const uint KBytes = KSectorsToWrite*KDefSecSize;
+    const int nRes = VHD_WriteSectors(hVhd, aBlockNo*KDefSecPerBlock, KSectorsToWrite, &aData[aBlockNo*KBytes], KBytes);
+    test_Val(nRes, (int)KSectorsToWrite);
+}
+
+//--------------------------------------------------------------------
+/**
+    Check mutually exclusive durability flags and VHD_SetMode() arguments.
+*/
+static void TestDurability_Flags(const char* aFileName)
+{
+    TEST_LOG();
+
+    int nRes;
+
+    //-- only one durability mode can be specified
+    TVhdHandle hVhd = VHD_Open(aFileName, VHDF_OPEN_RDWR | VHDF_OPMODE_WRITEBACK | VHDF_OPMODE_ORDERED);
+    test_Val(hVhd, KErrArgument);
+
+    hVhd = VHD_Open(aFileName, VHDF_OPEN_RDWR | VHDF_OPMODE_ORDERED | VHDF_OPMODE_WRITETHROUGH);
+    test_Val(hVhd, KErrArgument);
+
+    hVhd = VHD_Open(aFileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = VHD_SetMode(hVhd, VHDF_OPMODE_WRITEBACK | VHDF_OPMODE_ORDERED);
+    test_Val(nRes, KErrArgument);
+
+    nRes = VHD_SetMode(hVhd, VHDF_OPEN_ENABLE_TRIM);
+    test_Val(nRes, KErrArgument);
+
+    //-- write-through requires reopening the file
+    nRes = VHD_SetMode(hVhd, VHDF_OPMODE_WRITETHROUGH);
+    test_Val(nRes, KErrNotSupported);
+
+    nRes = VHD_SetMode(hVhd, VHDF_OPMODE_WRITEBACK);
+    test_KErrNone(nRes);
+
+    nRes = VHD_SetMode(hVhd, 0);
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+}
+
+//--------------------------------------------------------------------
+/**
+    Check when the BAT entries of the allocated blocks reach the media in different durability modes
+*/
+static void TestDurability_Modes(const char* aFileName)
+{
+    TEST_LOG();
+
+    int nRes;
+
+    vector<uint8_t> dataBuf(KVhdBlocks*KSectorsToWrite*KDefSecSize);
+    TRndSequenceGen seqGen(KRndSeed1);
+    seqGen.GenerateSequence(&dataBuf[0], dataBuf.size());
+
+    uint blockNo = 0;
+
+    //-- 1. writeback: the allocation isn't committed until flush
+    TVhdHandle hVhd = VHD_Open(aFileName, VHDF_OPEN_RDWR | VHDF_OPMODE_WRITEBACK);
+    test(hVhd > 0);
+
+    DoWriteBlock(hVhd, blockNo, dataBuf);
+    test(LibVhd_2_ReadRawBatEntry(aFileName, blockNo) == 0xFFFFFFFF);
+
+    nRes = VHD_Flush(hVhd);
+    test_KErrNone(nRes);
+    test(LibVhd_2_ReadRawBatEntry(aFileName, blockNo) != 0xFFFFFFFF);
+    ++blockNo;
+
+    //-- 2. switching the mode commits pending metadata
+    DoWriteBlock(hVhd, blockNo, dataBuf);
+    test(LibVhd_2_ReadRawBatEntry(aFileName, blockNo) == 0xFFFFFFFF);
+
+    nRes = VHD_SetMode(hVhd, VHDF_OPMODE_ORDERED);
+    test_KErrNone(nRes);
+    test(LibVhd_2_ReadRawBatEntry(aFileName, blockNo) != 0xFFFFFFFF);
+    ++blockNo;
+
+    //-- 3. ordered: the allocation is committed by the write call
+    DoWriteBlock(hVhd, blockNo, dataBuf);
+    test(LibVhd_2_ReadRawBatEntry(aFileName, blockNo) != 0xFFFFFFFF);
+    ++blockNo;
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 4. write-through: the allocation is on the media by the end of the write call
+    hVhd = VHD_Open(aFileName, VHDF_OPEN_RDWR | VHDF_OPMODE_WRITETHROUGH);
+    test(hVhd > 0);
+
+    DoWriteBlock(hVhd, blockNo, dataBuf);
+    test(LibVhd_2_ReadRawBatEntry(aFileName, blockNo) != 0xFFFFFFFF);
+    ++blockNo;
+
+    //-- writing to an already allocated block
+    nRes = VHD_WriteSectors(hVhd, KSectorsToWrite, KSectorsToWrite, &dataBuf[0], KSectorsToWrite*KDefSecSize);
+    test_Val(nRes, (int)KSectorsToWrite);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 5. everything can be read back
+    hVhd = VHD_Open(aFileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    const uint KBytes = KSectorsToWrite*KDefSecSize;
+    vector<uint8_t> readBuf(KBytes);
+
+    for(uint i=0; i<blockNo; ++i)
+    {
+        nRes = VHD_ReadSectors(hVhd, i*KDefSecPerBlock, KSectorsToWrite, &readBuf[0], KBytes);
+        test_Val(nRes, (int)KSectorsToWrite);
+        test(memcmp(&readBuf[0], &dataBuf[i*KBytes], KBytes) == 0);
+    }
+
+    nRes = VHD_ReadSectors(hVhd, KSectorsToWrite, KSectorsToWrite, &readBuf[0], KBytes);
+    test_Val(nRes, (int)KSectorsToWrite);
+    test(memcmp(&readBuf[0], &dataBuf[0], KBytes) == 0);
+
+    LibVhd_2_CloseVhd(hVhd);
+}
+
+//--------------------------------------------------------------------
+/** Execute durability modes tests */
+void DurabilityTests_Execute()
+{
+    TEST_LOG();
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_Durability.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+
+    TestDurability_Flags(fileName);
+    TestDurability_Modes(fileName);
+
+    unlink(fileName);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test background metadata flusher, see VHD_SetBackgroundFlush()
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+static const uint KRndSeed1 = 0xdeadbeef;
+
+/** number of blocks in the test VHD */
+static const uint KVhdBlocks = 16;
+
+/** number of sectors written to each block */
+static const uint KSectorsToWrite = 8;
+
+/** dirty writes threshold for the flusher */
+static const uint KMaxDirtyWrites = 4;
+
+/** dirty metadata age threshold for the flusher, ms */
+static const uint KMaxAgeMs = 500;
+
+/** interval between the flusher passes in the library, ms */
+static const uint KFlusherPollMs = 100;
+
+/** max. time to wait for the flusher, ms */
+static const uint KFlushTimeoutMs = 5000;
+
+//--------------------------------------------------------------------
+/**
+    Wait until the BAT entry of the given block appears on the media.
+    @return time waited, ms
+*/
+static uint DoWaitForBatEntry(const char* aFileName, uint aBlockNo)
+{
+    const uint KStepMs = 10;
+
+    uint waitedMs = 0;
+    while(LibVhd_2_ReadRawBatEntry(aFileName, aBlockNo) == 0xFFFFFFFF)
+    {
+        test(waitedMs < KFlushTimeoutMs);
+        usleep(KStepMs*1000);
+        waitedMs += KStepMs;
+    }
+
+    return waitedMs;
+}
+
+//--------------------------------------------------------------------
+/**
+    Write test data to the given block.
+    @param  hVhd        VHD handle
+    @param  aBlockNo    block number
+    @param  aData       data buffer, KSectorsToWrite sectors per block
+*/
+static void DoWriteBlock(TVhdHandle hVhd, uint aBlockNo, const vector<uint8_t>& aData)
+{
+    const uint KBytes = KSectorsToWrite*KDefSecSize;
+    const int nRes = VHD_WriteSectors(hVhd, aBlockNo*KDefSecPerBlock, KSectorsToWrite, &aData[aBlockNo*KBytes], KBytes);
+    test_Val(nRes, (int)KSectorsToWrite);
+}
+
+//--------------------------------------------------------------------
+/**
+    Open a VHD in "writeback" mode, so that the metadata isn't committed by the write calls, and check that the background
+    flusher commits it according to the dirty writes and age triggers.
+*/
+static void TestFlusher_Triggers()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_Flusher.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+
+    vector<uint8_t> dataBuf(KVhdBlocks*KSectorsToWrite*KDefSecSize);
+    TRndSequenceGen seqGen(KRndSeed1);
+    seqGen.GenerateSequence(&dataBuf[0], dataBuf.size());
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPMODE_WRITEBACK);
+    test(hVhd > 0);
+
+    uint blockNo = 0;
+
+    //-- 1. dirty writes trigger
+    nRes = VHD_SetBackgroundFlush(0, KMaxDirtyWrites);
+    test_KErrNone(nRes);
+
+    for(uint i=0; i<KMaxDirtyWrites-1; ++i)
+    {
+        DoWriteBlock(hVhd, blockNo++, dataBuf);
+    }
+
+    usleep(3*KFlusherPollMs*1000);
+    test(LibVhd_2_ReadRawBatEntry(fileName, 0) == 0xFFFFFFFF); //-- the threshold isn't reached yet
+
+    DoWriteBlock(hVhd, blockNo++, dataBuf);
+    DoWaitForBatEntry(fileName, 0);
+    DoWaitForBatEntry(fileName, blockNo-1);
+
+    //-- 2. age trigger
+    nRes = VHD_SetBackgroundFlush(KMaxAgeMs, 0);
+    test_KErrNone(nRes);
+
+    DoWriteBlock(hVhd, blockNo++, dataBuf);
+    const uint waitedMs = DoWaitForBatEntry(fileName, blockNo-1);
+    test(waitedMs >= KMaxAgeMs/2); //-- the flusher waits for the metadata to get old enough
+
+    //-- 3. the flusher is disabled
+    nRes = VHD_SetBackgroundFlush(0, 0);
+    test_KErrNone(nRes);
+
+    DoWriteBlock(hVhd, blockNo++, dataBuf);
+    usleep(3*KFlusherPollMs*1000);
+    test(LibVhd_2_ReadRawBatEntry(fileName, blockNo-1) == 0xFFFFFFFF);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 4. everything can be read back
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    const uint KBytes = KSectorsToWrite*KDefSecSize;
+    vector<uint8_t> readBuf(KBytes);
+
+    for(uint i=0; i<blockNo; ++i)
+    {
+        nRes = VHD_ReadSectors(hVhd, i*KDefSecPerBlock, KSectorsToWrite, &readBuf[0], KBytes);
+        test_Val(nRes, (int)KSectorsToWrite);
+        test(memcmp(&readBuf[0], &dataBuf[i*KBytes], KBytes) == 0);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(fileName);
+}
+
+
+//--------------------------------------------------------------------
+/** Execute background metadata flusher tests */
+void FlusherTests_Execute()
+{
+    TEST_LOG();
+    TestFlusher_Triggers();
+}
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test reusing the free block slots of Dynamic VHDs: the places of the blocks unlinked by TRIM are given to new blocks
+    instead of appending them to the end of the file.
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** number of blocks in the test VHD */
+static const uint KVhdBlocks = 8;
+
+/** size of a block in the file: 1 sector bitmap and the data */
+static const uint KBlockBytes = (1 + KDefSecPerBlock) * KDefSecSize;
+
+//--------------------------------------------------------------------
+/**
+    Check the first sector of the block and the rest of it
+    @param  aVhdHandle  VHD handle
+    @param  aBlock      block number
+    @param  aFill       fill byte of the first sector
+    @param  aRestFill   fill byte of the rest of the block
+*/
+static void DoCheckBlock(TVhdHandle aVhdHandle, uint aBlock, uint8_t aFill, uint8_t aRestFill)
+{
+    int nRes = LibVhd_2_CheckFileFill(aVhdHandle, aBlock*KDefSecPerBlock, 1, aFill);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(aVhdHandle, aBlock*KDefSecPerBlock + 1, KDefSecPerBlock - 1, aRestFill);
+    test_KErrNone(nRes);
+}
+
+//--------------------------------------------------------------------
+/** Blocks written after discarding other ones take their places in the file, the file grows only when there are no free slots */
+static void TestFreeSlots_Dynamic()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_FreeSlots.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+    const uint64_t initialSize = LibVhd_2_GetFileSize(fileName);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    //-- 1. write blocks 0..5, they are placed in the file in the same order
+    uint64_t blockOffset[KVhdBlocks];
+    for(uint blk=0; blk<6; ++blk)
+    {
+        nRes = LibVhd_2_FillFile(hVhd, blk*KDefSecPerBlock, KDefSecPerBlock, 'A' + blk);
+        test_KErrNone(nRes);
+
+        blockOffset[blk] = LibVhd_2_GetBlockOffset(hVhd, blk);
+        test(blockOffset[blk]);
+    }
+
+    const uint64_t fullSize = initialSize + 6*KBlockBytes;
+    test(LibVhd_2_GetFileSize(fileName) == fullSize);
+
+    //-- 2. discard blocks 1, 4 and 5, they are unlinked from the BAT
+    nRes = VHD_DiscardSectors(hVhd, 1*KDefSecPerBlock, KDefSecPerBlock);
+    test_KErrNone(nRes);
+
+    nRes = VHD_DiscardSectors(hVhd, 4*KDefSecPerBlock, 2*KDefSecPerBlock);
+    test_KErrNone(nRes);
+
+    //-- 3. block 4 goes to the slot after block 3, not to the first free one
+    nRes = LibVhd_2_FillFile(hVhd, 4*KDefSecPerBlock, 1, 'x');
+    test_KErrNone(nRes);
+    test(LibVhd_2_GetBlockOffset(hVhd, 4) == blockOffset[4]);
+
+    //-- block 5 follows block 4
+    nRes = LibVhd_2_FillFile(hVhd, 5*KDefSecPerBlock, 1, 'y');
+    test_KErrNone(nRes);
+    test(LibVhd_2_GetBlockOffset(hVhd, 5) == blockOffset[5]);
+
+    //-- block 7 has no block in front of it and takes the first free slot
+    nRes = LibVhd_2_FillFile(hVhd, 7*KDefSecPerBlock, 1, 'z');
+    test_KErrNone(nRes);
+    test(LibVhd_2_GetBlockOffset(hVhd, 7) == blockOffset[1]);
+
+    test(LibVhd_2_GetFileSize(fileName) == fullSize);
+
+    //-- 4. the slot of a block discarded after that is reused once the BAT is flushed
+    nRes = VHD_DiscardSectors(hVhd, 2*KDefSecPerBlock, KDefSecPerBlock);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_FillFile(hVhd, 1*KDefSecPerBlock, 1, 'w');
+    test_KErrNone(nRes);
+    test(LibVhd_2_GetBlockOffset(hVhd, 1) == blockOffset[2]);
+
+    test(LibVhd_2_GetFileSize(fileName) == fullSize);
+
+    //-- 5. no free slots left, the next block is appended
+    nRes = LibVhd_2_FillFile(hVhd, 6*KDefSecPerBlock, KDefSecPerBlock, 'G');
+    test_KErrNone(nRes);
+
+    test(LibVhd_2_GetFileSize(fileName) == fullSize + KBlockBytes);
+
+    for(int i=0; i<2; ++i)
+    {
+        DoCheckBlock(hVhd, 0, 'A', 'A');
+        DoCheckBlock(hVhd, 1, 'w', 0);
+        DoCheckBlock(hVhd, 2, 0, 0);
+        DoCheckBlock(hVhd, 3, 'D', 'D');
+        DoCheckBlock(hVhd, 4, 'x', 0);
+        DoCheckBlock(hVhd, 5, 'y', 0);
+        DoCheckBlock(hVhd, 6, 'G', 'G');
+        DoCheckBlock(hVhd, 7, 'z', 0);
+
+        //-- check the data after reopening; the reused slots read as zeroes even if the bitmaps are ignored
+        LibVhd_2_CloseVhd(hVhd);
+
+        hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+        test(hVhd > 0);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/** The free slots are found again after reopening the VHD and after compacting it */
+static void TestFreeSlots_Reopen()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_FreeSlotsReopen.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+    const uint64_t initialSize = LibVhd_2_GetFileSize(fileName);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_FillFile(hVhd, 0, 4*KDefSecPerBlock, 'a');
+    test_KErrNone(nRes);
+
+    const uint64_t offset1 = LibVhd_2_GetBlockOffset(hVhd, 1);
+    test(offset1);
+
+    nRes = VHD_DiscardSectors(hVhd, 1*KDefSecPerBlock, 2*KDefSecPerBlock);
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- the slots of blocks 1 and 2 are free in the reopened VHD
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_FillFile(hVhd, 6*KDefSecPerBlock, 1, 'b');
+    test_KErrNone(nRes);
+    test(LibVhd_2_GetBlockOffset(hVhd, 6) == offset1);
+
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + 4*KBlockBytes);
+
+    //-- compacting moves block 3 to the remaining free slot, there are no free slots after it
+    nRes = VHD_Compact(hVhd, 0);
+    test_KErrNone(nRes);
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + 3*KBlockBytes);
+
+    nRes = LibVhd_2_FillFile(hVhd, 7*KDefSecPerBlock, 1, 'c');
+    test_KErrNone(nRes);
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + 4*KBlockBytes);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 3*KDefSecPerBlock, KDefSecPerBlock, 'a');
+    test_KErrNone(nRes);
+
+    DoCheckBlock(hVhd, 6, 'b', 0);
+    DoCheckBlock(hVhd, 7, 'c', 0);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(fileName);
+}
+
+
+//--------------------------------------------------------------------
+/**
+    A block discarded in a freshly opened VHD before the first block allocation: its slot is reused only after the BAT on the
+    media stops referring to it.
+*/
+static void TestFreeSlots_DiscardBeforeLoad()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_FreeSlotsDiscard.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+    const uint64_t initialSize = LibVhd_2_GetFileSize(fileName);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_FillFile(hVhd, 0, 2*KDefSecPerBlock, 'a');
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    const uint64_t offset0 = LibVhd_2_GetBlockOffset(hVhd, 0);
+    test(offset0);
+
+    //-- the slot of block 0 is unlinked in the BAT cache only
+    nRes = VHD_DiscardSectors(hVhd, 0, KDefSecPerBlock);
+    test_KErrNone(nRes);
+    test(LibVhd_2_ReadRawBatEntry(fileName, 0) != 0xFFFFFFFF);
+
+    //-- the slot is reused, the BAT on the media doesn't refer to it from block 0 any more
+    nRes = LibVhd_2_FillFile(hVhd, 4*KDefSecPerBlock, 1, 'b');
+    test_KErrNone(nRes);
+    test(LibVhd_2_GetBlockOffset(hVhd, 4) == offset0);
+    test(LibVhd_2_ReadRawBatEntry(fileName, 0) == 0xFFFFFFFF);
+    test(LibVhd_2_GetFileSize(fileName) == initialSize + 2*KBlockBytes);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 1*KDefSecPerBlock, KDefSecPerBlock, 'a');
+    test_KErrNone(nRes);
+
+    DoCheckBlock(hVhd, 4, 'b', 0);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/** Execute free block slots reusing tests */
+void FreeSlotsTests_Execute()
+{
+    TEST_LOG();
+    TestFreeSlots_Dynamic();
+    TestFreeSlots_Reopen();
+    TestFreeSlots_DiscardBeforeLoad();
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test group commit of the allocated blocks metadata, see VHDF_OPMODE_ORDERED
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+static const uint KRndSeed1 = 0xdeadbeef;
+
+/** number of blocks in the test VHD */
+static const uint KVhdBlocks = 64;
+
+/** number of asynchronous write requests; each of them allocates its own block */
+static const uint KNumWriteReqs = 40;
+
+/** number of sectors in each request */
+static const uint KSectorsPerReq = 8;
+
+//--------------------------------------------------------------------
+/**
+    Write to a number of blocks with a batch of asynchronous requests and synchronously, with VHDF_OPMODE_ORDERED.
+    Check that by the time a write request is completed, the BAT entry for its block is on the media, without explicit flush.
+*/
+static void TestGroupCommit_Dynamic()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_GroupCommit.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPMODE_ORDERED);
+    test(hVhd > 0);
+
+    const uint KReqBufSize = KSectorsPerReq*KDefSecSize;
+    vector<uint8_t> dataBuf((KNumWriteReqs+1)*KReqBufSize);
+
+    TRndSequenceGen seqGen(KRndSeed1);
+    seqGen.GenerateSequence(&dataBuf[0], dataBuf.size());
+
+    //-- 1. a batch of writes, every one allocates a new block; a read of the first block goes after them
+    const uint KNumReqs = KNumWriteReqs + 1;
+    TVhdIoRequest reqs[KNumReqs];
+    TVhdIoRequest* pReqs[KNumReqs];
+
+    for(uint i=0; i<KNumWriteReqs; ++i)
+    {
+        FillZ(reqs[i]);
+        reqs[i].ioOpcode = EVhdIo_Write;
+        reqs[i].ioStartSector = i*KDefSecPerBlock + i;
+        reqs[i].ioSectors = KSectorsPerReq;
+        reqs[i].ioBuffer = &dataBuf[i*KReqBufSize];
+        reqs[i].ioBufSize = KReqBufSize;
+        pReqs[i] = &reqs[i];
+    }
+
+    vector<uint8_t> readBuf(KReqBufSize);
+    TVhdIoRequest& reqRead = reqs[KNumWriteReqs];
+    FillZ(reqRead);
+    reqRead.ioOpcode = EVhdIo_Read;
+    reqRead.ioStartSector = reqs[0].ioStartSector;
+    reqRead.ioSectors = KSectorsPerReq;
+    reqRead.ioBuffer = &readBuf[0];
+    reqRead.ioBufSize = KReqBufSize;
+    pReqs[KNumWriteReqs] = &reqRead;
+
+    nRes = VHD_SubmitIo(hVhd, pReqs, KNumReqs);
+    test_Val(nRes, (int)KNumReqs);
+
+    //-- collect completions one by one; the read doesn't wait for the commit, thus the order isn't defined
+    for(uint numCompleted = 0; numCompleted < KNumReqs; )
+    {
+        TVhdIoRequest* pCompleted = NULL;
+        nRes = VHD_PollCompletions(hVhd, &pCompleted, 1, 1);
+        test_Val(nRes, 1);
+        ++numCompleted;
+
+        if(pCompleted->ioOpcode != EVhdIo_Write)
+            continue;
+
+        //-- the block allocated by a completed write must be in the BAT on the media
+        const uint blockNo = pCompleted->ioStartSector / KDefSecPerBlock;
+        vector<uint32_t> bat;
+        LibVhd_2_ReadRawBat(fileName, bat);
+        test(bat[blockNo] != 0xFFFFFFFF);
+    }
+
+    for(uint i=0; i<KNumReqs; ++i)
+    {
+        test_Val(reqs[i].ioResult, (int)KSectorsPerReq);
+    }
+
+    test(memcmp(&readBuf[0], &dataBuf[0], KReqBufSize) == 0);
+
+    //-- 2. synchronous write allocating a block is committed at once
+    const uint32_t KSyncSector = KNumWriteReqs*KDefSecPerBlock;
+    nRes = VHD_WriteSectors(hVhd, KSyncSector, KSectorsPerReq, &dataBuf[KNumWriteReqs*KReqBufSize], KReqBufSize);
+    test_Val(nRes, (int)KSectorsPerReq);
+
+    {
+        vector<uint32_t> bat;
+        LibVhd_2_ReadRawBat(fileName, bat);
+        test(bat[KNumWriteReqs] != 0xFFFFFFFF);
+        test(bat[KNumWriteReqs+1] == 0xFFFFFFFF);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 3. reopen the file in the default mode and read all data back
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    for(uint i=0; i<=KNumWriteReqs; ++i)
+    {
+        const uint32_t startSector = (i < KNumWriteReqs) ? reqs[i].ioStartSector : KSyncSector;
+        nRes = VHD_ReadSectors(hVhd, startSector, KSectorsPerReq, &readBuf[0], KReqBufSize);
+        test_Val(nRes, (int)KSectorsPerReq);
+        test(memcmp(&readBuf[0], &dataBuf[i*KReqBufSize], KReqBufSize) == 0);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(fileName);
+}
+
+
+//--------------------------------------------------------------------
+/** Execute group commit tests */
+void GroupCommitTests_Execute()
+{
+    TEST_LOG();
+    TestGroupCommit_Dynamic();
+}
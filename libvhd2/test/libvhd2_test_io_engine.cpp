@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test VHD files I/O with io_uring engine, see VHDF_OPEN_IO_URING
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+static const uint KRndSeed1 = 0xdeadbeef;
+static const uint KRndSeed2 = 0xbeefdead;
+
+/** size of the test files */
+static const uint KVhdSizeInSectors = (16*K1MegaByte)>>KDefSecSizeLog2;
+
+/** number of blocks the test data occupy */
+static const uint KTestBlocks = 2;
+
+/** size of the sectors chunks written to the blocks, every other chunk is written; makes sector bitmaps with many small extents */
+static const uint KChunkSectors = 8;
+
+//--------------------------------------------------------------------
+/**
+    Write every other chunk of KChunkSectors sectors to the first KTestBlocks blocks of the VHD.
+    Written data are also copied to the corresponding place in the buffer with expected VHD contents.
+
+    @param  aFileName   VHD file name
+    @param  aOpenFlags  additional VHD opening flags
+    @param  aSeqGen     test sequence generator
+    @param  aExpected   in/out: expected VHD contents
+*/
+static void DoWriteChunks(const char* aFileName, uint32_t aOpenFlags, TRndSequenceGen& aSeqGen, vector<uint8_t>& aExpected)
+{
+    const uint KChunkBytes = KChunkSectors*KDefSecSize;
+    uint8_t buf[KChunkBytes];
+
+    TVhdHandle hVhd = VHD_Open(aFileName, VHDF_OPEN_RDWR | VHDF_OPEN_IO_URING | aOpenFlags);
+    test(hVhd > 0);
+
+    for(uint sector = 0; sector < KTestBlocks*KDefSecPerBlock; sector += 2*KChunkSectors)
+    {
+        aSeqGen.GenerateSequence(buf, KChunkBytes);
+
+        const int nRes = VHD_WriteSectors(hVhd, sector, KChunkSectors, buf, KChunkBytes);
+        test_Val(nRes, (int)KChunkSectors);
+
+        memcpy(&aExpected[sector*KDefSecSize], buf, KChunkBytes);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+}
+
+//--------------------------------------------------------------------
+/**
+    Read the first KTestBlocks blocks of the VHD with a single call and compare them with expected data.
+    Reading is performed with the default and io_uring engines.
+
+    @param  aFileName   VHD file name
+    @param  aExpected   expected VHD contents
+*/
+static void DoCheckContents(const char* aFileName, const vector<uint8_t>& aExpected)
+{
+    const uint32_t KModes[] = {VHDF_OPEN_RDONLY, VHDF_OPEN_RDONLY | VHDF_OPEN_IO_URING};
+
+    vector<uint8_t> readBuf(aExpected.size());
+
+    for(uint i=0; i<sizeof(KModes)/sizeof(KModes[0]); ++i)
+    {
+        TVhdHandle hVhd = VHD_Open(aFileName, KModes[i]);
+        test(hVhd > 0);
+
+        FillZ(&readBuf[0], readBuf.size());
+
+        const int nRes = VHD_ReadSectors(hVhd, 0, KTestBlocks*KDefSecPerBlock, &readBuf[0], readBuf.size());
+        test_Val(nRes, (int)(KTestBlocks*KDefSecPerBlock));
+
+        test(memcmp(&readBuf[0], &aExpected[0], readBuf.size()) == 0);
+
+        LibVhd_2_CloseVhd(hVhd);
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Test Dynamic VHD with sector bitmaps containing a mixture of '1's and '0's.
+    TRIM is enabled to keep '0's in the bitmaps of appended blocks.
+    '1' extents are read by a batch of requests, '0' extents must read zeros.
+*/
+static void TestIoEngine_VHD_Dynamic()
+{
+    TEST_LOG();
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_IoEngine.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdSizeInSectors);
+
+    vector<uint8_t> expected(KTestBlocks*KDefSecPerBlock*KDefSecSize, 0);
+    TRndSequenceGen seqGen(KRndSeed1);
+
+    DoWriteChunks(fileName, VHDF_OPEN_ENABLE_TRIM, seqGen, expected);
+    DoCheckContents(fileName, expected);
+
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/**
+    Test Differencing VHD with sector bitmaps containing a mixture of '1's and '0's.
+    '1' extents are read from the Diff VHD by a batch of requests, '0' extents are read from the parent.
+*/
+static void TestIoEngine_VHD_Diff()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strParentName = KVhdFilesPath;
+    strParentName += "!!Dynamic_IoEngine_Parent.vhd";
+    const char* parentName = strParentName.c_str();
+    unlink(parentName);
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Diff_IoEngine.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    //-- 1. fill the test area of the parent VHD completely
+    LibVhd_2_CreateVhd_Dynamic(parentName, KVhdSizeInSectors);
+
+    vector<uint8_t> expected(KTestBlocks*KDefSecPerBlock*KDefSecSize);
+    TRndSequenceGen seqGen(KRndSeed1);
+    seqGen.GenerateSequence(&expected[0], expected.size());
+
+    TVhdHandle hVhd = VHD_Open(parentName, VHDF_OPEN_RDWR | VHDF_OPEN_IO_URING);
+    test(hVhd > 0);
+
+    nRes = VHD_WriteSectors(hVhd, 0, KTestBlocks*KDefSecPerBlock, &expected[0], expected.size());
+    test_Val(nRes, (int)(KTestBlocks*KDefSecPerBlock));
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 2. overwrite every other chunk in the Diff VHD
+    LibVhd_2_CreateVhd_Diff(fileName, parentName);
+
+    seqGen.InitRndSeed(KRndSeed2);
+    DoWriteChunks(fileName, 0, seqGen, expected);
+    DoCheckContents(fileName, expected);
+
+    unlink(fileName);
+    unlink(parentName);
+}
+
+//--------------------------------------------------------------------
+/**
+    Test reading and writing runs of blocks that are located one after another in the file; such runs are accessed by a single batch of requests.
+    Blocks are appended out of order and one of them has a partially mapped bitmap, so that the sectors range consists
+    of several runs and single blocks.
+*/
+static void TestIoEngine_ContiguousBlocks()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_IoEngine_Runs.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdSizeInSectors);
+
+    const uint KBlocks       = 7;
+    const uint KBlockBytes   = KDefSecPerBlock*KDefSecSize;
+    const uint KPartialBlock = 4; //-- this block will have a partially mapped bitmap
+
+    //-- order of appending blocks: 0,1,2 and 5,6 are contiguous runs; 3 goes after 6
+    const uint KBlockOrder[] = {0, 1, 2, 5, 6, 3, KPartialBlock};
+
+    vector<uint8_t> expected(KBlocks*KBlockBytes, 0);
+    vector<uint8_t> readBuf(expected.size());
+    TRndSequenceGen seqGen(KRndSeed1);
+
+    //-- TRIM keeps '0's in the bitmap of the partially written block
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    for(uint i=0; i<KBlocks; ++i)
+    {
+        const uint block   = KBlockOrder[i];
+        const uint sectors = (block == KPartialBlock) ? KDefSecPerBlock/2 : KDefSecPerBlock;
+        uint8_t* pData = &expected[block*KBlockBytes];
+
+        seqGen.GenerateSequence(pData, sectors*KDefSecSize);
+
+        nRes = VHD_WriteSectors(hVhd, block*KDefSecPerBlock, sectors, pData, sectors*KDefSecSize);
+        test_Val(nRes, (int)sectors);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    const uint32_t KModes[] = {VHDF_OPEN_RDWR, VHDF_OPEN_RDWR | VHDF_OPEN_IO_URING};
+    for(uint i=0; i<sizeof(KModes)/sizeof(KModes[0]); ++i)
+    {
+        hVhd = VHD_Open(fileName, KModes[i] | VHDF_OPEN_ENABLE_TRIM);
+        test(hVhd > 0);
+
+        //-- 1. read the whole range, it doesn't start or end on the block boundary
+        const uint KStartSector = 10;
+        const uint KSectors     = KBlocks*KDefSecPerBlock - KStartSector - 3;
+        const uint KOffset      = KStartSector*KDefSecSize;
+
+        FillZ(&readBuf[0], readBuf.size());
+        nRes = VHD_ReadSectors(hVhd, KStartSector, KSectors, &readBuf[0], KSectors*KDefSecSize);
+        test_Val(nRes, (int)KSectors);
+        test(memcmp(&readBuf[0], &expected[KOffset], KSectors*KDefSecSize) == 0);
+
+        //-- 2. overwrite the blocks 0..2 run, except the beginning of the first block, and check the whole range
+        seqGen.GenerateSequence(&expected[KOffset], 3*KBlockBytes - KOffset);
+
+        nRes = VHD_WriteSectors(hVhd, KStartSector, 3*KDefSecPerBlock - KStartSector, &expected[KOffset], 3*KBlockBytes - KOffset);
+        test_Val(nRes, (int)(3*KDefSecPerBlock - KStartSector));
+
+        nRes = VHD_ReadSectors(hVhd, 0, KBlocks*KDefSecPerBlock, &readBuf[0], readBuf.size());
+        test_Val(nRes, (int)(KBlocks*KDefSecPerBlock));
+        test(memcmp(&readBuf[0], &expected[0], readBuf.size()) == 0);
+
+        LibVhd_2_CloseVhd(hVhd);
+    }
+
+    unlink(fileName);
+}
+
+
+//--------------------------------------------------------------------
+/** Execute I/O engine tests */
+void IoEngineTests_Execute()
+{
+    TEST_LOG();
+    TestIoEngine_VHD_Dynamic();
+    TestIoEngine_VHD_Diff();
+    TestIoEngine_ContiguousBlocks();
+}
+
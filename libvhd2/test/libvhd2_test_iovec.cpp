@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test vectored I/O API: VHD_ReadSectorsV(), VHD_WriteSectorsV()
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+static const uint KRndSeed1 = 0xdeadbeef;
+
+/** size of the test files */
+static const uint KVhdSizeInSectors = (16*K1MegaByte)>>KDefSecSizeLog2;
+
+/** sizes of the buffers in the scatter-gather list, not multiples of the sector size; the list is repeated to cover the whole data */
+static const uint KSegSizes[] = {100, 412, 4096, 1, 7000, 511, 2*KDefSecSize, 33};
+static const uint KNumSegSizes = sizeof(KSegSizes)/sizeof(KSegSizes[0]);
+
+//--------------------------------------------------------------------
+/**
+    Build a scatter-gather list of iovecs that covers the given buffer.
+    @param  apBuf   buffer
+    @param  aBytes  buffer size
+    @param  aIov    out: iovecs
+*/
+static void DoMakeIoVec(uint8_t* apBuf, uint aBytes, vector<iovec>& aIov)
+{
+    aIov.clear();
+
+    for(uint i=0; aBytes; ++i)
+    {
+        iovec iov;
+        iov.iov_base = apBuf;
+        iov.iov_len  = Min(KSegSizes[i % KNumSegSizes], aBytes);
+
+        aIov.push_back(iov);
+
+        apBuf  += iov.iov_len;
+        aBytes -= iov.iov_len;
+    }
+}
+
+//--------------------------------------------------------------------
+/**
+    Write sector ranges with VHD_WriteSectorsV() and read them back with both vectored and contiguous API.
+    The sector ranges are not aligned to blocks and span block boundaries.
+
+    @param  aFileName   VHD file name
+    @param  aOpenFlags  additional VHD opening flags
+*/
+static void DoTestIoVec(const char* aFileName, uint32_t aOpenFlags)
+{
+    int nRes;
+
+    const uint KStartSector = KDefSecPerBlock - 37;    //-- crosses the block boundary
+    const uint KNumSectors  = KDefSecPerBlock + 100;
+    const uint KBytes       = KNumSectors*KDefSecSize;
+
+    vector<uint8_t> dataBuf(KBytes);
+    vector<uint8_t> readBuf(KBytes);
+    vector<iovec>   iov;
+
+    TRndSequenceGen seqGen(KRndSeed1);
+    seqGen.GenerateSequence(&dataBuf[0], KBytes);
+
+    TVhdHandle hVhd = VHD_Open(aFileName, VHDF_OPEN_RDWR | aOpenFlags);
+    test(hVhd > 0);
+
+    //-- 1. write every other chunk of 64 sectors, so that Dynamic/Diff sector bitmaps get mixed '0's and '1's
+    const uint KChunkSectors = 64;
+    for(uint sec = 0; sec < KNumSectors; sec += 2*KChunkSectors)
+    {
+        const uint secNum = Min(KChunkSectors, KNumSectors - sec);
+        DoMakeIoVec(&dataBuf[sec*KDefSecSize], secNum*KDefSecSize, iov);
+
+        nRes = VHD_WriteSectorsV(hVhd, KStartSector + sec, secNum, &iov[0], iov.size());
+        test_Val(nRes, (int)secNum);
+    }
+
+    //-- 2. fill the gaps with a single vectored write
+    for(uint sec = KChunkSectors; sec < KNumSectors; sec += 2*KChunkSectors)
+    {
+        const uint secNum = Min(KChunkSectors, KNumSectors - sec);
+        DoMakeIoVec(&dataBuf[sec*KDefSecSize], secNum*KDefSecSize, iov);
+
+        nRes = VHD_WriteSectorsV(hVhd, KStartSector + sec, secNum, &iov[0], iov.size());
+        test_Val(nRes, (int)secNum);
+    }
+
+    //-- 3. read everything back with the contiguous API
+    nRes = VHD_ReadSectors(hVhd, KStartSector, KNumSectors, &readBuf[0], KBytes);
+    test_Val(nRes, (int)KNumSectors);
+    test(memcmp(&readBuf[0], &dataBuf[0], KBytes) == 0);
+
+    //-- 4. read everything back with the vectored API
+    FillZ(&readBuf[0], KBytes);
+    DoMakeIoVec(&readBuf[0], KBytes, iov);
+
+    nRes = VHD_ReadSectorsV(hVhd, KStartSector, KNumSectors, &iov[0], iov.size());
+    test_Val(nRes, (int)KNumSectors);
+    test(memcmp(&readBuf[0], &dataBuf[0], KBytes) == 0);
+
+    //-- 5. number of sectors is limited by the buffers size; unwritten sectors read zeros
+    DoMakeIoVec(&readBuf[0], 3*KDefSecSize + 10, iov);
+    nRes = VHD_ReadSectorsV(hVhd, KStartSector + KNumSectors, 10, &iov[0], iov.size());
+    test_Val(nRes, 3);
+    test(CheckFilling(&readBuf[0], 3*KDefSecSize, 0));
+
+    //-- 6. invalid arguments
+    nRes = VHD_ReadSectorsV(hVhd, 0, 1, NULL, 1);
+    test_Val(nRes, KErrArgument);
+
+    nRes = VHD_WriteSectorsV(hVhd, 0, 1, &iov[0], 0);
+    test_Val(nRes, KErrArgument);
+
+    LibVhd_2_CloseVhd(hVhd);
+}
+
+//--------------------------------------------------------------------
+/** Test vectored I/O on Fixed, Dynamic and Differencing VHDs */
+static void TestIoVec_AllTypes()
+{
+    TEST_LOG();
+
+    std::string strFixedName = KVhdFilesPath;
+    strFixedName += "!!Fixed_IoVec.vhd";
+    unlink(strFixedName.c_str());
+
+    std::string strDynamicName = KVhdFilesPath;
+    strDynamicName += "!!Dynamic_IoVec.vhd";
+    unlink(strDynamicName.c_str());
+
+    std::string strDiffName = KVhdFilesPath;
+    strDiffName += "!!Diff_IoVec.vhd";
+    unlink(strDiffName.c_str());
+
+    LibVhd_2_CreateVhd_Fixed(strFixedName.c_str(), KVhdSizeInSectors);
+    DoTestIoVec(strFixedName.c_str(), 0);
+    unlink(strFixedName.c_str());
+
+    //-- TRIM keeps '0's in the bitmaps of appended blocks
+    LibVhd_2_CreateVhd_Dynamic(strDynamicName.c_str(), KVhdSizeInSectors);
+    DoTestIoVec(strDynamicName.c_str(), VHDF_OPEN_ENABLE_TRIM);
+
+    LibVhd_2_CreateVhd_Diff(strDiffName.c_str(), strDynamicName.c_str());
+    DoTestIoVec(strDiffName.c_str(), VHDF_OPEN_IO_URING);
+
+    unlink(strDiffName.c_str());
+    unlink(strDynamicName.c_str());
+}
+
+
+//--------------------------------------------------------------------
+/** Execute vectored I/O tests */
+void IoVecTests_Execute()
+{
+    TEST_LOG();
+    TestIoVec_AllTypes();
+}
+
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test extents mapping API: VHD_MapExtents(), VHD_CommitExtents()
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+static const uint KRndSeed1 = 0xdeadbeef;
+
+/** size of the test files */
+static const uint KVhdSizeInSectors = (16*K1MegaByte)>>KDefSecSizeLog2;
+
+/** max. number of extents the tests expect */
+static const uint KMaxExtents = 16;
+
+//--------------------------------------------------------------------
+/**
+    Check that an extent has the expected parameters.
+*/
+static void DoCheckExtent(const TVhdExtent& aExt, TVhdExtentKind aKind, uint32_t aStartSector, uint32_t aSectors, uint32_t aLayer)
+{
+    test_Val(aExt.extKind, aKind);
+    test_Val(aExt.extStartSector, aStartSector);
+    test_Val(aExt.extSectors, aSectors);
+    test_Val(aExt.extLayer, aLayer);
+
+    if(aKind == EVhdExt_Data)
+        {test(aExt.extFd >= 0);}
+    else
+        {test(aExt.extFd == -1 && aExt.extFileOffset == 0);}
+}
+
+//--------------------------------------------------------------------
+/**
+    Check that the data of the EVhdExt_Data extent in the file match the expected ones.
+    @param  aExt        extent
+    @param  apExpected  expected data of the extent
+*/
+static void DoCheckExtentData(const TVhdExtent& aExt, const uint8_t* apExpected)
+{
+    const uint KBytes = aExt.extSectors*KDefSecSize;
+    vector<uint8_t> buf(KBytes);
+
+    test(aExt.extKind == EVhdExt_Data);
+    test_Val(pread64(aExt.extFd, &buf[0], KBytes, aExt.extFileOffset), (int)KBytes);
+    test(memcmp(&buf[0], apExpected, KBytes) == 0);
+}
+
+//--------------------------------------------------------------------
+/**
+    Test mapping sectors of the Fixed VHD: the whole range is a single extent with linear mapping to the file
+*/
+static void TestMapExtents_Fixed()
+{
+    TEST_LOG();
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Fixed_MapExtents.vhd";
+    unlink(strFileName.c_str());
+
+    LibVhd_2_CreateVhd_Fixed(strFileName.c_str(), KVhdSizeInSectors);
+
+    TVhdHandle hVhd = VHD_Open(strFileName.c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    TVhdExtent extents[KMaxExtents];
+    TVHD_ParamsStruct vhdInfo;
+
+    int nRes = VHD_Info(hVhd, &vhdInfo);
+    test_KErrNone(nRes);
+
+    //-- the range is clipped by the VHD size, which can be slightly different from the requested one
+    const uint KSectors = vhdInfo.vhdSectors;
+
+    nRes = VHD_MapExtents(hVhd, KSectors - 10, 100, 0, extents, KMaxExtents);
+    test_Val(nRes, 1);
+    DoCheckExtent(extents[0], EVhdExt_Data, KSectors - 10, 10, 0);
+    test(extents[0].extFileOffset == ((uint64_t)(KSectors - 10))*KDefSecSize);
+
+    nRes = VHD_MapExtents(hVhd, KSectors, 1, 0, extents, KMaxExtents);
+    test_Val(nRes, KErrTooBig);
+
+    nRes = VHD_CommitExtents(hVhd, 0, 100);
+    test_Val(nRes, KErrNone);
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(strFileName.c_str());
+}
+
+//--------------------------------------------------------------------
+/**
+    Test mapping sectors of the Dynamic VHD: '0' bits and absent blocks give zero extents, allocating blocks for writing,
+    committing sectors written directly to the file.
+*/
+static void TestMapExtents_Dynamic()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_MapExtents.vhd";
+    unlink(strFileName.c_str());
+
+    LibVhd_2_CreateVhd_Dynamic(strFileName.c_str(), KVhdSizeInSectors);
+
+    //-- TRIM keeps '0's in the bitmaps of appended blocks
+    TVhdHandle hVhd = VHD_Open(strFileName.c_str(), VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    TRndSequenceGen seqGen(KRndSeed1);
+    TVhdExtent extents[KMaxExtents];
+
+    //-- 1. write some sectors to the 2nd block, the rest of the block and the 1st block remain unmapped
+    const uint KDataSector  = KDefSecPerBlock + 10;
+    const uint KDataSectors = 20;
+
+    vector<uint8_t> dataBuf(KDataSectors*KDefSecSize);
+    seqGen.GenerateSequence(&dataBuf[0], dataBuf.size());
+
+    nRes = VHD_WriteSectors(hVhd, KDataSector, KDataSectors, &dataBuf[0], dataBuf.size());
+    test_Val(nRes, (int)KDataSectors);
+
+    //-- 2. map 2 blocks. Zero extents of the 1st block and the beginning of the 2nd one are merged
+    nRes = VHD_MapExtents(hVhd, 0, 2*KDefSecPerBlock, 0, extents, KMaxExtents);
+    test_Val(nRes, 3);
+
+    DoCheckExtent(extents[0], EVhdExt_Zero, 0, KDataSector, 0);
+    DoCheckExtent(extents[1], EVhdExt_Data, KDataSector, KDataSectors, 0);
+    DoCheckExtent(extents[2], EVhdExt_Zero, KDataSector + KDataSectors, 2*KDefSecPerBlock - (KDataSector + KDataSectors), 0);
+    DoCheckExtentData(extents[1], &dataBuf[0]);
+
+    //-- 3. not enough room for all extents, only a beginning of the range is mapped
+    nRes = VHD_MapExtents(hVhd, 0, 2*KDefSecPerBlock, 0, extents, 2);
+    test_Val(nRes, 2);
+    DoCheckExtent(extents[1], EVhdExt_Data, KDataSector, KDataSectors, 0);
+
+    //-- 4. map the range spanning 2 absent blocks for writing, write data directly to the file and commit them
+    const uint KAllocSector  = 3*KDefSecPerBlock - 5;
+    const uint KAllocSectors = 10;
+
+    nRes = VHD_MapExtents(hVhd, KAllocSector, KAllocSectors, 1, extents, KMaxExtents);
+    test_Val(nRes, 2);
+    DoCheckExtent(extents[0], EVhdExt_Data, KAllocSector, 5, 0);
+    DoCheckExtent(extents[1], EVhdExt_Data, 3*KDefSecPerBlock, 5, 0);
+
+    dataBuf.resize(KAllocSectors*KDefSecSize);
+    seqGen.GenerateSequence(&dataBuf[0], dataBuf.size());
+
+    uint8_t* pData = &dataBuf[0];
+    for(int i=0; i<nRes; ++i)
+    {
+        const uint bytes = extents[i].extSectors*KDefSecSize;
+        test_Val(pwrite64(extents[i].extFd, pData, bytes, extents[i].extFileOffset), (int)bytes);
+        pData += bytes;
+    }
+
+    //-- sectors that were mapped for writing, but haven't been committed yet, still read as zeros
+    vector<uint8_t> readBuf(dataBuf.size());
+    nRes = VHD_ReadSectors(hVhd, KAllocSector, KAllocSectors, &readBuf[0], readBuf.size());
+    test_Val(nRes, (int)KAllocSectors);
+    test(CheckFilling(&readBuf[0], readBuf.size(), 0));
+
+    nRes = VHD_CommitExtents(hVhd, KAllocSector, KAllocSectors);
+    test_Val(nRes, KErrNone);
+
+    nRes = VHD_ReadSectors(hVhd, KAllocSector, KAllocSectors, &readBuf[0], readBuf.size());
+    test_Val(nRes, (int)KAllocSectors);
+    test(memcmp(&readBuf[0], &dataBuf[0], dataBuf.size()) == 0);
+
+    //-- 5. committing sectors in the absent block isn't allowed
+    nRes = VHD_CommitExtents(hVhd, 5*KDefSecPerBlock, 1);
+    test_Val(nRes, KErrArgument);
+
+    //-- 6. invalid arguments
+    nRes = VHD_MapExtents(hVhd, 0, 1, 0, NULL, KMaxExtents);
+    test_Val(nRes, KErrArgument);
+
+    nRes = VHD_MapExtents(hVhd, 0, 1, 0, extents, 0);
+    test_Val(nRes, KErrArgument);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 7. the committed data are persistent; read-only VHD can't be mapped for writing
+    hVhd = VHD_Open(strFileName.c_str(), 0);
+    test(hVhd > 0);
+
+    nRes = VHD_ReadSectors(hVhd, KAllocSector, KAllocSectors, &readBuf[0], readBuf.size());
+    test_Val(nRes, (int)KAllocSectors);
+    test(memcmp(&readBuf[0], &dataBuf[0], dataBuf.size()) == 0);
+
+    nRes = VHD_MapExtents(hVhd, 0, 1, 1, extents, KMaxExtents);
+    test_Val(nRes, -EBADF);
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(strFileName.c_str());
+}
+
+//--------------------------------------------------------------------
+/**
+    Test mapping sectors of the Differencing VHD: sectors that are not in the child VHD are resolved through the parent.
+*/
+static void TestMapExtents_Diff()
+{
+    TEST_LOG();
+
+    int nRes;
+
+    std::string strParentName = KVhdFilesPath;
+    strParentName += "!!Dynamic_MapExtents_Parent.vhd";
+    unlink(strParentName.c_str());
+
+    std::string strDiffName = KVhdFilesPath;
+    strDiffName += "!!Diff_MapExtents.vhd";
+    unlink(strDiffName.c_str());
+
+    TRndSequenceGen seqGen(KRndSeed1);
+    TVhdExtent extents[KMaxExtents];
+
+    const uint KDataSectors = 100;
+    vector<uint8_t> dataBuf(KDataSectors*KDefSecSize);
+    seqGen.GenerateSequence(&dataBuf[0], dataBuf.size());
+
+    //-- 1. the parent has data in the 1st block
+    LibVhd_2_CreateVhd_Dynamic(strParentName.c_str(), KVhdSizeInSectors);
+
+    TVhdHandle hVhd = VHD_Open(strParentName.c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = VHD_WriteSectors(hVhd, 0, KDataSectors, &dataBuf[0], dataBuf.size());
+    test_Val(nRes, (int)KDataSectors);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 2. the child overwrites some sectors in the middle
+    LibVhd_2_CreateVhd_Diff(strDiffName.c_str(), strParentName.c_str());
+
+    hVhd = VHD_Open(strDiffName.c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    const uint KChildSector  = 50;
+    const uint KChildSectors = 10;
+    seqGen.GenerateSequence(&dataBuf[KChildSector*KDefSecSize], KChildSectors*KDefSecSize);
+
+    nRes = VHD_WriteSectors(hVhd, KChildSector, KChildSectors, &dataBuf[KChildSector*KDefSecSize], KChildSectors*KDefSecSize);
+    test_Val(nRes, (int)KChildSectors);
+
+    //-- 3. map the 1st block and the beginning of the 2nd one, that is absent in both VHDs
+    nRes = VHD_MapExtents(hVhd, 0, KDefSecPerBlock + 10, 0, extents, KMaxExtents);
+    test_Val(nRes, 4);
+
+    DoCheckExtent(extents[0], EVhdExt_Data, 0, KChildSector, 1);
+    DoCheckExtent(extents[1], EVhdExt_Data, KChildSector, KChildSectors, 0);
+    DoCheckExtent(extents[2], EVhdExt_Data, KChildSector + KChildSectors, KDefSecPerBlock - (KChildSector + KChildSectors), 1);
+    DoCheckExtent(extents[3], EVhdExt_Zero, KDefSecPerBlock, 10, 1);
+
+    test(extents[0].extFd != extents[1].extFd && extents[0].extFd == extents[2].extFd);
+
+    DoCheckExtentData(extents[0], &dataBuf[0]);
+    DoCheckExtentData(extents[1], &dataBuf[KChildSector*KDefSecSize]);
+
+    extents[2].extSectors = KDataSectors - (KChildSector + KChildSectors);
+    DoCheckExtentData(extents[2], &dataBuf[(KChildSector + KChildSectors)*KDefSecSize]);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- 4. the parent is missing and ignored, the sectors that aren't in the child are reported as the parent ones
+    unlink(strParentName.c_str());
+
+    hVhd = VHD_Open(strDiffName.c_str(), VHDF_OPEN_IGNORE_PARENT);
+    test(hVhd > 0);
+
+    nRes = VHD_MapExtents(hVhd, KDefSecPerBlock, 10, 0, extents, KMaxExtents);
+    test_Val(nRes, 1);
+    DoCheckExtent(extents[0], EVhdExt_Parent, KDefSecPerBlock, 10, 1);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(strDiffName.c_str());
+}
+
+
+//--------------------------------------------------------------------
+/** Execute extents mapping tests */
+void MapExtentsTests_Execute()
+{
+    TEST_LOG();
+
+    TestMapExtents_Fixed();
+    TestMapExtents_Dynamic();
+    TestMapExtents_Diff();
+}
+
@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test preallocation of the host file space ahead of the blocks appended to Dynamic VHDs: the space is allocated beyond
+    the footer without changing the file size, and released on closing the VHD or disabling preallocation.
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** number of blocks in the test VHD */
+static const uint KVhdBlocks = 16;
+
+/** size of the appended block in the file: 1 sector bitmap and the data */
+static const uint KAppendedBlockBytes = (1 + KDefSecPerBlock) * KDefSecSize;
+
+/** preallocation window used by the test, MB */
+static const uint32_t KWindowMB = 8;
+
+//--------------------------------------------------------------------
+/** @return true if the file system can preallocate space beyond the end of the file */
+static bool DoCheckPreallocSupported(const char* aFileName)
+{
+    int fd = open(aFileName, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    test(fd >= 0);
+
+    const bool bSupported = (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, 1024*1024) == 0);
+
+    close(fd);
+    unlink(aFileName);
+
+    return bSupported;
+}
+
+//--------------------------------------------------------------------
+/** Preallocate the space ahead of appended blocks, release it on closing and on disabling preallocation */
+static void TestPrealloc_Dynamic()
+{
+    TEST_LOG();
+
+    int nRes;
+    uint64_t allocated;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_Prealloc.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    if(!DoCheckPreallocSupported(fileName))
+    {
+        printf("preallocation isn't supported by the file system, skipping the test\n");
+        return;
+    }
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, KVhdBlocks*KDefSecPerBlock);
+
+    const uint64_t initialSize = LibVhd_2_GetFileSize(fileName, allocated);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    //-- invalid window size
+    nRes = VHD_SetPreallocation(hVhd, 4097);
+    test(nRes < 0);
+
+    nRes = VHD_SetPreallocation(hVhd, KWindowMB);
+    test_KErrNone(nRes);
+
+    //-- the first appended block preallocates the window beyond it; the file size doesn't change, the footer is at the end
+    nRes = LibVhd_2_FillFile(hVhd, 0, KDefSecPerBlock, 1);
+    test_KErrNone(nRes);
+
+    uint64_t fileSize = LibVhd_2_GetFileSize(fileName, allocated);
+    test(fileSize == initialSize + KAppendedBlockBytes);
+    test(allocated >= fileSize + (KWindowMB << 20) - KDefSecSize);
+
+    //-- blocks appended within the window don't allocate any more
+    const uint64_t allocated1 = allocated;
+
+    nRes = LibVhd_2_FillFile(hVhd, 3*KDefSecPerBlock, 1, 3);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_FillFile(hVhd, 5*KDefSecPerBlock, KDefSecPerBlock, 5);
+    test_KErrNone(nRes);
+
+    fileSize = LibVhd_2_GetFileSize(fileName, allocated);
+    test(fileSize == initialSize + 3*KAppendedBlockBytes);
+    test(allocated == allocated1);
+
+    //-- closing the VHD releases the space that hasn't been used
+    LibVhd_2_CloseVhd(hVhd);
+
+    fileSize = LibVhd_2_GetFileSize(fileName, allocated);
+    test(fileSize == initialSize + 3*KAppendedBlockBytes);
+    test(allocated < fileSize + (1 << 20));
+
+    //-- disabling preallocation releases the space and the next block is appended without it
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = VHD_SetPreallocation(hVhd, KWindowMB);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_FillFile(hVhd, 7*KDefSecPerBlock, KDefSecPerBlock, 7);
+    test_KErrNone(nRes);
+
+    fileSize = LibVhd_2_GetFileSize(fileName, allocated);
+    test(allocated >= fileSize + (KWindowMB << 20) - KDefSecSize);
+
+    nRes = VHD_SetPreallocation(hVhd, 0);
+    test_KErrNone(nRes);
+
+    fileSize = LibVhd_2_GetFileSize(fileName, allocated);
+    test(allocated < fileSize + (1 << 20));
+
+    nRes = LibVhd_2_FillFile(hVhd, 9*KDefSecPerBlock, KDefSecPerBlock, 9);
+    test_KErrNone(nRes);
+
+    fileSize = LibVhd_2_GetFileSize(fileName, allocated);
+    test(fileSize == initialSize + 5*KAppendedBlockBytes);
+    test(allocated < fileSize + (1 << 20));
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- check the data after reopening
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    for(uint blk=0; blk<KVhdBlocks; ++blk)
+    {
+        uint8_t fill = 0;
+        if(blk == 0)
+            fill = 1;
+        else if(blk == 5 || blk == 7 || blk == 9)
+            fill = blk;
+
+        //-- block 3 has only its first sector written
+        nRes = LibVhd_2_CheckFileFill(hVhd, blk*KDefSecPerBlock + (blk == 3), KDefSecPerBlock - (blk == 3), fill);
+        test_KErrNone(nRes);
+    }
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 3*KDefSecPerBlock, 1, 3);
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    unlink(fileName);
+}
+
+
+//--------------------------------------------------------------------
+/** Execute host file preallocation tests */
+void PreallocTests_Execute()
+{
+    TEST_LOG();
+    TestPrealloc_Dynamic();
+}
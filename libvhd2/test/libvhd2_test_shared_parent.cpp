@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+    @file  test sharing of the parent VHDs between the chains opened in the process: a "golden image" under many Differencing VHDs
+    is opened once, every chain still reads its own data and the parent is closed with the last child.
+*/
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <assert.h>
+#include <string.h>
+
+#include <string>
+using std::string;
+
+#include "libvhd2_test.h"
+
+//--------------------------------------------------------------------
+
+/** number of blocks in the test VHDs */
+static const uint KVhdBlocks = 4;
+
+/** number of sectors in the test VHDs */
+static const uint KVhdSectors = KVhdBlocks*KDefSecPerBlock;
+
+/** number of Differencing VHDs on top of the golden image */
+static const uint KChildren = 8;
+
+//--------------------------------------------------------------------
+/** @return name of the test VHD file */
+static string DoFileName(const char* aName, uint aIndex)
+{
+    char buf[16];
+    sprintf(buf, "_%02d.vhd", aIndex);
+
+    string strFileName = KVhdFilesPath;
+    strFileName += aName;
+    strFileName += buf;
+
+    return strFileName;
+}
+
+//--------------------------------------------------------------------
+/** @return number of the file descriptors of this process opened on the given file */
+static uint DoCountFileDescs(const string& aFileName)
+{
+    char realName[PATH_MAX];
+    test(realpath(aFileName.c_str(), realName) != NULL);
+
+    DIR* pDir = opendir("/proc/self/fd");
+    test(pDir != NULL);
+
+    uint cnt = 0;
+    struct dirent* pEntry;
+    while((pEntry = readdir(pDir)) != NULL)
+    {
+        char linkName[PATH_MAX];
+        char target[PATH_MAX];
+
+        snprintf(linkName, sizeof(linkName), "/proc/self/fd/%s", pEntry->d_name);
+
+        const ssize_t len = readlink(linkName, target, sizeof(target) - 1);
+        if(len <= 0)
+            continue;
+
+        target[len] = 0;
+        if(strcmp(target, realName) == 0)
+            cnt++;
+    }
+
+    closedir(pDir);
+    return cnt;
+}
+
+//--------------------------------------------------------------------
+/** The sectors of a child: its own block 1 and a few sectors in block 0, the rest comes from the golden image */
+static void DoCheckChild(TVhdHandle aVhdHandle, uint aChild)
+{
+    int nRes;
+
+    nRes = LibVhd_2_CheckFileFill(aVhdHandle, 0, aChild*8, 'G');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(aVhdHandle, aChild*8, 8, 'a' + aChild);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(aVhdHandle, aChild*8 + 8, KDefSecPerBlock - aChild*8 - 8, 'G');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(aVhdHandle, KDefSecPerBlock, KDefSecPerBlock, 'A' + aChild);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(aVhdHandle, 2*KDefSecPerBlock, KDefSecPerBlock, 'G');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(aVhdHandle, 3*KDefSecPerBlock, KDefSecPerBlock, 0);
+    test_KErrNone(nRes);
+}
+
+//--------------------------------------------------------------------
+/** Create the golden image and KChildren Differencing VHDs on it, every child has some data of its own */
+static void DoCreateGoldenChildren(const char* aName)
+{
+    int nRes;
+
+    for(uint i=0; i<=KChildren; ++i)
+        unlink(DoFileName(aName, i).c_str());
+
+    LibVhd_2_CreateVhd_Dynamic(DoFileName(aName, 0).c_str(), KVhdSectors);
+
+    TVhdHandle hVhd = VHD_Open(DoFileName(aName, 0).c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_FillFile(hVhd, 0, 3*KDefSecPerBlock, 'G');
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    for(uint i=1; i<=KChildren; ++i)
+    {
+        LibVhd_2_CreateVhd_Diff(DoFileName(aName, i).c_str(), DoFileName(aName, 0).c_str());
+
+        hVhd = VHD_Open(DoFileName(aName, i).c_str(), VHDF_OPEN_RDWR);
+        test(hVhd > 0);
+
+        nRes = LibVhd_2_FillFile(hVhd, i*8, 8, 'a' + i);
+        test_KErrNone(nRes);
+
+        nRes = LibVhd_2_FillFile(hVhd, KDefSecPerBlock, KDefSecPerBlock, 'A' + i);
+        test_KErrNone(nRes);
+
+        LibVhd_2_CloseVhd(hVhd);
+    }
+}
+
+//--------------------------------------------------------------------
+/** All children of the golden image share one opened parent; it is closed with the last child */
+static void TestSharedParent_Golden()
+{
+    TEST_LOG();
+
+    static const char KName[] = "!!Diff_SharedParent";
+    const string strGoldenName = DoFileName(KName, 0);
+
+    DoCreateGoldenChildren(KName);
+    test(DoCountFileDescs(strGoldenName) == 0);
+
+    //-- 1. open all children, the golden image is opened by the first read
+    TVhdHandle hVhd[KChildren+1];
+    for(uint i=1; i<=KChildren; ++i)
+    {
+        hVhd[i] = VHD_Open(DoFileName(KName, i).c_str(), (i & 1) ? VHDF_OPEN_RDONLY : VHDF_OPEN_RDWR);
+        test(hVhd[i] > 0);
+    }
+
+    for(uint i=1; i<=KChildren; ++i)
+    {
+        DoCheckChild(hVhd[i], i);
+        test(DoCountFileDescs(strGoldenName) == 1);
+    }
+
+    //-- 2. the children close in a mixed order, the rest still read their data
+    for(uint i=2; i<=KChildren; i+=2)
+        LibVhd_2_CloseVhd(hVhd[i]);
+
+    test(DoCountFileDescs(strGoldenName) == 1);
+
+    for(uint i=1; i<=KChildren; i+=2)
+        DoCheckChild(hVhd[i], i);
+
+    //-- 3. a child opened again gets the shared parent
+    hVhd[2] = VHD_Open(DoFileName(KName, 2).c_str(), VHDF_OPEN_RDWR);
+    test(hVhd[2] > 0);
+
+    DoCheckChild(hVhd[2], 2);
+    test(DoCountFileDescs(strGoldenName) == 1);
+
+    LibVhd_2_CloseVhd(hVhd[2]);
+
+    for(int i=KChildren-1; i>=1; i-=2)
+        LibVhd_2_CloseVhd(hVhd[i]);
+
+    //-- 4. the last child has closed the golden image
+    test(DoCountFileDescs(strGoldenName) == 0);
+
+    for(uint i=0; i<=KChildren; ++i)
+        unlink(DoFileName(KName, i).c_str());
+}
+
+//--------------------------------------------------------------------
+/** A shared Differencing parent: two chains on the same middle layer open the golden image once as well */
+static void TestSharedParent_MiddleLayer()
+{
+    TEST_LOG();
+
+    static const char KName[] = "!!Diff_SharedMiddle";
+    const uint KFiles = 4; //-- golden image, the middle layer and 2 tails
+    int nRes;
+
+    for(uint i=0; i<KFiles; ++i)
+        unlink(DoFileName(KName, i).c_str());
+
+    LibVhd_2_CreateVhd_Dynamic(DoFileName(KName, 0).c_str(), KVhdSectors);
+
+    TVhdHandle hVhd = VHD_Open(DoFileName(KName, 0).c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_FillFile(hVhd, 0, KVhdSectors, 'G');
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    LibVhd_2_CreateVhd_Diff(DoFileName(KName, 1).c_str(), DoFileName(KName, 0).c_str());
+
+    hVhd = VHD_Open(DoFileName(KName, 1).c_str(), VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_FillFile(hVhd, KDefSecPerBlock, KDefSecPerBlock, 'M');
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    LibVhd_2_CreateVhd_Diff(DoFileName(KName, 2).c_str(), DoFileName(KName, 1).c_str());
+    LibVhd_2_CreateVhd_Diff(DoFileName(KName, 3).c_str(), DoFileName(KName, 1).c_str());
+
+    TVhdHandle hTail1 = VHD_Open(DoFileName(KName, 2).c_str(), VHDF_OPEN_RDWR);
+    test(hTail1 > 0);
+
+    TVhdHandle hTail2 = VHD_Open(DoFileName(KName, 3).c_str(), VHDF_OPEN_RDONLY);
+    test(hTail2 > 0);
+
+    nRes = LibVhd_2_FillFile(hTail1, 10, 20, 'T');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(hTail1, 0, 10, 'G');
+    test_KErrNone(nRes);
+    nRes = LibVhd_2_CheckFileFill(hTail1, 10, 20, 'T');
+    test_KErrNone(nRes);
+    nRes = LibVhd_2_CheckFileFill(hTail1, 30, KDefSecPerBlock - 30, 'G');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(hTail2, 0, KDefSecPerBlock, 'G');
+    test_KErrNone(nRes);
+
+    for(uint i=0; i<2; ++i)
+    {
+        const TVhdHandle hTail = i ? hTail2 : hTail1;
+
+        nRes = LibVhd_2_CheckFileFill(hTail, KDefSecPerBlock, KDefSecPerBlock, 'M');
+        test_KErrNone(nRes);
+        nRes = LibVhd_2_CheckFileFill(hTail, 2*KDefSecPerBlock, 2*KDefSecPerBlock, 'G');
+        test_KErrNone(nRes);
+    }
+
+    test(DoCountFileDescs(DoFileName(KName, 1)) == 1);
+    test(DoCountFileDescs(DoFileName(KName, 0)) == 1);
+
+    //-- the parents' information is available through both chains
+    TVHD_ParamsStruct vhdParams;
+    nRes = VHD_ParentInfo(hTail2, &vhdParams, 2);
+    test_KErrNone(nRes);
+    test(vhdParams.vhdType == EVhd_Dynamic);
+
+    LibVhd_2_CloseVhd(hTail1);
+
+    nRes = LibVhd_2_CheckFileFill(hTail2, 0, KDefSecPerBlock, 'G');
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hTail2);
+
+    test(DoCountFileDescs(DoFileName(KName, 1)) == 0);
+    test(DoCountFileDescs(DoFileName(KName, 0)) == 0);
+
+    for(uint i=0; i<KFiles; ++i)
+        unlink(DoFileName(KName, i).c_str());
+}
+
+//--------------------------------------------------------------------
+
+/** parameters of a reader thread */
+struct TReaderParams
+{
+    TVhdHandle  iVhdHandle; ///< handle of the child VHD, used by this thread only
+    uint        iChild;     ///< index of the child
+    uint        iPasses;    ///< number of times to read the child
+};
+
+/** reader thread: reads the child's sectors, mostly from the shared parent */
+static void* DoReaderThread(void* apParams)
+{
+    const TReaderParams* pParams = (const TReaderParams*)apParams;
+
+    for(uint i=0; i<pParams->iPasses; ++i)
+        DoCheckChild(pParams->iVhdHandle, pParams->iChild);
+
+    return NULL;
+}
+
+//--------------------------------------------------------------------
+/** The children are read by different threads at the same time; the shared parent serves all of them */
+static void TestSharedParent_Threads()
+{
+    TEST_LOG();
+
+    static const char KName[] = "!!Diff_SharedThreads";
+
+    DoCreateGoldenChildren(KName);
+
+    //-- a small bitmap cache makes the threads evict each other's bitmaps from the shared parent
+    TReaderParams params[KChildren];
+    pthread_t threads[KChildren];
+
+    for(uint i=0; i<KChildren; ++i)
+    {
+        params[i].iChild = i+1;
+        params[i].iPasses = 20;
+        params[i].iVhdHandle = VHD_Open(DoFileName(KName, i+1).c_str(), VHDF_OPEN_RDONLY);
+        test(params[i].iVhdHandle > 0);
+
+        const int nRes = VHD_SetBitmapCacheSize(params[i].iVhdHandle, 1);
+        test_KErrNone(nRes);
+    }
+
+    for(uint i=0; i<KChildren; ++i)
+        test(pthread_create(&threads[i], NULL, DoReaderThread, &params[i]) == 0);
+
+    for(uint i=0; i<KChildren; ++i)
+        test(pthread_join(threads[i], NULL) == 0);
+
+    test(DoCountFileDescs(DoFileName(KName, 0)) == 1);
+
+    for(uint i=0; i<KChildren; ++i)
+        LibVhd_2_CloseVhd(params[i].iVhdHandle);
+
+    test(DoCountFileDescs(DoFileName(KName, 0)) == 0);
+
+    for(uint i=0; i<=KChildren; ++i)
+        unlink(DoFileName(KName, i).c_str());
+}
+
+
+//--------------------------------------------------------------------
+/** Execute shared parent VHDs tests */
+void SharedParentTests_Execute()
+{
+    TEST_LOG();
+    TestSharedParent_Golden();
+    TestSharedParent_MiddleLayer();
+    TestSharedParent_Threads();
+}
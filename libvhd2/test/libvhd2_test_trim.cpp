@@ -387,6 +387,178 @@ static void TestTRIM_VHD_Diff()
 
 
 
+//--------------------------------------------------------------------
+/**
+    Test that TRIM gives the space back to the host file system on a Dynamic VHD: discarded parts of a block are deallocated,
+    a fully discarded block is taken out of the BAT, so writing to it again appends a new block.
+*/
+static void TestTRIM_HolePunch_Dynamic()
+{
+    TEST_LOG();
+
+    int nRes;
+    uint64_t allocated, allocated1;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Dynamic_HolePunch.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Dynamic(fileName, 8*KDefSecPerBlock);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    nRes = VHD_SetPreallocation(hVhd, 0);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_FillFile(hVhd, 0, 2*KDefSecPerBlock, 'a');
+    test_KErrNone(nRes);
+
+    nRes = VHD_Flush(hVhd);
+    test_KErrNone(nRes);
+
+    const uint64_t fileSize = LibVhd_2_GetFileSize(fileName, allocated);
+
+    //-- discard a part of block 0, the data sectors are deallocated, the file size doesn't change
+    const uint KDiscardSectors = 1024;
+    nRes = VHD_DiscardSectors(hVhd, 8, KDiscardSectors);
+    test_KErrNone(nRes);
+
+    test(LibVhd_2_GetFileSize(fileName, allocated1) == fileSize);
+    if(allocated1 == allocated)
+    {
+        printf("hole punching isn't supported by the file system, skipping the test\n");
+        LibVhd_2_CloseVhd(hVhd);
+        unlink(fileName);
+        return;
+    }
+
+    test(allocated - allocated1 >= KDiscardSectors*KDefSecSize - 2*4096);
+
+    //-- discard the whole block 1, it's unlinked and deallocated
+    nRes = VHD_DiscardSectors(hVhd, KDefSecPerBlock, KDefSecPerBlock);
+    test_KErrNone(nRes);
+
+    test(LibVhd_2_GetFileSize(fileName, allocated) == fileSize);
+    test(allocated1 - allocated >= KDefSecPerBlock*KDefSecSize - 4096);
+
+    for(int i=0; i<2; ++i)
+    {
+        nRes = LibVhd_2_CheckFileFill(hVhd, 0, 8, 'a');
+        test_KErrNone(nRes);
+
+        nRes = LibVhd_2_CheckFileFill(hVhd, 8, KDiscardSectors, 0);
+        test_KErrNone(nRes);
+
+        nRes = LibVhd_2_CheckFileFill(hVhd, 8+KDiscardSectors, KDefSecPerBlock-8-KDiscardSectors, 'a');
+        test_KErrNone(nRes);
+
+        nRes = LibVhd_2_CheckFileFill(hVhd, KDefSecPerBlock, KDefSecPerBlock, 0);
+        test_KErrNone(nRes);
+
+        nRes = VHD_Flush(hVhd);
+        test_KErrNone(nRes);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    //-- without TRIM enabled the bitmaps are ignored on reading; the discarded sectors still read as zeroes
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 8, KDiscardSectors, 0);
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, KDefSecPerBlock, KDefSecPerBlock, 0);
+    test_KErrNone(nRes);
+
+    //-- block 1 isn't in the BAT any more, writing to it allocates a new block in the free slot it has left
+    nRes = LibVhd_2_FillFile(hVhd, KDefSecPerBlock, 1, 'b');
+    test_KErrNone(nRes);
+
+    test(LibVhd_2_GetFileSize(fileName, allocated) == fileSize);
+
+    LibVhd_2_CloseVhd(hVhd);
+
+    hVhd = VHD_Open(fileName, VHDF_OPEN_RDONLY);
+    test(hVhd > 0);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, 0, 8, 'a');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, KDefSecPerBlock, 1, 'b');
+    test_KErrNone(nRes);
+
+    nRes = LibVhd_2_CheckFileFill(hVhd, KDefSecPerBlock+1, KDefSecPerBlock-1, 0);
+    test_KErrNone(nRes);
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(fileName);
+}
+
+//--------------------------------------------------------------------
+/** Test that TRIM deallocates the discarded sectors of a Fixed VHD */
+static void TestTRIM_HolePunch_Fixed()
+{
+    TEST_LOG();
+
+    int nRes;
+    uint64_t allocated, allocated1;
+
+    std::string strFileName = KVhdFilesPath;
+    strFileName += "!!Fixed_HolePunch.vhd";
+    const char* fileName = strFileName.c_str();
+    unlink(fileName);
+
+    LibVhd_2_CreateVhd_Fixed(fileName, 4096);
+
+    TVhdHandle hVhd = VHD_Open(fileName, VHDF_OPEN_RDWR | VHDF_OPEN_ENABLE_TRIM);
+    test(hVhd > 0);
+
+    //-- the VHD size comes from the CHS geometry, it can be a bit less than requested
+    TVHD_ParamsStruct  params;
+    memset(&params, 0, sizeof(params));
+
+    nRes = VHD_Info(hVhd, &params);
+    test_KErrNone(nRes);
+
+    const uint KVhdSectors = params.vhdSectors;
+
+    nRes = LibVhd_2_FillFile(hVhd, 0, KVhdSectors, 'f');
+    test_KErrNone(nRes);
+
+    const uint64_t fileSize = LibVhd_2_GetFileSize(fileName, allocated);
+
+    //-- unaligned range, only the whole host file system blocks within it are deallocated
+    nRes = VHD_DiscardSectors(hVhd, 3, 2000);
+    test_KErrNone(nRes);
+
+    test(LibVhd_2_GetFileSize(fileName, allocated1) == fileSize);
+    if(allocated1 == allocated)
+    {
+        printf("hole punching isn't supported by the file system, skipping the test\n");
+    }
+    else
+    {
+        test(allocated - allocated1 >= 2000*KDefSecSize - 2*4096);
+
+        //-- the sectors outside of the whole host blocks aren't touched
+        nRes = LibVhd_2_CheckFileFill(hVhd, 0, 3, 'f');
+        test_KErrNone(nRes);
+
+        nRes = LibVhd_2_CheckFileFill(hVhd, 2003+8, KVhdSectors-2003-8, 'f');
+        test_KErrNone(nRes);
+
+        nRes = LibVhd_2_CheckFileFill(hVhd, 8, 1992, 0);
+        test_KErrNone(nRes);
+    }
+
+    LibVhd_2_CloseVhd(hVhd);
+    unlink(fileName);
+}
+
+
 //--------------------------------------------------------------------
 /** Execute TRIM tests */
 void TrimTests_Execute()
@@ -394,6 +566,8 @@ void TrimTests_Execute()
     TEST_LOG();
     TestTRIM_VHD_Dynamic();
     TestTRIM_VHD_Diff();
+    TestTRIM_HolePunch_Dynamic();
+    TestTRIM_HolePunch_Fixed();
 }
 
 
@@ -24,6 +24,10 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
 
 #include <string>
 using std::string;
@@ -474,6 +478,102 @@ int LibVhd_2_CheckSectorsFill(TVhdHandle aVhdHandle, vector<TSectorsBase>& aSect
     return KErrNone;
 }
 
+//--------------------------------------------------------------------
+/** @return size of the file in bytes */
+uint64_t LibVhd_2_GetFileSize(const char* aFileName)
+{
+    struct stat st;
+    test(stat(aFileName, &st) == 0);
+    return st.st_size;
+}
+
+//--------------------------------------------------------------------
+/**
+    Get the file size and the file system space allocated for the file
+    @param  aFileName   file name
+    @param  aAllocated  out: bytes allocated for the file
+    @return file size in bytes
+*/
+uint64_t LibVhd_2_GetFileSize(const char* aFileName, uint64_t& aAllocated)
+{
+    struct stat st;
+    test(stat(aFileName, &st) == 0);
+
+    aAllocated = ((uint64_t)st.st_blocks) << 9;
+    return st.st_size;
+}
+
+//--------------------------------------------------------------------
+/** @return offset of the given block data in the VHD file, 0 if the block isn't present */
+uint64_t LibVhd_2_GetBlockOffset(TVhdHandle aVhdHandle, uint aBlock)
+{
+    TVhdExtent extent;
+
+    const int nRes = VHD_MapExtents(aVhdHandle, aBlock*KDefSecPerBlock, 1, 0, &extent, 1);
+    test_Val(nRes, 1);
+
+    return (extent.extKind == EVhdExt_Data) ? extent.extFileOffset : 0;
+}
+
+//--------------------------------------------------------------------
+/** @return BAT offset in the VHD file, read from the VHD header directly, bypassing the library */
+static uint64_t DoReadRawBatOffset(int aFd)
+{
+    //-- BAT offset is a big-endian 64-bit field at offset 16 in the VHD header that follows the footer copy
+    uint64_t batOffset;
+    test_Val(pread(aFd, &batOffset, sizeof(batOffset), KDefSecSize + 16), (int)sizeof(batOffset));
+    return be64toh(batOffset);
+}
+
+//--------------------------------------------------------------------
+/**
+    Read the BAT directly from the VHD file, bypassing the library.
+    @param  aFileName   VHD file name
+    @param  aBat        out: BAT entries in the host byte order, including padding up to the sector boundary
+*/
+void LibVhd_2_ReadRawBat(const char* aFileName, vector<uint32_t>& aBat)
+{
+    const int fd = open(aFileName, O_RDONLY);
+    test(fd >= 0);
+
+    const uint64_t batOffset = DoReadRawBatOffset(fd);
+
+    //-- max. table entries is a big-endian 32-bit field at offset 28 in the VHD header
+    uint32_t maxEntries;
+    test_Val(pread(fd, &maxEntries, sizeof(maxEntries), KDefSecSize + 28), (int)sizeof(maxEntries));
+    maxEntries = be32toh(maxEntries);
+
+    const uint KBatBytes = ((maxEntries*sizeof(uint32_t) + KDefSecSize - 1) >> KDefSecSizeLog2) << KDefSecSizeLog2;
+    aBat.resize(KBatBytes/sizeof(uint32_t));
+
+    test_Val(pread(fd, &aBat[0], KBatBytes, batOffset), (int)KBatBytes);
+    close(fd);
+
+    for(uint i=0; i<aBat.size(); ++i)
+        aBat[i] = be32toh(aBat[i]);
+}
+
+//--------------------------------------------------------------------
+/**
+    Read a BAT entry directly from the VHD file, bypassing the library.
+    @param  aFileName   VHD file name
+    @param  aBlockNo    block number
+    @return BAT entry in the host byte order
+*/
+uint32_t LibVhd_2_ReadRawBatEntry(const char* aFileName, uint aBlockNo)
+{
+    const int fd = open(aFileName, O_RDONLY);
+    test(fd >= 0);
+
+    const uint64_t batOffset = DoReadRawBatOffset(fd);
+
+    uint32_t batEntry;
+    test_Val(pread(fd, &batEntry, sizeof(batEntry), batOffset + aBlockNo*sizeof(batEntry)), (int)sizeof(batEntry));
+    close(fd);
+
+    return be32toh(batEntry);
+}
+
 
 //-----------------------------------------------------------------------------
 /**